@@ -47,7 +47,7 @@ add_compile_options("-mcpu=68040")
 list (APPEND oboskrnl_sources 
 	"arch/m68k/entry.c" "arch/m68k/memmanip.c" "arch/m68k/asm_helpers.S" "arch/m68k/irql.c"
 	"arch/m68k/irq.c" "arch/m68k/isr.S" "arch/m68k/thread_ctx.S" "arch/m68k/thread_ctx.c"
-	"arch/m68k/mmu.c" "arch/m68k/pmm.c" "arch/m68k/exception_handlers.c" "arch/m68k/initial_swap.c"
+	"arch/m68k/mmu.c" "arch/m68k/pmm.c" "arch/m68k/exception_handlers.c"
 	"arch/m68k/goldfish_pic.c" "arch/m68k/goldfish_rtc.c" "arch/m68k/driver_loader.c"
 )
 
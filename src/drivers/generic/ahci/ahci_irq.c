@@ -14,28 +14,76 @@
 
 #include <locks/event.h>
 #include <locks/semaphore.h>
+#include <locks/spinlock.h>
+
+#include <scheduler/cpu_local.h>
+#include <scheduler/thread.h>
 
 #include "ahci_irq.h"
 #include "structs.h"
 #include "command.h"
 
-// static dpc ahci_dpc;
+bool CccEnabled;
+
 static void ahci_dpc_handler(dpc* d, void* userdata)
 {
     OBOS_UNUSED(d);
-    OBOS_UNUSED(userdata);
     Port* curr = (Port*)userdata;
-    for (uint8_t slot = 0; slot < (((HBA->cap >> 8) & 0b11111)+1); slot++)
+    struct command_data* cmds[32];
+    // Only look at the slots that the IRQ handler retired.
+    // The lock keeps ClearCommand from freeing a slot for another command while we look at it.
+    irql oldIrql = Core_SpinlockAcquireExplicit(&curr->issue_lock, IRQL_AHCI, true);
+    const uint32_t slots = __atomic_exchange_n(&curr->CompletedSlots, 0, __ATOMIC_ACQUIRE);
+    for (uint32_t left = slots; left; left &= (left - 1))
+        cmds[__builtin_ctz(left)] = curr->PendingCommands[__builtin_ctz(left)];
+    Core_SpinlockRelease(&curr->issue_lock, oldIrql);
+    for (uint32_t left = slots; left; left &= (left - 1))
     {
-        if (!curr->PendingCommands[slot])
-            continue; // There was never a command issued in the first place.
-        if (curr->PendingCommands[slot]->awaitingSignal)
-        {
-            Core_SemaphoreRelease(&curr->lock);
-            Core_EventSet(&curr->PendingCommands[slot]->completionEvent, false);
-        }
-        curr->PendingCommands[slot]->awaitingSignal = false;
+        struct command_data* cmd = cmds[__builtin_ctz(left)];
+        // The slot (and the port's semaphore) is released by the waiter through ClearCommand.
+        if (cmd)
+            Core_EventSet(&cmd->completionEvent, false);
+    }
+}
+// Retires every command the HBA finished on a port in one pass.
+// Called at IRQL_AHCI.
+static OBOS_NO_KASAN OBOS_NO_UBSAN void port_complete(Port* curr)
+{
+    volatile HBA_PORT* hPort = &HBA->ports[curr->hbaPortIndex];
+    // Acknowledge the port's interrupts before reading PxCI, so that a command that
+    // completes after PxCI is read raises another interrupt instead of being lost.
+    uint32_t portStatus = hPort->is;
+    hPort->is = portStatus;
+    if (!curr->works)
+        return;
+    obos_status status = OBOS_STATUS_SUCCESS;
+    if (portStatus & (0xFD800000))
+    {
+        // Some command failed.
+        // (How sad)
+        // Signal all commands with OBOS_STATUS_RETRY.
+        status = OBOS_STATUS_RETRY;
     }
+    irql oldIrql = Core_SpinlockAcquireExplicit(&curr->issue_lock, IRQL_AHCI, true);
+    uint32_t done = curr->IssuedSlots;
+    if (status == OBOS_STATUS_SUCCESS)
+        done &= ~(hPort->ci | hPort->sact);
+    else
+        curr->NeedsRecovery = true;
+    curr->IssuedSlots &= ~done;
+    for (uint32_t slots = done; slots; slots &= (slots - 1))
+        curr->PendingCommands[__builtin_ctz(slots)]->commandStatus = status;
+    // Published with the lock held, so that ClearCommand either sees the slots and clears them, or ran before.
+    __atomic_or_fetch(&curr->CompletedSlots, done, __ATOMIC_RELEASE);
+    Core_SpinlockRelease(&curr->issue_lock, oldIrql);
+    if (!done)
+        return;
+    // Signal the commands on this CPU, which, if the port has its own vector, is the one the port's IRQ was sent to.
+    // If the DPC is already enqueued, it will pick up the new slots when it runs.
+    curr->port_dpc.userdata = curr;
+    // Completions wake up waiting threads, so get them in before any other work.
+    curr->port_dpc.importance = DPC_IMPORTANCE_HIGH;
+    CoreH_InitializeDPC(&curr->port_dpc, ahci_dpc_handler, CoreH_CPUIdToAffinity(CoreS_GetCPULocalPtr()->id));
 }
 OBOS_NO_KASAN OBOS_NO_UBSAN bool ahci_irq_checker(struct irq* i, void* userdata)
 {
@@ -52,46 +100,38 @@ OBOS_NO_KASAN OBOS_NO_UBSAN void ahci_irq_handler(struct irq* i, interrupt_frame
     OBOS_UNUSED(userdata);
     OBOS_UNUSED(oldIrql);
     // OBOS_Debug("hola\n");
-    for (uint8_t port = 0; port < PortCount; port++)
+    uint32_t pending = HBA->is;
+    HBA->is = pending;
+    if (CccEnabled)
     {
-        Port* curr = &Ports[port];
-        if (!(HBA->is & BIT(curr->hbaPortIndex)))
-            continue;
-        uint32_t portStatus = HBA->ports[curr->hbaPortIndex].is;
-        if (!curr->works)
-        {
-            HBA->ports[curr->hbaPortIndex].is = portStatus;
-            continue;
-        }
-        // Signal each finished event here.
-        obos_status status = OBOS_STATUS_SUCCESS;
-        if (portStatus & (0xFD800000))
-        {
-            // Some command failed.
-            // (How sad)
-            // Signal all commands with OBOS_STATUS_RETRY.
-
-            status = OBOS_STATUS_RETRY;
-        }
-        bool requires_dpc = false;
-        for (uint8_t slot = 0; slot < (((HBA->cap >> 8) & 0b11111)+1); slot++)
+        // Coalesced completions are reported through the CCC interrupt (IS.IPS[CCC_CTL.INT]),
+        // instead of through the ports' own bits.
+        uint8_t cccInt = (HBA->ccc_ctl >> 3) & 0x1f;
+        if (pending & BIT(cccInt))
         {
-            if ((HBA->ports[curr->hbaPortIndex].ci & BIT(slot)) && status == OBOS_STATUS_SUCCESS)
-                continue;
-            if (!curr->PendingCommands[slot])
-                continue; // There was never a command issued in the first place.
-            if (curr->PendingCommands[slot]->awaitingSignal)
-                continue;
-            curr->PendingCommands[slot]->awaitingSignal = true;
-            requires_dpc = true;
-            curr->PendingCommands[slot]->commandStatus = status;
+            pending &= ~BIT(cccInt);
+            pending |= HBA->ccc_pts;
         }
-        if (requires_dpc)
-        {
-            curr->port_dpc.userdata = curr;
-            CoreH_InitializeDPC(&curr->port_dpc, ahci_dpc_handler, Core_DefaultThreadAffinity);
-        }
-        HBA->ports[curr->hbaPortIndex].is = portStatus;
     }
-    HBA->is = HBA->is;
-}
\ No newline at end of file
+    for (; pending; pending &= (pending - 1))
+    {
+        Port* curr = PortsByHbaIndex[__builtin_ctz(pending)];
+        if (curr)
+            port_complete(curr);
+    }
+}
+OBOS_NO_KASAN OBOS_NO_UBSAN bool ahci_port_irq_checker(struct irq* i, void* userdata)
+{
+    OBOS_UNUSED(i);
+    Port* port = (Port*)userdata;
+    return HBA->is & BIT(port->hbaPortIndex);
+}
+OBOS_NO_KASAN OBOS_NO_UBSAN void ahci_port_irq_handler(struct irq* i, interrupt_frame* frame, void* userdata, irql oldIrql)
+{
+    OBOS_UNUSED(i);
+    OBOS_UNUSED(frame);
+    OBOS_UNUSED(oldIrql);
+    Port* port = (Port*)userdata;
+    HBA->is = BIT(port->hbaPortIndex);
+    port_complete(port);
+}
@@ -15,4 +15,7 @@
 
 bool ahci_irq_checker(struct irq* i, void* userdata);
 void ahci_irq_handler(struct irq* i, interrupt_frame* frame, void* userdata, irql oldIrql);
+// Used when a port has its own MSI-X vector. The userdata is the Port.
+bool ahci_port_irq_checker(struct irq* i, void* userdata);
+void ahci_port_irq_handler(struct irq* i, interrupt_frame* frame, void* userdata, irql oldIrql);
 extern pci_irq_handle PCIIrqHandle;
\ No newline at end of file
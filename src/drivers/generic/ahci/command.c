@@ -13,6 +13,7 @@
 #include <locks/mutex.h>
 
 #include <irq/timer.h>
+#include <irq/irql.h>
 
 #include "structs.h"
 #include "command.h"
@@ -23,13 +24,13 @@ obos_status SendCommand(Port* port, struct command_data* data, uint64_t lba, uin
         return OBOS_STATUS_INVALID_ARGUMENT;
     if (data->physRegionCount > sizeof(((HBA_CMD_TBL*)nullptr))->prdt_entry/sizeof(HBA_PRDT_ENTRY))
         return OBOS_STATUS_INVALID_ARGUMENT;
-    StopCommandEngine(&HBA->ports[port->hbaPortIndex]);
     Core_SemaphoreAcquire(&port->lock);
-    HBA->ports[port->hbaPortIndex].is = 0xffffffff;
     Core_MutexAcquire(&port->bitmask_lock);
     uint32_t cmdSlot = __builtin_ctz(~port->CommandBitmask);
+    port->CommandBitmask |= BIT(cmdSlot);
     port->PendingCommands[cmdSlot] = data;
     Core_MutexRelease(&port->bitmask_lock);
+    data->internal.cmdSlot = cmdSlot;
     obos_status status = OBOS_STATUS_SUCCESS;
     volatile HBA_CMD_HEADER* cmdHeader = ((HBA_CMD_HEADER*)port->clBase) + cmdSlot;
     cmdHeader->b0 |= ((sizeof(FIS_REG_H2D) / sizeof(uint32_t)) & 0x1f) << 0;
@@ -53,22 +54,74 @@ obos_status SendCommand(Port* port, struct command_data* data, uint64_t lba, uin
             ((cmdHeader->ctba - port->clBasePhys)) // The offset of the HBA_CMD_TBL
     );
 #endif
-    memzero((void*)cmdTBL, sizeof(*cmdTBL));
-    for (uint16_t i = 0; i < data->physRegionCount; i++)
+    // Only clear the parts of the command table that we use, the PRDT is quite big.
+    memzero((void*)cmdTBL, offsetof(HBA_CMD_TBL, prdt_entry));
+    uint16_t nPrdtEntries = 0;
+    if (data->mapping)
+    {
+        // Build the PRDT straight from the buffer's pages into this slot's preallocated list.
+        dma_region* regions = port->SlotRegions + cmdSlot*AHCI_PRDT_PER_SLOT;
+        size_t nRegions = 0;
+        size_t nBytes = 0;
+        size_t nSectors = count ? count : AHCI_MAX_SECTORS_PER_COMMAND;
+        status = Mm_DMAGetScatterGatherList(data->mapping, data->mappingOffset, nSectors*port->sectorSize, AHCI_MAX_PRD_SIZE, regions, AHCI_PRDT_PER_SLOT, &nRegions, &nBytes);
+        // If the buffer was too fragmented to fit in the PRDT, the command can only transfer whole sectors,
+        // so cut the list off at the last sector boundary. The caller issues another command for the rest.
+        size_t trim = obos_is_success(status) ? nBytes % port->sectorSize : 0;
+        nBytes -= trim;
+        while (trim)
+        {
+            dma_region* last = &regions[nRegions - 1];
+            if (last->sz <= trim)
+            {
+                trim -= last->sz;
+                nRegions--;
+                continue;
+            }
+            last->sz -= trim;
+            trim = 0;
+        }
+        if (obos_is_success(status) && !nBytes)
+            status = OBOS_STATUS_INTERNAL_ERROR;
+        if (obos_is_error(status))
+        {
+            ClearCommand(port, data);
+            return status;
+        }
+        data->sectorCount = nBytes / port->sectorSize;
+        count = data->sectorCount == AHCI_MAX_SECTORS_PER_COMMAND ? 0 : data->sectorCount;
+        for (size_t i = 0; i < nRegions; i++)
+        {
+        #if OBOS_ARCHITECTURE_BITS == 64
+            if (!(HBA->cap & BIT(31)))
+                OBOS_ASSERT(!(regions[i].phys >> 32));
+        #endif
+            cmdTBL->prdt_entry[i].rsv0 = 0;
+            AHCISetAddress(regions[i].phys, cmdTBL->prdt_entry[i].dba);
+            cmdTBL->prdt_entry[i].dw4 = (((regions[i].sz - 1) & 0x3fffff) << 0) | BIT(31);
+        }
+        nPrdtEntries = nRegions;
+    }
+    else
     {
-    #if OBOS_ARCHITECTURE_BITS == 64
-        if (!(HBA->cap & BIT(31)))
-            OBOS_ASSERT(!(data->phys_regions[i].phys >> 32));
-    #endif
-        memzero((void*)&cmdTBL->prdt_entry[i], sizeof(cmdTBL->prdt_entry[i]));
-        AHCISetAddress(data->phys_regions[i].phys, cmdTBL->prdt_entry[i].dba);
-        uint32_t dw4 = ((data->phys_regions[i].sz - 1) & 0x3fffff) << 0;
-        // cmdTBL->prdt_entry[i].i = (i == (data->physRegionCount - 1));
-        // cmdTBL->prdt_entry[i].dw4 &= ~BIT(31);
-        dw4 |= BIT(31);
-        cmdTBL->prdt_entry[i].dw4 = dw4;
+        for (uint16_t i = 0; i < data->physRegionCount; i++)
+        {
+        #if OBOS_ARCHITECTURE_BITS == 64
+            if (!(HBA->cap & BIT(31)))
+                OBOS_ASSERT(!(data->phys_regions[i].phys >> 32));
+        #endif
+            memzero((void*)&cmdTBL->prdt_entry[i], sizeof(cmdTBL->prdt_entry[i]));
+            AHCISetAddress(data->phys_regions[i].phys, cmdTBL->prdt_entry[i].dba);
+            uint32_t dw4 = ((data->phys_regions[i].sz - 1) & 0x3fffff) << 0;
+            // cmdTBL->prdt_entry[i].i = (i == (data->physRegionCount - 1));
+            // cmdTBL->prdt_entry[i].dw4 &= ~BIT(31);
+            dw4 |= BIT(31);
+            cmdTBL->prdt_entry[i].dw4 = dw4;
+        }
+        nPrdtEntries = data->physRegionCount;
+        data->sectorCount = count;
     }
-    cmdHeader->prdtl = data->physRegionCount;
+    cmdHeader->prdtl = nPrdtEntries;
     FIS_REG_H2D* fis = (void*)cmdTBL->cfis;
     memzero(fis, sizeof(*fis));
     fis->fis_type = FIS_TYPE_REG_H2D;
@@ -86,24 +139,54 @@ obos_status SendCommand(Port* port, struct command_data* data, uint64_t lba, uin
     
     fis->countl = count & 0xff;
     fis->counth = count >> 8;
-    // Wait for the port.
-    // 0x88: ATA_DEV_BUSY | ATA_DEV_DRQ
-    while ((HBA->ports[port->hbaPortIndex].tfd & 0x88))
-        OBOSS_SpinlockHint();
-    // Issue the command
-    data->internal.cmdSlot = cmdSlot;
+    // Issue the command.
+    // Other commands can still be in flight on this port, so the command engine is left running
+    // unless it needs to be restarted after an error.
+    volatile HBA_PORT* hPort = &HBA->ports[port->hbaPortIndex];
+    irql oldIrql = Core_SpinlockAcquireExplicit(&port->issue_lock, IRQL_AHCI, false);
+    if (!port->IssuedSlots)
+    {
+        if (port->NeedsRecovery)
+        {
+            StopCommandEngine(hPort);
+            hPort->serr = 0xffffffff;
+            port->NeedsRecovery = false;
+        }
+        // Wait for the port.
+        // 0x88: ATA_DEV_BUSY | ATA_DEV_DRQ
+        while ((hPort->tfd & 0x88))
+            OBOSS_SpinlockHint();
+    }
+    if (!(hPort->cmd & BIT(0) /* PxCMD.ST */))
+        StartCommandEngine(hPort);
     // HBA->ports[port->hbaPortIndex].sact |= (1 << cmdSlot);
-    StartCommandEngine(&HBA->ports[port->hbaPortIndex]);
-    HBA->ports[port->hbaPortIndex].ci |= (1 << cmdSlot);
-    // Release the semaphore in the IRQ handler instead.
-    // Core_SemaphoreRelease(&port->lock);
+    port->IssuedSlots |= BIT(cmdSlot);
+    hPort->ci = BIT(cmdSlot);
+    Core_SpinlockRelease(&port->issue_lock, oldIrql);
+    // The semaphore is released in ClearCommand, once the slot is free again.
     return status;
 }
 obos_status ClearCommand(Port* port, struct command_data* data)
 {
+    if (!port || !data)
+        return OBOS_STATUS_INVALID_ARGUMENT;
     uint8_t cmdSlot = data->internal.cmdSlot;
-    HBA->ports[port->hbaPortIndex].ci &= ~(1 << cmdSlot);
+    Core_MutexAcquire(&port->bitmask_lock);
+    if (port->PendingCommands[cmdSlot] != data)
+    {
+        Core_MutexRelease(&port->bitmask_lock);
+        return OBOS_STATUS_NOT_FOUND;
+    }
+    // The command might not have been retired by the IRQ handler (e.g., if it was polled for).
+    // The slot is freed with the issue lock held, so that the port's DPC never sees it taken by another command.
+    irql oldIrql = Core_SpinlockAcquireExplicit(&port->issue_lock, IRQL_AHCI, false);
+    port->IssuedSlots &= ~BIT(cmdSlot);
+    __atomic_and_fetch(&port->CompletedSlots, ~BIT(cmdSlot), __ATOMIC_SEQ_CST);
     port->PendingCommands[cmdSlot] = nullptr;
+    Core_SpinlockRelease(&port->issue_lock, oldIrql);
+    port->CommandBitmask &= ~BIT(cmdSlot);
+    Core_MutexRelease(&port->bitmask_lock);
+    Core_SemaphoreRelease(&port->lock);
     return OBOS_STATUS_SUCCESS;
 }
 void StopCommandEngine(volatile HBA_PORT* hPort)
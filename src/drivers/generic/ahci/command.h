@@ -11,6 +11,8 @@
 
 #include <locks/event.h>
 
+#include <mm/dma.h>
+
 #include "structs.h"
 
 struct ahci_phys_region
@@ -24,11 +26,17 @@ enum {
 };
 struct command_data
 {
+    // If mapping is nullptr, the PRDT is built from these.
     struct ahci_phys_region* phys_regions;
     uint16_t physRegionCount;
+    // If not nullptr, the PRDT is built from this buffer, starting at mappingOffset.
+    // The sector count passed to SendCommand is then clamped to what fits in the slot's PRDT,
+    // and the amount of sectors actually sent is put in sectorCount.
+    dma_mapping* mapping;
+    size_t mappingOffset;
+    uint32_t sectorCount;
     uint8_t direction;
     uint8_t cmd;
-    bool awaitingSignal;
     // Set when the command is done.
     event completionEvent;
     obos_status commandStatus;
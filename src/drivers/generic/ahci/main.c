@@ -8,8 +8,10 @@
 #include <error.h>
 #include <memmanip.h>
 #include <klog.h>
+#include <cmdline.h>
 
 #include <scheduler/thread.h>
+#include <scheduler/cpu_local.h>
 
 #include <driver_interface/header.h>
 #include <driver_interface/pci.h>
@@ -67,6 +69,9 @@ OBOS_WEAK OBOS_PAGEABLE_FUNCTION obos_status ioctl(size_t nParameters, uint64_t
     va_end(list);
     return status;
 }
+static void free_port_irqs();
+// Set once HbaIrq is registered, which is not the case if every port has its own vector.
+static bool HbaIrqRegistered;
 void driver_cleanup_callback()
 {
     for (uint8_t porti = 0; porti < PortCount; porti++)
@@ -83,8 +88,15 @@ void driver_cleanup_callback()
         for (uint8_t i = 0; i < 32 && status != OBOS_STATUS_IN_USE; i++)
             ClearCommand(port, port->PendingCommands[i]);
     }
-    Drv_MaskPCIIrq(&PCIIrqHandle, true);
-    Core_IrqObjectFree(&HbaIrq);
+    if (CccEnabled)
+        HBA->ccc_ctl &= ~BIT(0);
+    free_port_irqs();
+    if (HbaIrqRegistered)
+    {
+        Drv_MaskPCIIrq(&PCIIrqHandle, true);
+        Core_IrqObjectFree(&HbaIrq);
+        HbaIrqRegistered = false;
+    }
     // TODO: Free HBA, port clb, and fb
     
 }
@@ -116,6 +128,7 @@ volatile HBA_MEM* HBA;
 uint32_t HbaIrqNumber;
 Port Ports[32];
 size_t PortCount;
+Port* PortsByHbaIndex[32];
 pci_device_node PCINode;
 bool FoundPCINode;
 pci_irq_handle PCIIrqHandle;
@@ -169,6 +182,112 @@ uintptr_t HBAAllocate(size_t size, size_t alignment)
         return Mm_AllocatePhysicalPages32(size, alignment, nullptr);
     OBOS_UNREACHABLE;
 }
+static void register_hba_irq()
+{
+    obos_status status = Core_IrqObjectInitializeIRQL(&HbaIrq, IRQL_AHCI, true, true);
+    if (obos_is_error(status))
+        OBOS_Panic(OBOS_PANIC_DRIVER_FAILURE, "%*s: Could not initialize IRQ object with IRQL %d.\nStatus: %d\n", uacpi_strnlen(drv_hdr.driverName, 64), IRQL_AHCI, status);
+    status = Drv_RegisterPCIIrq(&HbaIrq, &PCINode, &PCIIrqHandle);
+    if (obos_is_error(status))
+        OBOS_Panic(OBOS_PANIC_DRIVER_FAILURE, "Could not initialize HBA Irq. Status: %d.\n", status);
+    HbaIrq.irqChecker = ahci_irq_checker;
+    HbaIrq.handler = ahci_irq_handler;
+    status = Drv_MaskPCIIrq(&PCIIrqHandle, false);
+    if (obos_is_error(status))
+        OBOS_Panic(OBOS_PANIC_DRIVER_FAILURE, "Could not unmask HBA Irq. Status: %d.\n", status);
+    HbaIrqRegistered = true;
+}
+static void free_port_irqs()
+{
+    for (uint8_t i = 0; i < PortCount; i++)
+    {
+        Port* port = Ports + i;
+        if (!port->PortIrq)
+            continue;
+        if (port->PortIrq->vector)
+            Drv_MaskPCIIrq(&port->PortIrqHandle, true);
+        Core_IrqObjectFree(port->PortIrq);
+        port->PortIrq = nullptr;
+    }
+}
+// Gives every port its own MSI-X vector, with the vectors spread over all CPUs.
+// The HBA sends the interrupts of port n through MSI-X table entry n.
+// Returns false if this could not be done, in which case HbaIrq should be used.
+static bool register_port_irqs()
+{
+    for (uint8_t i = 0; i < PortCount; i++)
+    {
+        Port* port = Ports + i;
+        obos_status status = OBOS_STATUS_SUCCESS;
+        port->PortIrq = Core_IrqObjectAllocate(&status);
+        if (obos_is_success(status))
+            status = Core_IrqObjectInitializeIRQL(port->PortIrq, IRQL_AHCI, true, true);
+        if (obos_is_success(status))
+            status = Drv_RegisterPCIIrqMsixEntry(port->PortIrq, &PCINode, &port->PortIrqHandle, port->hbaPortIndex, Core_CpuInfo[i % Core_CpuCount].id);
+        if (obos_is_error(status))
+        {
+            OBOS_Warning("%*s: Could not register MSI-X vector for port %d. Status: %d. Falling back to one IRQ for the HBA.\n",
+                uacpi_strnlen(drv_hdr.driverName, 64), drv_hdr.driverName,
+                port->hbaPortIndex, status);
+            free_port_irqs();
+            return false;
+        }
+        port->PortIrq->irqChecker = ahci_port_irq_checker;
+        port->PortIrq->irqCheckerUserdata = port;
+        port->PortIrq->handler = ahci_port_irq_handler;
+        port->PortIrq->handlerUserdata = port;
+    }
+    if (HBA->ghc & BIT(2) /* GHC.MRSM */)
+    {
+        // The HBA reverted to using a single message for every port.
+        free_port_irqs();
+        return false;
+    }
+    for (uint8_t i = 0; i < PortCount; i++)
+        Drv_MaskPCIIrq(&Ports[i].PortIrqHandle, false);
+    return true;
+}
+// Configures command completion coalescing (CCC) from the command line.
+// With it, the HBA raises one interrupt per 'ahci-ccc-completions' commands completed (or per
+// 'ahci-ccc-timeout' ms with at least one completion), instead of one interrupt per command.
+static void configure_ccc()
+{
+    uint64_t completions = OBOS_GetOPTD("ahci-ccc-completions");
+    uint64_t timeout = OBOS_GetOPTD("ahci-ccc-timeout");
+    if (!completions)
+        return; // Disabled.
+    if (!(HBA->cap & BIT(7) /* CAP.CCCS */))
+    {
+        OBOS_Warning("%*s: Command completion coalescing was requested, but the HBA does not support it.\n", uacpi_strnlen(drv_hdr.driverName, 64), drv_hdr.driverName);
+        return;
+    }
+    if (completions > 0xff)
+        completions = 0xff;
+    if (!timeout)
+        timeout = 1;
+    if (timeout > 0xffff)
+        timeout = 0xffff;
+    // Only ports that share HbaIrq can be coalesced, as the CCC interrupt is delivered as one message.
+    uint32_t ports = 0;
+    for (uint8_t i = 0; i < PortCount; i++)
+        if (Ports[i].works && !Ports[i].PortIrq)
+            ports |= BIT(Ports[i].hbaPortIndex);
+    if (!ports)
+        return;
+    HBA->ccc_ctl &= ~BIT(0);
+    HBA->ccc_pts = ports;
+    HBA->ccc_ctl = (timeout << 16) | (completions << 8);
+    CccEnabled = true;
+    for (; ports; ports &= (ports - 1))
+    {
+        // Completions on coalesced ports are reported through the CCC interrupt, so don't have the port
+        // raise interrupts for them as well. Errors still raise an interrupt immediately.
+        // DHRE, PSE, DSE, SDBE, DPE
+        HBA->ports[__builtin_ctz(ports)].ie &= ~(BIT(0)|BIT(1)|BIT(2)|BIT(3)|BIT(5));
+    }
+    HBA->ccc_ctl |= BIT(0);
+    OBOS_Debug("Enabled command completion coalescing. CCC_CTL: 0x%08x, CCC_PORTS: 0x%08x.\n", HBA->ccc_ctl, HBA->ccc_pts);
+}
 const char* const DeviceNames[32] = {
     "sda", "sdb", "sdc", "sdd",
     "sde", "sdf", "sdg", "sdh",
@@ -205,19 +324,16 @@ void OBOS_DriverEntry(driver_id* this)
     OBOS_Debug("Mapping HBA memory.\n");
     HBA = map_registers(bar, barlen, true);
     // OBOS_Log("Mapped HBA memory at 0x%p-0x%p.\n", HBA, ((uintptr_t)HBA)+barlen);
-    obos_status status = Core_IrqObjectInitializeIRQL(&HbaIrq, IRQL_AHCI, true, true);
-    if (obos_is_error(status))
-        OBOS_Panic(OBOS_PANIC_DRIVER_FAILURE, "%*s: Could not initialize IRQ object with IRQL %d.\nStatus: %d\n", uacpi_strnlen(drv_hdr.driverName, 64), IRQL_AHCI, status);
-    OBOS_Debug("Enabling IRQs...\n");
-    status = Drv_RegisterPCIIrq(&HbaIrq, &PCINode, &PCIIrqHandle);
-    if (obos_is_error(status))
-        OBOS_Panic(OBOS_PANIC_DRIVER_FAILURE, "Could not initialize HBA Irq. Status: %d.\n", status);
-    HbaIrq.irqChecker = ahci_irq_checker;
-    HbaIrq.handler = ahci_irq_handler;
-    status = Drv_MaskPCIIrq(&PCIIrqHandle, false);
-    if (obos_is_error(status))
-        OBOS_Panic(OBOS_PANIC_DRIVER_FAILURE, "Could not unmask HBA Irq. Status: %d.\n", status);
-    OBOS_Debug("Enabled IRQs.\n");
+    // If there is an MSI-X vector for every port, every port gets its own vector, which is registered once the ports are initialized.
+    bool perPortIrqs =
+        __builtin_popcount(HBA->pi) > 1 &&
+        Drv_GetPCIMsixEntryCount(&PCINode) >= (size_t)(32 - __builtin_clz(HBA->pi));
+    if (!perPortIrqs)
+    {
+        OBOS_Debug("Enabling IRQs...\n");
+        register_hba_irq();
+        OBOS_Debug("Enabled IRQs.\n");
+    }
     HBA->ghc |= BIT(31);
     while (!(HBA->ghc & BIT(31)))
         OBOSS_SpinlockHint();
@@ -276,12 +392,15 @@ void OBOS_DriverEntry(driver_id* this)
             continue;
         HBA_PORT* hPort = HBA->ports + port;
         Port* curr = &Ports[PortCount++];
+        PortsByHbaIndex[port] = curr;
+        curr->issue_lock = Core_SpinlockCreate();
         curr->clBasePhys = HBAAllocate(sizeof(HBA_CMD_HEADER)*32+sizeof(HBA_CMD_TBL)*32, 0);
         curr->clBase = map_registers(curr->clBasePhys, sizeof(HBA_CMD_HEADER)*32+sizeof(HBA_CMD_TBL)*32, true);
         curr->fisBasePhys = HBAAllocate(4096, 0);
         curr->fisBase = map_registers(curr->fisBasePhys, 4096, true);
         memzero((void*)curr->fisBase, 4096);
         memzero((void*)curr->clBase, sizeof(HBA_CMD_HEADER)*32+sizeof(HBA_CMD_TBL)*32);
+        curr->SlotRegions = Mm_Allocator->ZeroAllocate(Mm_Allocator, 32*AHCI_PRDT_PER_SLOT, sizeof(dma_region), nullptr);
         for (uint8_t slot = 0; slot < (((HBA->cap >> 8) & 0b11111)+1); slot++)
         {
             HBA_CMD_HEADER* cmdHeader = (HBA_CMD_HEADER*)curr->clBase + slot;
@@ -307,6 +426,13 @@ void OBOS_DriverEntry(driver_id* this)
         curr->works = true;
     }
     OBOS_Log("%*s: Initialized %d ports.\n", uacpi_strnlen(drv_hdr.driverName, 64), drv_hdr.driverName, PortCount);
+    if (perPortIrqs)
+    {
+        OBOS_Debug("Enabling per-port IRQs...\n");
+        if (!register_port_irqs())
+            register_hba_irq();
+        OBOS_Debug("Enabled IRQs.\n");
+    }
     for (uint8_t i = 0; i < PortCount; i++)
     {
         Port* port = Ports + i;
@@ -334,6 +460,7 @@ void OBOS_DriverEntry(driver_id* this)
         port->lock = SEMAPHORE_INITIALIZE((((HBA->cap >> 8) & 0b11111)+1));
         size_t tries = 0;
         retry:
+        HBA->ports[port->hbaPortIndex].is = 0xffffffff;
         HBA->ghc &= ~BIT(1);
         // irql oldIrql = Core_RaiseIrql(IRQL_AHCI);
         SendCommand(port, &data, 0, 0, 0);
@@ -351,6 +478,7 @@ void OBOS_DriverEntry(driver_id* this)
         }
         if (data.commandStatus != OBOS_STATUS_SUCCESS)
         {
+            ClearCommand(port, &data);
             if (tries++ >= 3)
             {
                 Mm_FreePhysicalPages(reg.phys, reg.sz/OBOS_PAGE_SIZE);
@@ -392,6 +520,7 @@ void OBOS_DriverEntry(driver_id* this)
         port->vn = Drv_AllocateVNode(this, (dev_desc)port, port->nSectors*port->sectorSize, nullptr, VNODE_TYPE_BLK);
         Drv_RegisterVNode(port->vn, port->dev_name);
     }
+    configure_ccc();
     OBOS_Log("%*s: Finished initialization of the HBA.\n", uacpi_strnlen(drv_hdr.driverName, 64), drv_hdr.driverName);
     Core_ExitCurrentThread();
 }
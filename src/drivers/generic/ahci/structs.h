@@ -11,9 +11,14 @@
 
 #include <locks/semaphore.h>
 #include <locks/mutex.h>
+#include <locks/spinlock.h>
 
 #include <irq/irq.h>
 
+#include <driver_interface/pci.h>
+
+#include <mm/dma.h>
+
 #define	SATA_SIG_ATA	0x00000101	// SATA drive
 #define	SATA_SIG_ATAPI	0xEB140101	// SATAPI drive
 #define	SATA_SIG_SEMB	0xC33C0101	// Enclosure management bridge
@@ -303,12 +308,30 @@ typedef enum drive_type
 	DRIVE_TYPE_SATA,
 	DRIVE_TYPE_SATAPI,
 } drive_type;
+// The amount of PRDT entries used per command slot.
+// A command that needs more than this is split into multiple commands.
+#define AHCI_PRDT_PER_SLOT (256)
+// The maximum byte count of one PRDT entry.
+#define AHCI_MAX_PRD_SIZE (4*1024*1024)
+// The maximum amount of sectors in one command.
+#define AHCI_MAX_SECTORS_PER_COMMAND (0x10000)
 typedef struct Port
 {
 	struct command_data* PendingCommands[32];
+	// Preallocated scatter-gather lists for each command slot, AHCI_PRDT_PER_SLOT elements each.
+	dma_region* SlotRegions;
 	mutex bitmask_lock;
 	semaphore lock; // can have a maximum of 32 slots
 	dpc port_dpc;
+	// Protects IssuedSlots, CompletedSlots, NeedsRecovery, and the freeing of PendingCommands entries, taken at IRQL_AHCI.
+	spinlock issue_lock;
+	// The slots that were written to PxCI, and were not yet retired by the IRQ handler.
+	uint32_t IssuedSlots;
+	// The slots retired by the IRQ handler that the port's DPC has yet to signal.
+	uint32_t CompletedSlots;
+	// If the port has its own MSI-X vector, this is its IRQ object. Otherwise, HbaIrq is used.
+	irq* PortIrq;
+	pci_irq_handle PortIrqHandle;
 	volatile void* clBase;
 	volatile void* fisBase;
 	struct vnode* vn;
@@ -321,6 +344,9 @@ typedef struct Port
 	uint8_t hbaPortIndex;
 	bool works : 1;
 	bool supports48bitLBA : 1;
+	// Set when a command failed. The HBA stops processing commands on the port after an error,
+	// so the command engine is restarted before the next command is issued.
+	bool NeedsRecovery : 1;
 } Port;
 
 enum
@@ -337,7 +363,11 @@ extern volatile HBA_MEM* HBA;
 extern uint32_t HbaIrqNumber;
 extern Port Ports[32];
 extern size_t PortCount;
+// Maps an index into HBA->ports to its Port, or nullptr if the port is not implemented.
+extern Port* PortsByHbaIndex[32];
 extern irq HbaIrq;
+// Set if command completion coalescing is enabled for the ports in HBA->ccc_pts.
+extern bool CccEnabled;
 
 #if OBOS_IRQL_COUNT == 16
 #	define IRQL_AHCI (7)
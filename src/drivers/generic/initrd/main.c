@@ -15,6 +15,8 @@
 #include <driver_interface/header.h>
 #include <driver_interface/pci.h>
 
+#include <mm/bare_map.h>
+
 #include <stdint.h>
 #include <utils/hashmap.h>
 
@@ -99,6 +101,7 @@ OBOS_PAGEABLE_FUNCTION obos_status set_file_perms(dev_desc desc, driver_file_per
 OBOS_WEAK obos_status get_file_perms(dev_desc desc, driver_file_perm *perm);
 OBOS_WEAK obos_status get_file_type(dev_desc desc, file_type *type);
 OBOS_WEAK obos_status list_dir(dev_desc dir, void* unused, iterate_decision(*cb)(dev_desc desc, size_t blkSize, size_t blkCount, void* userdata), void* userdata);
+OBOS_WEAK obos_status get_resident_page(dev_desc desc, size_t offset, uintptr_t* phys);
 
 __attribute__((section(OBOS_DRIVER_HEADER_SECTION))) driver_header drv_hdr = {
     .magic = OBOS_DRIVER_MAGIC,
@@ -124,6 +127,7 @@ __attribute__((section(OBOS_DRIVER_HEADER_SECTION))) driver_header drv_hdr = {
         .set_file_perms = set_file_perms,
         .get_file_type = get_file_type,
         .list_dir = list_dir,
+        .get_resident_page = get_resident_page,
     },
     .driverName = INITRD_DRIVER_NAME
 };
@@ -149,20 +153,40 @@ OBOS_PAGEABLE_FUNCTION obos_status read_sync(dev_desc desc, void* buf, size_t bl
         return OBOS_STATUS_SUCCESS;
     if (hdr->type != AREGTYPE && hdr->type != REGTYPE)
         return OBOS_STATUS_NOT_A_FILE;
-    size_t filesize = oct2bin(hdr->filesize, uacpi_strnlen(hdr->filesize, 12));;
+    size_t filesize = 0;
+    const char* data = GetFileData(hdr, &filesize);
     if (blkOffset >= filesize)
     {
-        *nBlkRead = 0;
+        if (nBlkRead)
+            *nBlkRead = 0;
         return OBOS_STATUS_SUCCESS;
     }
     size_t nToRead = blkCount;
     if ((blkOffset + blkCount) >= filesize)
         nToRead = filesize - blkOffset;
-    const char* data = (char*)(hdr) + 0x200;
-    const char* iter = data+blkOffset;
-    memcpy(buf, iter, nToRead);
+    memcpy(buf, data+blkOffset, nToRead);
+    if (nBlkRead)
+        *nBlkRead = nToRead;
     return OBOS_STATUS_SUCCESS;
 }
+// The initrd image is always resident, so the page cache can map file pages straight out of it.
+OBOS_PAGEABLE_FUNCTION obos_status get_resident_page(dev_desc desc, size_t offset, uintptr_t* phys)
+{
+    const ustar_hdr* hdr = (ustar_hdr*)desc;
+    if (!hdr || !phys || (offset % OBOS_PAGE_SIZE))
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    if (hdr->type != AREGTYPE && hdr->type != REGTYPE)
+        return OBOS_STATUS_NOT_A_FILE;
+    size_t filesize = 0;
+    const char* data = GetFileData(hdr, &filesize);
+    // A partial page at the end of the file would expose whatever comes after it in the image.
+    if ((offset + OBOS_PAGE_SIZE) > filesize)
+        return OBOS_STATUS_EOF;
+    // File data is only 512-byte aligned in a USTAR archive, so this only works for pages that happen to be page aligned.
+    if (((uintptr_t)data + offset) % OBOS_PAGE_SIZE)
+        return OBOS_STATUS_MISMATCH;
+    return OBOSS_GetPagePhysicalAddress((void*)(data + offset), phys);
+}
 OBOS_PAGEABLE_FUNCTION static uint64_t hash(const void *item, uint64_t seed0, uint64_t seed1)
 {
     const char* pck = item;
@@ -19,19 +19,31 @@
 
 #include <utils/hashmap.h>
 
+// Maps every path in the initrd to its header.
+// Built in one pass over the image the first time a file is looked up, since the image never changes.
 static struct hashmap* cache;
 
+typedef struct initrd_entry
+{
+    // Without any trailing slash, and always nul-terminated.
+    char path[101];
+    size_t pathlen;
+    const ustar_hdr* hdr;
+} initrd_entry;
+
 static uint64_t hash(const void *item, uint64_t seed0, uint64_t seed1)
 {
-    const ustar_hdr* pck = item;
-    return hashmap_sip(pck->filename, uacpi_strnlen(pck->filename, 100), seed0, seed1);
+    const initrd_entry* ent = item;
+    return hashmap_sip(ent->path, ent->pathlen, seed0, seed1);
 }
 static int cmp(const void *a, const void *b, void *udata)
 {
     OBOS_UNUSED(udata);
-    const ustar_hdr* pck1 = a;
-    const ustar_hdr* pck2 = b;
-    return uacpi_strncmp(pck1->filename, pck2->filename, 100);
+    const initrd_entry* ent1 = a;
+    const initrd_entry* ent2 = b;
+    if (ent1->pathlen != ent2->pathlen)
+        return ent1->pathlen < ent2->pathlen ? -1 : 1;
+    return uacpi_strncmp(ent1->path, ent2->path, ent1->pathlen);
 }
 void* malloc(size_t sz)
 {
@@ -47,15 +59,35 @@ void free(void* buf)
     OBOS_KernelAllocator->QueryBlockSize(OBOS_KernelAllocator, buf, &blkSize);
     OBOS_KernelAllocator->Free(OBOS_KernelAllocator, buf, blkSize);
 }
-static void initialize_hashmap()
+static size_t normalize_path(const char* path, size_t pathlen)
+{
+    while (pathlen && path[pathlen-1] == '/')
+        pathlen--;
+    return pathlen;
+}
+static void build_index()
 {
     cache = hashmap_new_with_allocator(
         malloc, realloc, free,
-        sizeof(ustar_hdr), 
+        sizeof(initrd_entry), 
         64, 0, 0, 
         hash, cmp, 
         nullptr, 
         nullptr);
+    const uintptr_t end = (uintptr_t)OBOS_InitrdBinary + OBOS_InitrdSize;
+    const ustar_hdr* hdr = (ustar_hdr*)OBOS_InitrdBinary;
+    while (((uintptr_t)hdr + sizeof(*hdr)) <= end && memcmp(hdr->magic, USTAR_MAGIC, 6))
+    {
+        initrd_entry ent = {};
+        ent.pathlen = normalize_path(hdr->filename, uacpi_strnlen(hdr->filename, 100));
+        memcpy(ent.path, hdr->filename, ent.pathlen);
+        ent.hdr = hdr;
+        if (ent.pathlen)
+            hashmap_set(cache, &ent);
+        size_t filesize = oct2bin(hdr->filesize, uacpi_strnlen(hdr->filesize, 12));
+        size_t filesize_rounded = (filesize + 0x1ff) & ~0x1ff;
+        hdr = (ustar_hdr*)(((uintptr_t)hdr) + filesize_rounded + 512);
+    }
 }
 
 #define set_status(to) status ? (*status = to) : (void)0
@@ -72,38 +104,30 @@ const ustar_hdr* GetFile(const char* path, obos_status* status)
         return nullptr;
     }
     if (!cache)
-        initialize_hashmap();
-    set_status(OBOS_STATUS_SUCCESS);
-    ustar_hdr what = {};
-    memcpy(what.filename, path, uacpi_strnlen(path, 100));
-    const ustar_hdr* hdr = (ustar_hdr*)hashmap_get(cache, &what);
-    if (hdr)
-        return hdr;
-    hdr = (ustar_hdr*)OBOS_InitrdBinary;
-    size_t pathlen = uacpi_strnlen(path, 100);
-    char path_slash[100];
-    memcpy(path_slash, path, pathlen);
-    if (path_slash[pathlen-1] != '/')
-    {
-        path_slash[pathlen] = '/';
-        path_slash[++pathlen] = '\0';
-    }
-    while (memcmp(hdr->magic, USTAR_MAGIC, 6))
+        build_index();
+    initrd_entry what = {};
+    what.pathlen = normalize_path(path, uacpi_strnlen(path, 100));
+    memcpy(what.path, path, what.pathlen);
+    const initrd_entry* ent = what.pathlen ? hashmap_get(cache, &what) : nullptr;
+    if (!ent)
     {
-        if (uacpi_strncmp(path_slash, hdr->filename, pathlen) == 0 ||
-            uacpi_strncmp(path, hdr->filename, pathlen) == 0
-        )
-        {
-            hashmap_set(cache, hdr);
-            return hdr;
-        }
-        size_t filesize = oct2bin(hdr->filesize, uacpi_strnlen(hdr->filesize, 12));
-        size_t filesize_rounded = (filesize + 0x1ff) & ~0x1ff;
-        hdr = (ustar_hdr*)(((uintptr_t)hdr) + filesize_rounded + 512);
+        set_status(OBOS_STATUS_NOT_FOUND);
+        return nullptr;
     }
-    return nullptr;
+    set_status(OBOS_STATUS_SUCCESS);
+    return ent->hdr;
+}
+const char* GetFileData(const ustar_hdr* hdr, size_t* filesize)
+{
+    if (!hdr)
+        return nullptr;
+    if (filesize)
+        *filesize = oct2bin(hdr->filesize, uacpi_strnlen(hdr->filesize, 12));
+    return (const char*)hdr + 0x200;
 }
 void FreeCache()
 {
-    hashmap_free(cache);
-}
\ No newline at end of file
+    if (cache)
+        hashmap_free(cache);
+    cache = nullptr;
+}
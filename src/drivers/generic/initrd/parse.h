@@ -14,6 +14,8 @@
 // USTAR is strictly read only (on OBOS).
 
 const ustar_hdr* GetFile(const char* path, obos_status* status);
+// Returns the contents of the file, directly from the initrd image.
+const char* GetFileData(const ustar_hdr* hdr, size_t* filesize);
 void FreeCache();
 inline static uint64_t oct2bin(const char* str, size_t size)
 {
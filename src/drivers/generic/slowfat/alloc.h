@@ -13,17 +13,42 @@
 #include "structs.h"
 
 // All functions in this file, unless otherwise specified, should take the fat lock in the fat_cache struct.
-// returns UINT32_MAX if no sector was found
+// Allocates a new cluster chain, in as few runs as possible.
+// returns UINT32_MAX if there are not enough free clusters
 uint32_t AllocateClusters(fat_cache* volume, size_t nClusters);
-// Returns true if the cluster region was extended, otherwise you need to reallocate the clusters.
-bool ExtendClusters(fat_cache* volume, uint32_t cluster, size_t nClusters, size_t oldClusterCount);
+// Appends nClusters clusters to the chain ending at 'tail', preferring the clusters right after it.
+// Returns the first cluster appended, or UINT32_MAX if there are not enough free clusters.
+uint32_t ExtendClusters(fat_cache* volume, uint32_t tail, size_t nClusters);
 void TruncateClusters(fat_cache* volume, uint32_t cluster, size_t newClusterCount, size_t oldClusterCount);
 void FreeClusters(fat_cache* volume, uint32_t cluster, size_t nClusters);
+// Makes 'cluster' the last cluster of its chain.
+void EndClusterChain(fat_cache* volume, uint32_t cluster);
 void InitializeCacheFreelist(fat_cache* volume);
 
+// The FAT cache.
+// These take the FAT cache's own lock, so they can be called with or without any other lock held.
+obos_status InitializeFatCache(fat_cache* volume);
+obos_status FatGetEntry(fat_cache* volume, uint32_t cluster, uint32_t* value);
+obos_status FatSetEntry(fat_cache* volume, uint32_t cluster, uint32_t value);
+// Writes back every modified FAT sector to all copies of the FAT, and updates the FSInfo sector.
+obos_status FatFlush(fat_cache* volume);
+
 // if status is passed as OBOS_STATUS_SUCCESS, the cluster passed is valid.
 // if status is passed as OBOS_STATUS_EOF, the cluster passed is valid, and is the last cluster of the chain.
 // if status is passed as OBOS_STATUS_ABORTED, the cluster passed is not valid, as an error has occurred following the chain.
 typedef iterate_decision(*clus_chain_cb)(uint32_t cluster, obos_status status, void* userdata);
-obos_status NextCluster(fat_cache* cache, uint32_t cluster, uint8_t* sec_buf, uint32_t* ret);
-void FollowClusterChain(fat_cache* volume, uint32_t clus, clus_chain_cb callback, void* userdata);
\ No newline at end of file
+obos_status NextCluster(fat_cache* cache, uint32_t cluster, uint32_t* ret);
+void FollowClusterChain(fat_cache* volume, uint32_t clus, clus_chain_cb callback, void* userdata);
+
+// The extent map of a file.
+// These must be called with the fat lock held.
+// Builds the extent map of a file from its cluster chain, if it is not already built.
+obos_status GetFileExtents(fat_cache* volume, fat_dirent_cache* file);
+// Returns the run containing the file's fileCluster-th cluster, or nullptr if the file is not that big.
+const fat_extent* LookupFileExtent(fat_dirent_cache* file, uint32_t fileCluster);
+// Must be called whenever the clusters of the file change.
+void InvalidateFileExtents(fat_dirent_cache* file);
+// Makes the file's cluster chain at least nClusters long, growing it in place when possible.
+// The chain can be longer than the file, if clusters were preallocated.
+// If the file had no clusters, its first cluster is set, and *newChain is set to true. The dirent is not written.
+obos_status GrowFileClusters(fat_cache* volume, fat_dirent_cache* file, size_t nClusters, bool* newChain);
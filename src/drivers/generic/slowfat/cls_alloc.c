@@ -12,380 +12,289 @@
 
 #include <locks/mutex.h>
 
-#include <vfs/fd.h>
-
 #include <allocators/base.h>
 
+#include <utils/tree.h>
+
 #include <driver_interface/header.h>
 
 #include "error.h"
 #include "structs.h"
 #include "alloc.h"
 
-static bool isClusterFree(fat_cache* volume, uint32_t cluster, uint8_t* sector)
+static bool isClusterFree(fat_cache* volume, uint32_t cluster)
 {
-    bool res = false;
-    fat_entry_addr addr = {};
-    GetFatEntryAddrForCluster(volume, cluster, &addr);
-    if (Vfs_FdTellOff(volume->volume) != (addr.lba*volume->blkSize))
-    {
-        Vfs_FdSeek(volume->volume, addr.lba*volume->blkSize, SEEK_SET);
-        Vfs_FdRead(volume->volume, sector, volume->blkSize, nullptr);
-    }   
-    Vfs_FdSeek(volume->volume, addr.lba*volume->blkSize, SEEK_SET);
-    switch (volume->fatType)
-    {
-        case FAT32_VOLUME:
-        {
-            fat32_entry ent = {};
-            memcpy(&ent, sector + addr.offset, sizeof(ent));
-            res = !ent.ent;
-            break;
-        }
-        case FAT16_VOLUME:
-        {
-            fat16_entry ent = {};
-            memcpy(&ent, sector + addr.offset, sizeof(ent));
-            res = !ent.ent;
-            break;
-        }
-        case FAT12_VOLUME:
-        {
-            fat12_entry ent = GetFat12Entry(*(uint16_t*)(sector + addr.offset), cluster);
-            res = !ent.ent;
-            break;
-        }
-    }
-    return res;
+    uint32_t ent = 0;
+    if (obos_is_error(FatGetEntry(volume, cluster, &ent)))
+        return false;
+    return !ent;
 }
 static bool isLastCluster(fat_cache* volume, uint32_t cluster)
 {
     // return GetFatEntryAddrForCluster(volume, cluster).lba >= volume->fatSz;
-    return cluster >= volume->CountofClusters;
+    // Data clusters are numbered from two.
+    return cluster >= (volume->CountofClusters + 2);
 }
 static void markAllocated(fat_cache* volume, uint32_t cluster)
 {
-    fat_entry_addr addr = {};
-    GetFatEntryAddrForCluster(volume, cluster, &addr);
-    uint8_t* sector = FATAllocator->ZeroAllocate(FATAllocator, 1, volume->blkSize, nullptr);
-    Vfs_FdSeek(volume->volume, addr.lba*volume->blkSize, SEEK_SET);
-    Vfs_FdRead(volume->volume, sector, volume->blkSize, nullptr);
+    // note: +1 is intentional
+    FatSetEntry(volume, cluster, cluster+1);
+}
+static void markFree(fat_cache* volume, uint32_t cluster)
+{
+    FatSetEntry(volume, cluster, 0);
+}
+static void markEnd(fat_cache* volume, uint32_t cluster)
+{
+    uint32_t end = 0x0FFFFFF8;
     switch (volume->fatType)
     {
-        case FAT32_VOLUME:
-        {
-            fat32_entry ent = {};
-            memcpy(&ent, sector+addr.offset, sizeof(ent));
-            // note: +1 is intentional
-            ent.ent = cluster+1;
-            memcpy(sector+addr.offset, &ent, sizeof(ent));
-            break;
-        }
-        case FAT16_VOLUME:
-        {
-            fat16_entry ent = {};
-            memcpy(&ent, sector+addr.offset, sizeof(ent));
-            // note: +1 is intentional
-            ent.ent = cluster+1;
-            memcpy(sector+addr.offset, &ent, sizeof(ent));
-            break;
-        }
-        case FAT12_VOLUME:
-        {
-            fat12_entry ent = GetFat12Entry(*(uint16_t*)(sector+addr.offset), cluster);
-            // note: +1 is intentional
-            ent.ent = cluster+1;
-            memcpy(sector+addr.offset, &ent, sizeof(ent));
-            break;
-        }
-    }
-    for (size_t i = 0; i < volume->bpb->nFATs; i++)
-    {
-        Vfs_FdSeek(volume->volume, (addr.lba+volume->fatSz*i)*volume->blkSize, SEEK_SET);
-        Vfs_FdWrite(volume->volume, sector, volume->blkSize, nullptr);
+        case FAT32_VOLUME: end = 0x0FFFFFF8; break;
+        case FAT16_VOLUME: end = 0xFFF8; break;
+        case FAT12_VOLUME: end = 0x0FF8; break;
     }
-    FATAllocator->Free(FATAllocator, sector, volume->blkSize);
+    FatSetEntry(volume, cluster, end);
 }
-static void markFree(fat_cache* volume, uint32_t cluster)
+static int cmp_free_pos(fat_freenode* lhs, fat_freenode* rhs)
 {
-    fat_entry_addr addr = {};
-    GetFatEntryAddrForCluster(volume, cluster, &addr);
-    uint8_t* sector = FATAllocator->ZeroAllocate(FATAllocator, 1, volume->blkSize, nullptr);
-    Vfs_FdSeek(volume->volume, addr.lba*volume->blkSize, SEEK_SET);
-    Vfs_FdRead(volume->volume, sector, volume->blkSize, nullptr);
-    switch (volume->fatType)
+    if (lhs->cluster == rhs->cluster)
+        return 0;
+    return lhs->cluster < rhs->cluster ? -1 : 1;
+}
+// Runs of the same size are sorted by position, so the lowest one is picked first.
+static int cmp_free_size(fat_freenode* lhs, fat_freenode* rhs)
+{
+    if (lhs->nClusters == rhs->nClusters)
+        return cmp_free_pos(lhs, rhs);
+    return lhs->nClusters < rhs->nClusters ? -1 : 1;
+}
+RB_GENERATE_STATIC(fat_free_pos_tree, fat_freenode, by_pos, cmp_free_pos);
+RB_GENERATE_STATIC(fat_free_size_tree, fat_freenode, by_size, cmp_free_size);
+static void insert_free_run(fat_cache* volume, fat_freenode* node)
+{
+    RB_INSERT(fat_free_pos_tree, &volume->freelist.by_pos, node);
+    RB_INSERT(fat_free_size_tree, &volume->freelist.by_size, node);
+    volume->freelist.nNodes++;
+}
+static void remove_free_run(fat_cache* volume, fat_freenode* node)
+{
+    RB_REMOVE(fat_free_pos_tree, &volume->freelist.by_pos, node);
+    RB_REMOVE(fat_free_size_tree, &volume->freelist.by_size, node);
+    volume->freelist.nNodes--;
+}
+// Adds clusters to the free trees, merging them with the runs right before and after them.
+static void add_free_run(fat_cache* volume, uint32_t cluster, uint32_t nClusters)
+{
+    fat_freenode what = {.cluster=cluster};
+    fat_freenode* next = RB_NFIND(fat_free_pos_tree, &volume->freelist.by_pos, &what);
+    fat_freenode* prev = next ?
+        RB_PREV(fat_free_pos_tree, &volume->freelist.by_pos, next) :
+        RB_MAX(fat_free_pos_tree, &volume->freelist.by_pos);
+    if (next && next->cluster != (cluster + nClusters))
+        next = nullptr;
+    if (prev && (prev->cluster + prev->nClusters) != cluster)
+        prev = nullptr;
+    volume->freelist.freeClusterCount += nClusters;
+    if (prev)
     {
-        case FAT32_VOLUME:
-        {
-            fat32_entry ent = {};
-            memcpy(&ent, sector+addr.offset, sizeof(ent));
-            ent.ent = 0;
-            memcpy(sector+addr.offset, &ent, sizeof(ent));
-            break;
-        }
-        case FAT16_VOLUME:
-        {
-            fat16_entry ent = {};
-            memcpy(&ent, sector+addr.offset, sizeof(ent));
-            ent.ent = 0;
-            memcpy(sector+addr.offset, &ent, sizeof(ent));
-            break;
-        }
-        case FAT12_VOLUME:
+        remove_free_run(volume, prev);
+        prev->nClusters += nClusters;
+        if (next)
         {
-            fat12_entry ent = GetFat12Entry(*(uint16_t*)(sector+addr.offset), cluster);
-            ent.ent = 0;
-            memcpy(sector+addr.offset, &ent, sizeof(ent));
-            break;
+            remove_free_run(volume, next);
+            prev->nClusters += next->nClusters;
+            FATAllocator->Free(FATAllocator, next, sizeof(*next));
         }
+        insert_free_run(volume, prev);
+        return;
     }
-    for (size_t i = 0; i < volume->bpb->nFATs; i++)
+    if (next)
     {
-        Vfs_FdSeek(volume->volume, (addr.lba+volume->fatSz*i)*volume->blkSize, SEEK_SET);
-        Vfs_FdWrite(volume->volume, sector, volume->blkSize, nullptr);
+        remove_free_run(volume, next);
+        next->cluster = cluster;
+        next->nClusters += nClusters;
+        insert_free_run(volume, next);
+        return;
     }
-    FATAllocator->Free(FATAllocator, sector, volume->blkSize);
+    fat_freenode* node = FATAllocator->ZeroAllocate(FATAllocator, 1, sizeof(*node), nullptr);
+    node->cluster = cluster;
+    node->nClusters = nClusters;
+    insert_free_run(volume, node);
 }
-static void markEnd(fat_cache* volume, uint32_t cluster)
+// Takes nClusters clusters from the start of a free run.
+static uint32_t take_free_run(fat_cache* volume, fat_freenode* node, uint32_t nClusters)
 {
-    fat_entry_addr addr = {};
-    GetFatEntryAddrForCluster(volume, cluster, &addr);
-    uint8_t* sector = FATAllocator->ZeroAllocate(FATAllocator, 1, volume->blkSize, nullptr);
-    Vfs_FdSeek(volume->volume, addr.lba*volume->blkSize, SEEK_SET);
-    Vfs_FdRead(volume->volume, sector, volume->blkSize, nullptr);
-    switch (volume->fatType)
+    OBOS_ASSERT(nClusters <= node->nClusters);
+    const uint32_t cluster = node->cluster;
+    remove_free_run(volume, node);
+    volume->freelist.freeClusterCount -= nClusters;
+    if (node->nClusters == nClusters)
     {
-        case FAT32_VOLUME:
-        {
-            uint32_t free = 0x0FFFFFF8;
-            fat32_entry ent = {};
-            memcpy(&ent, sector+addr.offset, sizeof(ent));
-            ent.ent = free;
-            memcpy(sector+addr.offset, &ent, sizeof(ent));
-            break;
-        }
-        case FAT16_VOLUME:
-        {
-            uint16_t free = 0xFFF8;
-            fat16_entry ent = {};
-            memcpy(&ent, sector+addr.offset, sizeof(ent));
-            ent.ent = free;
-            memcpy(sector+addr.offset, &ent, sizeof(ent));
-            break;
-        }
-        case FAT12_VOLUME:
-        {
-            uint16_t free = 0x0FF8;
-            fat12_entry ent = GetFat12Entry(*(uint16_t*)(sector+addr.offset), cluster);
-            ent.ent = free;
-            memcpy(sector+addr.offset, &ent, sizeof(ent));
-            break;
-        }
+        FATAllocator->Free(FATAllocator, node, sizeof(*node));
+        return cluster;
     }
-    for (size_t i = 0; i < volume->bpb->nFATs; i++)
+    node->cluster += nClusters;
+    node->nClusters -= nClusters;
+    insert_free_run(volume, node);
+    return cluster;
+}
+// Picks the free run to allocate from.
+// The run right after 'tail' is preferred, so a chain grows in place. Otherwise, the smallest run
+// that can hold every cluster is picked, and if there is none, the biggest run.
+static fat_freenode* pick_free_run(fat_cache* volume, uint32_t tail, size_t nClusters)
+{
+    fat_freenode what = {};
+    fat_freenode* node = nullptr;
+    if (tail >= 2)
     {
-        Vfs_FdSeek(volume->volume, (addr.lba+volume->fatSz*i)*volume->blkSize, SEEK_SET);
-        Vfs_FdWrite(volume->volume, sector, volume->blkSize, nullptr);
+        what.cluster = tail + 1;
+        node = RB_FIND(fat_free_pos_tree, &volume->freelist.by_pos, &what);
+        if (node)
+            return node;
     }
-    FATAllocator->Free(FATAllocator, sector, volume->blkSize);
+    what.cluster = 0;
+    what.nClusters = nClusters > UINT32_MAX ? UINT32_MAX : nClusters;
+    node = RB_NFIND(fat_free_size_tree, &volume->freelist.by_size, &what);
+    if (node)
+        return node;
+    return RB_MAX(fat_free_size_tree, &volume->freelist.by_size);
 }
-uint32_t AllocateClusters(fat_cache* volume, size_t nClusters)
+// Allocates nClusters clusters, and links them after 'tail', or makes a new chain if 'tail' is zero.
+static uint32_t allocate_chain(fat_cache* volume, uint32_t tail, size_t nClusters)
 {
-    // TODO: Use fsinfo structure.
-    // if (volume->fatType == FAT32_VOLUME)
-    // {}
-    if (volume->freelist.freeClusterCount < nClusters)
+    if (!volume->freelist.initialized)
+        InitializeCacheFreelist(volume);
+    if (!nClusters || volume->freelist.freeClusterCount < nClusters)
         return UINT32_MAX;
-    fat_freenode* node = volume->freelist.tail;
-    while (node && node->nClusters < nClusters)
-        node = node->prev;
-    if (!node)
-        return UINT32_MAX;
-    node->nClusters -= nClusters;
-    uint32_t cluster = node->cluster+node->nClusters;
-    if (!node->nClusters)
+    uint32_t first = UINT32_MAX;
+    while (nClusters)
     {
-        if (node->prev)
-            node->prev->next = node->prev;
-        if (node->next)
-            node->next->prev = node->prev;
-        if (volume->freelist.head == node)
-            volume->freelist.head = node->next;
-        if (volume->freelist.tail == node)
-            volume->freelist.tail = node->prev;
-        volume->freelist.nNodes--;
-        FATAllocator->Free(FATAllocator, node, sizeof(*node));
+        fat_freenode* node = pick_free_run(volume, tail, nClusters);
+        OBOS_ASSERT(node);
+        if (!node)
+            break;
+        const uint32_t nTaken = node->nClusters < nClusters ? node->nClusters : nClusters;
+        const uint32_t cluster = take_free_run(volume, node, nTaken);
+        if (first == UINT32_MAX)
+            first = cluster;
+        if (tail >= 2)
+            FatSetEntry(volume, tail, cluster);
+        for (uint32_t i = 0; i < (nTaken - 1); i++)
+            markAllocated(volume, cluster+i);
+        tail = cluster + nTaken - 1;
+        nClusters -= nTaken;
     }
-    for (size_t i = 0; i < nClusters; i++)
-        markAllocated(volume, cluster+i);
-    markEnd(volume, cluster+(nClusters-1));
-    volume->freelist.freeClusterCount -= nClusters;
-    return cluster;
+    markEnd(volume, tail);
+    return first;
+}
+uint32_t AllocateClusters(fat_cache* volume, size_t nClusters)
+{
+    return allocate_chain(volume, 0, nClusters);
 }
-// Returns true if the cluster region was extended, otherwise you need to reallocate the clusters.
-bool ExtendClusters(fat_cache* volume, uint32_t cluster, size_t nClusters, size_t oldClusterCount)
+uint32_t ExtendClusters(fat_cache* volume, uint32_t tail, size_t nClusters)
 {
-    // if (nClusters < oldClusterCount)
-    //     return false;
-    // if (nClusters == oldClusterCount)
-    //     return true;
-    // size_t diff = nClusters-oldClusterCount;
-    // size_t i = 0;
-    // markFree(volume, cluster);
-    // for (i = 0; i < diff && !isLastCluster(volume, cluster+i); i++)
-    // {
-    //     if (!isClusterFree(volume, cluster+i))
-    //         return false;
-    // };
-    // for (i = 0; i < diff; i++)
-    //     markAllocated(volume, cluster+i);
-    // markEnd(volume, cluster+diff);
-    // return true;
-    OBOS_UNUSED(volume);
-    OBOS_UNUSED(cluster);
-    OBOS_UNUSED(nClusters);
-    OBOS_UNUSED(oldClusterCount);
-    return false; // TODO: Implement extending clusters.
+    if (tail < 2 || isLastCluster(volume, tail))
+        return UINT32_MAX;
+    return allocate_chain(volume, tail, nClusters);
 }
 void TruncateClusters(fat_cache* volume, uint32_t cluster, size_t newClusterCount, size_t oldClusterCount)
 {
     if (newClusterCount >= oldClusterCount)
         return;
-    FreeClusters(volume, cluster+oldClusterCount, oldClusterCount-newClusterCount);
+    FreeClusters(volume, cluster+newClusterCount, oldClusterCount-newClusterCount);
     if (newClusterCount)
         markEnd(volume, cluster+newClusterCount-1);
 }
+void EndClusterChain(fat_cache* volume, uint32_t cluster)
+{
+    markEnd(volume, cluster);
+}
 void FreeClusters(fat_cache* volume, uint32_t cluster, size_t nClusters)
 {
-    for (size_t i = 0; i < nClusters && !isLastCluster(volume, cluster); i++)
+    if (cluster < 2 || !nClusters || isLastCluster(volume, cluster))
+        return;
+    if (nClusters > ((volume->CountofClusters + 2) - cluster))
+        nClusters = (volume->CountofClusters + 2) - cluster;
+    for (size_t i = 0; i < nClusters; i++)
         markFree(volume, cluster+i);
-    fat_freenode *curr = FATAllocator->ZeroAllocate(FATAllocator, 1, sizeof(*curr), nullptr);
-    curr->cluster = cluster;
-    curr->nClusters = nClusters;
-    if (!volume->freelist.head)
-        volume->freelist.head = curr;
-    if (volume->freelist.tail)
-        volume->freelist.tail->next = curr;
-    curr->prev = volume->freelist.tail;
-    volume->freelist.tail = curr;
-    volume->freelist.nNodes++;
-    volume->freelist.freeClusterCount += curr->nClusters;
+    // If the trees have not been built yet, they will pick these clusters up from the FAT.
+    if (volume->freelist.initialized)
+        add_free_run(volume, cluster, nClusters);
 }
 void InitializeCacheFreelist(fat_cache* volume)
 {
-    uint32_t cluster = 0;
-    struct fat_freenode* curr = nullptr;
-    uint8_t* sector = FATAllocator->ZeroAllocate(FATAllocator, 1, volume->blkSize, nullptr);
+    RB_INIT(&volume->freelist.by_pos);
+    RB_INIT(&volume->freelist.by_size);
+    volume->freelist.initialized = true;
+    uint32_t cluster = 2;
+    uint32_t runStart = 0;
+    uint32_t runLength = 0;
     for (; !isLastCluster(volume, cluster); cluster++)
     {
-        if (isClusterFree(volume, cluster, sector))
+        if (isClusterFree(volume, cluster))
         {
-            if (!curr)
-            {
-                curr = FATAllocator->ZeroAllocate(FATAllocator, 1, sizeof(*curr), nullptr);
-                curr->cluster = cluster;
-            }
-            curr->nClusters++;
+            if (!runLength)
+                runStart = cluster;
+            runLength++;
+            continue;
         }
-        else
-        {
-            if (!curr)
-                continue;
-            while (isLastCluster(volume, curr->cluster + curr->nClusters))
-                curr->nClusters--;
-            if (!volume->freelist.head)
-                volume->freelist.head = curr;
-            if (volume->freelist.tail)
-                volume->freelist.tail->next = curr;
-            curr->prev = volume->freelist.tail;
-            volume->freelist.tail = curr;
-            volume->freelist.nNodes++;
-            volume->freelist.freeClusterCount += curr->nClusters;
-            curr = nullptr;
-        }
-    }
-    if (curr)
-    {
-        if (!volume->freelist.head)
-            volume->freelist.head = curr;
-        if (volume->freelist.tail)
-            volume->freelist.tail->next = curr;
-        curr->prev = volume->freelist.tail;
-        volume->freelist.tail = curr;
-        volume->freelist.nNodes++;
-        volume->freelist.freeClusterCount += curr->nClusters;
+        if (runLength)
+            add_free_run(volume, runStart, runLength);
+        runLength = 0;
     }
-    FATAllocator->Free(FATAllocator, sector, volume->blkSize);
+    if (runLength)
+        add_free_run(volume, runStart, runLength);
 }
-obos_status NextCluster(fat_cache* cache, uint32_t cluster, uint8_t* sec_buf, uint32_t* ret)
+obos_status NextCluster(fat_cache* cache, uint32_t cluster, uint32_t* ret)
 {
     uint32_t res = 0;
     uint32_t last_clus_val = 0x0ffffff8;
-    fat_entry_addr addr = {};
-    GetFatEntryAddrForCluster(cache, cluster, &addr);
-    uint32_t offset = addr.offset;
     switch (cache->fatType) {
         case FAT32_VOLUME:
-        {
-            fat32_entry ent = {};
-            memcpy(&ent, sec_buf + offset, sizeof(ent));
-            res = ent.ent;
             last_clus_val = 0x0ffffff8;
             break;
-        }
         case FAT16_VOLUME:
-        {
-            fat16_entry ent = {};
-            memcpy(&ent, sec_buf + offset, sizeof(ent));
-            res = ent.ent;
             last_clus_val = 0xfff8;
             break;
-        }
         case FAT12_VOLUME:
-        {
-            fat12_entry ent = GetFat12Entry(*(uint16_t*)(sec_buf + offset), cluster);
-            res = ent.ent;
             last_clus_val = 0xff8;
             break;
-        }
     }
+    obos_status status = FatGetEntry(cache, cluster, &res);
+    if (obos_is_error(status))
+        return status;
     *ret = res;
     return res >= last_clus_val ? OBOS_STATUS_EOF : OBOS_STATUS_SUCCESS;
 }
 void FollowClusterChain(fat_cache* volume, uint32_t clus, clus_chain_cb callback, void* userdata)
 {
-    fat_entry_addr addr = {};
-    GetFatEntryAddrForCluster(volume, clus, &addr);
-    uint8_t* sector = FATAllocator->ZeroAllocate(FATAllocator, 1, volume->blkSize, nullptr);
-    Vfs_FdSeek(volume->volume, addr.lba*volume->blkSize, SEEK_SET);
-    Vfs_FdRead(volume->volume, sector, volume->blkSize, nullptr);
     uint32_t curr = clus;
-    obos_status status = OBOS_STATUS_SUCCESS;
-    do {
-        if (callback(clus, status, userdata) == ITERATE_DECISION_STOP)
+    while (1)
+    {
+        uint32_t next = 0;
+        obos_status status = NextCluster(volume, curr, &next);
+        if (obos_is_error(status) && status != OBOS_STATUS_EOF)
+        {
+            OBOS_Error("FAT: Error following cluster chain: Could not read FAT. Status: %d. Aborting.\n", status);
+            callback(0, OBOS_STATUS_ABORTED, userdata);
+            break;
+        }
+        if (callback(curr, status, userdata) == ITERATE_DECISION_STOP)
             break;
-        status = NextCluster(volume, curr, sector, &curr);
         if (status == OBOS_STATUS_EOF)
             break;
-        if (curr == 0)
+        if (next == 0)
         {
             OBOS_Error("FAT: Error following cluster chain: Unexpected free cluster. Aborting.\n");
             callback(0, OBOS_STATUS_ABORTED, userdata);
             break;
         }
-        if (curr >= volume->CountofClusters)
+        if (next < 2 || isLastCluster(volume, next))
         {
             OBOS_Error("FAT: Error following cluster chain: Cluster is over disk boundaries. Aborting.\n");
             callback(0, OBOS_STATUS_ABORTED, userdata);
             break;
         }
-        uint64_t prev_lba = addr.lba;
-        GetFatEntryAddrForCluster(volume, clus, &addr);
-        if (addr.lba != prev_lba)
-        {
-            Vfs_FdSeek(volume->volume, addr.lba*volume->blkSize, SEEK_SET);
-            Vfs_FdRead(volume->volume, sector, volume->blkSize, nullptr);
-        }
-    } while(status != OBOS_STATUS_EOF);
-    FATAllocator->Free(FATAllocator, sector, volume->blkSize);
+        curr = next;
+    }
 }
\ No newline at end of file
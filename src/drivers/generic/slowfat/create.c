@@ -75,15 +75,10 @@ obos_status mk_file(dev_desc* newDesc, dev_desc parent_desc, void* vn_, const ch
     }
     if (!(parent->data.attribs & DIRECTORY))
         return OBOS_STATUS_INVALID_ARGUMENT;
-    for (fat_dirent_cache* curr = parent->fdc_children.head; curr; )
-    {
-        if (OBOS_CompareStringC(&curr->name, name))
-        {
-            printf("abort\n");
-            return OBOS_STATUS_ALREADY_INITIALIZED;
-        }
-        curr = curr->fdc_next_child;
-    }
+    // The name needs to be checked against every entry, not just the ones we have already read.
+    PopulateDirectory(parent->owner, parent);
+    if (DirIndexLookup(parent, name, strlen(name)))
+        return OBOS_STATUS_ALREADY_INITIALIZED;
     fat_dirent_cache* new = FATAllocator->ZeroAllocate(FATAllocator, 1, sizeof(fat_dirent_cache), nullptr);
     *newDesc = (dev_desc)new;
     new->data.creation_date = (fat_date){};
@@ -157,32 +152,31 @@ static void gen_short_name(const char* long_name, char* name, fat_dirent_cache*
         gen_short_name_impl(long_name, name);
         return;
     }
-    uint32_t n = 1;
     char raw[11] = {};
     gen_short_name_impl(long_name, raw);
-    for (fat_dirent_cache* curr = parent->fdc_children.head; curr; )
-    {
-        if (curr == dirent)
-        {
-            curr = curr->fdc_next_child;
-            continue;
-        }
-        char curr_name[11] = {};
-        gen_short_name_impl(OBOS_GetStringCPtr(&curr->name), curr_name);
-        if (memcmp(raw, curr_name, 11))
-            n++;
-        curr = curr->fdc_next_child;
-    }
-    OBOS_ASSERT(n <= 999999);
     uint8_t basename_len = 0;
     for (; raw[basename_len] != ' ' && basename_len < 8; basename_len++)
         ;
-    size_t sz = snprintf(nullptr, 0, "%d", n);
-    raw[basename_len-sz-1] = '~';
-    char buf[7] = {};
-    snprintf(buf, sz+1, "%d", n);
-    memcpy(&raw[basename_len-sz], buf, sz);
-    memcpy(name, raw, 11);
+    // Take the first "BASE~N" that isn't used by another entry in the directory.
+    char candidate[11];
+    uint32_t n = 1;
+    for (; n <= 999999; n++)
+    {
+        size_t sz = snprintf(nullptr, 0, "%d", n);
+        size_t end = basename_len;
+        if (end < sz+1)
+            end = sz+1;
+        memcpy(candidate, raw, 11);
+        candidate[end-sz-1] = '~';
+        char buf[7] = {};
+        snprintf(buf, sz+1, "%d", n);
+        memcpy(&candidate[end-sz], buf, sz);
+        fat_dirent_cache* found = DirIndexLookupShort(parent, candidate);
+        if (!found || found == dirent)
+            break;
+    }
+    OBOS_ASSERT(n <= 999999);
+    memcpy(name, candidate, 11);
 }
 static const char* basename(const char* path)
 {
@@ -398,41 +392,40 @@ static void ref_dirent(fat_dirent_cache* cache_entry)
     {
         // We need MOREEEEEEEEEEEE clusters
         if (inRoot && cache->fatType != FAT32_VOLUME)
+        {
+            FATAllocator->Free(FATAllocator, buf, bytesPerCluster);
             return; // nothing we can do about this...
-        size_t newSizeCls = szClusters + nClusters;
-        uint32_t cluster = cache_entry->fdc_parent->data.first_cluster_low;
-        cluster |= ((uint32_t)cache_entry->fdc_parent->data.first_cluster_high << 16);
-        if (!ExtendClusters(cache, cluster, newSizeCls, szClusters))
+        }
+        // The directory grows in place where possible, so the existing entries never need to be copied.
+        fat_dirent_cache* parent = cache_entry->fdc_parent;
+        if (obos_is_error(GetFileExtents(cache, parent)))
         {
-            uint32_t newCluster = AllocateClusters(cache, newSizeCls);
-            if (newCluster == UINT32_MAX)
-            {
-                Core_MutexRelease(&cache->fat_lock);
-                return;
-            }
-            for (size_t i = 0; i < szClusters; i++)
-            {
-                Vfs_FdSeek(cache->volume, ClusterToSector(cache, cluster+i)*cache->blkSize, SEEK_SET);
-                Vfs_FdRead(cache->volume, buf, bytesPerCluster, nullptr);
-                Vfs_FdSeek(cache->volume, ClusterToSector(cache, newCluster+i)*cache->blkSize, SEEK_SET);
-                Vfs_FdWrite(cache->volume, buf, bytesPerCluster, nullptr);
-            }
-            if (cluster)
-                FreeClusters(cache, cluster, szClusters);
-            cluster = newCluster;
-            cache_entry->fdc_parent->data.first_cluster_high = cluster >> 16;
-            cache_entry->fdc_parent->data.first_cluster_low = cluster & 0xffff;
-            if (cache_entry != cache->root)
-                WriteFatDirent(cache, cache_entry->fdc_parent, false);
-            else 
-            {
-                cache->bpb->ebpb.fat32.rootCluster = cluster;
-                WriteFatDirent(cache, cache_entry->fdc_parent, false);
-                Vfs_FdSeek(cache->volume, 0, SEEK_SET);
-                memzero(buf, cache->blkSize);
-                memcpy(buf, cache->bpb, sizeof(*cache->bpb));
-                Vfs_FdWrite(cache->volume, buf, cache->blkSize, nullptr);
-            }
+            FATAllocator->Free(FATAllocator, buf, bytesPerCluster);
+            return;
+        }
+        const fat_extent* last = parent->extents.nRuns ? &parent->extents.runs[parent->extents.nRuns - 1] : nullptr;
+        const size_t oldSizeCls = last ? (size_t)last->fileCluster + last->nClusters : 0;
+        bool newChain = false;
+        if (obos_is_error(GrowFileClusters(cache, parent, oldSizeCls + nClusters, &newChain)) ||
+            obos_is_error(GetFileExtents(cache, parent)))
+        {
+            FatFlush(cache);
+            FATAllocator->Free(FATAllocator, buf, bytesPerCluster);
+            return;
+        }
+        FatFlush(cache);
+        if (newChain && parent != cache->root)
+            WriteFatDirent(cache, parent, false);
+        const fat_extent* run = LookupFileExtent(parent, oldSizeCls);
+        OBOS_ASSERT(run);
+        uint32_t cluster = run->cluster + (oldSizeCls - run->fileCluster);
+        // The new clusters must not have any stale entries in them.
+        memzero(buf, bytesPerCluster);
+        for (size_t i = oldSizeCls; i < (oldSizeCls + nClusters); i++)
+        {
+            const fat_extent* ext = LookupFileExtent(parent, i);
+            Vfs_FdSeek(cache->volume, ClusterToSector(cache, ext->cluster + (i - ext->fileCluster))*cache->blkSize, SEEK_SET);
+            Vfs_FdWrite(cache->volume, buf, bytesPerCluster, nullptr);
         }
         fileoff = ClusterToSector(cache, cluster)*cache->blkSize;
         entry_cluster = cluster;
@@ -466,15 +459,9 @@ static void ref_dirent(fat_dirent_cache* cache_entry)
                 Vfs_FdSeek(cache->volume, fileoff, SEEK_SET);
                 Vfs_FdWrite(cache->volume, buf, blkSize, nullptr);
                 uint32_t next = 0;
-                fat_entry_addr addr = {};
-                GetFatEntryAddrForCluster(cache, entry_cluster, &addr);
-                uint8_t* sector = FATAllocator->Allocate(FATAllocator, cache->blkSize, nullptr);
-                Vfs_FdSeek(cache->volume, addr.lba*cache->blkSize, SEEK_SET);
-                Vfs_FdRead(cache->volume, sector, cache->blkSize, nullptr);
-                obos_status status = NextCluster(cache, entry_cluster, sector, &next);
-                if (status == OBOS_STATUS_EOF)
+                obos_status status = NextCluster(cache, entry_cluster, &next);
+                if (obos_is_error(status))
                     break;
-                FATAllocator->Free(FATAllocator, sector, cache->blkSize);
                 if (next == 0)
                 {
                     OBOS_Error("FAT: Error following cluster chain: Unexpected free cluster. Aborting.\n");
@@ -567,7 +554,9 @@ obos_status move_desc_to(dev_desc desc, const char* where)
         deref_dirent(cache_entry);
         CacheRemoveChild(cache_entry->fdc_parent, cache_entry);
         CacheAppendChild(parent, cache_entry);
+        DirIndexRemove(parent, cache_entry);
         gen_short_name(OBOS_GetStringCPtr(&cache_entry->name), &cache_entry->data.filename_83[0], parent, cache_entry);
+        DirIndexInsert(parent, cache_entry);
         ref_dirent(cache_entry);
         Core_MutexRelease(&cache->fd_lock);
         Core_MutexRelease(&cache->fat_lock);
@@ -577,7 +566,10 @@ obos_status move_desc_to(dev_desc desc, const char* where)
         deref_dirent(cache_entry);
         Core_MutexAcquire(&cache->fat_lock);
         Core_MutexAcquire(&cache->fd_lock);
+        // The entry is still indexed under its old names.
+        DirIndexRemove(parent, cache_entry);
         gen_short_name(OBOS_GetStringCPtr(&cache_entry->name), &cache_entry->data.filename_83[0], parent, cache_entry);
+        DirIndexInsert(parent, cache_entry);
         ref_dirent(cache_entry);
         Core_MutexRelease(&cache->fd_lock);
         Core_MutexRelease(&cache->fat_lock);
@@ -590,6 +582,8 @@ obos_status remove_file(dev_desc desc)
     if (!desc)
         return OBOS_STATUS_INVALID_ARGUMENT;
     fat_dirent_cache* cache_entry = (fat_dirent_cache*)desc;
+    if (cache_entry->data.attribs & DIRECTORY)
+        PopulateDirectory(cache_entry->owner, cache_entry);
     if (cache_entry->fdc_children.nChildren)
         return OBOS_STATUS_IN_USE; // we cannot remove a directory with children.
     fat_cache* cache = cache_entry->owner;
@@ -603,8 +597,20 @@ obos_status remove_file(dev_desc desc)
     deref_dirent(cache_entry);
     const size_t bytesPerCluster = (cache->bpb->sectorsPerCluster*cache->blkSize);
     const uint32_t szClusters = ((cache_entry->data.filesize / bytesPerCluster) + ((cache_entry->data.filesize % bytesPerCluster) != 0));
-    FreeClusters(cache, (uint32_t)cache_entry->data.first_cluster_low|((uint32_t)cache_entry->data.first_cluster_high<<16), szClusters);
+    Core_MutexAcquire(&cache->fat_lock);
+    if (obos_is_success(GetFileExtents(cache, cache_entry)))
+    {
+        for (size_t i = 0; i < cache_entry->extents.nRuns; i++)
+            FreeClusters(cache, cache_entry->extents.runs[i].cluster, cache_entry->extents.runs[i].nClusters);
+    }
+    else
+        FreeClusters(cache, (uint32_t)cache_entry->data.first_cluster_low|((uint32_t)cache_entry->data.first_cluster_high<<16), szClusters);
+    FatFlush(cache);
+    Core_MutexRelease(&cache->fat_lock);
+    if (cache_entry->extents.runs)
+        FATAllocator->Free(FATAllocator, cache_entry->extents.runs, cache_entry->extents.capacity*sizeof(fat_extent));
     CacheRemoveChild(cache_entry->fdc_parent, cache_entry);
+    DirIndexFree(cache_entry);
     FATAllocator->Free(FATAllocator, cache_entry, sizeof(*cache_entry));
     Vfs_FdFlush(cache->volume);
     return OBOS_STATUS_SUCCESS;
@@ -0,0 +1,126 @@
+/*
+ * drivers/generic/slowfat/extent.c
+ *
+ * Copyright (c) 2024 Omar Berrow
+ *
+ * Abandon all hope ye who enter here
+*/
+
+#include <int.h>
+#include <klog.h>
+#include <error.h>
+
+#include <allocators/base.h>
+
+#include <driver_interface/header.h>
+
+#include "structs.h"
+#include "alloc.h"
+
+static iterate_decision build_cb(uint32_t cluster, obos_status status, void* udata)
+{
+    uintptr_t* data = udata;
+    fat_dirent_cache* file = (fat_dirent_cache*)data[0];
+    if (status == OBOS_STATUS_ABORTED)
+    {
+        data[1] = OBOS_STATUS_ABORTED;
+        return ITERATE_DECISION_STOP;
+    }
+    fat_extent* last = file->extents.nRuns ? &file->extents.runs[file->extents.nRuns - 1] : nullptr;
+    if (last && (last->cluster + last->nClusters) == cluster)
+    {
+        last->nClusters++;
+        return ITERATE_DECISION_CONTINUE;
+    }
+    if (file->extents.nRuns == file->extents.capacity)
+    {
+        size_t oldCapacity = file->extents.capacity;
+        file->extents.capacity = oldCapacity ? oldCapacity*2 : 4;
+        file->extents.runs = FATAllocator->Reallocate(FATAllocator, file->extents.runs, file->extents.capacity*sizeof(fat_extent), nullptr);
+    }
+    fat_extent* run = &file->extents.runs[file->extents.nRuns++];
+    run->fileCluster = last ? last->fileCluster + last->nClusters : 0;
+    run->cluster = cluster;
+    run->nClusters = 1;
+    return ITERATE_DECISION_CONTINUE;
+}
+obos_status GetFileExtents(fat_cache* volume, fat_dirent_cache* file)
+{
+    if (!volume || !file)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    if (file->extents.valid)
+        return OBOS_STATUS_SUCCESS;
+    file->extents.nRuns = 0;
+    uint32_t cluster = file->data.first_cluster_low;
+    if (volume->fatType == FAT32_VOLUME)
+        cluster |= ((uint32_t)file->data.first_cluster_high << 16);
+    if (cluster < 2)
+    {
+        // No clusters.
+        file->extents.valid = true;
+        return OBOS_STATUS_SUCCESS;
+    }
+    uintptr_t udata[2] = { (uintptr_t)file, OBOS_STATUS_SUCCESS };
+    FollowClusterChain(volume, cluster, build_cb, udata);
+    if (udata[1] != OBOS_STATUS_SUCCESS)
+    {
+        file->extents.nRuns = 0;
+        return OBOS_STATUS_INTERNAL_ERROR;
+    }
+    file->extents.valid = true;
+    return OBOS_STATUS_SUCCESS;
+}
+const fat_extent* LookupFileExtent(fat_dirent_cache* file, uint32_t fileCluster)
+{
+    if (!file || !file->extents.valid || !file->extents.nRuns)
+        return nullptr;
+    // Binary search for the last run that starts at or before fileCluster.
+    size_t lo = 0, hi = file->extents.nRuns;
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (file->extents.runs[mid].fileCluster <= fileCluster)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    const fat_extent* run = &file->extents.runs[lo];
+    if (fileCluster < run->fileCluster || fileCluster >= (run->fileCluster + run->nClusters))
+        return nullptr;
+    return run;
+}
+void InvalidateFileExtents(fat_dirent_cache* file)
+{
+    if (!file)
+        return;
+    file->extents.valid = false;
+    file->extents.nRuns = 0;
+}
+obos_status GrowFileClusters(fat_cache* volume, fat_dirent_cache* file, size_t nClusters, bool* newChain)
+{
+    if (!volume || !file)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    if (newChain)
+        *newChain = false;
+    obos_status status = GetFileExtents(volume, file);
+    if (obos_is_error(status))
+        return status;
+    const fat_extent* last = file->extents.nRuns ? &file->extents.runs[file->extents.nRuns - 1] : nullptr;
+    const size_t have = last ? (size_t)last->fileCluster + last->nClusters : 0;
+    if (have >= nClusters)
+        return OBOS_STATUS_SUCCESS;
+    if (!last)
+    {
+        uint32_t cluster = AllocateClusters(volume, nClusters);
+        if (cluster == UINT32_MAX)
+            return OBOS_STATUS_NOT_ENOUGH_MEMORY;
+        file->data.first_cluster_high = cluster >> 16;
+        file->data.first_cluster_low = cluster & 0xffff;
+        if (newChain)
+            *newChain = true;
+    }
+    else if (ExtendClusters(volume, last->cluster + last->nClusters - 1, nClusters - have) == UINT32_MAX)
+        return OBOS_STATUS_NOT_ENOUGH_MEMORY;
+    InvalidateFileExtents(file);
+    return OBOS_STATUS_SUCCESS;
+}
@@ -0,0 +1,329 @@
+/*
+ * drivers/generic/slowfat/fat_table.c
+ *
+ * Copyright (c) 2024 Omar Berrow
+ *
+ * An in-memory cache of the FAT.
+ * FAT12/16 volumes have the whole table read in at mount, while FAT32 volumes
+ * keep up to FAT_MAX_RESIDENT_CHUNKS chunks of FAT_CHUNK_SECTORS sectors in memory.
+ * Modified chunks are only written back (to every copy of the FAT) in FatFlush.
+*/
+
+#include <int.h>
+#include <klog.h>
+#include <error.h>
+#include <memmanip.h>
+
+#include <locks/mutex.h>
+
+#include <vfs/fd.h>
+
+#include <allocators/base.h>
+
+#include <utils/list.h>
+
+#include "structs.h"
+#include "alloc.h"
+
+LIST_GENERATE(fat_chunk_lru, struct fat_table_chunk, node);
+
+#define FSINFO_LEAD_SIGNATURE  (0x41615252)
+#define FSINFO_OTHER_SIGNATURE (0x61417272)
+#define FSINFO_TRAIL_SIGNATURE (0xAA550000)
+
+static size_t chunk_size(fat_cache* volume, uint32_t index)
+{
+    size_t nSectors = volume->fatSz - (size_t)index*FAT_CHUNK_SECTORS;
+    if (nSectors > FAT_CHUNK_SECTORS)
+        nSectors = FAT_CHUNK_SECTORS;
+    return nSectors*volume->bpb->bytesPerSector;
+}
+static uoff_t fat_offset(fat_cache* volume, uint8_t fat)
+{
+    return ((uoff_t)volume->bpb->reservedSectorCount + (uoff_t)fat*volume->fatSz)*volume->bpb->bytesPerSector;
+}
+// On FAT32, mirroring can be disabled, in which case only one FAT is in use.
+static bool fat_mirroring_disabled(fat_cache* volume)
+{
+    return volume->fatType == FAT32_VOLUME && (volume->bpb->ebpb.fat32.extendedFlags & BIT(7));
+}
+static uint8_t active_fat(fat_cache* volume)
+{
+    return fat_mirroring_disabled(volume) ? (volume->bpb->ebpb.fat32.extendedFlags & 0xf) : 0;
+}
+static obos_status read_chunk(fat_cache* volume, fat_table_chunk* chunk)
+{
+    const size_t size = chunk_size(volume, chunk->index);
+    const uoff_t offset = fat_offset(volume, active_fat(volume)) + (uoff_t)chunk->index*FAT_CHUNK_SECTORS*volume->bpb->bytesPerSector;
+    obos_status status = Vfs_FdSeek(volume->fat.fd, offset, SEEK_SET);
+    if (obos_is_error(status))
+        return status;
+    return Vfs_FdRead(volume->fat.fd, chunk->data, size, nullptr);
+}
+static obos_status write_chunk(fat_cache* volume, fat_table_chunk* chunk)
+{
+    const size_t size = chunk_size(volume, chunk->index);
+    const uoff_t chunk_offset = (uoff_t)chunk->index*FAT_CHUNK_SECTORS*volume->bpb->bytesPerSector;
+    for (uint8_t i = 0; i < volume->bpb->nFATs; i++)
+    {
+        if (fat_mirroring_disabled(volume) && i != active_fat(volume))
+            continue;
+        obos_status status = Vfs_FdSeek(volume->fat.fd, fat_offset(volume, i) + chunk_offset, SEEK_SET);
+        if (obos_is_success(status))
+            status = Vfs_FdWrite(volume->fat.fd, chunk->data, size, nullptr);
+        if (obos_is_error(status))
+            return status;
+    }
+    chunk->dirty = false;
+    return OBOS_STATUS_SUCCESS;
+}
+// Must be called with the FAT cache lock held.
+static fat_table_chunk* get_chunk(fat_cache* volume, uint32_t index, obos_status* status)
+{
+    *status = OBOS_STATUS_SUCCESS;
+    if (index >= volume->fat.nChunks)
+    {
+        *status = OBOS_STATUS_INVALID_ARGUMENT;
+        return nullptr;
+    }
+    fat_table_chunk* chunk = volume->fat.chunks[index];
+    if (chunk)
+    {
+        if (!volume->fat.table && LIST_GET_HEAD(fat_chunk_lru, &volume->fat.lru) != chunk)
+        {
+            LIST_REMOVE(fat_chunk_lru, &volume->fat.lru, chunk);
+            LIST_PREPEND(fat_chunk_lru, &volume->fat.lru, chunk);
+        }
+        return chunk;
+    }
+    OBOS_ASSERT(!volume->fat.table);
+    if (LIST_GET_NODE_COUNT(fat_chunk_lru, volume->fat.lru) >= FAT_MAX_RESIDENT_CHUNKS)
+    {
+        // Reuse the least recently used chunk.
+        chunk = LIST_GET_TAIL(fat_chunk_lru, &volume->fat.lru);
+        if (chunk->dirty)
+        {
+            *status = write_chunk(volume, chunk);
+            if (obos_is_error(*status))
+                return nullptr;
+        }
+        LIST_REMOVE(fat_chunk_lru, &volume->fat.lru, chunk);
+        volume->fat.chunks[chunk->index] = nullptr;
+    }
+    else
+    {
+        chunk = FATAllocator->ZeroAllocate(FATAllocator, 1, sizeof(*chunk), nullptr);
+        chunk->data = FATAllocator->Allocate(FATAllocator, FAT_CHUNK_SECTORS*volume->bpb->bytesPerSector, nullptr);
+    }
+    chunk->index = index;
+    chunk->dirty = false;
+    *status = read_chunk(volume, chunk);
+    if (obos_is_error(*status))
+    {
+        FATAllocator->Free(FATAllocator, chunk->data, FAT_CHUNK_SECTORS*volume->bpb->bytesPerSector);
+        FATAllocator->Free(FATAllocator, chunk, sizeof(*chunk));
+        return nullptr;
+    }
+    volume->fat.chunks[index] = chunk;
+    LIST_PREPEND(fat_chunk_lru, &volume->fat.lru, chunk);
+    return chunk;
+}
+// Returns the byte offset of a cluster's entry into the FAT.
+static size_t entry_offset(fat_cache* volume, uint32_t cluster)
+{
+    fat_entry_addr addr = {};
+    GetFatEntryAddrForCluster(volume, cluster, &addr);
+    return (addr.lba - volume->bpb->reservedSectorCount)*volume->bpb->bytesPerSector + addr.offset;
+}
+obos_status InitializeFatCache(fat_cache* volume)
+{
+    obos_status status = OBOS_STATUS_SUCCESS;
+    volume->fat.fd = FATAllocator->ZeroAllocate(FATAllocator, 1, sizeof(fd), nullptr);
+    status = Vfs_FdOpenVnode(volume->fat.fd, volume->vn, 0);
+    if (obos_is_error(status))
+        return status;
+    const size_t chunkBytes = FAT_CHUNK_SECTORS*volume->bpb->bytesPerSector;
+    volume->fat.nChunks = (volume->fatSz + FAT_CHUNK_SECTORS - 1) / FAT_CHUNK_SECTORS;
+    volume->fat.chunks = FATAllocator->ZeroAllocate(FATAllocator, volume->fat.nChunks, sizeof(fat_table_chunk*), nullptr);
+    if (volume->fatType != FAT32_VOLUME)
+    {
+        // Read the entire table in one go.
+        const size_t tableSize = (size_t)volume->fatSz*volume->bpb->bytesPerSector;
+        volume->fat.table = FATAllocator->Allocate(FATAllocator, tableSize, nullptr);
+        status = Vfs_FdSeek(volume->fat.fd, fat_offset(volume, 0), SEEK_SET);
+        if (obos_is_success(status))
+            status = Vfs_FdRead(volume->fat.fd, volume->fat.table, tableSize, nullptr);
+        if (obos_is_error(status))
+            return status;
+        for (size_t i = 0; i < volume->fat.nChunks; i++)
+        {
+            fat_table_chunk* chunk = FATAllocator->ZeroAllocate(FATAllocator, 1, sizeof(*chunk), nullptr);
+            chunk->index = i;
+            chunk->data = volume->fat.table + i*chunkBytes;
+            volume->fat.chunks[i] = chunk;
+        }
+        return OBOS_STATUS_SUCCESS;
+    }
+    volume->fat.nextFreeHint = 0xffffffff;
+    fsinfo info = {};
+    status = Vfs_FdSeek(volume->fat.fd, (uoff_t)volume->bpb->ebpb.fat32.fsInfoOffset*volume->bpb->bytesPerSector, SEEK_SET);
+    if (obos_is_success(status))
+        status = Vfs_FdRead(volume->fat.fd, &info, sizeof(info), nullptr);
+    volume->fat.hasFsinfo =
+        obos_is_success(status) &&
+        volume->bpb->ebpb.fat32.fsInfoOffset != 0 && volume->bpb->ebpb.fat32.fsInfoOffset != 0xffff &&
+        info.leadSignature == FSINFO_LEAD_SIGNATURE &&
+        info.other_signature == FSINFO_OTHER_SIGNATURE &&
+        info.trailSignature == FSINFO_TRAIL_SIGNATURE;
+    if (volume->fat.hasFsinfo)
+        volume->fat.nextFreeHint = info.firstAvailableCluster;
+    return OBOS_STATUS_SUCCESS;
+}
+obos_status FatGetEntry(fat_cache* volume, uint32_t cluster, uint32_t* value)
+{
+    if (!volume || !value)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    const size_t offset = entry_offset(volume, cluster);
+    Core_MutexAcquire(&volume->fat.lock);
+    obos_status status = OBOS_STATUS_SUCCESS;
+    switch (volume->fatType)
+    {
+        case FAT32_VOLUME:
+        {
+            const size_t chunkBytes = FAT_CHUNK_SECTORS*volume->bpb->bytesPerSector;
+            fat_table_chunk* chunk = get_chunk(volume, offset / chunkBytes, &status);
+            if (!chunk)
+                break;
+            fat32_entry ent = {};
+            memcpy(&ent, chunk->data + (offset % chunkBytes), sizeof(ent));
+            *value = ent.ent;
+            break;
+        }
+        case FAT16_VOLUME:
+        {
+            fat16_entry ent = {};
+            memcpy(&ent, volume->fat.table + offset, sizeof(ent));
+            *value = ent.ent;
+            break;
+        }
+        case FAT12_VOLUME:
+        {
+            uint16_t val = 0;
+            memcpy(&val, volume->fat.table + offset, sizeof(val));
+            *value = GetFat12Entry(val, cluster).ent;
+            break;
+        }
+    }
+    Core_MutexRelease(&volume->fat.lock);
+    return status;
+}
+obos_status FatSetEntry(fat_cache* volume, uint32_t cluster, uint32_t value)
+{
+    if (!volume)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    const size_t offset = entry_offset(volume, cluster);
+    const size_t chunkBytes = FAT_CHUNK_SECTORS*volume->bpb->bytesPerSector;
+    Core_MutexAcquire(&volume->fat.lock);
+    obos_status status = OBOS_STATUS_SUCCESS;
+    switch (volume->fatType)
+    {
+        case FAT32_VOLUME:
+        {
+            fat_table_chunk* chunk = get_chunk(volume, offset / chunkBytes, &status);
+            if (!chunk)
+                break;
+            // The high four bits are reserved, and must be preserved.
+            uint32_t ent = 0;
+            memcpy(&ent, chunk->data + (offset % chunkBytes), sizeof(ent));
+            ent = (ent & 0xf0000000) | (value & 0x0fffffff);
+            memcpy(chunk->data + (offset % chunkBytes), &ent, sizeof(ent));
+            chunk->dirty = true;
+            break;
+        }
+        case FAT16_VOLUME:
+        {
+            fat16_entry ent = { .ent=value };
+            memcpy(volume->fat.table + offset, &ent, sizeof(ent));
+            volume->fat.chunks[offset / chunkBytes]->dirty = true;
+            break;
+        }
+        case FAT12_VOLUME:
+        {
+            // FAT12 entries share a byte with their neighbour.
+            uint16_t val = 0;
+            memcpy(&val, volume->fat.table + offset, sizeof(val));
+            if (cluster % 2)
+                val = (val & 0x000f) | ((value & 0xfff) << 4);
+            else
+                val = (val & 0xf000) | (value & 0xfff);
+            memcpy(volume->fat.table + offset, &val, sizeof(val));
+            // The entry can straddle two chunks.
+            volume->fat.chunks[offset / chunkBytes]->dirty = true;
+            volume->fat.chunks[(offset + 1) / chunkBytes]->dirty = true;
+            break;
+        }
+    }
+    if (obos_is_success(status) && volume->fat.hasFsinfo)
+    {
+        // Keep FSI_Nxt_Free pointing past the most recently allocated cluster.
+        if (value)
+            volume->fat.nextFreeHint = cluster + 1;
+        volume->fat.fsinfoDirty = true;
+    }
+    Core_MutexRelease(&volume->fat.lock);
+    return status;
+}
+obos_status FatFlush(fat_cache* volume)
+{
+    if (!volume)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    obos_status status = OBOS_STATUS_SUCCESS;
+    bool wrote = false;
+    Core_MutexAcquire(&volume->fat.lock);
+    if (volume->fat.table)
+    {
+        for (size_t i = 0; i < volume->fat.nChunks && obos_is_success(status); i++)
+        {
+            if (!volume->fat.chunks[i]->dirty)
+                continue;
+            status = write_chunk(volume, volume->fat.chunks[i]);
+            wrote = true;
+        }
+    }
+    else
+    {
+        for (fat_table_chunk* chunk = LIST_GET_HEAD(fat_chunk_lru, &volume->fat.lru); chunk && obos_is_success(status); )
+        {
+            if (chunk->dirty)
+            {
+                status = write_chunk(volume, chunk);
+                wrote = true;
+            }
+            chunk = LIST_GET_NEXT(fat_chunk_lru, &volume->fat.lru, chunk);
+        }
+    }
+    if (obos_is_success(status) && volume->fat.hasFsinfo && volume->fat.fsinfoDirty)
+    {
+        fsinfo info = {};
+        const uoff_t off = (uoff_t)volume->bpb->ebpb.fat32.fsInfoOffset*volume->bpb->bytesPerSector;
+        status = Vfs_FdSeek(volume->fat.fd, off, SEEK_SET);
+        if (obos_is_success(status))
+            status = Vfs_FdRead(volume->fat.fd, &info, sizeof(info), nullptr);
+        if (obos_is_success(status))
+        {
+            // The free count is unknown until the free cluster trees are built.
+            info.lastFreeCluster = volume->freelist.initialized ? volume->freelist.freeClusterCount : 0xffffffff;
+            info.firstAvailableCluster = volume->fat.nextFreeHint;
+            status = Vfs_FdSeek(volume->fat.fd, off, SEEK_SET);
+        }
+        if (obos_is_success(status))
+            status = Vfs_FdWrite(volume->fat.fd, &info, sizeof(info), nullptr);
+        if (obos_is_success(status))
+            volume->fat.fsinfoDirty = false;
+        wrote = true;
+    }
+    if (wrote)
+        Vfs_FdFlush(volume->fat.fd);
+    Core_MutexRelease(&volume->fat.lock);
+    return status;
+}
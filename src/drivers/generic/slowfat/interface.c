@@ -117,6 +117,7 @@ obos_status list_dir(dev_desc dir, void* vn, iterate_decision(*cb)(dev_desc desc
         return OBOS_STATUS_INVALID_OPERATION; // not a fat volume we have probed
     if (dir == UINTPTR_MAX)
         dir = (dev_desc)cache->root;
+    PopulateDirectory(cache, (fat_dirent_cache*)dir);
     for (fat_dirent_cache* cache_entry = ((fat_dirent_cache*)dir)->fdc_children.head; cache_entry; )
     {
         if (cache_entry->data.attribs & VOLUME_ID)
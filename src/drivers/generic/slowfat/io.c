@@ -29,43 +29,39 @@
 #include "structs.h"
 #include "alloc.h"
 
-static iterate_decision read_callback(uint32_t cluster, obos_status stat, void* udata_)
+// Transfers 'size' bytes at 'offset' into the file, with one volume transfer for each run of contiguous clusters.
+// Must be called with the fat lock and the fd lock held, and with the file's extent map built.
+static obos_status file_io(fat_cache* cache, fat_dirent_cache* file, uint8_t* buf, size_t size, size_t offset, bool write, size_t* nDone)
 {
-    uintptr_t* udata = udata_;
-    uint8_t* buf = (void*)udata[0];
-    size_t i = udata[1]++;
-    size_t nClustersToRead = udata[2];
-    int64_t bytesLeft = udata[3];
-    size_t current_offset = udata[4];
-    size_t cluster_offset = udata[5];
-    fat_cache* cache = (void*)udata[6];
-    obos_status* status = (void*)udata[7];
-    uint8_t* cluster_buf = (void*)udata[8];
     const size_t bytesPerCluster = (cache->bpb->sectorsPerCluster*cache->blkSize);
-    if (stat != OBOS_STATUS_EOF && stat != OBOS_STATUS_SUCCESS)
-    {
-        *status = stat;
-        return ITERATE_DECISION_STOP;
-    }
-    Vfs_FdSeek(cache->volume, ClusterToSector(cache, cluster)*cache->blkSize, SEEK_SET);
-    *status = Vfs_FdRead(cache->volume, cluster_buf, bytesPerCluster, nullptr);
-    if (obos_is_error(*status))
+    obos_status status = OBOS_STATUS_SUCCESS;
+    size_t done = 0;
+    while (done < size)
     {
-        FATAllocator->Free(FATAllocator, cluster_buf, bytesPerCluster);
-        Core_MutexRelease(&cache->fd_lock);
-        return ITERATE_DECISION_STOP;
+        const size_t off = offset + done;
+        const fat_extent* run = LookupFileExtent(file, off / bytesPerCluster);
+        if (!run)
+        {
+            // The cluster chain is shorter than the file.
+            status = OBOS_STATUS_INTERNAL_ERROR;
+            break;
+        }
+        const size_t runOffset = off - (size_t)run->fileCluster*bytesPerCluster;
+        size_t nBytes = (size_t)run->nClusters*bytesPerCluster - runOffset;
+        if (nBytes > (size - done))
+            nBytes = size - done;
+        status = Vfs_FdSeek(cache->volume, (uoff_t)ClusterToSector(cache, run->cluster)*cache->blkSize + runOffset, SEEK_SET);
+        if (obos_is_success(status))
+            status = write ?
+                Vfs_FdWrite(cache->volume, buf+done, nBytes, nullptr) :
+                Vfs_FdRead(cache->volume, buf+done, nBytes, nullptr);
+        if (obos_is_error(status))
+            break;
+        done += nBytes;
     }
-    memcpy(buf+current_offset, cluster_buf + cluster_offset, (size_t)bytesLeft <= bytesPerCluster ? (size_t)bytesLeft : bytesPerCluster);
-
-    current_offset += bytesPerCluster;
-    // cluster_offset += bytesPerCluster;
-    cluster_offset = 0;
-    bytesLeft -= bytesPerCluster;
-    if (i >= nClustersToRead)
-        return ITERATE_DECISION_STOP;
-    if (bytesLeft < 0)
-        return ITERATE_DECISION_STOP;
-    return ITERATE_DECISION_CONTINUE;
+    if (nDone)
+        *nDone = done;
+    return status;
 }
 obos_status read_sync(dev_desc desc, void* buf_, size_t blkCount, size_t blkOffset, size_t* nBlkRead)
 {
@@ -86,36 +82,20 @@ obos_status read_sync(dev_desc desc, void* buf_, size_t blkCount, size_t blkOffs
     size_t nToRead = blkCount;
     if ((blkOffset + blkCount) >= cache_entry->data.filesize)
         nToRead = cache_entry->data.filesize - blkOffset;
-    const size_t bytesPerCluster = (cache->bpb->sectorsPerCluster*cache->blkSize);
-    size_t nClustersToRead = (nToRead / bytesPerCluster) + (((nToRead % bytesPerCluster) != 0) ? 1 : 0);
-    uint32_t cluster = cache_entry->data.first_cluster_low;
-    if (cache->fatType == FAT32_VOLUME)
-        cluster |= ((uint32_t)cache_entry->data.first_cluster_high << 16);
-    if (blkOffset)
-        cluster += blkOffset/bytesPerCluster;
-    uint8_t* cluster_buf = FATAllocator->Allocate(FATAllocator, bytesPerCluster, nullptr);
-    size_t current_offset = 0;
-    size_t cluster_offset = blkOffset % bytesPerCluster;
-    int64_t bytesLeft = blkCount;
-    uint8_t *buf = buf_;
+    Core_MutexAcquire(&cache->fat_lock);
+    obos_status status = GetFileExtents(cache, cache_entry);
+    if (obos_is_error(status))
+    {
+        Core_MutexRelease(&cache->fat_lock);
+        return status;
+    }
+    size_t nRead = 0;
     Core_MutexAcquire(&cache->fd_lock);
-    obos_status status = OBOS_STATUS_SUCCESS;
-    uintptr_t udata[9] = {
-        (uintptr_t)buf,
-        (uintptr_t)0, /* i */
-        (uintptr_t)nClustersToRead,
-        (uintptr_t)bytesLeft,
-        (uintptr_t)current_offset,
-        (uintptr_t)cluster_offset,
-        (uintptr_t)cache,
-        (uintptr_t)&status,
-        (uintptr_t)cluster_buf,
-    };
-    FollowClusterChain(cache, cluster, read_callback, udata);
+    status = file_io(cache, cache_entry, buf_, nToRead, blkOffset, false, &nRead);
     Core_MutexRelease(&cache->fd_lock);
+    Core_MutexRelease(&cache->fat_lock);
     if (nBlkRead)
-        *nBlkRead = (blkCount-(bytesLeft >= 0 ? bytesLeft : 0));
-    FATAllocator->Free(FATAllocator, cluster_buf, bytesPerCluster);
+        *nBlkRead = nRead;
     return status;
 }
 obos_status write_sync(dev_desc desc, const void* buf_, size_t blkCount, size_t blkOffset, size_t* nBlkWritten)
@@ -139,99 +119,67 @@ obos_status write_sync(dev_desc desc, const void* buf_, size_t blkCount, size_t
         filesz_cluster_aligned += bytesPerCluster-(filesz_cluster_aligned%bytesPerCluster);
     if ((blkOffset+blkCount) >= filesz_cluster_aligned)
         requiresExpand = expandClusters = true;
-    size_t nToWrite = blkCount;
-    size_t nClustersToWrite = (nToWrite / bytesPerCluster) + (((nToWrite % bytesPerCluster) != 0) ? 1 : 0);
     obos_status status = OBOS_STATUS_SUCCESS;
-    uint32_t cluster = cache_entry->data.first_cluster_low;
-    if (cache->fatType == FAT32_VOLUME)
-        cluster |= ((uint32_t)cache_entry->data.first_cluster_high << 16);
     if (requiresExpand)
     {
-        uint32_t szClusters = ((cache_entry->data.filesize / bytesPerCluster) + ((cache_entry->data.filesize % bytesPerCluster) != 0));
-        cache_entry->data.filesize += blkCount;
+        const uint32_t oldSize = cache_entry->data.filesize;
+        cache_entry->data.filesize = blkOffset+blkCount;
         uint32_t newSizeCls = ((cache_entry->data.filesize / bytesPerCluster) + ((cache_entry->data.filesize % bytesPerCluster) != 0));
         Core_MutexAcquire(&cache->fat_lock);
-        uint8_t* cluster_buf = FATAllocator->Allocate(FATAllocator, bytesPerCluster, nullptr);
         if (expandClusters)
-            if (!ExtendClusters(cache, cluster, newSizeCls, szClusters))
+        {
+            // The file is grown in place where possible, and otherwise gets a new run linked onto its tail,
+            // so nothing needs to be copied. If clusters were preallocated, there might be nothing to do.
+            status = GrowFileClusters(cache, cache_entry, newSizeCls, nullptr);
+            if (obos_is_error(status))
             {
-                uint32_t newCluster = AllocateClusters(cache, newSizeCls);
-                if (newCluster == UINT32_MAX)
-                {
-                    Core_MutexRelease(&cache->fat_lock);
-                    return OBOS_STATUS_NOT_ENOUGH_MEMORY;
-                }
-                Core_MutexAcquire(&cache->fd_lock);
-                for (size_t i = 0; i < szClusters; i++)
-                {
-                    Vfs_FdSeek(cache->volume, ClusterToSector(cache, cluster+i)*cache->blkSize, SEEK_SET);
-                    status = Vfs_FdRead(cache->volume, cluster_buf, bytesPerCluster, nullptr);
-                    if (obos_is_error(status))
-                    {
-                        FATAllocator->Free(FATAllocator, cluster_buf, bytesPerCluster);
-                        Core_MutexRelease(&cache->fat_lock);
-                        Core_MutexRelease(&cache->fd_lock);
-                        return status;
-                    }
-                    Vfs_FdSeek(cache->volume, ClusterToSector(cache, newCluster+i)*cache->blkSize, SEEK_SET);
-                    status = Vfs_FdWrite(cache->volume, cluster_buf, bytesPerCluster, nullptr);
-                    if (obos_is_error(status))
-                    {
-                        FATAllocator->Free(FATAllocator, cluster_buf, bytesPerCluster);
-                        Core_MutexRelease(&cache->fat_lock);
-                        Core_MutexRelease(&cache->fd_lock);
-                        return status;
-                    }
-                }
-                if (cluster)
-                    FreeClusters(cache, cluster, szClusters);
-                cluster = newCluster;
-                cache_entry->data.first_cluster_high = cluster >> 16;
-                cache_entry->data.first_cluster_low = cluster & 0xffff;
-                Core_MutexRelease(&cache->fd_lock);
+                cache_entry->data.filesize = oldSize;
+                FatFlush(cache);
+                Core_MutexRelease(&cache->fat_lock);
+                return status;
             }
+        }
+        FatFlush(cache);
         Core_MutexRelease(&cache->fat_lock);
         WriteFatDirent(cache, cache_entry, true);
     }
-    uint8_t* cluster_buf = FATAllocator->Allocate(FATAllocator, bytesPerCluster, nullptr);
-    size_t current_offset = 0;
-    size_t cluster_offset = blkOffset % bytesPerCluster;
-    int64_t bytesLeft = blkCount;
-    Core_MutexAcquire(&cache->fd_lock);
-    uint32_t base_cluster = blkOffset / bytesPerCluster;
-    Vfs_FdSeek(cache->volume, ClusterToSector(cache, cluster+base_cluster)*cache->blkSize, SEEK_SET);
-    status = Vfs_FdRead(cache->volume, cluster_buf, bytesPerCluster, nullptr);
+    Core_MutexAcquire(&cache->fat_lock);
+    status = GetFileExtents(cache, cache_entry);
     if (obos_is_error(status))
     {
-        FATAllocator->Free(FATAllocator, cluster_buf, bytesPerCluster);
-        Core_MutexRelease(&cache->fd_lock);
+        Core_MutexRelease(&cache->fat_lock);
         return status;
     }
-    const uint8_t *buf = buf_;
-    for (size_t i = 0; i < nClustersToWrite && bytesLeft > 0; i++)
-    {
-        Vfs_FdSeek(cache->volume, ClusterToSector(cache, cluster+base_cluster+i)*cache->blkSize, SEEK_SET);
-        memcpy(cluster_buf + cluster_offset, buf+current_offset, ((size_t)bytesLeft <= bytesPerCluster ? (size_t)bytesLeft : bytesPerCluster-cluster_offset));
-        status = Vfs_FdWrite(cache->volume, cluster_buf, bytesPerCluster, nullptr);
-        if (obos_is_error(status))
-        {
-            FATAllocator->Free(FATAllocator, cluster_buf, bytesPerCluster);
-            Core_MutexRelease(&cache->fd_lock);
-            return status;
-        }
-
-        memzero(cluster_buf, bytesPerCluster);
-        current_offset += bytesPerCluster;
-        // cluster_offset += bytesPerCluster;
-        cluster_offset = 0;
-        bytesLeft -= bytesPerCluster;
-    }
+    size_t nWritten = 0;
+    Core_MutexAcquire(&cache->fd_lock);
+    status = file_io(cache, cache_entry, (uint8_t*)buf_, blkCount, blkOffset, true, &nWritten);
     Vfs_FdFlush(cache->volume);
     Core_MutexRelease(&cache->fd_lock);
+    Core_MutexRelease(&cache->fat_lock);
     if (nBlkWritten)
-        *nBlkWritten = blkCount;
-    FATAllocator->Free(FATAllocator, cluster_buf, bytesPerCluster);
-    return OBOS_STATUS_SUCCESS;
+        *nBlkWritten = nWritten;
+    return status;
+}
+obos_status preallocate_file(dev_desc desc, size_t newsize)
+{
+    if (!desc)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    fat_dirent_cache* cache_entry = (fat_dirent_cache*)desc;
+    fat_cache* cache = cache_entry->owner;
+    if (cache_entry->data.attribs & DIRECTORY)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    if (newsize > UINT32_MAX)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    const size_t bytesPerCluster = (cache->bpb->sectorsPerCluster*cache->blkSize);
+    size_t nClusters = (newsize / bytesPerCluster) + ((newsize % bytesPerCluster) != 0);
+    bool newChain = false;
+    Core_MutexAcquire(&cache->fat_lock);
+    obos_status status = GrowFileClusters(cache, cache_entry, nClusters, &newChain);
+    FatFlush(cache);
+    Core_MutexRelease(&cache->fat_lock);
+    if (newChain)
+        WriteFatDirent(cache, cache_entry, true);
+    return status;
 }
 obos_status trunc_file(dev_desc desc, size_t blkCount)
 {
@@ -245,20 +193,36 @@ obos_status trunc_file(dev_desc desc, size_t blkCount)
     if (blkCount > cache_entry->data.filesize)
         return OBOS_STATUS_INVALID_ARGUMENT;
     const size_t bytesPerCluster = (cache->bpb->sectorsPerCluster*cache->blkSize);
-    uint32_t szClusters = ((cache_entry->data.filesize / bytesPerCluster) + ((cache_entry->data.filesize % bytesPerCluster) != 0));
-    cache_entry->data.filesize = blkCount;
-    uint32_t newSizeCls = ((cache_entry->data.filesize / bytesPerCluster) + ((cache_entry->data.filesize % bytesPerCluster) != 0));
-    uint32_t cluster = cache_entry->data.first_cluster_low;
-    if (cache->fatType == FAT32_VOLUME)
-        cluster |= ((uint32_t)cache_entry->data.first_cluster_high << 16);
+    uint32_t newSizeCls = ((blkCount / bytesPerCluster) + ((blkCount % bytesPerCluster) != 0));
     Core_MutexAcquire(&cache->fat_lock);
-    TruncateClusters(cache, cluster, newSizeCls, szClusters);
+    // The chain is only walked through the extent map; assuming it is contiguous would free clusters of other files.
+    obos_status status = GetFileExtents(cache, cache_entry);
+    if (obos_is_error(status))
+    {
+        Core_MutexRelease(&cache->fat_lock);
+        return status;
+    }
+    cache_entry->data.filesize = blkCount;
+    // If the new size is zero, this frees every cluster of the file.
+    for (size_t i = 0; i < cache_entry->extents.nRuns; i++)
+    {
+        const fat_extent* run = &cache_entry->extents.runs[i];
+        if ((run->fileCluster + run->nClusters) <= newSizeCls)
+            continue;
+        size_t keep = newSizeCls > run->fileCluster ? newSizeCls - run->fileCluster : 0;
+        FreeClusters(cache, run->cluster+keep, run->nClusters-keep);
+    }
+    // The new last cluster can be the end of a run that was kept whole, so it is marked here rather than per run.
+    const fat_extent* last = newSizeCls ? LookupFileExtent(cache_entry, newSizeCls-1) : nullptr;
+    if (last)
+        EndClusterChain(cache, last->cluster + (newSizeCls - 1 - last->fileCluster));
+    InvalidateFileExtents(cache_entry);
     if (!newSizeCls)
     {
-        FreeClusters(cache, cluster, szClusters);
         cache_entry->data.first_cluster_low = 0;
         cache_entry->data.first_cluster_high = 0;
     }
+    FatFlush(cache);
     Core_MutexRelease(&cache->fat_lock);
     WriteFatDirent(cache, cache_entry, true);
     Vfs_FdFlush(cache->volume);
@@ -9,88 +9,187 @@
 #include <int.h>
 #include <memmanip.h>
 
+#include <allocators/base.h>
+
 #include "structs.h"
 
-// Adapated from vfs/dirent.c
+#define INDEX_INITIAL_BUCKETS (16)
 
-static size_t str_search(const char* str, char ch)
+static char fold(char ch)
+{
+    if (ch >= 'a' && ch <= 'z')
+        return (ch - 'a') + 'A';
+    return ch;
+}
+// FNV-1a over the case-folded name.
+static uint32_t hash_name(const char* name, size_t namelen)
+{
+    uint32_t hash = 0x811c9dc5;
+    for (size_t i = 0; i < namelen; i++)
+    {
+        hash ^= (uint8_t)fold(name[i]);
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+static bool names_equal(const char* a, size_t alen, const char* b, size_t blen)
 {
-    size_t ret = strchr(str, ch);
-    for (; str[ret] == ch && str[ret] != 0; ret++)
+    if (alen != blen)
+        return false;
+    for (size_t i = 0; i < alen; i++)
+        if (fold(a[i]) != fold(b[i]))
+            return false;
+    return true;
+}
+// Converts an on-disk short name to "NAME.EXT". 'out' must be at least 12 bytes.
+static size_t format_short_name(const char* filename_83, char* out)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < 8 && filename_83[i] != ' ' && filename_83[i]; i++)
+        out[len++] = filename_83[i];
+    size_t extlen = 0;
+    for (; extlen < 3 && filename_83[8+extlen] != ' ' && filename_83[8+extlen]; extlen++)
+        ;
+    if (extlen)
+    {
+        out[len++] = '.';
+        for (size_t i = 0; i < extlen; i++)
+            out[len++] = filename_83[8+i];
+    }
+    return len;
+}
+static void index_link(fat_dirent_cache* dir, fat_dirent_cache* child)
+{
+    const size_t mask = dir->index.nBuckets - 1;
+    child->index_node.nextLong = dir->index.longBuckets[child->index_node.longHash & mask];
+    dir->index.longBuckets[child->index_node.longHash & mask] = child;
+    child->index_node.nextShort = dir->index.shortBuckets[child->index_node.shortHash & mask];
+    dir->index.shortBuckets[child->index_node.shortHash & mask] = child;
+}
+static void index_resize(fat_dirent_cache* dir, size_t nBuckets)
+{
+    fat_dirent_cache** oldLong = dir->index.longBuckets;
+    fat_dirent_cache** oldShort = dir->index.shortBuckets;
+    const size_t oldCount = dir->index.nBuckets;
+    dir->index.longBuckets = FATAllocator->ZeroAllocate(FATAllocator, nBuckets, sizeof(fat_dirent_cache*), nullptr);
+    dir->index.shortBuckets = FATAllocator->ZeroAllocate(FATAllocator, nBuckets, sizeof(fat_dirent_cache*), nullptr);
+    dir->index.nBuckets = nBuckets;
+    // Every entry is in exactly one long chain, so walking those visits each entry once.
+    for (size_t i = 0; i < oldCount; i++)
+    {
+        for (fat_dirent_cache* curr = oldLong[i]; curr; )
+        {
+            fat_dirent_cache* next = curr->index_node.nextLong;
+            index_link(dir, curr);
+            curr = next;
+        }
+    }
+    if (oldLong)
+        FATAllocator->Free(FATAllocator, oldLong, oldCount*sizeof(fat_dirent_cache*));
+    if (oldShort)
+        FATAllocator->Free(FATAllocator, oldShort, oldCount*sizeof(fat_dirent_cache*));
+}
+void DirIndexInsert(fat_dirent_cache* dir, fat_dirent_cache* child)
+{
+    if (!dir || !child || child->index_node.indexed)
+        return;
+    if (!dir->index.nBuckets)
+        index_resize(dir, INDEX_INITIAL_BUCKETS);
+    else if (dir->index.nEntries >= dir->index.nBuckets*2)
+        index_resize(dir, dir->index.nBuckets*2);
+    char short_name[12];
+    const size_t short_len = format_short_name(child->data.filename_83, short_name);
+    child->index_node.longHash = hash_name(OBOS_GetStringCPtr(&child->name), OBOS_GetStringSize(&child->name));
+    child->index_node.shortHash = hash_name(short_name, short_len);
+    child->index_node.indexed = true;
+    index_link(dir, child);
+    dir->index.nEntries++;
+}
+void DirIndexRemove(fat_dirent_cache* dir, fat_dirent_cache* child)
+{
+    if (!dir || !child || !child->index_node.indexed || !dir->index.nBuckets)
+        return;
+    const size_t mask = dir->index.nBuckets - 1;
+    fat_dirent_cache** link = &dir->index.longBuckets[child->index_node.longHash & mask];
+    for (; *link && *link != child; link = &(*link)->index_node.nextLong)
+        ;
+    if (*link)
+        *link = child->index_node.nextLong;
+    link = &dir->index.shortBuckets[child->index_node.shortHash & mask];
+    for (; *link && *link != child; link = &(*link)->index_node.nextShort)
         ;
-    return ret;
+    if (*link)
+        *link = child->index_node.nextShort;
+    child->index_node.nextLong = nullptr;
+    child->index_node.nextShort = nullptr;
+    child->index_node.indexed = false;
+    dir->index.nEntries--;
 }
-static fat_dirent_cache* on_match(fat_dirent_cache** const curr_, fat_dirent_cache** const root, const char** const tok, size_t* const tok_len, const char** const path, 
-                        size_t* const path_len)
+static fat_dirent_cache* lookup_short(fat_dirent_cache* dir, const char* name, size_t namelen, uint32_t hash)
 {
-    fat_dirent_cache *curr = *curr_;
-    *root = curr;
-    const char *newtok = (*tok) + str_search(*tok, '/');
-    if (newtok >= (*path + *path_len))
-        return curr;
-    if (!curr->fdc_children.nChildren)
-        return nullptr; // could not find node.
-    *tok = newtok;
-    size_t currentPathLen = strlen(*tok)-1;
-    if ((*tok)[currentPathLen] != '/')
-        currentPathLen++;
-    while ((*tok)[currentPathLen] == '/')
-        currentPathLen--;
-    *tok_len = strchr(*tok, '/');
-    if (*tok_len != currentPathLen)
-        (*tok_len)--;
-    while ((*tok)[(*tok_len) - 1] == '/')
-        (*tok_len)--;
+    for (fat_dirent_cache* curr = dir->index.shortBuckets[hash & (dir->index.nBuckets - 1)]; curr; curr = curr->index_node.nextShort)
+    {
+        if (curr->index_node.shortHash != hash)
+            continue;
+        char short_name[12];
+        const size_t short_len = format_short_name(curr->data.filename_83, short_name);
+        if (names_equal(short_name, short_len, name, namelen))
+            return curr;
+    }
     return nullptr;
 }
-fat_dirent_cache* DirentLookupFrom(const char* path, fat_dirent_cache* root)
+fat_dirent_cache* DirIndexLookup(fat_dirent_cache* dir, const char* name, size_t namelen)
+{
+    if (!dir || !name || !namelen || !dir->index.nBuckets)
+        return nullptr;
+    const uint32_t hash = hash_name(name, namelen);
+    for (fat_dirent_cache* curr = dir->index.longBuckets[hash & (dir->index.nBuckets - 1)]; curr; curr = curr->index_node.nextLong)
+    {
+        if (curr->index_node.longHash != hash)
+            continue;
+        if (names_equal(OBOS_GetStringCPtr(&curr->name), OBOS_GetStringSize(&curr->name), name, namelen))
+            return curr;
+    }
+    return lookup_short(dir, name, namelen, hash);
+}
+fat_dirent_cache* DirIndexLookupShort(fat_dirent_cache* dir, const char* filename_83)
 {
-    if (!path)
+    if (!dir || !filename_83 || !dir->index.nBuckets)
         return nullptr;
-    size_t path_len = strlen(path);
-    if (!path_len)
+    char short_name[12];
+    const size_t short_len = format_short_name(filename_83, short_name);
+    return lookup_short(dir, short_name, short_len, hash_name(short_name, short_len));
+}
+void DirIndexFree(fat_dirent_cache* dir)
+{
+    if (!dir || !dir->index.nBuckets)
+        return;
+    FATAllocator->Free(FATAllocator, dir->index.longBuckets, dir->index.nBuckets*sizeof(fat_dirent_cache*));
+    FATAllocator->Free(FATAllocator, dir->index.shortBuckets, dir->index.nBuckets*sizeof(fat_dirent_cache*));
+    dir->index.longBuckets = nullptr;
+    dir->index.shortBuckets = nullptr;
+    dir->index.nBuckets = 0;
+    dir->index.nEntries = 0;
+}
+
+fat_dirent_cache* DirentLookupFrom(const char* path, fat_dirent_cache* root)
+{
+    if (!path || !root)
         return nullptr;
-    for (; *path == '/'; path++, path_len--)
+    for (; *path == '/'; path++)
         ;
-    const char* tok = path;
-    size_t tok_len = strchr(tok, '/');
-    if (tok_len != path_len)
-        tok_len--;
-    while (tok[tok_len - 1] == '/')
-        tok_len--;
-    if (!tok_len)
+    if (!(*path))
         return nullptr;
-    while(root)
+    fat_dirent_cache* curr = root;
+    while (*path && curr)
     {
-        fat_dirent_cache* curr = root;
-        if (OBOS_CompareStringNC(&root->name, tok, tok_len))
-        {
-            // Match!
-            root = curr->fdc_children.head ? curr->fdc_children.head : root;
-            fat_dirent_cache* what = 
-                on_match(&curr, &root, &tok, &tok_len, &path, &path_len);
-            if (what)
-                return what;
-            continue;
-        }
-        for (curr = root->fdc_children.head; curr;)
-        {
-            if (OBOS_CompareStringNC(&curr->name, tok, tok_len))
-            {
-                // Match!
-                fat_dirent_cache* what = 
-                    on_match(&curr, &root, &tok, &tok_len, &path, &path_len);
-                if (what)
-                    return what;
-                curr = curr->fdc_children.head ? curr->fdc_children.head : curr;
-                break;
-            }
-
-            // root = curr->fdc_children.head ? curr->fdc_children.head : root;
-            curr = curr->fdc_next_child;
-        }
-        if (!curr)
-            root = root->fdc_parent;
+        size_t tok_len = 0;
+        for (; path[tok_len] != '/' && path[tok_len]; tok_len++)
+            ;
+        PopulateDirectory(curr->owner, curr);
+        curr = DirIndexLookup(curr, path, tok_len);
+        for (path += tok_len; *path == '/'; path++)
+            ;
     }
-    return nullptr;
-}
\ No newline at end of file
+    return curr;
+}
@@ -53,6 +53,7 @@ OBOS_WEAK obos_status move_desc_to(dev_desc desc, const char* where);
 OBOS_WEAK obos_status mk_file(dev_desc* newDesc, dev_desc parent, void* vn, const char* name, file_type type);
 OBOS_WEAK obos_status remove_file(dev_desc desc);
 OBOS_WEAK obos_status trunc_file(dev_desc desc, size_t newsize);
+OBOS_WEAK obos_status preallocate_file(dev_desc desc, size_t newsize);
 OBOS_WEAK obos_status set_file_perms(dev_desc desc, driver_file_perm newperm);
 OBOS_WEAK obos_status get_file_perms(dev_desc desc, driver_file_perm *perm);
 OBOS_WEAK obos_status get_file_type(dev_desc desc, file_type *type);
@@ -85,6 +86,7 @@ __attribute__((section(OBOS_DRIVER_HEADER_SECTION))) driver_header drv_hdr = {
         .get_file_type = get_file_type,
         .list_dir = list_dir,
         .probe = probe,
+        .preallocate_file = preallocate_file,
     },
     .driverName = "FAT Driver",
 };
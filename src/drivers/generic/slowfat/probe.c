@@ -24,6 +24,8 @@
 
 #include <driver_interface/header.h>
 
+#include <locks/mutex.h>
+
 #include "structs.h"
 #include "alloc.h"
 
@@ -48,7 +50,6 @@ static size_t lfn_strlen(const lfn_dirent* lfn)
     for (; lfn_at(lfn, ret) && ret < 13; ret++);
     return ret;
 }
-static void dir_iterate(fat_cache* cache, fat_dirent_cache* parent, uint32_t cluster);
 static void process_dirent(fat_cache* cache, fat_dirent_cache* const parent, uint32_t cluster, void* buff, fat_dirent* curr, lfn_dirent*** const lfn_entries, size_t* const lfn_entry_count, string* current_filename)
 {
     OBOS_UNUSED(cluster);
@@ -62,7 +63,7 @@ static void process_dirent(fat_cache* cache, fat_dirent_cache* const parent, uin
         {
             // Allocate all the memory we'll need for this LFN chain.
             *lfn_entry_count = (lfn->order & ~0x40 /* last entry */);
-            *lfn_entries = FATAllocator->Reallocate(FATAllocator, lfn_entries, sizeof(lfn_dirent)*(*lfn_entry_count), nullptr);
+            *lfn_entries = FATAllocator->Reallocate(FATAllocator, *lfn_entries, sizeof(lfn_dirent*)*(*lfn_entry_count), nullptr);
         }
         (*lfn_entries)[(lfn->order & ~0x40) - 1] = lfn;
         return;
@@ -74,7 +75,7 @@ static void process_dirent(fat_cache* cache, fat_dirent_cache* const parent, uin
         return;
     if (curr->filename_83[0] == '.')
         return;
-    if (lfn_entry_count)
+    if (*lfn_entry_count)
     {
         for (size_t i = 0; i < (*lfn_entry_count); i++)
         {
@@ -134,14 +135,9 @@ static void process_dirent(fat_cache* cache, fat_dirent_cache* const parent, uin
         OBOS_AppendStringC(&dir_cache->path, "/");
     OBOS_AppendStringS(&dir_cache->path, &dir_cache->name);
     *current_filename = (string){};
+    // Subdirectories are read when they are first used.
+    dir_cache->unpopulated = (curr->attribs & DIRECTORY) != 0;
     CacheAppendChild(parent, dir_cache);
-    if (curr->attribs & DIRECTORY)
-    {
-        uint32_t cluster = curr->first_cluster_low;
-        if (cache->fatType == FAT32_VOLUME)
-            cluster |= ((uint32_t)curr->first_cluster_high << 16);
-        dir_iterate(cache, dir_cache, cluster);
-    }
 }
 static iterate_decision dir_iterate_impl(uint32_t current_cluster, obos_status stat, void* udata)
 {
@@ -163,7 +159,7 @@ static iterate_decision dir_iterate_impl(uint32_t current_cluster, obos_status s
             cache, parent, current_cluster, buff,
             curr, &lfn_entries, &lfn_entry_count, &current_filename);
         curr += 1;
-        if ((uintptr_t)curr >= ((uintptr_t)buff + cache->blkSize))
+        if ((uintptr_t)curr >= ((uintptr_t)buff + cache->bpb->sectorsPerCluster*cache->blkSize))
             return ITERATE_DECISION_CONTINUE;
     }
     return ITERATE_DECISION_STOP;
@@ -177,11 +173,74 @@ static void dir_iterate(fat_cache* cache, fat_dirent_cache* parent, uint32_t clu
     };
     uoff_t oldOffset = Vfs_FdTellOff(cache->volume);
     FollowClusterChain(cache, cluster, dir_iterate_impl, udata);
-    FATAllocator->Free(FATAllocator, (void*)udata[2], cache->blkSize);
+    FATAllocator->Free(FATAllocator, (void*)udata[2], cache->bpb->sectorsPerCluster*cache->blkSize);
     Vfs_FdSeek(cache->volume, oldOffset, SEEK_SET);
 }
 #undef read_next_sector
 
+// The root directory of FAT12/16 volumes is not made of clusters, but is a fixed amount of sectors after the FATs.
+static void root_iterate(fat_cache* cache)
+{
+    void* buff = FATAllocator->Allocate(FATAllocator, cache->blkSize, nullptr);
+    lfn_dirent** lfn_entries = nullptr;
+    size_t lfn_entry_count = 0;
+    string current_filename = {};
+    OBOS_InitString(&current_filename, "");
+    Vfs_FdSeek(cache->volume, cache->root_sector*cache->blkSize, SEEK_SET);
+    for (size_t i = cache->root_sector; i < (cache->root_sector+cache->RootDirSectors); i++)
+    {
+        fat_dirent* curr = buff;
+        Vfs_FdSeek(cache->volume, i*cache->blkSize, SEEK_SET);
+        Vfs_FdRead(cache->volume, buff, cache->blkSize, nullptr);
+        for (size_t j = 0; j < (cache->blkSize/sizeof(lfn_dirent)); j++, curr++)
+        {
+            if (curr->filename_83[0] == (char)0xe5)
+                continue;
+            if (curr->filename_83[0] == (char)0)
+            {
+                curr = nullptr;
+                break;
+            }
+            process_dirent(
+                cache, cache->root, 0, buff, curr, 
+                &lfn_entries, &lfn_entry_count, &current_filename);
+        }
+        if (!curr)
+            break;
+    }
+    FATAllocator->Free(FATAllocator, buff, cache->blkSize);
+}
+obos_status PopulateDirectory(fat_cache* cache, fat_dirent_cache* dir)
+{
+    if (!cache || !dir)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    if (!(dir->data.attribs & DIRECTORY))
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    if (!dir->unpopulated)
+        return OBOS_STATUS_SUCCESS;
+    Core_MutexAcquire(&cache->fd_lock);
+    if (dir->unpopulated)
+    {
+        if (dir == cache->root && cache->fatType != FAT32_VOLUME)
+            root_iterate(cache);
+        else
+        {
+            uint32_t cluster = cache->root_cluster;
+            if (dir != cache->root)
+            {
+                cluster = dir->data.first_cluster_low;
+                if (cache->fatType == FAT32_VOLUME)
+                    cluster |= ((uint32_t)dir->data.first_cluster_high << 16);
+            }
+            if (cluster >= 2)
+                dir_iterate(cache, dir, cluster);
+        }
+        dir->unpopulated = false;
+    }
+    Core_MutexRelease(&cache->fd_lock);
+    return OBOS_STATUS_SUCCESS;
+}
+
 bool probe(void* vn_)
 {
     OBOS_ASSERT(vn_);
@@ -254,38 +313,15 @@ bool probe(void* vn_)
     cache->root->dirent_offset = 0;
     OBOS_InitString(&cache->root->path, "");
     OBOS_InitString(&cache->root->name, "");
-    if (cache->fatType == FAT32_VOLUME)
-        dir_iterate(cache, cache->root, cache->root_cluster);
-    else
+    status = InitializeFatCache(cache);
+    if (obos_is_error(status))
     {
-        void* buff = FATAllocator->Allocate(FATAllocator, cache->blkSize, nullptr);
-        lfn_dirent** lfn_entries;
-        size_t lfn_entry_count = 0;
-        string current_filename = {};
-        Vfs_FdSeek(cache->volume, cache->root_sector*cache->blkSize, SEEK_SET);
-        for (size_t i = cache->root_sector; i < (cache->root_sector+cache->RootDirSectors); i++)
-        {
-            fat_dirent* curr = buff;
-            Vfs_FdSeek(cache->volume, i*cache->blkSize, SEEK_SET);
-            Vfs_FdRead(cache->volume, buff, cache->blkSize, nullptr);
-            for (size_t j = 0; j < (cache->blkSize/sizeof(lfn_dirent)); j++, curr++)
-            {
-                if (curr->filename_83[0] == (char)0xe5)
-                    continue;
-                if (curr->filename_83[0] == (char)0)
-                {
-                    curr = nullptr;
-                    break;
-                }
-                process_dirent(
-                    cache, cache->root, 0, buff, curr, 
-                    &lfn_entries, &lfn_entry_count, &current_filename);
-            }
-            if (!curr)
-                break;
-        }
+        OBOS_Error("FAT: Could not read the FAT. Status: %d\n", status);
+        return false;
     }
-    InitializeCacheFreelist(cache);
+    // Only the boot sector and the FAT have been read at this point. Directories are read on first use,
+    // and the free cluster trees are built on the first allocation.
+    cache->root->unpopulated = true;
     LIST_APPEND(fat_cache_list, &FATVolumes, cache);
     OBOS_Debug("FAT: CountofClusters: 0x%08x\n", CountofClusters);
     OBOS_Debug("FAT: blkSize: 0x%08x\n", blkSize);
@@ -323,9 +359,10 @@ uint32_t GetClusterFromFatEntryAddr(fat_cache* cache, fat_entry_addr addr)
 }
 fat12_entry GetFat12Entry(uint16_t val, uint32_t valCluster)
 {
+    // Odd clusters are in the high 12 bits.
     if (valCluster % 2)
-        return (fat12_entry){ .ent=(val & 0xfff) };
-    return (fat12_entry){ .ent=((val >> 4) & 0xfff) };
+        return (fat12_entry){ .ent=((val >> 4) & 0xfff) };
+    return (fat12_entry){ .ent=(val & 0xfff) };
 }
 void CacheAppendChild(fat_dirent_cache* parent, fat_dirent_cache* child)
 {
@@ -337,6 +374,7 @@ void CacheAppendChild(fat_dirent_cache* parent, fat_dirent_cache* child)
     parent->fdc_children.tail = child;
     parent->fdc_children.nChildren++;
     child->d_parent = parent;
+    DirIndexInsert(parent, child);
 }
 void CacheRemoveChild(fat_dirent_cache* parent, fat_dirent_cache* what)
 {
@@ -349,5 +387,6 @@ void CacheRemoveChild(fat_dirent_cache* parent, fat_dirent_cache* what)
     if (parent->fdc_children.tail == what)
         parent->fdc_children.tail = what->fdc_prev_child;
     parent->fdc_children.nChildren--;
+    DirIndexRemove(parent, what);
     what->d_parent = nullptr; // we're now an orphan :(
 }
\ No newline at end of file
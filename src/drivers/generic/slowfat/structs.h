@@ -16,6 +16,7 @@
 #include <locks/mutex.h>
 
 #include <utils/list.h>
+#include <utils/tree.h>
 #include <utils/string.h>
 
 typedef struct fsinfo
@@ -122,6 +123,14 @@ typedef struct lfn_dirent
 } OBOS_PACK lfn_dirent;
 OBOS_STATIC_ASSERT(sizeof(fat_dirent) == 32, "sizeof(fat_dirent) isn't 32 bytes.");
 OBOS_STATIC_ASSERT(sizeof(lfn_dirent) == 32, "sizeof(lfn_dirent) isn't 32 bytes.");
+// A run of contiguous clusters in a file.
+typedef struct fat_extent
+{
+    // The index of the run's first cluster in the file.
+    uint32_t fileCluster;
+    uint32_t cluster;
+    uint32_t nClusters;
+} fat_extent;
 typedef struct fat_dirent_cache
 {
     fat_dirent data;
@@ -132,6 +141,35 @@ typedef struct fat_dirent_cache
     // The offset into the dirent sector in which this dirent is at.
     uint32_t dirent_offset;
     struct fat_cache* owner;
+    // The file's cluster chain as runs of contiguous clusters, built on first use.
+    // Protected by the volume's fat lock.
+    struct
+    {
+        fat_extent* runs;
+        size_t nRuns;
+        size_t capacity;
+        bool valid;
+    } extents;
+    // Set if this is a directory whose entries have not been read yet (see PopulateDirectory).
+    bool unpopulated;
+    // Directories only. The children, hashed by their case-folded long and short names (see lookup.c).
+    struct
+    {
+        struct fat_dirent_cache** longBuckets;
+        struct fat_dirent_cache** shortBuckets;
+        size_t nBuckets;
+        size_t nEntries;
+    } index;
+    // This entry's links in its parent's index.
+    // The hashes are kept so the entry can be unlinked after its name has changed.
+    struct
+    {
+        struct fat_dirent_cache* nextLong;
+        struct fat_dirent_cache* nextShort;
+        uint32_t longHash;
+        uint32_t shortHash;
+        bool indexed;
+    } index_node;
     struct
     {
         struct fat_dirent_cache* parent;
@@ -156,12 +194,31 @@ enum {
 };
 typedef LIST_HEAD(fat_cache_list, struct fat_cache) fat_cache_list;
 LIST_PROTOTYPE(fat_cache_list, struct fat_cache, node);
+// A run of free clusters.
+// Every run is in two trees, one sorted by position, and one sorted by size.
 typedef struct fat_freenode
 {
     uint32_t cluster;
     uint32_t nClusters;
-    struct fat_freenode *next, *prev;
+    RB_ENTRY(fat_freenode) by_pos;
+    RB_ENTRY(fat_freenode) by_size;
 } fat_freenode;
+typedef RB_HEAD(fat_free_pos_tree, fat_freenode) fat_free_pos_tree;
+typedef RB_HEAD(fat_free_size_tree, fat_freenode) fat_free_size_tree;
+// The amount of FAT sectors in one chunk of the FAT cache.
+#define FAT_CHUNK_SECTORS (32)
+// The maximum amount of FAT chunks kept in memory for FAT32 volumes.
+// FAT12/16 volumes always have their whole FAT in memory, as it is at most 128KiB.
+#define FAT_MAX_RESIDENT_CHUNKS (128)
+typedef LIST_HEAD(fat_chunk_lru, struct fat_table_chunk) fat_chunk_lru;
+LIST_PROTOTYPE(fat_chunk_lru, struct fat_table_chunk, node);
+typedef struct fat_table_chunk
+{
+    uint8_t* data;
+    uint32_t index;
+    bool dirty;
+    LIST_NODE(fat_chunk_lru, struct fat_table_chunk) node;
+} fat_table_chunk;
 typedef struct fat_cache {
     fat_dirent_cache* root;
     uint8_t fatType;
@@ -178,12 +235,34 @@ typedef struct fat_cache {
     size_t blkSize;
     uint32_t fatSz;
     mutex fat_lock;
+    // The free clusters of the volume (see cls_alloc.c).
+    // Adjacent runs are always merged.
     struct {
-        fat_freenode *head, *tail;
+        fat_free_pos_tree by_pos;
+        fat_free_size_tree by_size;
         size_t nNodes;
         size_t freeClusterCount;
         mutex lock;
+        // The trees are built from the FAT on the first allocation, as that needs the whole FAT.
+        bool initialized;
     } freelist;
+    // The in-memory copy of the FAT (see fat_table.c).
+    struct {
+        // Indexed by chunk number, nullptr if the chunk is not in memory.
+        fat_table_chunk** chunks;
+        size_t nChunks;
+        // FAT12/16 only. The whole FAT, which every chunk's data points into.
+        uint8_t* table;
+        // FAT32 only. The chunks in memory, most recently used first.
+        fat_chunk_lru lru;
+        // Used for all FAT I/O, so that it does not need fd_lock.
+        struct fd* fd;
+        mutex lock;
+        // FAT32 only.
+        bool hasFsinfo;
+        bool fsinfoDirty;
+        uint32_t nextFreeHint;
+    } fat;
 } fat_cache;
 extern fat_cache_list FATVolumes;
 void CacheAppendChild(fat_dirent_cache* parent, fat_dirent_cache* child);
@@ -207,6 +286,17 @@ void GetFatEntryAddrForCluster(fat_cache* cache, uint32_t cluster, fat_entry_add
 uint32_t GetClusterFromFatEntryAddr(fat_cache* cache, fat_entry_addr addr);
 fat12_entry GetFat12Entry(uint16_t val, uint32_t valCluster);
 fat_dirent_cache* DirentLookupFrom(const char* path, fat_dirent_cache* root);
+// The per-directory name index.
+// Names are compared case-insensitively, like FAT does. A name matches an entry if it is either its long or its short name.
+void DirIndexInsert(fat_dirent_cache* dir, fat_dirent_cache* child);
+void DirIndexRemove(fat_dirent_cache* dir, fat_dirent_cache* child);
+fat_dirent_cache* DirIndexLookup(fat_dirent_cache* dir, const char* name, size_t namelen);
+// Looks up an entry by its short name, as stored on disk (space padded, without the dot).
+fat_dirent_cache* DirIndexLookupShort(fat_dirent_cache* dir, const char* filename_83);
+void DirIndexFree(fat_dirent_cache* dir);
+// Reads the entries of a directory if that has not been done yet.
+// Must be called without the fd lock held.
+obos_status PopulateDirectory(fat_cache* cache, fat_dirent_cache* dir);
 #define ClusterToSector(cache, n) (((n) - 2) * (cache)->bpb->sectorsPerCluster + (cache)->FirstDataSector)
 #define SectorToCluster(cache, n) (((int64_t)(n)-(int64_t)(cache)->FirstDataSector+(int64_t)(cache)->bpb->sectorsPerCluster*2)/(int64_t)(cache)->bpb->sectorsPerCluster)
 extern allocator_info* FATAllocator;
@@ -21,9 +21,11 @@
 
 #define IOCTL_TESTDRIVER_FIREWORKS 1
 #define IOCTL_TESTDRIVER_ALLOCATOR 2 /* TODO */
+#define IOCTL_TESTDRIVER_PAGE_LOOKUP_BENCH 3
 void cleanup()
 { /* Nothing to do */ }
 DRV_EXPORT void TestDriver_Fireworks(uint32_t max_iterations, int spawn_min, int spawn_max, bool stress_test);
+DRV_EXPORT obos_status TestDriver_PageLookupBenchmark(size_t nPages);
 obos_status ioctl_var(size_t nParameters, uint64_t request, va_list list)
 {
     switch(request)
@@ -39,6 +41,10 @@ obos_status ioctl_var(size_t nParameters, uint64_t request, va_list list)
         return OBOS_STATUS_SUCCESS;
     case IOCTL_TESTDRIVER_ALLOCATOR:
         return OBOS_STATUS_UNIMPLEMENTED;
+    case IOCTL_TESTDRIVER_PAGE_LOOKUP_BENCH:
+        if (nParameters < 1)
+            return OBOS_STATUS_INVALID_ARGUMENT;
+        return TestDriver_PageLookupBenchmark(va_arg(list, size_t));
     }
     return OBOS_STATUS_INVALID_IOCTL;
 }
@@ -0,0 +1,85 @@
+/*
+ * drivers/test_driver/page_bench.c
+ *
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+#include <int.h>
+#include <klog.h>
+#include <error.h>
+
+#include <mm/context.h>
+#include <mm/alloc.h>
+#include <mm/page.h>
+
+#include <irq/timer.h>
+#include <irq/irql.h>
+
+#include <locks/spinlock.h>
+
+#include <utils/tree.h>
+
+#include <driver_interface/header.h>
+
+static uint64_t ticks_to_ns(timer_tick ticks)
+{
+    timer_tick freq = CoreS_GetNativeTimerFrequency();
+    if (!freq)
+        return 0;
+    return (ticks * 1000000000) / freq;
+}
+
+// Measures the cost of faulting in 'nPages' pages, and of looking each of them up in the page tree,
+// both with a plain tree walk and with MmH_LookupPage.
+DRV_EXPORT obos_status TestDriver_PageLookupBenchmark(size_t nPages)
+{
+    if (!nPages)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    context* ctx = &Mm_KernelContext;
+    const size_t size = nPages * OBOS_PAGE_SIZE;
+    obos_status status = OBOS_STATUS_SUCCESS;
+    volatile uint8_t* buf = Mm_VirtualMemoryAlloc(ctx, nullptr, size, 0, 0, nullptr, &status);
+    if (!buf)
+        return obos_is_error(status) ? status : OBOS_STATUS_NOT_ENOUGH_MEMORY;
+
+    timer_tick start = CoreS_GetNativeTimerTick();
+    for (size_t i = 0; i < nPages; i++)
+        buf[i * OBOS_PAGE_SIZE] = 0xcc;
+    const timer_tick faultTicks = CoreS_GetNativeTimerTick() - start;
+
+    const uintptr_t base = (uintptr_t)buf;
+    size_t nFound = 0;
+    irql oldIrql = Core_SpinlockAcquireExplicit(&ctx->lock, IRQL_DISPATCH, true);
+
+    page what = {};
+    start = CoreS_GetNativeTimerTick();
+    for (size_t i = 0; i < nPages; i++)
+    {
+        what.addr = base + i * OBOS_PAGE_SIZE;
+        nFound += RB_FIND(page_tree, &ctx->pages, &what) != nullptr;
+    }
+    const timer_tick findTicks = CoreS_GetNativeTimerTick() - start;
+
+    ctx->lastLookup = nullptr;
+    start = CoreS_GetNativeTimerTick();
+    for (size_t i = 0; i < nPages; i++)
+        nFound += MmH_LookupPage(ctx, base + i * OBOS_PAGE_SIZE) != nullptr;
+    const timer_tick lookupTicks = CoreS_GetNativeTimerTick() - start;
+
+    Core_SpinlockRelease(&ctx->lock, oldIrql);
+
+    Mm_VirtualMemoryFree(ctx, (void*)buf, size);
+    if (nFound != nPages * 2)
+    {
+        OBOS_Error("%s: Only found %ld out of %ld pages.\n", __func__, nFound, nPages*2);
+        return OBOS_STATUS_INTERNAL_ERROR;
+    }
+    OBOS_Log("%s: %ld pages. Faults: %ld ns/page. RB_FIND: %ld ns/page. MmH_LookupPage: %ld ns/page.\n",
+        __func__,
+        nPages,
+        ticks_to_ns(faultTicks) / nPages,
+        ticks_to_ns(findTicks) / nPages,
+        ticks_to_ns(lookupTicks) / nPages
+    );
+    return OBOS_STATUS_SUCCESS;
+}
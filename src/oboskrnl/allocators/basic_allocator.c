@@ -69,7 +69,7 @@ static OBOS_NO_KASAN void* allocateBlock(basic_allocator* This, size_t size, int
 			size_t nPages = size / OBOS_PAGE_SIZE;
 			if (size % OBOS_PAGE_SIZE)
 				nPages++;
-			uintptr_t phys = Mm_AllocatePhysicalPages(nPages, 1, status);
+			uintptr_t phys = Mm_AllocatePhysicalPagesEx(nPages, 1, PHYS_ALLOC_ZEROED, status);
 			if (!phys)
 				return nullptr;
 			// Arch-specific:
@@ -85,7 +85,6 @@ static OBOS_NO_KASAN void* allocateBlock(basic_allocator* This, size_t size, int
 #else
 #	error Unknown architecture
 #endif
-			memzero(ret, size);
 			return ret;
 		}
 		void* ret = Mm_VirtualMemoryAlloc(&Mm_KernelContext, nullptr, size, 0, ((allocator_info*)This == OBOS_NonPagedPoolAllocator ? VMA_FLAGS_NON_PAGED : 0), nullptr, status);
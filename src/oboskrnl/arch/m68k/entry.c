@@ -22,6 +22,7 @@
 #include <scheduler/cpu_local.h>
 #include <scheduler/thread_context_info.h>
 #include <scheduler/schedule.h>
+#include <scheduler/work.h>
 
 #include <arch/m68k/asm_helpers.h>
 #include <arch/m68k/cpu_local_arch.h>
@@ -38,6 +39,7 @@
 #include <mm/bare_map.h>
 #include <mm/context.h>
 #include <mm/pmm.h>
+#include <mm/compressed_swap.h>
 
 #include <vfs/init.h>
 
@@ -137,7 +139,6 @@ void Arch_KernelEntryBootstrap()
     Core_Yield();
 }
 void Arch_InitializePageTables();
-obos_status Arch_InitializeInitialSwapDevice(swap_dev* dev, void* buf, size_t size);
 obos_status Arch_MapPage(uint32_t pt_root, uintptr_t virt, uintptr_t phys, uintptr_t ptFlags);
 void Arch_PageFaultHandler(interrupt_frame* frame);
 static basic_allocator kalloc;
@@ -219,11 +220,14 @@ void Arch_KernelEntry()
     static swap_dev swap;
     size_t swap_size = 16777216 /* 16 MiB */;
     uintptr_t swap_buf = Mm_AllocatePhysicalPages(swap_size/OBOS_PAGE_SIZE, 1, nullptr);
-    Arch_InitializeInitialSwapDevice(&swap, Arch_MapToHHDM(swap_buf), swap_size);
+    MmH_InitializeCompressedSwapDevice(&swap, Arch_MapToHHDM(swap_buf), swap_size);
 	Mm_SwapProvider = &swap;
 	Mm_Initialize();
     OBOS_Debug("%s: Initializing timer interface.\n", __func__);
     Core_InitializeTimerInterface();
+    OBOS_Debug("%s: Initializing work queues.\n", __func__);
+    if (obos_is_error(status = Core_InitializeWorkQueues()))
+        OBOS_Panic(OBOS_PANIC_FATAL_ERROR, "Could not initialize work queues. Status: %d\n", status);
     OBOS_Debug("%s: Initializing scheduler timer.\n", __func__);
     static timer sched_timer;
     sched_timer.handler = sched_timer_hnd;
@@ -322,6 +326,11 @@ cpu_local* CoreS_GetCPULocalPtr()
 {
     return &bsp_cpu;
 }
+void CoreS_WakeIdleCPU(cpu_local* cpu)
+{
+    // There is only one CPU, which is the one making the thread ready.
+    OBOS_UNUSED(cpu);
+}
 BootInfoTag* Arch_GetBootInfo(BootInfoType type)
 {
     return Arch_GetBootInfoFrom(type, nullptr);
@@ -51,10 +51,9 @@ OBOS_NO_UBSAN OBOS_NO_KASAN obos_status Arch_MapPage(page_table pt_root, uintptr
     if (!(pte3[pte3Index] & PT_FLAGS_RESIDENT))
     {
         obos_status status = OBOS_STATUS_SUCCESS;
-        uintptr_t phys = Mm_AllocatePhysicalPages(1, 1, &status);
+        uintptr_t phys = Mm_AllocatePhysicalPagesEx(1, 1, PHYS_ALLOC_ZEROED, &status);
         if (obos_is_error(status))
             return status;
-        memzero(Arch_MapToHHDM(phys), OBOS_PAGE_SIZE);
         pte3[pte3Index] = ((uintptr_t)phys) | ptFlags;
     }
     else
@@ -68,10 +67,9 @@ OBOS_NO_UBSAN OBOS_NO_KASAN obos_status Arch_MapPage(page_table pt_root, uintptr
     if (!((uintptr_t)pte2[pte2Index] & PT_FLAGS_RESIDENT))
     {
         obos_status status = OBOS_STATUS_SUCCESS;
-        uintptr_t phys = Mm_AllocatePhysicalPages(1, 1, &status);
+        uintptr_t phys = Mm_AllocatePhysicalPagesEx(1, 1, PHYS_ALLOC_ZEROED, &status);
         if (obos_is_error(status))
             return status;
-        memzero(Arch_MapToHHDM(phys), OBOS_PAGE_SIZE);
         ((uintptr_t*)pte2)[pte2Index] = phys | ptFlags;
     }
     {
@@ -208,10 +206,12 @@ OBOS_NO_UBSAN OBOS_NO_KASAN void Arch_InitializePageTables()
     OBOSH_BasicMMAddRegion(&kernel_region, (void*)(uintptr_t)Arch_KernelAddressRequest.response->virtual_base, kernelSize);
     OBOSH_BasicMMAddRegion(&hhdm_region, (void*)Arch_MapToHHDM(0), Mm_PhysicalMemoryBoundaries);
 }
-OBOS_NO_UBSAN OBOS_NO_KASAN obos_status MmS_QueryPageInfo(page_table pt, uintptr_t addr, page* ppage)
+OBOS_NO_UBSAN OBOS_NO_KASAN obos_status MmS_QueryPageInfo(page_table pt, uintptr_t addr, page* ppage, uintptr_t* phys)
 {
     if (!pt || !ppage)
         return OBOS_STATUS_INVALID_ARGUMENT;
+    if (phys)
+        *phys = 0;
     uintptr_t entry = 0;
     obos_status status = Arch_GetPagePTE(pt, addr, &entry);
     page page;
@@ -223,6 +223,8 @@ OBOS_NO_UBSAN OBOS_NO_KASAN obos_status MmS_QueryPageInfo(page_table pt, uintptr
         return status;
     }
     page.addr = addr;
+    if (phys && page.prot.present)
+        *phys = MASK_PTE(entry);
     page.prot.huge_page = false;
     page.prot.rw = !(entry & PT_FLAGS_READONLY);
     page.prot.executable = true;
@@ -244,6 +246,9 @@ OBOS_NO_UBSAN OBOS_NO_KASAN obos_status MmS_SetPageMapping(page_table pt, const
 {
     if (!pt || !page)
         return OBOS_STATUS_INVALID_ARGUMENT;
+    uint32_t oldEntry = 0;
+    Arch_GetPagePTE(pt, page->addr, &oldEntry);
+    MmH_UpdatePageFrameMapping(page, (oldEntry & PT_FLAGS_RESIDENT) ? MASK_PTE(oldEntry) : 0, page->prot.present ? phys : 0);
     if (!page->prot.present)
         return Arch_UnmapPage(pt, page->addr);
     uintptr_t flags = PT_FLAGS_RESIDENT;
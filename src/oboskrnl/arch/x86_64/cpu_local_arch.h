@@ -11,6 +11,7 @@
 #include <struct_packing.h>
 
 #include <arch/x86_64/gdbstub/connection.h>
+#include <arch/x86_64/idle.h>
 
 #include <irq/dpc.h>
 
@@ -42,4 +43,9 @@ typedef struct cpu_local_arch
 	bool pf_handler_running;
 	gdb_ctx dbg_ctx;
 	dpc dbg_dpc;
+	arch_idle_data idle;
+	// IRQs that came in while the IRQL was too high, indexed by vector id.
+	uint64_t deferredVectors[4];
+	// Bit n is set if an IRQ of IRQL n is in deferredVectors.
+	uint16_t deferredIrqls;
 } cpu_local_arch;
\ No newline at end of file
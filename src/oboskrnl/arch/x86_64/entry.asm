@@ -52,19 +52,3 @@ Arch_KernelEntryBootstrap:
 	; Call into the kernel entry.
 	push 0 ; Make sure if the kernel entry returns, it triple faults and doesn't do goofy things.
 	jmp Arch_KernelEntry
-global Arch_IdleTask:function hidden
-section .data
-global Arch_MakeIdleTaskSleep:data hidden
-Arch_MakeIdleTaskSleep: db 0
-section .text
-Arch_IdleTask:
-	hlt
-	cmp byte [Arch_MakeIdleTaskSleep], 1
-	jne Arch_IdleTask
-	cli
-.slp:
-	pause
-	cmp byte [Arch_MakeIdleTaskSleep], 1
-	je .slp
-	sti
-	jmp Arch_IdleTask
\ No newline at end of file
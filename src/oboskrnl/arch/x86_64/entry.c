@@ -20,6 +20,9 @@
 #include <arch/x86_64/idt.h>
 #include <arch/x86_64/interrupt_frame.h>
 #include <arch/x86_64/hpet_table.h>
+#include <arch/x86_64/srat.h>
+#include <arch/x86_64/idle.h>
+#include <arch/x86_64/xsave.h>
 
 #include <irq/irql.h>
 
@@ -57,8 +60,10 @@
 #include <mm/alloc.h>
 #include <mm/pmm.h>
 #include <mm/disk_swap.h>
+#include <mm/compressed_swap.h>
 
 #include <scheduler/process.h>
+#include <scheduler/work.h>
 #include <scheduler/thread_context_info.h>
 
 #include <stdatomic.h>
@@ -200,6 +205,8 @@ OBOS_PAGEABLE_FUNCTION void Arch_KernelEntry(struct ultra_boot_context* bcontext
 		if (edx & (1 << 20))
 			wrmsr(0xC0000080 /* IA32_EFER */, rdmsr(0xC0000080) | (1<<11) /* XD Enable */);
 	}
+	OBOS_Debug("%s: Enabling XSAVE.\n", __func__);
+	Arch_InitializeXSave(true);
 	OBOS_Debug("%s: Initializing scheduler.\n", __func__);
 	bsp_cpu.id = 0;
 	bsp_cpu.isBSP = true;
@@ -239,7 +246,6 @@ volatile struct ultra_module_info_attribute* Arch_KernelBinary;
 volatile struct ultra_module_info_attribute* Arch_InitialSwapBuffer;
 volatile struct ultra_module_info_attribute* Arch_InitRDDriver;
 volatile struct ultra_framebuffer* Arch_Framebuffer;
-extern obos_status Arch_InitializeInitialSwapDevice(swap_dev* dev, void* buf, size_t size);
 static OBOS_PAGEABLE_FUNCTION OBOS_NO_UBSAN struct ultra_module_info_attribute* FindBootModule(volatile struct ultra_boot_context* bcontext, const char* name, size_t nameLen)
 {
 	if (!nameLen)
@@ -612,6 +618,8 @@ void Arch_KernelMainBootstrap()
 {
 	//Core_Yield();
 	irql oldIrql = Core_RaiseIrql(IRQL_DISPATCH);
+	OBOS_Debug("%s: Reading NUMA topology.\n", __func__);
+	Arch_InitializeNUMA();
 	OBOS_Debug("%s: Initializing PMM.\n", __func__);
 	Mm_InitializePMM();
 	OBOS_Debug("%s: Initializing page tables.\n", __func__);
@@ -695,7 +703,7 @@ void Arch_KernelMainBootstrap()
 	if (obos_is_error(status = Arch_InitializeIOAPICs()))
 		OBOS_Panic(OBOS_PANIC_DRIVER_FAILURE, "Could not initialize I/O APICs. Status: %d\n", status);
 	OBOS_Debug("%s: Initializing VMM.\n", __func__);
-	Arch_InitializeInitialSwapDevice(&swap, (void*)Arch_InitialSwapBuffer->address, Arch_InitialSwapBuffer->size);
+	MmH_InitializeCompressedSwapDevice(&swap, (void*)Arch_InitialSwapBuffer->address, Arch_InitialSwapBuffer->size);
 	Mm_SwapProvider = &swap;
 	Mm_Initialize();
 	if (Arch_Framebuffer->physical_address)
@@ -750,6 +758,9 @@ void Arch_KernelMainBootstrap()
 	}
 	OBOS_Debug("%s: Initializing timer interface.\n", __func__);
 	Core_InitializeTimerInterface();
+	OBOS_Debug("%s: Initializing work queues.\n", __func__);
+	if (obos_is_error(status = Core_InitializeWorkQueues()))
+		OBOS_Panic(OBOS_PANIC_FATAL_ERROR, "Could not initialize work queues. Status: %d\n", status);
 	OBOS_Debug("%s: Initializing uACPI\n", __func__);
 #define verify_status(st, in) \
 if (st != UACPI_STATUS_OK)\
@@ -771,6 +782,9 @@ if (st != UACPI_STATUS_OK)\
 
 	st = uacpi_namespace_initialize();
 	verify_status(st, uacpi_namespace_initialize);
+
+	OBOS_Debug("%s: Initializing idle states.\n", __func__);
+	Arch_InitializeIdle();
 	
 	uacpi_install_fixed_event_handler(
         UACPI_FIXED_EVENT_POWER_BUTTON,
@@ -0,0 +1,369 @@
+/*
+ * oboskrnl/arch/x86_64/idle.c
+ *
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+#include <int.h>
+#include <error.h>
+#include <klog.h>
+#include <memmanip.h>
+
+#include <stdatomic.h>
+
+#include <arch/x86_64/idle.h>
+#include <arch/x86_64/lapic.h>
+#include <arch/x86_64/asm_helpers.h>
+
+#include <scheduler/cpu_local.h>
+#include <scheduler/schedule.h>
+#include <scheduler/thread.h>
+#include <scheduler/thread_context_info.h>
+
+#include <irq/irq.h>
+#include <irq/irql.h>
+#include <irq/timer.h>
+
+#include <uacpi/uacpi.h>
+#include <uacpi/types.h>
+#include <uacpi/namespace.h>
+#include <uacpi/utilities.h>
+
+#include <uacpi_libc.h>
+
+// Idle CPUs wait with MONITOR/MWAIT on their wake flag (cpu_local_arch.idle.wake), so that
+// making a thread ready on an idle CPU only costs a store, instead of an IPI.
+// The C-state is chosen from the _CST object of the processor, using how long the CPU has
+// been staying idle recently as the prediction of how long it will stay idle this time.
+
+typedef enum cstate_entry
+{
+	CSTATE_ENTRY_HLT,
+	CSTATE_ENTRY_MWAIT,
+	// Reading the P_LVLx port puts the processor into the C-state.
+	CSTATE_ENTRY_IO,
+} cstate_entry;
+typedef struct cstate
+{
+	cstate_entry entry;
+	// The ACPI C-state type (1, 2, or 3).
+	uint8_t type;
+	// The MWAIT hint, or the I/O port.
+	uint32_t hint;
+	// In microseconds.
+	uint32_t latency;
+	// The least amount of time the CPU needs to be idle for the state to be worth it, in native timer ticks.
+	timer_tick targetResidency;
+} cstate;
+typedef struct cstate_table
+{
+	size_t count;
+	cstate states[ARCH_MAX_CSTATES];
+} cstate_table;
+static cstate_table s_defaultTable = {
+	.count = 1,
+	.states = { { .entry=CSTATE_ENTRY_HLT, .type=1 } },
+};
+static cstate_table s_acpiTable;
+// Swapped out in one go, so that a CPU that is about to go idle never sees a half-built table.
+static _Atomic(cstate_table*) s_table = &s_defaultTable;
+static bool s_hasMwait;
+// Whether MWAIT can be woken up by an interrupt while interrupts are disabled.
+static bool s_mwaitBreakOnInterrupt;
+
+bool Arch_MakeIdleTaskSleep;
+
+static OBOS_NO_KASAN void monitor(const volatile void* addr)
+{
+	asm volatile("monitor" : : "a"(addr), "c"(0), "d"(0) : "memory");
+}
+static OBOS_NO_KASAN void mwait(uint32_t hint, uint32_t extensions)
+{
+	asm volatile("mwait" : : "a"(hint), "c"(extensions) : "memory");
+}
+// Whether there is a thread on 'cpu' other than the idle thread.
+static bool has_work(const cpu_local* cpu)
+{
+	size_t nThreads = 0;
+	for (thread_priority i = 0; i <= THREAD_PRIORITY_MAX_VALUE; i++)
+		nThreads += cpu->priorityLists[i].list.nNodes;
+	// The idle thread is always in one of the lists.
+	// Yielding also runs any DPCs queued on the CPU.
+	return nThreads > 1 || atomic_load(&cpu->dpcs.nPending);
+}
+static size_t select_cstate(const cstate_table* table, const arch_idle_data* data)
+{
+	size_t chosen = 0;
+	for (size_t i = 1; i < table->count; i++)
+		if (table->states[i].targetResidency <= data->predicted)
+			chosen = i;
+	return chosen;
+}
+// Idles the CPU once, until an interrupt or a write to the wake flag.
+// Returns true if the CPU should reschedule.
+static bool idle_once(cpu_local* cpu)
+{
+	arch_idle_data* data = &cpu->arch_specific.idle;
+	const cstate_table* table = atomic_load(&s_table);
+	const size_t index = select_cstate(table, data);
+	const cstate* state = &table->states[index];
+	asm volatile("cli" : : : "memory");
+	atomic_store(&data->wake, 0);
+	if (state->entry == CSTATE_ENTRY_MWAIT)
+		monitor(&data->wake);
+	atomic_store(&data->status, state->entry == CSTATE_ENTRY_MWAIT ? ARCH_IDLE_STATUS_MWAIT : ARCH_IDLE_STATUS_HLT);
+	// Anyone that readied a thread before the status was set won't have woken us up.
+	if (has_work(cpu))
+	{
+		atomic_store(&data->status, ARCH_IDLE_STATUS_BUSY);
+		asm volatile("sti" : : : "memory");
+		return true;
+	}
+	timer_tick start = CoreS_GetNativeTimerTick();
+	switch (state->entry)
+	{
+		case CSTATE_ENTRY_MWAIT:
+			if (s_mwaitBreakOnInterrupt)
+			{
+				// Stay with interrupts disabled, so that the time spent in the interrupt handler
+				// isn't counted as idle time.
+				mwait(state->hint, 1);
+				break;
+			}
+			// STI only takes effect after the next instruction, so no interrupt can come in between.
+			asm volatile("sti; mwait" : : "a"(state->hint), "c"(0) : "memory");
+			break;
+		case CSTATE_ENTRY_IO:
+			inb(state->hint);
+			break;
+		case CSTATE_ENTRY_HLT:
+		default:
+			asm volatile("sti; hlt" : : : "memory");
+			break;
+	}
+	timer_tick elapsed = CoreS_GetNativeTimerTick() - start;
+	atomic_store(&data->status, ARCH_IDLE_STATUS_BUSY);
+	asm volatile("sti" : : : "memory");
+	data->entries[index]++;
+	data->residency[index] += elapsed;
+	data->predicted = (data->predicted * 7 + elapsed) / 8;
+	return atomic_load(&data->wake) || has_work(cpu);
+}
+static void sleep_until_resumed()
+{
+	asm volatile("cli" : : : "memory");
+	volatile bool* sleep = &Arch_MakeIdleTaskSleep;
+	while (*sleep)
+	{
+		if (!s_hasMwait)
+		{
+			pause();
+			continue;
+		}
+		monitor(sleep);
+		if (*sleep)
+			mwait(0, 0);
+	}
+	asm volatile("sti" : : : "memory");
+}
+static void yield()
+{
+	irql oldIrql = IRQL_INVALID;
+	if (Core_GetIrql() <= IRQL_DISPATCH)
+		oldIrql = Core_RaiseIrql(IRQL_DISPATCH);
+	// Core_Yield would return early, since the idle thread's quantum is likely not used up.
+	CoreS_SaveRegisterContextAndYield(&Core_GetCurrentThread()->context);
+	if (oldIrql != IRQL_INVALID)
+		Core_LowerIrql(oldIrql);
+}
+void Arch_IdleTask()
+{
+	while (1)
+	{
+		if (Arch_MakeIdleTaskSleep)
+			sleep_until_resumed();
+		if (idle_once(CoreS_GetCPULocalPtr()))
+			yield();
+	}
+}
+void CoreS_WakeIdleCPU(cpu_local* cpu)
+{
+	if (!cpu || cpu == CoreS_GetCPULocalPtr())
+		return;
+	// The thread needs to be visible in the CPU's lists before we look at whether it is idle.
+	atomic_thread_fence(memory_order_seq_cst);
+	switch (atomic_load(&cpu->arch_specific.idle.status))
+	{
+		case ARCH_IDLE_STATUS_MWAIT:
+			atomic_store(&cpu->arch_specific.idle.wake, 1);
+			break;
+		case ARCH_IDLE_STATUS_HLT:
+		{
+			if (!Core_SchedulerIRQ || !Core_SchedulerIRQ->vector)
+				break;
+			ipi_lapic_info target = {
+				.isShorthand = false,
+				.info = {
+					.lapicId = cpu->id,
+				},
+			};
+			ipi_vector_info vector = {
+				.deliveryMode = LAPIC_DELIVERY_MODE_FIXED,
+				.info.vector = Core_SchedulerIRQ->vector->id + 0x20
+			};
+			Arch_LAPICSendIPI(target, vector);
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+// See the ACPI spec, section 6.4.3.7 (Generic Register Descriptor).
+typedef struct acpi_gas_descriptor
+{
+	uint8_t tag;
+	uint16_t length;
+	uint8_t addressSpace;
+	uint8_t bitWidth;
+	uint8_t bitOffset;
+	uint8_t accessSize;
+	uint64_t address;
+} OBOS_PACK acpi_gas_descriptor;
+#define ACPI_ADDRESS_SPACE_SYSTEM_IO (1)
+#define ACPI_ADDRESS_SPACE_FFH (0x7f)
+// For FFH C-states, bitWidth is the vendor, and bitOffset is the class.
+#define FFH_VENDOR_INTEL (1)
+#define FFH_CLASS_NATIVE_CSTATE (2)
+
+static cstate default_c1()
+{
+	cstate state = s_defaultTable.states[0];
+	// Prefer MWAIT for C1 too, so that waking the CPU doesn't need an IPI.
+	if (s_hasMwait)
+		state.entry = CSTATE_ENTRY_MWAIT;
+	return state;
+}
+static void add_cstate(cstate_table* table, uacpi_object* ent)
+{
+	if (ent->type != UACPI_OBJECT_PACKAGE || ent->package->count < 4)
+		return;
+	uacpi_object** fields = ent->package->objects;
+	if (fields[0]->type != UACPI_OBJECT_BUFFER || fields[0]->buffer->size < sizeof(acpi_gas_descriptor))
+		return;
+	if (fields[1]->type != UACPI_OBJECT_INTEGER || fields[2]->type != UACPI_OBJECT_INTEGER)
+		return;
+	const acpi_gas_descriptor* reg = (const acpi_gas_descriptor*)fields[0]->buffer->data;
+	cstate state = {
+		.type = fields[1]->integer,
+		.latency = fields[2]->integer,
+	};
+	const bool nativeMwait = s_hasMwait &&
+		reg->addressSpace == ACPI_ADDRESS_SPACE_FFH &&
+		reg->bitWidth == FFH_VENDOR_INTEL &&
+		reg->bitOffset == FFH_CLASS_NATIVE_CSTATE;
+	if (state.type == 1)
+	{
+		state.entry = default_c1().entry;
+		state.hint = nativeMwait ? reg->address : 0;
+	}
+	else if (nativeMwait)
+	{
+		state.entry = CSTATE_ENTRY_MWAIT;
+		state.hint = reg->address;
+	}
+	else if (state.type == 2 && reg->addressSpace == ACPI_ADDRESS_SPACE_SYSTEM_IO)
+	{
+		state.entry = CSTATE_ENTRY_IO;
+		state.hint = reg->address;
+	}
+	else
+		return; // C3 through an I/O port needs bus master arbitration to be handled, which we don't do.
+	// Only go into a state if the CPU is going to stay there for at least twice its exit latency.
+	state.targetResidency = (CoreS_GetNativeTimerFrequency() * state.latency * 2) / 1000000;
+	// The first state is always C1, which is always chosen as a last resort.
+	if (!table->count && state.type != 1)
+		table->states[table->count++] = default_c1();
+	else if (table->count && state.type == 1)
+		return;
+	if (table->count < ARCH_MAX_CSTATES)
+		table->states[table->count++] = state;
+}
+static bool parse_cst(uacpi_namespace_node* processor, cstate_table* table)
+{
+	uacpi_object* cst = nullptr;
+	uacpi_status st = uacpi_eval_typed(processor, "_CST", UACPI_NULL, UACPI_OBJECT_PACKAGE_BIT, &cst);
+	if (uacpi_unlikely_error(st))
+		return false;
+	// The first element is the amount of C-states.
+	for (size_t i = 1; i < cst->package->count; i++)
+		add_cstate(table, cst->package->objects[i]);
+	uacpi_object_unref(cst);
+	return table->count > 0;
+}
+static uacpi_ns_iteration_decision find_cst(void* udata, uacpi_namespace_node* node)
+{
+	cstate_table* table = udata;
+	uacpi_namespace_node_info* info = nullptr;
+	uacpi_status st = uacpi_get_namespace_node_info(node, &info);
+	if (uacpi_unlikely_error(st))
+		return UACPI_NS_ITERATION_DECISION_CONTINUE;
+	bool isProcessor = info->type == UACPI_OBJECT_PROCESSOR;
+	if (info->type == UACPI_OBJECT_DEVICE && (info->flags & UACPI_NS_NODE_INFO_HAS_HID))
+		isProcessor = uacpi_strcmp(info->hid.value, "ACPI0007") == 0;
+	uacpi_free_namespace_node_info(info);
+	if (!isProcessor)
+		return UACPI_NS_ITERATION_DECISION_CONTINUE;
+	// NOTE: We assume every processor has the same C-states, so the first _CST found is used for every CPU.
+	return parse_cst(node, table) ? UACPI_NS_ITERATION_DECISION_BREAK : UACPI_NS_ITERATION_DECISION_CONTINUE;
+}
+void Arch_InitializeIdle()
+{
+	uint32_t ecx = 0, unused = 0;
+	__cpuid__(1, 0, &unused, &unused, &ecx, &unused);
+	s_hasMwait = ecx & (1<<3);
+	if (s_hasMwait)
+	{
+		uint32_t leaf5Ecx = 0;
+		__cpuid__(5, 0, &unused, &unused, &leaf5Ecx, &unused);
+		// Bit 0: MWAIT extensions are enumerated, bit 1: interrupts break MWAIT even if disabled.
+		s_mwaitBreakOnInterrupt = (leaf5Ecx & 0b11) == 0b11;
+	}
+	cstate_table* table = &s_acpiTable;
+	memzero(table, sizeof(*table));
+	uacpi_namespace_for_each_node_depth_first(uacpi_namespace_root(), find_cst, table);
+	if (!table->count)
+	{
+		// No _CST, so just use C1.
+		table->states[0] = default_c1();
+		table->count = 1;
+	}
+	for (size_t i = 0; i < table->count; i++)
+		OBOS_Debug("C-state %d: C%d, entered through %s (hint 0x%x), exit latency: %d us.\n",
+			i, table->states[i].type,
+			table->states[i].entry == CSTATE_ENTRY_MWAIT ? "MWAIT" : (table->states[i].entry == CSTATE_ENTRY_IO ? "I/O port" : "HLT"),
+			table->states[i].hint, table->states[i].latency);
+	atomic_store(&s_table, table);
+}
+size_t Arch_IdleStateCount()
+{
+	return atomic_load(&s_table)->count;
+}
+obos_status Arch_GetIdleResidency(size_t cpu, size_t cstate, uint64_t* residencyNs, uint64_t* entries)
+{
+	if (cpu >= Core_CpuCount || cstate >= ARCH_MAX_CSTATES || cstate >= Arch_IdleStateCount())
+		return OBOS_STATUS_INVALID_ARGUMENT;
+	if (!residencyNs && !entries)
+		return OBOS_STATUS_INVALID_ARGUMENT;
+	const arch_idle_data* data = &Core_CpuInfo[cpu].arch_specific.idle;
+	if (residencyNs)
+	{
+		// Done in 128 bits, since the residency times 10^9 overflows 64 bits after a few seconds.
+		const timer_tick freq = CoreS_GetNativeTimerFrequency();
+		const unsigned __int128 ns = freq ? ((unsigned __int128)data->residency[cstate] * 1000000000) / freq : 0;
+		*residencyNs = ns > UINT64_MAX ? UINT64_MAX : (uint64_t)ns;
+	}
+	if (entries)
+		*entries = data->entries[cstate];
+	return OBOS_STATUS_SUCCESS;
+}
@@ -0,0 +1,48 @@
+/*
+ * oboskrnl/arch/x86_64/idle.h
+ *
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+#pragma once
+
+#include <int.h>
+#include <error.h>
+
+#include <stdatomic.h>
+
+// The maximum amount of C-states that are used, including C1.
+#define ARCH_MAX_CSTATES (8)
+
+typedef enum arch_idle_status
+{
+	// The CPU is running something other than the idle loop, or is about to check for work.
+	ARCH_IDLE_STATUS_BUSY,
+	// The CPU is in MWAIT, and wakes up once 'wake' is written to.
+	ARCH_IDLE_STATUS_MWAIT,
+	// The CPU is in HLT, or in a C-state entered through an I/O port, and needs an IPI to wake up.
+	ARCH_IDLE_STATUS_HLT,
+} arch_idle_status;
+typedef struct arch_idle_data
+{
+	// Monitored by the CPU while it is idle.
+	// Other CPUs set this to wake the CPU without an IPI.
+	_Atomic(uint32_t) wake;
+	// An arch_idle_status.
+	_Atomic(uint32_t) status;
+	// An exponential moving average of how long the CPU stayed idle, in native timer ticks.
+	uint64_t predicted;
+	// Per C-state, in native timer ticks.
+	uint64_t residency[ARCH_MAX_CSTATES];
+	uint64_t entries[ARCH_MAX_CSTATES];
+} arch_idle_data;
+
+// Reads the C-states from the _CST object of the processors, and starts using MWAIT if the CPU supports it.
+// Must be called after the ACPI namespace is initialized.
+// Until this is called, idle CPUs use HLT.
+void Arch_InitializeIdle();
+// The amount of C-states that idle CPUs can choose from.
+OBOS_EXPORT size_t Arch_IdleStateCount();
+// Gets the time 'cpu' (an index into Core_CpuInfo) spent in 'cstate', and the amount of times it entered it.
+// 'cstate' is an index, where zero is C1.
+OBOS_EXPORT obos_status Arch_GetIdleResidency(size_t cpu, size_t cstate, uint64_t* residencyNs, uint64_t* entries);
@@ -0,0 +1,119 @@
+/*
+ * oboskrnl/arch/x86_64/irql.c
+ *
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+#include <int.h>
+#include <klog.h>
+
+#include <irq/irql.h>
+#include <irq/irq.h>
+
+#include <scheduler/cpu_local.h>
+
+#include <arch/x86_64/lapic.h>
+#include <arch/x86_64/interrupt_frame.h>
+#include <arch/x86_64/asm_helpers.h>
+
+irql* Core_GetIRQLVar();
+
+// The IRQL is raised lazily: raising it only changes the software IRQL, and CR8 (the TPR) is left alone.
+// If an interrupt comes in while the IRQL is at or above the IRQL of its vector, it is deferred, and
+// only then is CR8 raised to the current IRQL, so that no other interrupt at that IRQL or lower comes in.
+// Once the IRQL is lowered below a deferred interrupt's IRQL, it is replayed with a self-IPI.
+// This makes raising and lowering the IRQL (eg. on every spinlock acquire and release) free of CR8 writes
+// in the common case, where no interrupt comes in.
+
+static OBOS_NO_KASAN OBOS_NO_UBSAN void write_tpr(uint8_t to)
+{
+	asm volatile("mov %0, %%cr8" : : "r"((uintptr_t)to) : "memory");
+}
+// Must be called with interrupts disabled.
+static OBOS_NO_KASAN OBOS_NO_UBSAN void replay_deferred(cpu_local* cpu, irql to)
+{
+	uint16_t pending = cpu->arch_specific.deferredIrqls & ~(uint16_t)((2u << to) - 1);
+	if (!pending)
+		return;
+	for (size_t i = 0; i < sizeof(cpu->arch_specific.deferredVectors)/sizeof(*cpu->arch_specific.deferredVectors); i++)
+	{
+		uint64_t word = cpu->arch_specific.deferredVectors[i];
+		while (word)
+		{
+			const irq_vector_id vector = i*64 + __builtin_ctzll(word);
+			word &= word - 1;
+			if (OBOS_IRQ_VECTOR_ID_TO_IRQL(vector) <= to)
+				continue;
+			cpu->arch_specific.deferredVectors[i] &= ~BIT_TYPE(vector % 64, UL);
+			// The IPI is held in the IRR until the TPR is lowered and interrupts are enabled.
+			// If a level-triggered IRQ was reasserted while the TPR was raised, they are merged into one.
+			ipi_lapic_info target = {
+				.isShorthand = true,
+				.info.shorthand = LAPIC_DESTINATION_SHORTHAND_SELF,
+			};
+			ipi_vector_info ipi = {
+				.deliveryMode = LAPIC_DELIVERY_MODE_FIXED,
+				.info.vector = vector + 0x20,
+			};
+			Arch_LAPICSendIPI(target, ipi);
+		}
+	}
+	cpu->arch_specific.deferredIrqls &= ~pending;
+}
+// Must be called with interrupts disabled.
+static OBOS_NO_KASAN OBOS_NO_UBSAN void lower_hardware_irql(cpu_local* cpu, irql to)
+{
+	replay_deferred(cpu, to);
+	if (getCR8() > to)
+		write_tpr(to);
+}
+OBOS_NO_KASAN OBOS_NO_UBSAN void CoreS_SetIRQL(uint8_t to, uint8_t old)
+{
+	if (to == 1)
+		OBOS_Panic(OBOS_PANIC_FATAL_ERROR, "Invalid IRQL %d passed to %s.\n", to, __func__);
+	cpu_local* cpu = CoreS_GetCPULocalPtr();
+	if (obos_expect(!cpu, false))
+	{
+		// Nothing can be deferred without a CPU-local struct.
+		write_tpr(to);
+		return;
+	}
+	if (to >= old)
+		return;
+	uintptr_t flags = 0;
+	asm volatile("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+	lower_hardware_irql(cpu, to);
+	if (flags & BIT(9) /* IF */)
+		asm volatile("sti" : : : "memory");
+}
+OBOS_NO_KASAN OBOS_NO_UBSAN uint8_t CoreS_GetIRQL()
+{
+	// CR8 is only a lower bound of the real IRQL.
+	return *Core_GetIRQLVar();
+}
+OBOS_NO_KASAN OBOS_NO_UBSAN void CoreS_DeferIRQ(interrupt_frame* frame)
+{
+	const irq_vector_id vector = frame->vector;
+	const irql current = *Core_GetIRQLVar();
+	cpu_local* cpu = CoreS_GetCPULocalPtr();
+	if (cpu)
+	{
+		cpu->arch_specific.deferredVectors[vector / 64] |= BIT_TYPE(vector % 64, UL);
+		cpu->arch_specific.deferredIrqls |= BIT(OBOS_IRQ_VECTOR_ID_TO_IRQL(vector));
+	}
+	write_tpr(current);
+	// The interrupt is remembered, so it doesn't need to stay in service.
+	Arch_LAPICSendEOI();
+}
+// Called by CoreS_SwitchToThreadContext with interrupts disabled.
+OBOS_NO_KASAN OBOS_NO_UBSAN void Arch_RestoreThreadIRQL(irql to)
+{
+	*Core_GetIRQLVar() = to;
+	cpu_local* cpu = CoreS_GetCPULocalPtr();
+	if (!cpu)
+	{
+		write_tpr(to);
+		return;
+	}
+	lower_hardware_irql(cpu, to);
+}
@@ -166,43 +166,6 @@ section .text
 Arch_FlushIDT:
 	lidt [rdi]
 	ret
-global CoreS_GetIRQL:function hidden
-global CoreS_SetIRQL:function hidden
-extern OBOS_Panic
-section .rodata
-panic_format1: db "Invalid IRQL %d passed to CoreS_GetIRQL.", 0xa, 0x0
-section .text
-; Takes no registers as input.
-; Sets rax to the current IRQL (cr8).
-CoreS_GetIRQL:
-	push rbp
-	mov rbp, rsp
-	
-	mov rax, cr8
-	
-	leave
-	ret
-; Input:
-; rdi: New IRQL.
-CoreS_SetIRQL:
-	push rbp
-	mov rbp, rsp
-
-	cmp rdi, 1
-	jne .success
-; Panic!
-	mov rax, 1
-	push rdi
-	mov rdi, 1 ; OBOS_PANIC_FATAL_ERROR
-	mov rsi, panic_format1
-	pop rdx
-	call OBOS_Panic
-.success:
-	mov cr8, rdi
-	
-	leave
-	ret
-section .text
 global Arch_disablePIC:function hidden
 Arch_disablePIC:
 	mov al, 0xff
@@ -102,8 +102,7 @@ uintptr_t* Arch_AllocatePageMapAt(uintptr_t pml4Base, uintptr_t at, uintptr_t cp
 		uintptr_t* pageMap = (uintptr_t*)MmS_MapVirtFromPhys((i + 1) == 4 ? pml4Base : Arch_MaskPhysicalAddressFromEntry(GetPageMapEntryForDepth(pml4Base, at, i + 1)));
 		if (!pageMap[AddressToIndex(at, i)])
 		{
-			uintptr_t newTable = Mm_AllocatePhysicalPages(1,1, nullptr);
-			memzero(MmS_MapVirtFromPhys(newTable), 4096);
+			uintptr_t newTable = Mm_AllocatePhysicalPagesEx(1,1, PHYS_ALLOC_ZEROED, nullptr);
 			pageMap[AddressToIndex(at, i)] = newTable | cpuFlags;
 		}
 		else
@@ -390,10 +389,12 @@ obos_status Arch_InitializeKernelPageTable()
 	Arch_KernelCR3 = newCR3;
 	return OBOS_STATUS_SUCCESS;
 }
-obos_status MmS_QueryPageInfo(page_table pt, uintptr_t addr, page* ppage)
+obos_status MmS_QueryPageInfo(page_table pt, uintptr_t addr, page* ppage, uintptr_t* phys)
 {
 	if (!pt || !ppage)
 		return OBOS_STATUS_INVALID_ARGUMENT;
+	if (phys)
+		*phys = 0;
 	page page;
 	memzero(&page, sizeof(page));
 	uintptr_t pml2Entry = Arch_GetPML2Entry(pt, addr);
@@ -418,6 +419,8 @@ obos_status MmS_QueryPageInfo(page_table pt, uintptr_t addr, page* ppage)
 		entry = pml1Entry;
 	}
 	page.addr = addr;
+	if (phys && page.prot.present)
+		*phys = Arch_MaskPhysicalAddressFromEntry(entry) & ~(page.prot.huge_page ? (OBOS_HUGE_PAGE_SIZE-1) : (OBOS_PAGE_SIZE-1));
 	page.prot.rw = entry & BIT_TYPE(1, UL);
 	page.prot.user = entry & BIT_TYPE(2, UL);
 	page.prot.touched = entry & (BIT_TYPE(5, UL) | BIT_TYPE(6, UL));
@@ -439,10 +442,24 @@ obos_status MmS_QueryPageInfo(page_table pt, uintptr_t addr, page* ppage)
 	memcpy(&ppage->prot, &page.prot, sizeof(page.prot));
 	return OBOS_STATUS_SUCCESS;	
 }
+// Returns the physical address currently mapped at 'addr', or zero if nothing is.
+static uintptr_t get_mapped_phys(page_table pt, uintptr_t addr)
+{
+	uintptr_t pml2Entry = Arch_GetPML2Entry(pt, addr);
+	if (!(pml2Entry & BIT_TYPE(0, UL)))
+		return 0;
+	if (pml2Entry & BIT_TYPE(7, UL))
+		return Arch_MaskPhysicalAddressFromEntry(pml2Entry) & ~0x1fffff;
+	uintptr_t pml1Entry = Arch_GetPML1Entry(pt, addr);
+	if (!(pml1Entry & BIT_TYPE(0, UL)))
+		return 0;
+	return Arch_MaskPhysicalAddressFromEntry(pml1Entry);
+}
 obos_status MmS_SetPageMapping(page_table pt, const page* page, uintptr_t phys)
 {
 	if (!page || !pt)
 		return OBOS_STATUS_INVALID_ARGUMENT;
+	MmH_UpdatePageFrameMapping(page, get_mapped_phys(pt, page->addr), page->prot.present ? phys : 0);
 	if (!page->prot.present)
 		return Arch_UnmapPage(pt, (void*)page->addr);
 	uintptr_t flags = 1;
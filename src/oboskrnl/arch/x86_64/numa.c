@@ -0,0 +1,131 @@
+/*
+ * oboskrnl/arch/x86_64/numa.c
+ * 
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+#include <int.h>
+#include <error.h>
+#include <klog.h>
+#include <memmanip.h>
+
+#include <arch/x86_64/sdt.h>
+#include <arch/x86_64/srat.h>
+#include <arch/x86_64/boot_info.h>
+#include <arch/x86_64/pmm.h>
+
+#include <mm/pmm.h>
+
+#include <UltraProtocol/ultra_protocol.h>
+
+// NOTE: This runs before the PMM (and therefore uACPI) is initialized, so the tables are found
+// the same way the HPET and MADT are.
+
+// Indexed by LAPIC id.
+static uint8_t s_lapicNodes[256];
+
+#define OffsetPtr(ptr, off, t) ((t*)(((uintptr_t)(ptr)) + (off)))
+#define NextSRATEntry(cur) OffsetPtr(cur, cur->length, SRAT_EntryHeader)
+static OBOS_NO_UBSAN ACPISDTHeader* find_table(const char* signature)
+{
+	ACPIRSDPHeader* rsdp = (ACPIRSDPHeader*)Arch_MapToHHDM(Arch_LdrPlatformInfo->acpi_rsdp_address);
+	bool tables32 = rsdp->Revision == 0;
+	ACPISDTHeader* xsdt = tables32 ? (ACPISDTHeader*)(uintptr_t)rsdp->RsdtAddress : (ACPISDTHeader*)rsdp->XsdtAddress;
+	xsdt = (ACPISDTHeader*)Arch_MapToHHDM((uintptr_t)xsdt);
+	size_t nEntries = (xsdt->Length - sizeof(*xsdt)) / (tables32 ? 4 : 8);
+	for (size_t i = 0; i < nEntries; i++)
+	{
+		uintptr_t phys = tables32 ? OffsetPtr(xsdt, sizeof(*xsdt), uint32_t)[i] : OffsetPtr(xsdt, sizeof(*xsdt), uint64_t)[i];
+		ACPISDTHeader* header = (ACPISDTHeader*)Arch_MapToHHDM(phys);
+		if (memcmp(header->Signature, signature, 4))
+			return header;
+	}
+	return nullptr;
+}
+static void set_lapic_node(uint32_t lapicId, uint32_t domain)
+{
+	uint32_t node = MmH_GetNumaNode(domain);
+	if (node == UINT32_MAX)
+	{
+		OBOS_Warning("%s: Too many NUMA nodes, CPU with LAPIC id %d will be treated as part of the first node.\n", __func__, lapicId);
+		return;
+	}
+	// xAPIC ids fit in a byte, which is all the SMP code supports.
+	if (lapicId < sizeof(s_lapicNodes))
+		s_lapicNodes[lapicId] = node;
+}
+static OBOS_NO_UBSAN void parse_srat(SRATTable* srat)
+{
+	SRAT_EntryHeader* end = OffsetPtr(srat, srat->sdtHeader.Length, SRAT_EntryHeader);
+	for (SRAT_EntryHeader* cur = OffsetPtr(srat, sizeof(*srat), SRAT_EntryHeader); cur < end && cur->length; cur = NextSRATEntry(cur))
+	{
+		switch (cur->type)
+		{
+			case SRAT_ENTRY_LAPIC_AFFINITY:
+			{
+				SRAT_LAPICAffinity* ent = (SRAT_LAPICAffinity*)cur;
+				if (!(ent->flags & SRAT_AFFINITY_ENABLED))
+					break;
+				uint32_t domain = ent->proximityDomainLow |
+					((uint32_t)ent->proximityDomainHigh[0] << 8) |
+					((uint32_t)ent->proximityDomainHigh[1] << 16) |
+					((uint32_t)ent->proximityDomainHigh[2] << 24);
+				set_lapic_node(ent->apicID, domain);
+				break;
+			}
+			case SRAT_ENTRY_X2APIC_AFFINITY:
+			{
+				SRAT_X2APICAffinity* ent = (SRAT_X2APICAffinity*)cur;
+				if (!(ent->flags & SRAT_AFFINITY_ENABLED))
+					break;
+				set_lapic_node(ent->x2apicID, ent->proximityDomain);
+				break;
+			}
+			case SRAT_ENTRY_MEMORY_AFFINITY:
+			{
+				SRAT_MemoryAffinity* ent = (SRAT_MemoryAffinity*)cur;
+				if (!(ent->flags & SRAT_AFFINITY_ENABLED) || !ent->length)
+					break;
+				obos_status status = MmH_AddNumaMemoryRange(ent->proximityDomain, ent->base, ent->length);
+				if (obos_is_error(status))
+					OBOS_Warning("%s: Could not add memory range 0x%p-0x%p to NUMA domain %d. Status: %d.\n", __func__, ent->base, ent->base+ent->length, ent->proximityDomain, status);
+				break;
+			}
+			default:
+				break;
+		}
+	}
+}
+static OBOS_NO_UBSAN void parse_slit(SLITTable* slit)
+{
+	const uint8_t* matrix = OffsetPtr(slit, sizeof(*slit), uint8_t);
+	uint64_t n = slit->nLocalities;
+	if (sizeof(*slit) + n*n > slit->sdtHeader.Length)
+	{
+		OBOS_Warning("%s: SLIT is too small for %d localities, ignoring it.\n", __func__, n);
+		return;
+	}
+	for (uint64_t from = 0; from < n; from++)
+		for (uint64_t to = 0; to < n; to++)
+			MmH_SetNumaDistance(from, to, matrix[from*n + to]);
+}
+void Arch_InitializeNUMA()
+{
+	SRATTable* srat = (SRATTable*)find_table("SRAT");
+	if (!srat)
+	{
+		OBOS_Debug("%s: No SRAT, assuming all memory is on one NUMA node.\n", __func__);
+		return;
+	}
+	parse_srat(srat);
+	SLITTable* slit = (SLITTable*)find_table("SLIT");
+	if (slit)
+		parse_slit(slit);
+	OBOS_Debug("%s: Found %d NUMA node(s).\n", __func__, Mm_NumaNodeCount);
+}
+uint32_t Arch_GetNUMANodeForLAPIC(uint32_t lapicId)
+{
+	if (lapicId >= sizeof(s_lapicNodes))
+		return 0;
+	return s_lapicNodes[lapicId];
+}
@@ -18,6 +18,8 @@
 
 #include <arch/x86_64/sdt.h>
 #include <arch/x86_64/madt.h>
+#include <arch/x86_64/srat.h>
+#include <arch/x86_64/xsave.h>
 
 #include <locks/spinlock.h>
 
@@ -144,6 +146,7 @@ void Arch_APEntry(cpu_local* info)
 	Arch_CPUInitializeGDT(info, (uintptr_t)info->arch_specific.ist_stack, 0x20000);
 	wrmsr(0xC0000101 /* GS_BASE */, (uint64_t)info);
 	Arch_InitializeIDT(false);
+	Arch_InitializeXSave(false);
 	(void)Core_RaiseIrql(0xf);
 	// Setup the idle thread.
 	thread_ctx ctx;
@@ -190,6 +193,7 @@ void Arch_SMPStartup()
 	irql oldIrql = Core_RaiseIrql(0xf);
 	for (size_t i = 0; i < s_nLAPICIDs; i++)
 	{
+		cpu_info[i].numaNode = Arch_GetNUMANodeForLAPIC(s_lapicIDs[i]);
 		if (s_lapicIDs[i] == Arch_LAPICAddress->lapicID)
 		{
 			Arch_CPUInitializeGDT(&cpu_info[i], (uintptr_t)(cpu_info[i].arch_specific.ist_stack = OBOS_BasicMMAllocatePages(0x20000, nullptr)), 0x20000);
@@ -0,0 +1,78 @@
+/*
+ * oboskrnl/arch/x86_64/srat.h
+ * 
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+#pragma once
+
+#include <int.h>
+#include <struct_packing.h>
+
+#include <arch/x86_64/sdt.h>
+
+// System Resource Affinity Table
+typedef struct OBOS_PACK SRATTable
+{
+	ACPISDTHeader sdtHeader;
+	uint32_t resv1;
+	uint64_t resv2;
+	// There are more entries.
+} SRATTable;
+typedef struct OBOS_PACK SRAT_EntryHeader
+{
+	uint8_t type;
+	uint8_t length;
+} SRAT_EntryHeader;
+enum {
+	SRAT_ENTRY_LAPIC_AFFINITY = 0,
+	SRAT_ENTRY_MEMORY_AFFINITY = 1,
+	SRAT_ENTRY_X2APIC_AFFINITY = 2,
+};
+enum {
+	SRAT_AFFINITY_ENABLED = 0b1,
+};
+typedef struct OBOS_PACK SRAT_LAPICAffinity
+{
+	SRAT_EntryHeader entryHeader;
+	uint8_t proximityDomainLow;
+	uint8_t apicID;
+	uint32_t flags;
+	uint8_t localSapicEID;
+	uint8_t proximityDomainHigh[3];
+	uint32_t clockDomain;
+} SRAT_LAPICAffinity;
+typedef struct OBOS_PACK SRAT_MemoryAffinity
+{
+	SRAT_EntryHeader entryHeader;
+	uint32_t proximityDomain;
+	uint16_t resv1;
+	uint64_t base;
+	uint64_t length;
+	uint32_t resv2;
+	uint32_t flags;
+	uint64_t resv3;
+} SRAT_MemoryAffinity;
+typedef struct OBOS_PACK SRAT_X2APICAffinity
+{
+	SRAT_EntryHeader entryHeader;
+	uint16_t resv1;
+	uint32_t proximityDomain;
+	uint32_t x2apicID;
+	uint32_t flags;
+	uint32_t clockDomain;
+	uint32_t resv2;
+} SRAT_X2APICAffinity;
+// System Locality Information Table
+typedef struct OBOS_PACK SLITTable
+{
+	ACPISDTHeader sdtHeader;
+	uint64_t nLocalities;
+	// Followed by an nLocalities*nLocalities matrix of distances.
+} SLITTable;
+
+// Reads the NUMA topology out of the SRAT and SLIT, and gives it to the PMM.
+// Must be called before Mm_InitializePMM.
+void Arch_InitializeNUMA();
+// Gets the index of the NUMA node that the CPU with the LAPIC id 'lapicId' is on.
+uint32_t Arch_GetNUMANodeForLAPIC(uint32_t lapicId);
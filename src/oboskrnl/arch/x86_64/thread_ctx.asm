@@ -53,7 +53,16 @@ align 8
 .stackSize: resq 1
 endstruc
 
-extern Core_GetIRQLVar
+; See xsave_instruction in xsave.h
+XSAVE_INSTRUCTION_NONE equ 0
+XSAVE_INSTRUCTION_XSAVEOPT equ 2
+XSAVE_INSTRUCTION_XSAVEC equ 3
+XSAVE_INSTRUCTION_XSAVES equ 4
+
+extern Arch_RestoreThreadIRQL
+extern Arch_XSaveInstruction
+extern Arch_AllocateXSaveArea
+extern Arch_FreeXSaveArea
 section .text
 CoreS_SwitchToThreadContext:
 	; Disable interrupts, getting an interrupt in the middle of execution of this function can be deadly.
@@ -62,9 +71,15 @@ CoreS_SwitchToThreadContext:
 	cmp rbx, 0
 	je .no_xstate
 	; Restore the extended state.
-	xor rcx,rcx
-	xgetbv
-	xrstor [rbx]
+	; Every component enabled in XCR0 is restored, XRSTOR detects the compacted format by itself.
+	mov eax, 0xffffffff
+	mov edx, eax
+	cmp dword [Arch_XSaveInstruction], XSAVE_INSTRUCTION_XSAVES
+	je .xrstors
+	xrstor64 [rbx]
+	jmp .no_xstate
+.xrstors:
+	xrstors64 [rbx]
 .no_xstate:
 	add rdi, 8
 	; Restore CR3 (address space)
@@ -72,13 +87,11 @@ CoreS_SwitchToThreadContext:
 	mov cr3, rax
 	add rdi, 8
 	; Restore IRQL.
-	mov rax, [rdi]
-	mov cr8, rax
+	; This also replays any interrupts that were deferred while the IRQL was raised.
 	push rdi
-	call Core_GetIRQLVar
+	movzx edi, byte [rdi]
+	call Arch_RestoreThreadIRQL
 	pop rdi
-	mov rcx, [rdi]
-	mov [rax], rcx
 	add rdi, 8
 	; Restore GS_BASE
 	test qword [rdi+16+0xB8], 0x3
@@ -105,8 +118,23 @@ section .pageable.text
 CoreS_FreeThreadContext:
 	push rbp
 	mov rbp, rsp
-	; TODO: Implement.
 
+	cmp rdi, 0
+	jnz .free
+	mov rax, 2 ; OBOS_STATUS_INVALID_ARGUMENT
+	jmp .finish
+
+.free:
+	push rdi
+	sub rsp, 8
+	mov rdi, [rdi+thread_ctx.extended_ctx_ptr]
+	call Arch_FreeXSaveArea
+	add rsp, 8
+	pop rdi
+	mov qword [rdi+thread_ctx.extended_ctx_ptr], 0
+
+	xor rax, rax ; OBOS_STATUS_SUCCESS
+.finish:
 	leave
 	ret
 CoreS_SetupThreadContext:
@@ -140,6 +168,21 @@ CoreS_SetupThreadContext:
 .userspace:
 	mov qword [rdi+thread_ctx.frame+0xB8], 0x20|3 ; ctx->frame.cs=user (CPL3) data segment
 	mov qword [rdi+thread_ctx.frame+0xD0], 0x18|3 ; ctx->frame.ss=user (CPL3) code segment
+	; Only threads that can run user code have extended state, the kernel doesn't use it.
+	push rdi
+	sub rsp, 8
+	call Arch_AllocateXSaveArea
+	add rsp, 8
+	pop rdi
+	mov qword [rdi+thread_ctx.extended_ctx_ptr], rax  ; ctx->extended_ctx_ptr
+	test rax, rax
+	jnz .kmode
+	; nullptr is only fine if XSAVE isn't supported, otherwise the allocation failed, and the thread
+	; would share its extended state with every other thread.
+	cmp dword [Arch_XSaveInstruction], XSAVE_INSTRUCTION_NONE
+	je .kmode
+	mov rax, 6 ; OBOS_STATUS_NOT_ENOUGH_MEMORY
+	jmp .finish
 
 .kmode:
 
@@ -217,8 +260,27 @@ CoreS_SaveRegisterContextAndYield:
 	
 	cmp qword [rdi+thread_ctx.extended_ctx_ptr], 0
 	jz .call_scheduler
-	mov rax, [rdi+thread_ctx.extended_ctx_ptr]
-	xsave [rax]
+	mov r8, [rdi+thread_ctx.extended_ctx_ptr]
+	; Save every component enabled in XCR0.
+	mov eax, 0xffffffff
+	mov edx, eax
+	mov ecx, [Arch_XSaveInstruction]
+	cmp ecx, XSAVE_INSTRUCTION_XSAVES
+	je .xsaves
+	cmp ecx, XSAVE_INSTRUCTION_XSAVEOPT
+	je .xsaveopt
+	cmp ecx, XSAVE_INSTRUCTION_XSAVEC
+	je .xsavec
+	xsave64 [r8]
+	jmp .call_scheduler
+.xsaves:
+	xsaves64 [r8]
+	jmp .call_scheduler
+.xsaveopt:
+	xsaveopt64 [r8]
+	jmp .call_scheduler
+.xsavec:
+	xsavec64 [r8]
 
 .call_scheduler:
 	popfq ; see the rflags saving code at the beginning of the function
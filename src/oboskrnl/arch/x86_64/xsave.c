@@ -0,0 +1,113 @@
+/*
+ * oboskrnl/arch/x86_64/xsave.c
+ *
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+#include <int.h>
+#include <error.h>
+#include <klog.h>
+#include <memmanip.h>
+
+#include <arch/x86_64/xsave.h>
+#include <arch/x86_64/asm_helpers.h>
+
+#include <allocators/base.h>
+
+xsave_instruction Arch_XSaveInstruction = XSAVE_INSTRUCTION_NONE;
+size_t Arch_XSaveAreaSize;
+static uint64_t s_xcr0;
+
+#define XCR0_X87 BIT_TYPE(0, UL)
+#define XCR0_SSE BIT_TYPE(1, UL)
+#define XCR0_AVX BIT_TYPE(2, UL)
+// Opmask, ZMM_Hi256, and Hi16_ZMM, which can only be enabled together.
+#define XCR0_AVX512 (BIT_TYPE(5, UL)|BIT_TYPE(6, UL)|BIT_TYPE(7, UL))
+#define IA32_XSS (0xDA0)
+
+#define XSAVE_HEADER_OFFSET (512)
+#define XSAVE_MXCSR_OFFSET (24)
+#define XCOMP_BV_COMPACTED BIT_TYPE(63, UL)
+
+static void xsetbv(uint32_t xcr, uint64_t val)
+{
+	asm volatile("xsetbv" : : "c"(xcr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)) : "memory");
+}
+static void choose_instruction()
+{
+	uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+	__cpuid__(0xd, 0, &eax, &ebx, &ecx, &edx);
+	const uint64_t supported = eax | ((uint64_t)edx << 32);
+	s_xcr0 = supported & (XCR0_X87|XCR0_SSE|XCR0_AVX);
+	if ((supported & XCR0_AVX512) == XCR0_AVX512 && (s_xcr0 & XCR0_AVX))
+		s_xcr0 |= XCR0_AVX512;
+	__cpuid__(0xd, 1, &eax, &ebx, &ecx, &edx);
+	// XSAVES is preferred, since it has both optimizations, and uses the compacted format.
+	// We have no supervisor state, so IA32_XSS stays zero, and XSAVES saves the same thing XSAVEC would.
+	if (eax & BIT(3))
+		Arch_XSaveInstruction = XSAVE_INSTRUCTION_XSAVES;
+	else if (eax & BIT(0))
+		Arch_XSaveInstruction = XSAVE_INSTRUCTION_XSAVEOPT;
+	else if (eax & BIT(1))
+		Arch_XSaveInstruction = XSAVE_INSTRUCTION_XSAVEC;
+	else
+		Arch_XSaveInstruction = XSAVE_INSTRUCTION_XSAVE;
+}
+static bool compacted()
+{
+	return Arch_XSaveInstruction == XSAVE_INSTRUCTION_XSAVEC || Arch_XSaveInstruction == XSAVE_INSTRUCTION_XSAVES;
+}
+void Arch_InitializeXSave(bool isBSP)
+{
+	uint32_t ecx = 0;
+	__cpuid__(1, 0, nullptr, nullptr, &ecx, nullptr);
+	if (!(ecx & BIT(26)))
+	{
+		if (isBSP)
+			OBOS_Warning("XSAVE is not supported. User threads will not have their FPU/SSE state saved.\n");
+		return;
+	}
+	// CR4.OSFXSR, CR4.OSXMMEXCPT, and CR4.OSXSAVE
+	uintptr_t cr4 = getCR4() | BIT(9) | BIT(10) | BIT(18);
+	asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+	if (isBSP)
+		choose_instruction();
+	xsetbv(0, s_xcr0);
+	if (Arch_XSaveInstruction == XSAVE_INSTRUCTION_XSAVES)
+		wrmsr(IA32_XSS, 0);
+	if (!isBSP)
+		return;
+	// The sizes reported depend on what is currently enabled, so this has to be done after XSETBV.
+	uint32_t eax = 0, ebx = 0, edx = 0;
+	__cpuid__(0xd, compacted() ? 1 : 0, &eax, &ebx, &ecx, &edx);
+	Arch_XSaveAreaSize = ebx;
+	static const char* const names[] = { "none", "XSAVE", "XSAVEOPT", "XSAVEC", "XSAVES" };
+	OBOS_Debug("Saving extended state with %s. XCR0: 0x%016lx, save area size: %ld bytes.\n", names[Arch_XSaveInstruction], s_xcr0, Arch_XSaveAreaSize);
+}
+void* Arch_AllocateXSaveArea()
+{
+	if (Arch_XSaveInstruction == XSAVE_INSTRUCTION_NONE)
+		return nullptr;
+	allocator_info* alloc = OBOS_NonPagedPoolAllocator ? OBOS_NonPagedPoolAllocator : OBOS_KernelAllocator;
+	// The area must be 64-byte aligned, so over-allocate, and keep the real pointer right before the area.
+	const size_t size = Arch_XSaveAreaSize + 64 + sizeof(void*);
+	uint8_t* buf = alloc->ZeroAllocate(alloc, 1, size, nullptr);
+	if (!buf)
+		return nullptr;
+	uintptr_t area = ((uintptr_t)buf + sizeof(void*) + 63) & ~(uintptr_t)63;
+	((void**)area)[-1] = buf;
+	// A zeroed XSAVE header means every component is in its initial state, but MXCSR is still
+	// loaded from the legacy area, and zero would unmask every SSE exception.
+	*(uint32_t*)(area + XSAVE_MXCSR_OFFSET) = 0x1f80;
+	if (compacted())
+		*(uint64_t*)(area + XSAVE_HEADER_OFFSET + 8) = XCOMP_BV_COMPACTED | s_xcr0;
+	return (void*)area;
+}
+void Arch_FreeXSaveArea(void* area)
+{
+	if (!area)
+		return;
+	allocator_info* alloc = OBOS_NonPagedPoolAllocator ? OBOS_NonPagedPoolAllocator : OBOS_KernelAllocator;
+	void* buf = ((void**)area)[-1];
+	alloc->Free(alloc, buf, Arch_XSaveAreaSize + 64 + sizeof(void*));
+}
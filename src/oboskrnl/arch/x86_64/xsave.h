@@ -0,0 +1,36 @@
+/*
+ * oboskrnl/arch/x86_64/xsave.h
+ *
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+#pragma once
+
+#include <int.h>
+
+// Don't forget to update these in the assembly code (thread_ctx.asm)
+typedef enum xsave_instruction
+{
+	// Extended state isn't saved at all.
+	XSAVE_INSTRUCTION_NONE,
+	XSAVE_INSTRUCTION_XSAVE,
+	// Doesn't write components that weren't modified since the last XRSTOR.
+	XSAVE_INSTRUCTION_XSAVEOPT,
+	// Uses the compacted format, and doesn't write components that are in their initial state.
+	XSAVE_INSTRUCTION_XSAVEC,
+	// Compacted, and skips both unmodified and initial components.
+	XSAVE_INSTRUCTION_XSAVES,
+} xsave_instruction;
+
+// The instruction used to save extended state on a context switch, read by thread_ctx.asm.
+extern xsave_instruction Arch_XSaveInstruction;
+// The size of a thread's extended state save area.
+extern size_t Arch_XSaveAreaSize;
+
+// Enables XSAVE on the current CPU, and picks the best save instruction the first time it is called.
+void Arch_InitializeXSave(bool isBSP);
+// Allocates an extended state save area, in the initial state.
+// Only threads that can run user code get one, since the kernel doesn't use extended state.
+// Returns nullptr if XSAVE isn't supported, or if the area couldn't be allocated.
+void* Arch_AllocateXSaveArea();
+void Arch_FreeXSaveArea(void* area);
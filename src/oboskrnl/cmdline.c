@@ -68,6 +68,10 @@ void OBOS_ParseCMDLine()
             "                     is used as root.\n"
             "--root-fs-partid=partid: Specifies the partition to mount as root. If set to 'initrd', the initrd\n"
             "--working-set-cap=bytes: Specifies the kernel's working-set size in bytes.\n"
+            "--ahci-ccc-completions=n: Makes the AHCI driver raise one interrupt per 'n' (max 255) completed\n"
+            "                          commands, if the HBA supports command completion coalescing.\n"
+            "--ahci-ccc-timeout=ms: The maximum amount of milliseconds a completed command can wait for its\n"
+            "                       interrupt when --ahci-ccc-completions is set. Defaults to 1.\n"
             "--help: Displays this help message.\n";
         printf("%s", help_message);
     }
@@ -134,6 +134,16 @@ typedef struct driver_ftable
     // Can only be nullptr for the InitRD driver.
     // MUST be called before any operations on the filesystem for that vnode (e.g., list_dir, path_search).
     bool(*probe)(void* vn);
+    // Optional, can be nullptr.
+    // Hints that the file is about to be written up to newsize bytes, so the driver can allocate the space in one go.
+    // Like fallocate with FALLOC_FL_KEEP_SIZE, this does not change the file size.
+    obos_status(*preallocate_file)(dev_desc desc, size_t newsize);
+    // Optional, can be nullptr.
+    // If the page of the file at 'offset' (page aligned) is already resident in memory, and can be mapped as-is, returns
+    // its physical address, so the page cache can map it instead of reading it with read_sync.
+    // The page is mapped read-only, and is never freed by the kernel.
+    // Returns an error if the page needs to be read normally.
+    obos_status(*get_resident_page)(dev_desc desc, size_t offset, uintptr_t* phys);
     // ----------- END FS FUNCTIONS ----------
     // ---------------------------------------
 } driver_ftable;
@@ -95,8 +95,16 @@ typedef struct pci_irq_handle
     uint8_t msi_capability; // the offset of the MSI capability
     pci_device_location dev;
     uintptr_t msix_pending_entry;
+    // The processor MSI(-X) messages are sent to.
+    uint32_t processor;
 } pci_irq_handle;
 OBOS_EXPORT obos_status Drv_RegisterPCIIrq(irq* irq, const pci_device_node* dev, pci_irq_handle* handle);
+// Returns the amount of MSI-X table entries the device has, or zero if it does not support MSI-X.
+OBOS_EXPORT size_t Drv_GetPCIMsixEntryCount(const pci_device_node* dev);
+// Like Drv_RegisterPCIIrq, but uses MSI-X table entry 'index', and sends the interrupt to 'processor'.
+// This allows devices that raise different MSI-X messages for different queues to have their IRQs handled on different CPUs.
+// Returns OBOS_STATUS_UNIMPLEMENTED if the device does not support MSI-X.
+OBOS_EXPORT obos_status Drv_RegisterPCIIrqMsixEntry(irq* irq, const pci_device_node* dev, pci_irq_handle* handle, uint16_t index, uint32_t processor);
 OBOS_EXPORT obos_status Drv_MaskPCIIrq(const pci_irq_handle* handle, bool mask);
 #else
 OBOS_WEAK obos_status DrvS_EnumeratePCI(pci_iteration_decision(*cb)(void* udata, pci_device_node device), void *cb_udata);
@@ -114,5 +122,7 @@ typedef struct pci_irq_handle
     uint8_t unused;
 } pci_irq_handle;
 OBOS_WEAK obos_status Drv_RegisterPCIIrq(irq* irq, const pci_device_node* dev, pci_irq_handle* handle);
+OBOS_WEAK size_t Drv_GetPCIMsixEntryCount(const pci_device_node* dev);
+OBOS_WEAK obos_status Drv_RegisterPCIIrqMsixEntry(irq* irq, const pci_device_node* dev, pci_irq_handle* handle, uint16_t index, uint32_t processor);
 OBOS_WEAK obos_status Drv_MaskPCIIrq(const pci_irq_handle* handle, bool mask);
 #endif
\ No newline at end of file
@@ -9,6 +9,7 @@
 #include <error.h>
 
 #include <irq/irq.h>
+#include <irq/irql.h>
 
 #include <driver_interface/pci.h>
 
@@ -16,6 +17,10 @@
 #include <mm/alloc.h>
 #include <mm/page.h>
 
+#include <locks/spinlock.h>
+
+#include <allocators/base.h>
+
 #include <utils/tree.h>
 
 #if OBOS_ARCHITECTURE_HAS_PCI
@@ -41,6 +46,13 @@ static void* map_registers(uintptr_t phys, size_t size, bool uc)
     }
     return virt+phys_page_offset;
 }
+static void unmap_registers(void* virt, size_t size)
+{
+    size_t phys_page_offset = ((uintptr_t)virt % OBOS_PAGE_SIZE);
+    size = size + (OBOS_PAGE_SIZE - (size % OBOS_PAGE_SIZE));
+    size += phys_page_offset;
+    Mm_VirtualMemoryFree(&Mm_KernelContext, (char*)virt - phys_page_offset, size);
+}
 static void pci_irq_move_callback(struct irq* i, struct irq_vector* from, struct irq_vector* to, void* userdata)
 {
     OBOS_UNUSED(i);
@@ -54,7 +66,7 @@ static void pci_irq_move_callback(struct irq* i, struct irq_vector* from, struct
         return;
     }
     uint64_t msi_data = 0;
-    uint64_t msi_address = DrvS_MSIAddressAndData(&msi_data, 0, 0, true, false);
+    uint64_t msi_address = DrvS_MSIAddressAndData(&msi_data, to->id, hnd->processor, true, false);
     if (hnd->un.msix_entry)
     {
         uint32_t* entry = (uint32_t*)hnd->un.msix_entry;
@@ -77,24 +89,16 @@ static void pci_irq_move_callback(struct irq* i, struct irq_vector* from, struct
     // Write back the header.
     DrvS_WritePCIRegister(hnd->dev, hnd->msi_capability+0, 4, header);
 }
-obos_status Drv_RegisterPCIIrq(irq* irq, const pci_device_node* dev, pci_irq_handle* handle)
+// Looks for the MSI and MSI-X capabilities of a device.
+// Returns false if the device has neither.
+static bool find_msi_capabilities(const pci_device_node* dev, uint8_t* msi_offset, uint8_t* msix_offset)
 {
-    if (!irq || !dev || !handle)
-        return OBOS_STATUS_INVALID_ARGUMENT;
-    irq->irqChecker = nullptr;
-    irq->moveCallback = pci_irq_move_callback;
-    irq->irqMoveCallbackUserdata = handle;
-    handle->dev = dev->info;
-    handle->msi_capability = 0;
-    handle->un.msix_entry = 0;
+    *msi_offset = 0;
+    *msix_offset = 0;
     uint64_t pci_status = 0;
-    bool has_msix = false;
-    bool has_msi = false;
-    uint8_t msix_offset = 0;
-    uint8_t msi_offset = 0;
     DrvS_ReadPCIRegister(dev->info, 1*4+2, 2, &pci_status);
     if (!(pci_status & BIT(4)))
-        goto fallback;
+        return false;
     // Look for an MSI(-X capability).
     uint64_t cap_header = 0; // 16-bit
     uint64_t offset = 0;
@@ -111,14 +115,12 @@ obos_status Drv_RegisterPCIIrq(irq* irq, const pci_device_node* dev, pci_irq_han
         switch (cap_header & 0xff)
         {
             case 0x05:
-                has_msi = true;
-                msi_offset = offset;
-                OBOS_Debug("Found MSI capability at 0x%02x.\n", msi_offset);
+                *msi_offset = offset;
+                OBOS_Debug("Found MSI capability at 0x%02x.\n", *msi_offset);
                 break;
             case 0x11:
-                has_msix = true;
-                msix_offset = offset;
-                OBOS_Debug("Found MSI-X capability at 0x%02x.\n", msix_offset);
+                *msix_offset = offset;
+                OBOS_Debug("Found MSI-X capability at 0x%02x.\n", *msix_offset);
                 break;
             case 0x00:
                 abort = true;
@@ -126,52 +128,129 @@ obos_status Drv_RegisterPCIIrq(irq* irq, const pci_device_node* dev, pci_irq_han
             default:
                 break;
         }
-        if (has_msix || abort)
+        if (*msix_offset || abort)
             break; // If we have MSI-X, break.
     }
-    if (!has_msi && !has_msix)
-        goto fallback;
-    uint64_t msi_data = 0;
-    uint64_t msi_address = DrvS_MSIAddressAndData(&msi_data, irq->vector->id, 0, true, false);
-    if (has_msix)
+    return *msi_offset || *msix_offset;
+}
+// Maps a structure (the table or the PBA) pointed to by an MSI-X capability's BIR/offset register.
+static uintptr_t map_msix_structure(const pci_device_node* dev, uint8_t reg, size_t size)
+{
+    uint64_t bar_info = 0; // 32-bit register
+    DrvS_ReadPCIRegister(dev->info, reg, 4, &bar_info);
+    uint8_t bar_index = bar_info & 0x7;
+    uint64_t bar = 0;
+    DrvS_ReadPCIRegister(dev->info, (bar_index+4)*4, 4, &bar);
+    if (((bar >> 1) & 0b11) == 0x2)
+        DrvS_ReadPCIRegister(dev->info, (bar_index+5)*4, 4, (uint64_t*)(((uint32_t*)&bar) + 1));
+    bar &= ~0xf;
+    uint32_t bar_offset = bar_info & ~0x7;
+    return (uintptr_t)map_registers(bar+bar_offset, size, true);
+}
+// The MSI-X table and PBA of a device.
+// These are mapped once per device, and shared by the handles of all of its vectors.
+typedef struct msix_structures
+{
+    struct msix_structures* next;
+    pci_device_location dev;
+    uintptr_t table;
+    uintptr_t pba;
+    size_t nEntries;
+} msix_structures;
+static msix_structures* s_msixStructures;
+static spinlock s_msixStructuresLock;
+// Must be called with s_msixStructuresLock held.
+static msix_structures* find_msix_structures(pci_device_location dev)
+{
+    for (msix_structures* curr = s_msixStructures; curr; curr = curr->next)
+        if (curr->dev.bus == dev.bus && curr->dev.slot == dev.slot && curr->dev.function == dev.function)
+            return curr;
+    return nullptr;
+}
+// Each table entry is 16 bytes, and the PBA has one bit per entry, in qwords.
+#define MSIX_TABLE_SIZE(nEntries) ((nEntries)*16)
+#define MSIX_PBA_SIZE(nEntries) ((((nEntries)+63)/64)*8)
+static msix_structures* get_msix_structures(const pci_device_node* dev, uint8_t msix_offset, size_t nEntries)
+{
+    irql oldIrql = Core_SpinlockAcquire(&s_msixStructuresLock);
+    msix_structures* found = find_msix_structures(dev->info);
+    Core_SpinlockRelease(&s_msixStructuresLock, oldIrql);
+    if (found)
+        return found;
+    // Mapping the structures can block, so it is done without the lock.
+    msix_structures* structures = OBOS_KernelAllocator->ZeroAllocate(OBOS_KernelAllocator, 1, sizeof(msix_structures), nullptr);
+    if (!structures)
+        return nullptr;
+    structures->dev = dev->info;
+    structures->nEntries = nEntries;
+    structures->table = map_msix_structure(dev, 4+msix_offset, MSIX_TABLE_SIZE(nEntries));
+    structures->pba = map_msix_structure(dev, 8+msix_offset, MSIX_PBA_SIZE(nEntries));
+    oldIrql = Core_SpinlockAcquire(&s_msixStructuresLock);
+    // Another vector of the device could have been registered in the meantime.
+    found = find_msix_structures(dev->info);
+    if (!found)
     {
-        // Prefer MSI-X over MSI.
-        uint64_t header = 0; // 32-bit
-        DrvS_ReadPCIRegister(dev->info, msix_offset+0, 4, &header);
-        header |= BIT(31) /* Enable */;
-        uint64_t bar_info = 0; // 32-bit register
-        DrvS_ReadPCIRegister(dev->info, 4+msix_offset, 4, &bar_info);
-        uint8_t bar_index = bar_info & 0x7;
-        uint64_t bar = 0;
-        DrvS_ReadPCIRegister(dev->info, (bar_index+4)*4, 4, &bar);
-        if (((bar >> 1) & 0b11) == 0x2)
-            DrvS_ReadPCIRegister(dev->info, (bar_index+5)*4, 4, (uint64_t*)(((uint32_t*)&bar) + 1));
-        bar &= ~0xf;
-        uint32_t bar_offset = bar_info & ~0x7;
-        handle->msi_capability = msix_offset;
-        handle->un.msix_entry = (uintptr_t)map_registers(bar+bar_offset, OBOS_PAGE_SIZE, true);
-        bar_info = 0; // 32-bit register
-        DrvS_ReadPCIRegister(dev->info, 8+msix_offset, 4, &bar_info);
-        bar_index = bar_info & 0x7;
-        bar = 0;
-        DrvS_ReadPCIRegister(dev->info, (bar_index+4)*4, 4, &bar);
-        if (((bar >> 1) & 0b11) == 0x2)
-            DrvS_ReadPCIRegister(dev->info, (bar_index+5)*4, 4, (uint64_t*)(((uint32_t*)&bar) + 1));
-        bar &= ~0xf;
-        bar_offset = bar_info & ~0x7;
-        handle->msix_pending_entry = (uintptr_t)map_registers(bar+bar_offset, OBOS_PAGE_SIZE, true);
-        uint32_t* entry = (uint32_t*)handle->un.msix_entry;
-        entry[0] = msi_address & UINT32_MAX;
-        entry[1] = msi_address >> 32;
-        entry[2] = msi_data;
-        entry[3] |= BIT(0); // masked
-        // Write back the header.
-        DrvS_WritePCIRegister(dev->info, msix_offset+0, 4, header);
-        return OBOS_STATUS_SUCCESS;
+        structures->next = s_msixStructures;
+        s_msixStructures = structures;
     }
-    if (has_msi)
+    Core_SpinlockRelease(&s_msixStructuresLock, oldIrql);
+    if (!found)
+        return structures;
+    unmap_registers((void*)structures->table, MSIX_TABLE_SIZE(nEntries));
+    unmap_registers((void*)structures->pba, MSIX_PBA_SIZE(nEntries));
+    OBOS_KernelAllocator->Free(OBOS_KernelAllocator, structures, sizeof(*structures));
+    return found;
+}
+// Programs and enables MSI-X table entry 'index' of a device.
+static obos_status register_msix_entry(irq* irq, const pci_device_node* dev, pci_irq_handle* handle, uint8_t msix_offset, uint16_t index, uint32_t processor)
+{
+    uint64_t header = 0; // 32-bit
+    DrvS_ReadPCIRegister(dev->info, msix_offset+0, 4, &header);
+    const size_t nEntries = ((header >> 16) & 0x7ff) + 1;
+    if (index >= nEntries)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    msix_structures* structures = get_msix_structures(dev, msix_offset, nEntries);
+    if (!structures)
+        return OBOS_STATUS_NOT_ENOUGH_MEMORY;
+    header |= BIT(31) /* Enable */;
+    handle->msi_capability = msix_offset;
+    handle->processor = processor;
+    handle->un.msix_entry = structures->table + MSIX_TABLE_SIZE(index);
+    handle->msix_pending_entry = structures->pba;
+    uint64_t msi_data = 0;
+    uint64_t msi_address = DrvS_MSIAddressAndData(&msi_data, irq->vector->id, processor, true, false);
+    uint32_t* entry = (uint32_t*)handle->un.msix_entry;
+    entry[0] = msi_address & UINT32_MAX;
+    entry[1] = msi_address >> 32;
+    entry[2] = msi_data;
+    entry[3] |= BIT(0); // masked
+    // Write back the header.
+    DrvS_WritePCIRegister(dev->info, msix_offset+0, 4, header);
+    return OBOS_STATUS_SUCCESS;
+}
+obos_status Drv_RegisterPCIIrq(irq* irq, const pci_device_node* dev, pci_irq_handle* handle)
+{
+    if (!irq || !dev || !handle)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    irq->irqChecker = nullptr;
+    irq->moveCallback = pci_irq_move_callback;
+    irq->irqMoveCallbackUserdata = handle;
+    handle->dev = dev->info;
+    handle->msi_capability = 0;
+    handle->processor = 0;
+    handle->un.msix_entry = 0;
+    uint8_t msix_offset = 0;
+    uint8_t msi_offset = 0;
+    if (!find_msi_capabilities(dev, &msi_offset, &msix_offset))
+        goto fallback;
+    // Prefer MSI-X over MSI.
+    if (msix_offset)
+        return register_msix_entry(irq, dev, handle, msix_offset, 0, 0);
+    if (msi_offset)
     {
         // Fallback to MSI.
+        uint64_t msi_data = 0;
+        uint64_t msi_address = DrvS_MSIAddressAndData(&msi_data, irq->vector->id, 0, true, false);
         uint64_t header = 0; // 32-bit
         DrvS_ReadPCIRegister(dev->info, msi_offset+0, 4, &header);
         handle->msi_capability = msi_offset;
@@ -198,6 +277,32 @@ obos_status Drv_RegisterPCIIrq(irq* irq, const pci_device_node* dev, pci_irq_han
     irq->irqCheckerUserdata = handle;
     return DrvS_RegisterIRQPin(dev, &handle->un.arch_handle, irq->vector->id);
 }
+size_t Drv_GetPCIMsixEntryCount(const pci_device_node* dev)
+{
+    if (!dev)
+        return 0;
+    uint8_t msix_offset = 0;
+    uint8_t msi_offset = 0;
+    if (!find_msi_capabilities(dev, &msi_offset, &msix_offset) || !msix_offset)
+        return 0;
+    uint64_t header = 0; // 32-bit
+    DrvS_ReadPCIRegister(dev->info, msix_offset+0, 4, &header);
+    return ((header >> 16) & 0x7ff) + 1;
+}
+obos_status Drv_RegisterPCIIrqMsixEntry(irq* irq, const pci_device_node* dev, pci_irq_handle* handle, uint16_t index, uint32_t processor)
+{
+    if (!irq || !dev || !handle)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    uint8_t msix_offset = 0;
+    uint8_t msi_offset = 0;
+    if (!find_msi_capabilities(dev, &msi_offset, &msix_offset) || !msix_offset)
+        return OBOS_STATUS_UNIMPLEMENTED;
+    irq->irqChecker = nullptr;
+    irq->moveCallback = pci_irq_move_callback;
+    irq->irqMoveCallbackUserdata = handle;
+    handle->dev = dev->info;
+    return register_msix_entry(irq, dev, handle, msix_offset, index, processor);
+}
 obos_status Drv_MaskPCIIrq(const pci_irq_handle* handle, bool mask)
 {
     if (!handle)
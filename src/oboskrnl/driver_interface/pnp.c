@@ -414,6 +414,7 @@ obos_status Drv_PnpLoadDriversAt(dirent* directory, bool wait)
             0, 0, 0,
             driver_file_hash, driver_file_compare, driver_file_free, nullptr);
     driver_header_list what = {};
+    VfsH_DirentPopulate(directory);
     for (dirent* ent = directory->d_children.head; ent; )
     {
         fd* file = Vfs_Calloc(1, sizeof(fd));
@@ -24,9 +24,8 @@
 #include <vfs/vnode.h>
 
 #include <utils/string.h>
+#include <utils/crc32.h>
 
-static uint32_t crc32_bytes_from_previous(void *data, size_t sz, uint32_t previousChecksum);
-static uint32_t crc32_bytes(void *data, size_t sz);
 obos_status OBOS_IdentifyGPTPartitions(fd *desc, partition *partition_list, size_t *nPartitions, bool allow_checksum_fail) 
 {
     if (!desc || (!partition_list && !nPartitions))
@@ -71,7 +70,7 @@ obos_status OBOS_IdentifyGPTPartitions(fd *desc, partition *partition_list, size
         (void)0;
         uint32_t hdr_checksum = hdr.checksum;
         hdr.checksum = 0;
-        uint32_t our_checksum = crc32_bytes(&hdr, sizeof(hdr));
+        uint32_t our_checksum = OBOS_Crc32(&hdr, sizeof(hdr));
         hdr.checksum = hdr_checksum;
         if (retried && our_checksum != hdr_checksum)
         {
@@ -120,7 +119,7 @@ obos_status OBOS_IdentifyGPTPartitions(fd *desc, partition *partition_list, size
         Vfs_FdRead(desc, buf+i*blkSize, blkSize*(i-nSectorsForPartitionTable), nullptr);
     if (!allow_checksum_fail)
     {
-        uint32_t entriesCRC32 = crc32_bytes(buf, blkSize * nSectorsForPartitionTable);
+        uint32_t entriesCRC32 = OBOS_Crc32(buf, blkSize * nSectorsForPartitionTable);
         if (entriesCRC32 != hdr.partition_entry_checksum)
         {
             Mm_VirtualMemoryFree(&Mm_KernelContext, buf, blkSize * nSectorsForPartitionTable);
@@ -164,41 +163,3 @@ obos_status OBOS_IdentifyGPTPartitions(fd *desc, partition *partition_list, size
     Mm_VirtualMemoryFree(&Mm_KernelContext, buf, blkSize * nSectorsForPartitionTable);
     return OBOS_STATUS_SUCCESS;
 }
-static bool initialized_crc32 = false;
-static uint32_t crctab[256];
-
-// For future reference, we cannot hardware-accelerate the crc32 algorithm as
-// x86-64's crc32 uses a different polynomial than that of GPT.
-
-static void crcInit() {
-  uint32_t crc = 0;
-  for (uint16_t i = 0; i < 256; ++i) {
-    crc = i;
-    for (uint8_t j = 0; j < 8; ++j) {
-      uint32_t mask = -(crc & 1);
-      crc = (crc >> 1) ^ (0xEDB88320 & mask);
-    }
-    crctab[i] = crc;
-  }
-}
-static uint32_t crc(const char *data, size_t len, uint32_t result) {
-  for (size_t i = 0; i < len; ++i)
-    result = (result >> 8) ^ crctab[(result ^ data[i]) & 0xFF];
-  return ~result;
-}
-static uint32_t crc32_bytes_from_previous(void *data, size_t sz,
-                                   uint32_t previousChecksum) {
-  if (!initialized_crc32) {
-    crcInit();
-    initialized_crc32 = true;
-  }
-  return crc((char *)data, sz, ~previousChecksum);
-}
-static uint32_t crc32_bytes(void *data, size_t sz)
-{
-  if (!initialized_crc32) {
-    crcInit();
-    initialized_crc32 = true;
-  }
-  return crc((char *)data, sz, ~0U);
-}
\ No newline at end of file
@@ -8,8 +8,6 @@
 #include <klog.h>
 #include <error.h>
 
-#include <utils/list.h>
-
 #include <irq/dpc.h>
 #include <irq/irql.h>
 
@@ -18,9 +16,103 @@
 
 #include <allocators/base.h>
 
-#include <locks/spinlock.h>
+#include <stdatomic.h>
+
+#ifdef __x86_64__
+#	define spinlock_hint() __builtin_ia32_pause()
+#elif defined(__m68k__)
+#	define spinlock_hint() asm("nop")
+#endif
+
+// DPCs go on the current CPU, unless it already has this many pending.
+#define DPC_LOCAL_QUEUE_LIMIT (16)
+// The amount of CPUs looked at to find the least busy one, when the current CPU can't take a DPC.
+#define DPC_TARGET_PROBES (4)
 
-LIST_GENERATE(dpc_queue, dpc, node);
+static const dpc_importance s_dispatchOrder[] = { DPC_IMPORTANCE_HIGH, DPC_IMPORTANCE_MEDIUM, DPC_IMPORTANCE_LOW };
+static _Atomic(size_t) s_nextProbe;
+
+static size_t pending(cpu_local* cpu)
+{
+    return atomic_load_explicit(&cpu->dpcs.nPending, memory_order_relaxed);
+}
+static bool allowed(const cpu_local* cpu, thread_affinity affinity)
+{
+    return affinity & CoreH_CPUIdToAffinity(cpu->id);
+}
+static cpu_local* select_target(thread_affinity affinity)
+{
+    cpu_local* local = CoreS_GetCPULocalPtr();
+    if (local && allowed(local, affinity) && pending(local) < DPC_LOCAL_QUEUE_LIMIT)
+        return local;
+    // Take the least busy of a few CPUs, starting somewhere else every time.
+    cpu_local* target = nullptr;
+    const size_t start = atomic_fetch_add_explicit(&s_nextProbe, 1, memory_order_relaxed);
+    for (size_t i = 0; i < DPC_TARGET_PROBES && i < Core_CpuCount; i++)
+    {
+        cpu_local* cpu = &Core_CpuInfo[(start + i) % Core_CpuCount];
+        if (allowed(cpu, affinity) && (!target || pending(cpu) < pending(target)))
+            target = cpu;
+    }
+    if (target)
+        return target;
+    // None of those CPUs are in the affinity, so look through all of them.
+    for (size_t i = 0; i < Core_CpuCount; i++)
+        if (allowed(&Core_CpuInfo[i], affinity) && (!target || pending(&Core_CpuInfo[i]) < pending(target)))
+            target = &Core_CpuInfo[i];
+    return target;
+}
+
+// Moves the DPCs other CPUs queued to the end of the queue's lists.
+// Must be called by the CPU that owns the queue, at IRQL_DISPATCH.
+static void take_incoming(dpc_queue* queue)
+{
+    for (dpc_importance i = 0; i <= DPC_IMPORTANCE_MAX; i++)
+    {
+        if (!atomic_load_explicit(&queue->incoming[i], memory_order_relaxed))
+            continue;
+        dpc* cur = atomic_exchange_explicit(&queue->incoming[i], nullptr, memory_order_acquire);
+        // The stack has the newest DPC first, so reverse it.
+        dpc* first = nullptr;
+        dpc* last = cur;
+        while (cur)
+        {
+            dpc* next = cur->next;
+            cur->next = first;
+            first = cur;
+            cur = next;
+        }
+        if (queue->tail[i])
+            queue->tail[i]->next = first;
+        else
+            queue->head[i] = first;
+        queue->tail[i] = last;
+    }
+}
+static dpc* pop(dpc_queue* queue)
+{
+    for (size_t i = 0; i < sizeof(s_dispatchOrder)/sizeof(*s_dispatchOrder); i++)
+    {
+        const dpc_importance importance = s_dispatchOrder[i];
+        dpc* cur = queue->head[importance];
+        if (!cur)
+            continue;
+        queue->head[importance] = cur->next;
+        if (!cur->next)
+            queue->tail[importance] = nullptr;
+        cur->next = nullptr;
+        return cur;
+    }
+    return nullptr;
+}
+static void push(cpu_local* target, dpc* dpc)
+{
+    _Atomic(struct dpc*)* stack = &target->dpcs.incoming[dpc->importance];
+    struct dpc* head = atomic_load_explicit(stack, memory_order_relaxed);
+    do {
+        dpc->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(stack, &head, dpc, memory_order_release, memory_order_relaxed));
+}
 
 dpc* CoreH_AllocateDPC(obos_status* status)
 {
@@ -30,43 +122,100 @@ dpc* CoreH_AllocateDPC(obos_status* status)
             *status = OBOS_STATUS_INVALID_INIT_PHASE;
         return nullptr;
     }
-    return OBOS_NonPagedPoolAllocator->Allocate(OBOS_NonPagedPoolAllocator, sizeof(dpc), status);
+    return OBOS_NonPagedPoolAllocator->ZeroAllocate(OBOS_NonPagedPoolAllocator, 1, sizeof(dpc), status);
 }
 obos_status CoreH_InitializeDPC(dpc* dpc, void(*handler)(struct dpc* obj, void* userdata), thread_affinity affinity)
 {
-    if (!dpc || !handler)
+    if (!dpc || !handler || dpc->importance > DPC_IMPORTANCE_MAX)
         return OBOS_STATUS_INVALID_ARGUMENT;
-    if (dpc->cpu)
+    if (atomic_load_explicit(&dpc->cpu, memory_order_relaxed))
         return OBOS_STATUS_DPC_ALREADY_ENQUEUED;
-        // if (LIST_IS_NODE_UNLINKED(dpc_queue, &dpc->cpu->dpcs, dpc))
     affinity &= Core_DefaultThreadAffinity;
     if (!affinity)
         affinity = Core_DefaultThreadAffinity;
-    dpc->handler = handler;
-    cpu_local* target = nullptr;
-    for (size_t i = 0; i < Core_CpuCount; i++)
-        if ((!target || Core_CpuInfo[i].dpcs.nNodes < target->dpcs.nNodes))
-            target = (affinity & CoreH_CPUIdToAffinity(Core_CpuInfo[i].id)) ? &Core_CpuInfo[i] : nullptr;
+    cpu_local* target = select_target(affinity);
     // If this fails, something stupid has happened.
     OBOS_ASSERT(target);
-    dpc->cpu = target;
-    irql oldIrql = Core_SpinlockAcquire(&target->dpc_queue_lock);
-    LIST_PREPEND(dpc_queue, &target->dpcs, dpc);
-    Core_SpinlockRelease(&target->dpc_queue_lock, oldIrql);
+    // Another CPU could be queueing the DPC at the same time.
+    struct cpu_local* expected = nullptr;
+    if (!atomic_compare_exchange_strong(&dpc->cpu, &expected, target))
+        return OBOS_STATUS_DPC_ALREADY_ENQUEUED;
+    dpc->handler = handler;
+    atomic_store_explicit(&dpc->cancelled, false, memory_order_relaxed);
+    // Counted before it is visible, so that the count never goes below zero.
+    atomic_fetch_add(&target->dpcs.nPending, 1);
+    push(target, dpc);
+    if (dpc->importance != DPC_IMPORTANCE_LOW)
+        CoreS_WakeIdleCPU(target);
     return OBOS_STATUS_SUCCESS;
 }
+// Must be called at IRQL_DISPATCH, on the CPU the DPC is queued on.
+static void remove_local(cpu_local* cpu, dpc* dpc)
+{
+    dpc_queue* queue = &cpu->dpcs;
+    take_incoming(queue);
+    struct dpc* prev = nullptr;
+    struct dpc* cur = queue->head[dpc->importance];
+    for (; cur && cur != dpc; prev = cur, cur = cur->next)
+        ;
+    if (!cur)
+        return;
+    if (prev)
+        prev->next = dpc->next;
+    else
+        queue->head[dpc->importance] = dpc->next;
+    if (queue->tail[dpc->importance] == dpc)
+        queue->tail[dpc->importance] = prev;
+    dpc->next = nullptr;
+    atomic_fetch_sub(&queue->nPending, 1);
+    atomic_store(&dpc->cpu, nullptr);
+}
 obos_status CoreH_FreeDPC(dpc* dpc, bool dealloc)
 {
     if (!dpc)
         return OBOS_STATUS_INVALID_ARGUMENT;
-    if (!dpc->handler || !dpc->cpu)
+    if (!dpc->handler)
         return OBOS_STATUS_UNINITIALIZED;
-    if (!LIST_IS_NODE_UNLINKED(dpc_queue, &dpc->cpu->dpcs, dpc))
+    irql oldIrql = Core_GetIrql() < IRQL_DISPATCH ? Core_RaiseIrql(IRQL_DISPATCH) : IRQL_INVALID;
+    cpu_local* cpu = atomic_load(&dpc->cpu);
+    const bool local = cpu && cpu == CoreS_GetCPULocalPtr();
+    if (local)
+        remove_local(cpu, dpc);
+    if (oldIrql != IRQL_INVALID)
+        Core_LowerIrql(oldIrql);
+    if (cpu && !local)
     {
-        irql oldIrql = Core_SpinlockAcquire(&dpc->cpu->dpc_queue_lock);
-        LIST_REMOVE(dpc_queue, &dpc->cpu->dpcs, dpc);
-        Core_SpinlockRelease(&dpc->cpu->dpc_queue_lock, oldIrql);
-        dpc->cpu = nullptr;
+        // The DPC can't be taken off another CPU's queue, so wait for that CPU to skip it.
+        // The caller has stopped queueing the DPC, so once it is off every queue, it stays off.
+        atomic_store(&dpc->cancelled, true);
+        CoreS_WakeIdleCPU(cpu);
+        while (atomic_load(&dpc->cpu))
+            spinlock_hint();
     }
     return dealloc ? OBOS_NonPagedPoolAllocator->Free(OBOS_NonPagedPoolAllocator, dpc, sizeof(*dpc)) : OBOS_STATUS_SUCCESS;
-}
\ No newline at end of file
+}
+OBOS_NO_UBSAN OBOS_NO_KASAN bool CoreH_DispatchDPCs()
+{
+    // Run pending DPCs on the current CPU.
+    dpc_queue* queue = &CoreS_GetCPULocalPtr()->dpcs;
+    take_incoming(queue);
+    for (size_t budget = DPC_DISPATCH_BUDGET; budget; budget--)
+    {
+        dpc* cur = pop(queue);
+        if (!cur)
+        {
+            take_incoming(queue);
+            if (!(cur = pop(queue)))
+                return false;
+        }
+        void(*handler)(struct dpc* dpc, void* userdata) = cur->handler;
+        void* userdata = cur->userdata;
+        const bool cancelled = atomic_load(&cur->cancelled);
+        atomic_fetch_sub(&queue->nPending, 1);
+        // After this, the DPC can be queued again, or freed.
+        atomic_store_explicit(&cur->cpu, nullptr, memory_order_release);
+        if (!cancelled)
+            handler(cur, userdata);
+    }
+    return atomic_load(&queue->nPending) != 0;
+}
@@ -9,23 +9,57 @@
 #include <int.h>
 #include <error.h>
 
-#include <utils/list.h>
-
 #include <scheduler/thread.h>
 
-typedef LIST_HEAD(dpc_queue, struct dpc) dpc_queue;
-LIST_PROTOTYPE(dpc_queue, struct dpc, node);
+#include <stdatomic.h>
+
+typedef enum dpc_importance
+{
+    // The default, so that zeroed DPCs get it.
+    DPC_IMPORTANCE_MEDIUM,
+    // Run before any other DPC on the target CPU.
+    DPC_IMPORTANCE_HIGH,
+    // Run after every other DPC, and doesn't wake up the target CPU if it is idle.
+    DPC_IMPORTANCE_LOW,
+    DPC_IMPORTANCE_MAX = DPC_IMPORTANCE_LOW,
+} dpc_importance;
+
+// A queue of DPCs for a CPU.
+// Any CPU can queue a DPC without taking a lock, but only the CPU that owns the queue can run or remove them.
+typedef struct dpc_queue
+{
+    // Stacks of DPCs that were queued but not yet taken by the owning CPU, one per importance.
+    _Atomic(struct dpc*) incoming[DPC_IMPORTANCE_MAX + 1];
+    // DPCs that were taken from 'incoming', in the order they were queued.
+    // Only touched by the owning CPU, at IRQL_DISPATCH.
+    struct dpc* head[DPC_IMPORTANCE_MAX + 1];
+    struct dpc* tail[DPC_IMPORTANCE_MAX + 1];
+    // The amount of DPCs queued on the CPU that haven't run yet.
+    _Atomic(size_t) nPending;
+} dpc_queue;
 
 typedef struct dpc
 {
-    LIST_NODE(dpc_queue, struct dpc) node;
+    struct dpc* next;
     // The handler mustn't ever lower the irql below IRQL_DISPATCH
     // This is called at IRQL_DISPATCH.
     void(*handler)(struct dpc* dpc, void* userdata);
     void* userdata;
-    struct cpu_local* cpu;
+    // The CPU the DPC is queued on, or nullptr if it isn't queued.
+    // This is cleared right before the handler is called, so the DPC can queue itself again.
+    _Atomic(struct cpu_local*) cpu;
+    // Set before queueing the DPC.
+    dpc_importance importance;
+    // Set by CoreH_FreeDPC for DPCs queued on another CPU, which then skips it.
+    _Atomic(bool) cancelled;
 } dpc;
 
+// The maximum amount of DPCs run by CoreH_DispatchDPCs before it lets interrupts in.
+#define DPC_DISPATCH_BUDGET (32)
+
 OBOS_EXPORT dpc* CoreH_AllocateDPC(obos_status* status);
+// Queues 'dpc' on one of the CPUs in 'affinity', preferring the current CPU, and otherwise the least busy one.
 OBOS_EXPORT obos_status CoreH_InitializeDPC(dpc* dpc, void(*handler)(struct dpc* obj, void* userdata), thread_affinity affinity);
-OBOS_EXPORT obos_status CoreH_FreeDPC(dpc* dpc, bool dealloc);
\ No newline at end of file
+// Dequeues 'dpc' if it is queued, waiting for its CPU to drop it if it's queued on another CPU.
+// Whatever queues the DPC (including its own handler) must have stopped doing so before this is called.
+OBOS_EXPORT obos_status CoreH_FreeDPC(dpc* dpc, bool dealloc);
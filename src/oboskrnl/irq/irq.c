@@ -33,6 +33,13 @@ void Core_IRQDispatcher(interrupt_frame* frame)
 {
 #if !OBOS_ARCH_EMULATED_IRQL
 	irql irql_ = OBOS_IRQ_VECTOR_ID_TO_IRQL(frame->vector);
+	// The IRQL is only raised in hardware once an IRQ comes in at too high of an IRQL,
+	// so defer the IRQ until the IRQL is lowered.
+	if (irql_ <= Core_GetIrql())
+	{
+		CoreS_DeferIRQ(frame);
+		return;
+	}
 	irql oldIrql2 = Core_RaiseIrqlNoThread(irql_);
 	if (!CoreS_EnterIRQHandler(frame))
 		return;
@@ -181,6 +181,13 @@ OBOS_WEAK void CoreS_SendEOI(interrupt_frame* frame);
 /// <returns>Whether the IRQ dispatcher should continue running or not. This could be useful for e.g., IRQL emulation.</returns>
 OBOS_WEAK bool CoreS_EnterIRQHandler(interrupt_frame* frame);
 /// <summary>
+/// Defers an IRQ that came in while the IRQL was at or above the IRQL of its vector.<para/>
+/// The IRQ should be dispatched again once the IRQL is lowered below the vector's IRQL.<para/>
+/// Only used by architectures that don't emulate the IRQL, but raise it lazily.
+/// </summary>
+/// <param name="frame">The interrupt frame.</param>
+OBOS_WEAK void CoreS_DeferIRQ(interrupt_frame* frame);
+/// <summary>
 /// Exits an IRQ handler.
 /// </summary>
 /// <param name="frame">The interrupt frame.</param>
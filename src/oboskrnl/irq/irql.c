@@ -17,6 +17,8 @@
 
 #include <utils/list.h>
 
+#include <stdatomic.h>
+
 irql s_irql = IRQL_MASKED;
 
 OBOS_NO_UBSAN OBOS_NO_KASAN irql* Core_GetIRQLVar()
@@ -39,28 +41,22 @@ OBOS_NO_UBSAN OBOS_NO_KASAN void Core_LowerIrql(irql to)
 	if (Core_GetCurrentThread())
 		CoreS_SetThreadIRQL(&Core_GetCurrentThread()->context, to);
 }
-OBOS_NO_UBSAN OBOS_NO_KASAN void CoreH_DispatchDPCs()
-{
-	// Run pending DPCs on the current CPU.
-	for (dpc* cur = LIST_GET_HEAD(dpc_queue, &CoreS_GetCPULocalPtr()->dpcs); cur; )
-	{
-		dpc* next = LIST_GET_NEXT(dpc_queue, &CoreS_GetCPULocalPtr()->dpcs, cur);
-		LIST_REMOVE(dpc_queue, &CoreS_GetCPULocalPtr()->dpcs, cur);
-		cur->cpu = nullptr;
-		cur->handler(cur, cur->userdata);
-		cur = next;
-	}
-}
 OBOS_NO_UBSAN OBOS_NO_KASAN void Core_LowerIrqlNoThread(irql to)
 {
 	Core_LowerIrqlNoDPCDispatch(to);
-	if (to < IRQL_DISPATCH && CoreS_GetCPULocalPtr())
+	if (to >= IRQL_DISPATCH || !CoreS_GetCPULocalPtr())
+		return;
+	// Run the DPCs in batches, letting interrupts in between them.
+	// Whatever is left after a few batches is run the next time the IRQL is lowered.
+	for (size_t pass = 0; pass < 4 && atomic_load_explicit(&CoreS_GetCPULocalPtr()->dpcs.nPending, memory_order_relaxed); pass++)
 	{
 		CoreS_SetIRQL(IRQL_DISPATCH, to);
 		*Core_GetIRQLVar() = IRQL_DISPATCH;
-		CoreH_DispatchDPCs();
+		bool more = CoreH_DispatchDPCs();
 		*Core_GetIRQLVar() = to;
 		CoreS_SetIRQL(to, IRQL_DISPATCH);
+		if (!more)
+			break;
 	}
 }
 OBOS_NO_UBSAN OBOS_NO_KASAN void Core_LowerIrqlNoDPCDispatch(irql to)
@@ -48,7 +48,8 @@ enum
 };
 
 // Internal-use only pls
-void CoreH_DispatchDPCs();
+// Returns true if DPCs are still pending after it ran as many as it could.
+bool CoreH_DispatchDPCs();
 /// <summary>
 /// Lowers the IRQL. Panics if 'to' > Core_GetIrql().
 /// </summary>
@@ -82,14 +83,14 @@ OBOS_EXPORT irql Core_GetIrql();
 
 /// <summary>
 /// Sets the current IRQL in the IRQ controller.<para/>
-/// For example, this would set the cr8 register to 'to' on x86_64.
+/// For example, this would set the cr8 register to 'to' on x86_64, though it is only written when the IRQL is lowered there.
 /// </summary>
 /// <param name="to">The IRQL to set the current IRQL to.</param>
 /// <param name="old">The old IRQL.</param>
 OBOS_WEAK void CoreS_SetIRQL(uint8_t to, uint8_t old);
 /// <summary>
 /// Sets the current IRQL in the IRQ controller.<para/>
-/// For example, this would return the cr8 register on x86_64.
+/// On x86_64, this is the software IRQL, since cr8 is raised lazily.
 /// </summary>
 /// <returns>The current IRQL.</returns>
 OBOS_WEAK uint8_t CoreS_GetIRQL();
\ No newline at end of file
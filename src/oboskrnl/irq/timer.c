@@ -51,8 +51,8 @@ OBOS_NO_KASAN OBOS_NO_UBSAN static void timer_irq(struct irq* i, interrupt_frame
 #ifdef OBOS_TIMER_IS_DEADLINE
     CoreS_ResetTimer();
 #endif
-    if (!work->cpu || LIST_IS_NODE_UNLINKED(dpc_queue, &work->cpu->dpcs, work))
-        CoreH_InitializeDPC(work, timer_dispatcher, Core_DefaultThreadAffinity);
+    // Fails with OBOS_STATUS_DPC_ALREADY_ENQUEUED if the last tick wasn't handled yet.
+    CoreH_InitializeDPC(work, timer_dispatcher, Core_DefaultThreadAffinity);
 }
 static void notify_timer_dpc(dpc* dpc, void* userdata)
 {
@@ -0,0 +1,121 @@
+/*
+ * oboskrnl/locks/rwlock.c
+ *
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+#include <int.h>
+#include <klog.h>
+#include <error.h>
+
+#include <scheduler/thread.h>
+#include <scheduler/schedule.h>
+
+#include <locks/rwlock.h>
+#include <locks/spinlock.h>
+#include <locks/wait.h>
+
+#include <irq/irql.h>
+
+// The waitable header is used as a sticky "the lock might be free now" flag.
+// A thread that has to wait clears it while still holding the spinlock, so a release that happens
+// between the check and the wait sets it again, and the wait returns immediately instead of being lost.
+static obos_status wait_for_release(rwlock* lock, irql oldIrql)
+{
+    // Set here rather than at initialization, so a zeroed rwlock is valid.
+    lock->hdr.use_signaled = true;
+    CoreH_ClearSignaledState(&lock->hdr);
+    Core_SpinlockRelease(&lock->lock, oldIrql);
+    return Core_WaitOnObject(&lock->hdr);
+}
+obos_status Core_RwLockAcquireShared(rwlock* lock)
+{
+    if (!lock)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    OBOS_ASSERT(Core_GetIrql() <= IRQL_DISPATCH);
+    if (Core_GetIrql() > IRQL_DISPATCH)
+        return OBOS_STATUS_INVALID_IRQL;
+    OBOS_ASSERT(lock->writer != Core_GetCurrentThread());
+    while (1)
+    {
+        irql oldIrql = Core_SpinlockAcquire(&lock->lock);
+        if (!lock->writer && !lock->nWaitingWriters)
+        {
+            lock->nReaders++;
+            Core_SpinlockRelease(&lock->lock, oldIrql);
+            return OBOS_STATUS_SUCCESS;
+        }
+        obos_status status = wait_for_release(lock, oldIrql);
+        if (obos_is_error(status))
+            return status;
+    }
+}
+obos_status Core_RwLockAcquireExclusive(rwlock* lock)
+{
+    if (!lock)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    OBOS_ASSERT(Core_GetIrql() <= IRQL_DISPATCH);
+    if (Core_GetIrql() > IRQL_DISPATCH)
+        return OBOS_STATUS_INVALID_IRQL;
+    OBOS_ASSERT(lock->writer != Core_GetCurrentThread());
+    bool waiting = false;
+    while (1)
+    {
+        irql oldIrql = Core_SpinlockAcquire(&lock->lock);
+        if (!lock->writer && !lock->nReaders)
+        {
+            if (waiting)
+                lock->nWaitingWriters--;
+            lock->writer = Core_GetCurrentThread();
+            Core_SpinlockRelease(&lock->lock, oldIrql);
+            return OBOS_STATUS_SUCCESS;
+        }
+        if (!waiting)
+        {
+            // New readers now wait behind us.
+            lock->nWaitingWriters++;
+            waiting = true;
+        }
+        obos_status status = wait_for_release(lock, oldIrql);
+        if (obos_is_error(status))
+        {
+            oldIrql = Core_SpinlockAcquire(&lock->lock);
+            lock->nWaitingWriters--;
+            Core_SpinlockRelease(&lock->lock, oldIrql);
+            CoreH_SignalWaitingThreads(&lock->hdr, true, false);
+            return status;
+        }
+    }
+}
+obos_status Core_RwLockReleaseShared(rwlock* lock)
+{
+    if (!lock)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    irql oldIrql = Core_SpinlockAcquire(&lock->lock);
+    OBOS_ASSERT(lock->nReaders);
+    if (!lock->nReaders)
+    {
+        Core_SpinlockRelease(&lock->lock, oldIrql);
+        return OBOS_STATUS_INVALID_OPERATION;
+    }
+    const bool wake = !(--lock->nReaders);
+    Core_SpinlockRelease(&lock->lock, oldIrql);
+    // Only a writer can be waiting on a lock held shared.
+    if (wake)
+        return CoreH_SignalWaitingThreads(&lock->hdr, true, false);
+    return OBOS_STATUS_SUCCESS;
+}
+obos_status Core_RwLockReleaseExclusive(rwlock* lock)
+{
+    if (!lock)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    irql oldIrql = Core_SpinlockAcquire(&lock->lock);
+    if (lock->writer != Core_GetCurrentThread())
+    {
+        Core_SpinlockRelease(&lock->lock, oldIrql);
+        return OBOS_STATUS_ACCESS_DENIED;
+    }
+    lock->writer = nullptr;
+    Core_SpinlockRelease(&lock->lock, oldIrql);
+    return CoreH_SignalWaitingThreads(&lock->hdr, true, false);
+}
@@ -0,0 +1,37 @@
+/*
+ * oboskrnl/locks/rwlock.h
+ *
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+#pragma once
+
+#include <int.h>
+#include <error.h>
+
+#include <scheduler/thread.h>
+
+#include <locks/spinlock.h>
+#include <locks/wait.h>
+
+// A reader/writer lock.
+// Any amount of threads can hold the lock shared, or one thread can hold it exclusively.
+// Writers are preferred, so that a steady stream of readers cannot starve them.
+// A zero-initialized rwlock is valid, and unlocked.
+typedef struct rwlock {
+    struct waitable_header hdr;
+    spinlock lock;
+    // The amount of threads that hold the lock shared.
+    size_t nReaders;
+    // The amount of threads waiting to take the lock exclusively.
+    size_t nWaitingWriters;
+    // The thread that holds the lock exclusively, if any.
+    thread* writer;
+} rwlock;
+
+#define RWLOCK_INITIALIZE() (rwlock){ .hdr=WAITABLE_HEADER_INITIALIZE(false, true) }
+
+OBOS_EXPORT obos_status Core_RwLockAcquireShared(rwlock* lock);
+OBOS_EXPORT obos_status Core_RwLockAcquireExclusive(rwlock* lock);
+OBOS_EXPORT obos_status Core_RwLockReleaseShared(rwlock* lock);
+OBOS_EXPORT obos_status Core_RwLockReleaseExclusive(rwlock* lock);
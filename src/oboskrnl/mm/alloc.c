@@ -213,6 +213,9 @@ void* Mm_VirtualMemoryAlloc(context* ctx, void* base_, size_t size, prot_flags p
         reg->ctx = ctx;
         LIST_APPEND(mapped_region_list, &reg->owner->mapped_regions, reg);
     }
+    // Untouched anonymous memory is backed by the zero page until it is first written.
+    // Non-paged memory can't take the fault, and huge pages would need a huge zero page.
+    const bool zeroFill = !file && Mm_ZeroPage && !(flags & (VMA_FLAGS_RESERVE|VMA_FLAGS_NON_PAGED|VMA_FLAGS_HUGE_PAGE));
     what = (page){};
     for (size_t i = 0; i < nNodes; i++)
     {
@@ -238,8 +241,13 @@ void* Mm_VirtualMemoryAlloc(context* ctx, void* base_, size_t size, prot_flags p
         if (node->reserved && !(flags & VMA_FLAGS_RESERVE))
             ctx->stat.reserved -= (node->prot.huge_page) ? OBOS_HUGE_PAGE_SIZE : OBOS_PAGE_SIZE;
         node->reserved = flags & VMA_FLAGS_RESERVE;
-        if (!file)
-            phys = node->reserved ? 0 : Mm_AllocatePhysicalPages(pgSize/OBOS_PAGE_SIZE, pgSize/OBOS_PAGE_SIZE, &status);
+        if (zeroFill)
+        {
+            phys = Mm_ZeroPage;
+            node->cow = true;
+        }
+        else if (!file)
+            phys = node->reserved ? 0 : Mm_AllocatePhysicalPagesEx(pgSize/OBOS_PAGE_SIZE, pgSize/OBOS_PAGE_SIZE, PHYS_ALLOC_ZEROED, &status);
         else
         {
             // If this is a private mapping...
@@ -249,13 +257,13 @@ void* Mm_VirtualMemoryAlloc(context* ctx, void* base_, size_t size, prot_flags p
                 page what = { .addr=(uintptr_t)pagecache_base };
                 page* pc_page = RB_FIND(page_tree, &Mm_KernelContext.pages, &what);
                 OBOSS_GetPagePhysicalAddress(pagecache_base, &phys);
+                // The page cache keeps its own reference.
+                Mm_ReferencePhysicalPage(phys);
+                node->isPrivateMapping = true;
                 if (!(prot & OBOS_PROTECTION_READ_ONLY))
                 {
-                    if (pc_page->next_copied_page)
-                        pc_page->next_copied_page->prev_copied_page = node;
-                    node->next_copied_page = pc_page->next_copied_page;
-                    node->prev_copied_page = pc_page;
-                    pc_page->next_copied_page = node;
+                    node->cow = true;
+                    pc_page->cow = true;
                     pc_page->prot.rw = false;
                     pc_page->prot.present = true;
                     MmS_SetPageMapping(Mm_KernelContext.pt, pc_page, phys);
@@ -287,6 +295,8 @@ void* Mm_VirtualMemoryAlloc(context* ctx, void* base_, size_t size, prot_flags p
             }
             if (!(flags & VMA_FLAGS_PRIVATE) && file)
                 node->prot.rw = false; // force it off so that we can mark dirty pages.
+            if (zeroFill)
+                node->prot.rw = false;
             node->prot.executable = prot & OBOS_PROTECTION_EXECUTABLE;
             node->prot.user = prot & OBOS_PROTECTION_USER_PAGE;
             node->prot.ro = prot & OBOS_PROTECTION_READ_ONLY;
@@ -305,6 +315,7 @@ void* Mm_VirtualMemoryAlloc(context* ctx, void* base_, size_t size, prot_flags p
                     RB_REMOVE(page_tree, &ctx->pages, nodes[j]);
                     Mm_Allocator->Free(Mm_Allocator, nodes[j], sizeof(page));
                 }
+                ctx->lastLookup = nullptr;
                 if (reg)
                     Mm_Allocator->Free(Mm_Allocator, reg, sizeof(*reg));
                 Core_SpinlockRelease(&ctx->lock, oldIrql);
@@ -313,22 +324,22 @@ void* Mm_VirtualMemoryAlloc(context* ctx, void* base_, size_t size, prot_flags p
                 set_statusp(ustatus, status);
                 return nullptr;
             }
-            if (node->prot.present && !(prot & OBOS_PROTECTION_READ_ONLY) && !file)
-                memzero((void*)node->addr, pgSize);
         }
         currFileOff += pgSize;
         currSize -= pgSize;
         RB_INSERT(page_tree, &ctx->pages, node);
     }
     // Page out each page so we don't explode.
+    // Pages backed by the zero page don't use any memory, so there is nothing to page out.
     // TODO: Error handling?
-    for (size_t i = 0; i < nNodes && !(flags & (VMA_FLAGS_NON_PAGED|VMA_FLAGS_RESERVE)); i++)
+    for (size_t i = 0; i < nNodes && !(flags & (VMA_FLAGS_NON_PAGED|VMA_FLAGS_RESERVE)) && !zeroFill; i++)
         Mm_SwapOut(nodes[i]);
     if (!(flags & VMA_FLAGS_RESERVE))
     {
         if (!(flags & VMA_FLAGS_NON_PAGED))
         {
-            ctx->stat.paged += size;
+            if (!zeroFill)
+                ctx->stat.paged += size;
             ctx->stat.pageable += size;
         }
         else
@@ -402,6 +413,19 @@ obos_status Mm_VirtualMemoryFree(context* ctx, void* base_, size_t size)
 
     irql oldIrql = Core_SpinlockAcquireExplicit(&ctx->lock, IRQL_DISPATCH, true);
 
+    // A device might still be reading or writing pages pinned for DMA, so they can't be freed.
+    curr = baseNode;
+    for (uintptr_t addr = base; curr && addr < (base + size); addr += offset)
+    {
+        if (curr->pinCount)
+        {
+            Core_SpinlockRelease(&ctx->lock, oldIrql);
+            return OBOS_STATUS_IN_USE;
+        }
+        offset = curr->prot.huge_page ? OBOS_HUGE_PAGE_SIZE : OBOS_PAGE_SIZE;
+        curr = RB_NEXT(page_tree, &ctx->pages, curr);
+    }
+
     offset = 0;
     curr = nullptr;
     page* next = nullptr;
@@ -420,6 +444,8 @@ obos_status Mm_VirtualMemoryFree(context* ctx, void* base_, size_t size)
         }
 
         RB_REMOVE(page_tree, &ctx->pages, curr);
+        if (ctx->lastLookup == curr)
+            ctx->lastLookup = nullptr;
         if (curr->region && !LIST_IS_NODE_UNLINKED(mapped_region_list, &curr->region->owner->mapped_regions, curr->region))
             LIST_REMOVE(mapped_region_list, &curr->region->owner->mapped_regions, curr->region);
         if (curr->ln_node.next || curr->ln_node.prev || &curr->ln_node == ctx->referenced.head || &curr->ln_node == ctx->workingSet.pages.head)
@@ -440,20 +466,14 @@ obos_status Mm_VirtualMemoryFree(context* ctx, void* base_, size_t size)
         {
             uintptr_t phys = 0;
             OBOSS_GetPagePhysicalAddress((void*)curr->addr, &phys);
-            if (!curr->region && !curr->isPrivateMapping)
-                Mm_FreePhysicalPages(phys, (curr->prot.huge_page ? OBOS_HUGE_PAGE_SIZE : OBOS_PAGE_SIZE) / OBOS_PAGE_SIZE);
+            if ((!curr->region || curr->isPrivateMapping) && !curr->borrowed)
+                Mm_DereferencePhysicalPages(phys, (curr->prot.huge_page ? OBOS_HUGE_PAGE_SIZE : OBOS_PAGE_SIZE) / OBOS_PAGE_SIZE);
         }
         else 
         {
             if (curr->pageable)
                 ctx->stat.paged -= (curr->prot.huge_page ? OBOS_HUGE_PAGE_SIZE : OBOS_PAGE_SIZE);
         }
-        if (curr->prev_copied_page)
-            curr->prev_copied_page->next_copied_page = curr->next_copied_page;
-        if (curr->next_copied_page)
-            curr->next_copied_page->prev_copied_page = curr->prev_copied_page;
-        curr->next_copied_page = nullptr;
-        curr->prev_copied_page = nullptr;
         if (curr->allocated)
             Mm_Allocator->Free(Mm_Allocator, curr, sizeof(*curr));
         offset = curr->prot.huge_page ? OBOS_HUGE_PAGE_SIZE : OBOS_PAGE_SIZE;
@@ -463,7 +483,7 @@ obos_status Mm_VirtualMemoryFree(context* ctx, void* base_, size_t size)
     struct page current = {};
     for (uintptr_t addr = base; addr < (base + size); addr += offset)
     {
-        MmS_QueryPageInfo(ctx->pt, addr, &current);
+        MmS_QueryPageInfo(ctx->pt, addr, &current, nullptr);
         if (current.prot.present)
         {
             current.prot.present = false;
@@ -495,7 +515,7 @@ obos_status Mm_VirtualMemoryProtect(context* ctx, void* base_, size_t size, prot
     irql oldIrql = Core_SpinlockAcquireExplicit(&ctx->lock, IRQL_DISPATCH, true);
 
     uintptr_t offset = 0;
-    page* baseNode = RB_FIND(page_tree, &ctx->pages, &what); 
+    page* baseNode = MmH_LookupPage(ctx, base); 
     if (!baseNode)
     {
         Core_SpinlockRelease(&ctx->lock, oldIrql);
@@ -514,6 +534,12 @@ obos_status Mm_VirtualMemoryProtect(context* ctx, void* base_, size_t size, prot
             Core_SpinlockRelease(&ctx->lock, oldIrql);
             return OBOS_STATUS_NOT_FOUND;
         }
+        // The device could be relying on the mapping of a page pinned for DMA.
+        if (curr->pinCount)
+        {
+            Core_SpinlockRelease(&ctx->lock, oldIrql);
+            return OBOS_STATUS_IN_USE;
+        }
         offset = curr->prot.huge_page ? OBOS_HUGE_PAGE_SIZE : OBOS_PAGE_SIZE;
     }
 
@@ -570,6 +596,9 @@ obos_status Mm_VirtualMemoryProtect(context* ctx, void* base_, size_t size, prot
         }
         if (isPageable < 2)
             curr->pageable = isPageable;
+        // Shared frames stay read-only until the first write copies them.
+        if (curr->cow)
+            curr->prot.rw = false;
         uintptr_t phys = 0;
         // TODO: Use a function that takes in a context.
         OBOSS_GetPagePhysicalAddress((void*)curr->addr, &phys);
@@ -581,4 +610,76 @@ obos_status Mm_VirtualMemoryProtect(context* ctx, void* base_, size_t size, prot
     Core_SpinlockRelease(&ctx->lock, oldIrql);
 
     return OBOS_STATUS_SUCCESS;
-}
\ No newline at end of file
+}
+obos_status Mm_VirtualMemoryMapBorrowed(context* ctx, void* at, uintptr_t phys)
+{
+    if (!ctx || !at || ((uintptr_t)at % OBOS_PAGE_SIZE) || (phys % OBOS_PAGE_SIZE))
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    irql oldIrql = Core_SpinlockAcquireExplicit(&ctx->lock, IRQL_DISPATCH, true);
+    page* node = MmH_LookupPage(ctx, (uintptr_t)at);
+    if (!node || !node->reserved || node->prot.huge_page)
+    {
+        Core_SpinlockRelease(&ctx->lock, oldIrql);
+        return node ? OBOS_STATUS_IN_USE : OBOS_STATUS_NOT_FOUND;
+    }
+    node->reserved = false;
+    node->borrowed = true;
+    node->pageable = false;
+    node->prot.present = true;
+    node->prot.rw = false;
+    node->prot.ro = true;
+    obos_status status = MmS_SetPageMapping(ctx->pt, node, phys);
+    if (obos_is_error(status))
+    {
+        node->reserved = true;
+        node->borrowed = false;
+        node->prot.present = false;
+        Core_SpinlockRelease(&ctx->lock, oldIrql);
+        return status;
+    }
+    ctx->stat.reserved -= OBOS_PAGE_SIZE;
+    ctx->stat.nonPaged += OBOS_PAGE_SIZE;
+    ctx->stat.committedMemory += OBOS_PAGE_SIZE;
+    Core_SpinlockRelease(&ctx->lock, oldIrql);
+    return OBOS_STATUS_SUCCESS;
+}
+obos_status Mm_VirtualMemoryDecommitPage(context* ctx, void* at)
+{
+    if (!ctx || !at || ((uintptr_t)at % OBOS_PAGE_SIZE))
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    irql oldIrql = Core_SpinlockAcquireExplicit(&ctx->lock, IRQL_DISPATCH, true);
+    page* node = MmH_LookupPage(ctx, (uintptr_t)at);
+    if (!node)
+    {
+        Core_SpinlockRelease(&ctx->lock, oldIrql);
+        return OBOS_STATUS_NOT_FOUND;
+    }
+    if (node->reserved)
+    {
+        Core_SpinlockRelease(&ctx->lock, oldIrql);
+        return OBOS_STATUS_SUCCESS;
+    }
+    // Anything that might still be using the physical page keeps it alive.
+    // Pageable pages are refused too, since they might be in a working set.
+    if (node->prot.huge_page || node->pageable || node->pagedOut || !node->prot.present || node->pinCount || node->isGuardPage ||
+        node->region)
+    {
+        Core_SpinlockRelease(&ctx->lock, oldIrql);
+        return OBOS_STATUS_IN_USE;
+    }
+    uintptr_t phys = 0;
+    OBOSS_GetPagePhysicalAddress(at, &phys);
+    node->prot.present = false;
+    MmS_SetPageMapping(ctx->pt, node, 0);
+    // If the page is shared copy-on-write, this only drops our reference.
+    if (!node->borrowed)
+        Mm_DereferencePhysicalPages(phys, 1);
+    node->cow = false;
+    ctx->stat.nonPaged -= OBOS_PAGE_SIZE;
+    ctx->stat.committedMemory -= OBOS_PAGE_SIZE;
+    ctx->stat.reserved += OBOS_PAGE_SIZE;
+    node->borrowed = false;
+    node->reserved = true;
+    Core_SpinlockRelease(&ctx->lock, oldIrql);
+    return OBOS_STATUS_SUCCESS;
+}
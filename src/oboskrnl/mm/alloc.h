@@ -68,10 +68,20 @@ OBOS_EXPORT void* MmH_FindAvailableAddress(context* ctx, size_t size, vma_flags
 // file can be nullptr for a anonymous mapping.
 OBOS_EXPORT void* Mm_VirtualMemoryAlloc(context* ctx, void* base, size_t size, prot_flags prot, vma_flags flags, fd* file, obos_status* status);
 // Note: base must be the exact address as returned by AllocateVirtualMemory.
+// Fails with OBOS_STATUS_IN_USE if any of the pages are pinned for DMA.
 OBOS_EXPORT obos_status Mm_VirtualMemoryFree(context* ctx, void* base, size_t size);
 // Note: base must be the exact address as returned by AllocateVirtualMemory.
 // isPageable values:
 // 0: Non-pageable
 // 1: Pageable
 // >1: Same as previous value.
+// Fails with OBOS_STATUS_IN_USE if any of the pages are pinned for DMA.
 OBOS_EXPORT obos_status Mm_VirtualMemoryProtect(context* ctx, void* base, size_t size, prot_flags newProt, int isPageable);
+// Maps 'phys' at 'at', which must be a page that was allocated with VMA_FLAGS_RESERVE.
+// Nothing is allocated, and the physical page is never freed or paged out by the memory manager, so this
+// can be used to map memory that is already resident (e.g., the InitRD) without copying it.
+// The page is mapped read-only.
+OBOS_EXPORT obos_status Mm_VirtualMemoryMapBorrowed(context* ctx, void* at, uintptr_t phys);
+// Releases the physical page backing 'at', and turns it back into a reserved page, as if it were allocated with VMA_FLAGS_RESERVE.
+// Fails with OBOS_STATUS_IN_USE if something else could still be using the physical page (e.g., it is pinned, or shared by CoW).
+OBOS_EXPORT obos_status Mm_VirtualMemoryDecommitPage(context* ctx, void* at);
@@ -0,0 +1,449 @@
+/*
+ * oboskrnl/mm/compressed_swap.c
+ *
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+#include <int.h>
+#include <klog.h>
+#include <error.h>
+#include <memmanip.h>
+
+#include <mm/swap.h>
+#include <mm/pmm.h>
+#include <mm/compressed_swap.h>
+
+#include <irq/irql.h>
+
+#include <locks/spinlock.h>
+
+#include <utils/lz4.h>
+
+// The buffer is split into pool pages, each of which either holds objects of one size class, or is part of
+// a run of pages holding one big object.
+// Objects never straddle pool pages, and are never moved once allocated.
+
+#define ZSWAP_HEADER_MAGIC 0x5A53574150484452
+#define ZSWAP_ENTRY_MAGIC 0x5A535745
+
+// Size classes are multiples of this.
+#define ZSWAP_CLASS_GRANULARITY (64)
+// Pages that don't compress to at most this many bytes are stored as is, since a bigger object would
+// get a pool page to itself anyway.
+#define ZSWAP_MAX_COMPRESSED (OBOS_PAGE_SIZE/2)
+#define ZSWAP_NCLASSES (ZSWAP_MAX_COMPRESSED/ZSWAP_CLASS_GRANULARITY)
+#define ZSWAP_NO_PAGE UINT32_MAX
+
+OBOS_STATIC_ASSERT(OBOS_PAGE_SIZE/ZSWAP_CLASS_GRANULARITY <= 64, "A pool page cannot have more objects than fit in its bitmap.");
+
+enum {
+    POOL_PAGE_FREE,
+    POOL_PAGE_CLASS,
+    POOL_PAGE_RUN_HEAD,
+    POOL_PAGE_RUN_TAIL,
+};
+typedef struct zswap_pool_page
+{
+    // Links in either the free list, or the list of partially used pages of the size class.
+    uint32_t next, prev;
+    // For POOL_PAGE_CLASS, the objects in use.
+    uint64_t used;
+    // For POOL_PAGE_RUN_HEAD, the amount of pages in the run.
+    uint32_t nRun;
+    uint8_t state;
+    uint8_t sizeClass;
+    uint8_t nUsed;
+} zswap_pool_page;
+
+enum {
+    ZSWAP_SLOT_SAME_FILLED = 0b1,
+    ZSWAP_SLOT_RAW = 0b10,
+};
+typedef struct zswap_slot
+{
+    // The fill word if ZSWAP_SLOT_SAME_FILLED is set, otherwise a pointer to the object.
+    uintptr_t value;
+    // Zero if nothing has been written to the slot.
+    uint16_t len;
+    uint8_t flags;
+} zswap_slot;
+// The swap id is a pointer to one of these.
+typedef struct zswap_entry
+{
+    uint32_t magic;
+    uint32_t nPages;
+    zswap_slot slots[];
+} zswap_entry;
+
+typedef struct zswap_header
+{
+    uint64_t magic;
+    spinlock lock;
+    zswap_pool_page* pages;
+    uint8_t* pool;
+    uint32_t nPoolPages;
+    uint32_t freeList;
+    // Pages of each size class with at least one free object.
+    uint32_t partial[ZSWAP_NCLASSES+1];
+    zswap_stats stats;
+    // Protected by the lock.
+    uint8_t workspace[LZ4_WORKSPACE_SIZE];
+    uint8_t scratch[ZSWAP_MAX_COMPRESSED];
+} zswap_header;
+
+static void list_push(zswap_header* hdr, uint32_t* head, uint32_t idx)
+{
+    hdr->pages[idx].prev = ZSWAP_NO_PAGE;
+    hdr->pages[idx].next = *head;
+    if (*head != ZSWAP_NO_PAGE)
+        hdr->pages[*head].prev = idx;
+    *head = idx;
+}
+static void list_remove(zswap_header* hdr, uint32_t* head, uint32_t idx)
+{
+    zswap_pool_page* pg = &hdr->pages[idx];
+    if (pg->prev != ZSWAP_NO_PAGE)
+        hdr->pages[pg->prev].next = pg->next;
+    else
+        *head = pg->next;
+    if (pg->next != ZSWAP_NO_PAGE)
+        hdr->pages[pg->next].prev = pg->prev;
+    pg->next = pg->prev = ZSWAP_NO_PAGE;
+}
+static size_t class_objects(uint8_t sizeClass)
+{
+    return OBOS_PAGE_SIZE / (sizeClass*ZSWAP_CLASS_GRANULARITY);
+}
+// Finds 'nPages' consecutive free pool pages.
+static uint32_t find_run(zswap_header* hdr, size_t nPages)
+{
+    if (nPages == 1)
+        return hdr->freeList;
+    size_t found = 0;
+    for (uint32_t i = 0; i < hdr->nPoolPages; i++)
+    {
+        found = hdr->pages[i].state == POOL_PAGE_FREE ? found + 1 : 0;
+        if (found == nPages)
+            return i - (nPages - 1);
+    }
+    return ZSWAP_NO_PAGE;
+}
+// Must be called with the lock held.
+static void* pool_alloc(zswap_header* hdr, size_t sz)
+{
+    if (sz <= ZSWAP_MAX_COMPRESSED)
+    {
+        const uint8_t sizeClass = (sz + ZSWAP_CLASS_GRANULARITY - 1) / ZSWAP_CLASS_GRANULARITY;
+        uint32_t idx = hdr->partial[sizeClass];
+        if (idx == ZSWAP_NO_PAGE)
+        {
+            idx = hdr->freeList;
+            if (idx == ZSWAP_NO_PAGE)
+                return nullptr;
+            list_remove(hdr, &hdr->freeList, idx);
+            zswap_pool_page* pg = &hdr->pages[idx];
+            pg->state = POOL_PAGE_CLASS;
+            pg->sizeClass = sizeClass;
+            pg->used = 0;
+            pg->nUsed = 0;
+            list_push(hdr, &hdr->partial[sizeClass], idx);
+            hdr->stats.nPoolPagesUsed++;
+        }
+        zswap_pool_page* pg = &hdr->pages[idx];
+        size_t obj = 0;
+        while (pg->used & ((uint64_t)1 << obj))
+            obj++;
+        pg->used |= ((uint64_t)1 << obj);
+        if (++pg->nUsed == class_objects(sizeClass))
+            list_remove(hdr, &hdr->partial[sizeClass], idx);
+        return hdr->pool + idx*OBOS_PAGE_SIZE + obj*sizeClass*ZSWAP_CLASS_GRANULARITY;
+    }
+    const size_t nPages = (sz + OBOS_PAGE_SIZE - 1) / OBOS_PAGE_SIZE;
+    uint32_t idx = find_run(hdr, nPages);
+    if (idx == ZSWAP_NO_PAGE)
+        return nullptr;
+    for (uint32_t i = idx; i < idx + nPages; i++)
+    {
+        list_remove(hdr, &hdr->freeList, i);
+        hdr->pages[i].state = i == idx ? POOL_PAGE_RUN_HEAD : POOL_PAGE_RUN_TAIL;
+    }
+    hdr->pages[idx].nRun = nPages;
+    hdr->stats.nPoolPagesUsed += nPages;
+    return hdr->pool + idx*OBOS_PAGE_SIZE;
+}
+// Must be called with the lock held.
+static void pool_free(zswap_header* hdr, void* obj)
+{
+    const size_t off = (uint8_t*)obj - hdr->pool;
+    const uint32_t idx = off / OBOS_PAGE_SIZE;
+    zswap_pool_page* pg = &hdr->pages[idx];
+    if (pg->state == POOL_PAGE_CLASS)
+    {
+        const size_t i = (off % OBOS_PAGE_SIZE) / (pg->sizeClass*ZSWAP_CLASS_GRANULARITY);
+        OBOS_ASSERT(pg->used & ((uint64_t)1 << i));
+        if (pg->nUsed == class_objects(pg->sizeClass))
+            list_push(hdr, &hdr->partial[pg->sizeClass], idx);
+        pg->used &= ~((uint64_t)1 << i);
+        if (--pg->nUsed)
+            return;
+        list_remove(hdr, &hdr->partial[pg->sizeClass], idx);
+        pg->state = POOL_PAGE_FREE;
+        list_push(hdr, &hdr->freeList, idx);
+        hdr->stats.nPoolPagesUsed--;
+        return;
+    }
+    OBOS_ASSERT(pg->state == POOL_PAGE_RUN_HEAD);
+    const uint32_t nRun = pg->nRun;
+    for (uint32_t i = idx; i < idx + nRun; i++)
+    {
+        hdr->pages[i].state = POOL_PAGE_FREE;
+        list_push(hdr, &hdr->freeList, i);
+    }
+    hdr->stats.nPoolPagesUsed -= nRun;
+}
+
+static zswap_header* get_header(struct swap_device* dev)
+{
+    if (!dev)
+        return nullptr;
+    zswap_header* hdr = (zswap_header*)dev->metadata;
+    if (!hdr || hdr->magic != ZSWAP_HEADER_MAGIC)
+        return nullptr;
+    return hdr;
+}
+static zswap_entry* get_entry(zswap_header* hdr, uintptr_t id)
+{
+    if (id < (uintptr_t)hdr->pool || id >= ((uintptr_t)hdr->pool + hdr->nPoolPages*OBOS_PAGE_SIZE))
+        return nullptr;
+    zswap_entry* ent = (zswap_entry*)id;
+    if (ent->magic != ZSWAP_ENTRY_MAGIC)
+        return nullptr;
+    return ent;
+}
+// Must be called with the lock held.
+static void release_slot(zswap_header* hdr, zswap_slot* slot)
+{
+    if (!slot->len)
+        return;
+    if (slot->flags & ZSWAP_SLOT_SAME_FILLED)
+        hdr->stats.nSameFilled--;
+    else
+    {
+        pool_free(hdr, (void*)slot->value);
+        if (slot->flags & ZSWAP_SLOT_RAW)
+            hdr->stats.nIncompressible--;
+        else
+            hdr->stats.nCompressedBytes -= slot->len;
+    }
+    hdr->stats.nPagesStored--;
+    memzero(slot, sizeof(*slot));
+}
+// Must be called with the lock held.
+static obos_status store_page(zswap_header* hdr, zswap_slot* slot, const uint8_t* data)
+{
+    release_slot(hdr, slot);
+    const uintptr_t* words = (const uintptr_t*)data;
+    size_t i = 1;
+    for (; i < OBOS_PAGE_SIZE/sizeof(uintptr_t); i++)
+        if (words[i] != words[0])
+            break;
+    if (i == OBOS_PAGE_SIZE/sizeof(uintptr_t))
+    {
+        slot->value = words[0];
+        slot->len = OBOS_PAGE_SIZE;
+        slot->flags = ZSWAP_SLOT_SAME_FILLED;
+        hdr->stats.nSameFilled++;
+        hdr->stats.nPagesStored++;
+        return OBOS_STATUS_SUCCESS;
+    }
+    size_t len = OBOS_LZ4Compress(data, OBOS_PAGE_SIZE, hdr->scratch, sizeof(hdr->scratch), hdr->workspace);
+    const bool raw = !len;
+    if (raw)
+        len = OBOS_PAGE_SIZE;
+    void* obj = pool_alloc(hdr, len);
+    if (!obj)
+        return OBOS_STATUS_NOT_ENOUGH_MEMORY;
+    memcpy(obj, raw ? data : hdr->scratch, len);
+    slot->value = (uintptr_t)obj;
+    slot->len = len;
+    slot->flags = raw ? ZSWAP_SLOT_RAW : 0;
+    if (raw)
+        hdr->stats.nIncompressible++;
+    else
+        hdr->stats.nCompressedBytes += len;
+    hdr->stats.nPagesStored++;
+    return OBOS_STATUS_SUCCESS;
+}
+static obos_status load_page(const zswap_slot* slot, uint8_t* data)
+{
+    if (!slot->len)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    if (slot->flags & ZSWAP_SLOT_SAME_FILLED)
+    {
+        uintptr_t* words = (uintptr_t*)data;
+        for (size_t i = 0; i < OBOS_PAGE_SIZE/sizeof(uintptr_t); i++)
+            words[i] = slot->value;
+        return OBOS_STATUS_SUCCESS;
+    }
+    if (slot->flags & ZSWAP_SLOT_RAW)
+    {
+        memcpy(data, (void*)slot->value, OBOS_PAGE_SIZE);
+        return OBOS_STATUS_SUCCESS;
+    }
+    size_t len = 0;
+    obos_status status = OBOS_LZ4Decompress((void*)slot->value, slot->len, data, OBOS_PAGE_SIZE, &len);
+    if (obos_is_error(status) || len != OBOS_PAGE_SIZE)
+        return OBOS_STATUS_INTERNAL_ERROR;
+    return OBOS_STATUS_SUCCESS;
+}
+
+// The allocation id is a pointer to a zswap_entry in the pool.
+static obos_status swap_resv(struct swap_device* dev, uintptr_t* id, size_t nPages)
+{
+    if (!id || !nPages)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    zswap_header* hdr = get_header(dev);
+    if (!hdr)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    const size_t sz = sizeof(zswap_entry) + nPages*sizeof(zswap_slot);
+    irql oldIrql = Core_SpinlockAcquireExplicit(&hdr->lock, IRQL_DISPATCH, true);
+    zswap_entry* ent = pool_alloc(hdr, sz);
+    Core_SpinlockRelease(&hdr->lock, oldIrql);
+    if (!ent)
+        return OBOS_STATUS_NOT_ENOUGH_MEMORY;
+    memzero(ent, sz);
+    ent->nPages = nPages;
+    ent->magic = ZSWAP_ENTRY_MAGIC;
+    *id = (uintptr_t)ent;
+    return OBOS_STATUS_SUCCESS;
+}
+static obos_status swap_free(struct swap_device* dev, uintptr_t id, size_t nPages)
+{
+    OBOS_UNUSED(nPages);
+    if (!id || !nPages)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    zswap_header* hdr = get_header(dev);
+    if (!hdr)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    irql oldIrql = Core_SpinlockAcquireExplicit(&hdr->lock, IRQL_DISPATCH, true);
+    zswap_entry* ent = get_entry(hdr, id);
+    if (!ent)
+    {
+        Core_SpinlockRelease(&hdr->lock, oldIrql);
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    }
+    for (size_t i = 0; i < ent->nPages; i++)
+        release_slot(hdr, &ent->slots[i]);
+    ent->magic = 0;
+    pool_free(hdr, ent);
+    Core_SpinlockRelease(&hdr->lock, oldIrql);
+    return OBOS_STATUS_SUCCESS;
+}
+static obos_status swap_write(struct swap_device* dev, uintptr_t id, uintptr_t phys, size_t nPages, size_t offsetBytes)
+{
+    if (!id)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    zswap_header* hdr = get_header(dev);
+    if (!hdr)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    zswap_entry* ent = get_entry(hdr, id);
+    if (!ent)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    if (!nPages)
+        return OBOS_STATUS_SUCCESS;
+    if (offsetBytes % OBOS_PAGE_SIZE)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    const size_t first = offsetBytes / OBOS_PAGE_SIZE;
+    if (first >= ent->nPages || nPages > (ent->nPages - first))
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    obos_status status = OBOS_STATUS_SUCCESS;
+    for (size_t i = 0; i < nPages && obos_is_success(status); i++)
+    {
+        // The lock is dropped between pages, so a huge page doesn't keep everyone else waiting for too long.
+        irql oldIrql = Core_SpinlockAcquireExplicit(&hdr->lock, IRQL_DISPATCH, true);
+        status = store_page(hdr, &ent->slots[first + i], MmS_MapVirtFromPhys(phys + i*OBOS_PAGE_SIZE));
+        Core_SpinlockRelease(&hdr->lock, oldIrql);
+    }
+    return status;
+}
+static obos_status swap_read(struct swap_device* dev, uintptr_t id, uintptr_t phys, size_t nPages, size_t offsetBytes)
+{
+    if (!id)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    zswap_header* hdr = get_header(dev);
+    if (!hdr)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    zswap_entry* ent = get_entry(hdr, id);
+    if (!ent)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    if (!nPages)
+        return OBOS_STATUS_SUCCESS;
+    if (offsetBytes % OBOS_PAGE_SIZE)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    const size_t first = offsetBytes / OBOS_PAGE_SIZE;
+    if (first >= ent->nPages || nPages > (ent->nPages - first))
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    // Objects are never moved, and only the owner of the id frees them, so this doesn't need the lock.
+    for (size_t i = 0; i < nPages; i++)
+    {
+        obos_status status = load_page(&ent->slots[first + i], MmS_MapVirtFromPhys(phys + i*OBOS_PAGE_SIZE));
+        if (obos_is_error(status))
+            return status;
+    }
+    return OBOS_STATUS_SUCCESS;
+}
+
+obos_status MmH_InitializeCompressedSwapDevice(swap_dev* dev, void* buf, size_t size)
+{
+    if (!dev || !buf || size < sizeof(zswap_header))
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    zswap_header* hdr = (zswap_header*)buf;
+    memzero(hdr, sizeof(*hdr));
+    const uintptr_t end = (uintptr_t)buf + size;
+    hdr->pages = (zswap_pool_page*)(hdr + 1);
+    size_t nPoolPages = (size - sizeof(*hdr)) / (OBOS_PAGE_SIZE + sizeof(zswap_pool_page));
+    uintptr_t pool = 0;
+    // Page align the pool, giving up pool pages until it fits.
+    for (; nPoolPages; nPoolPages--)
+    {
+        pool = (uintptr_t)(hdr->pages + nPoolPages);
+        pool = (pool + OBOS_PAGE_SIZE - 1) & ~(uintptr_t)(OBOS_PAGE_SIZE - 1);
+        if (pool + nPoolPages*OBOS_PAGE_SIZE <= end)
+            break;
+    }
+    if (nPoolPages < 2 || nPoolPages >= ZSWAP_NO_PAGE)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    hdr->pool = (uint8_t*)pool;
+    hdr->nPoolPages = nPoolPages;
+    hdr->stats.nPoolPages = nPoolPages;
+    hdr->freeList = ZSWAP_NO_PAGE;
+    for (size_t i = 0; i <= ZSWAP_NCLASSES; i++)
+        hdr->partial[i] = ZSWAP_NO_PAGE;
+    // Pushed in reverse, so that allocations start at the beginning of the pool.
+    for (uint32_t i = nPoolPages; i > 0; i--)
+    {
+        memzero(&hdr->pages[i - 1], sizeof(zswap_pool_page));
+        hdr->pages[i - 1].state = POOL_PAGE_FREE;
+        list_push(hdr, &hdr->freeList, i - 1);
+    }
+    hdr->magic = ZSWAP_HEADER_MAGIC;
+    dev->metadata = hdr;
+    dev->swap_resv = swap_resv;
+    dev->swap_free = swap_free;
+    dev->swap_write = swap_write;
+    dev->swap_read = swap_read;
+    dev->deinit_dev = nullptr;
+    return OBOS_STATUS_SUCCESS;
+}
+obos_status MmH_GetCompressedSwapStats(swap_dev* dev, zswap_stats* stats)
+{
+    if (!stats)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    zswap_header* hdr = get_header(dev);
+    if (!hdr)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    irql oldIrql = Core_SpinlockAcquireExplicit(&hdr->lock, IRQL_DISPATCH, true);
+    *stats = hdr->stats;
+    Core_SpinlockRelease(&hdr->lock, oldIrql);
+    return OBOS_STATUS_SUCCESS;
+}
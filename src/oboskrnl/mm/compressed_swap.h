@@ -0,0 +1,33 @@
+/*
+ * oboskrnl/mm/compressed_swap.h
+ *
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+// Defines a swap device that keeps swapped out pages compressed in a RAM buffer.
+
+#pragma once
+
+#include <int.h>
+#include <error.h>
+
+#include <mm/swap.h>
+
+typedef struct zswap_stats
+{
+    // The amount of pages currently stored in the device.
+    size_t nPagesStored;
+    // Of those, the amount of pages that were filled with a single word, and take no space in the pool.
+    size_t nSameFilled;
+    // Of those, the amount of pages that did not compress well enough, and are stored as is.
+    size_t nIncompressible;
+    // The sum of the sizes of every compressed page.
+    size_t nCompressedBytes;
+    // The amount of pool pages in use, and the total amount of pool pages.
+    size_t nPoolPagesUsed;
+    size_t nPoolPages;
+} zswap_stats;
+
+// Initializes a compressed swap device that uses 'buf' for all of its storage, including its own metadata.
+obos_status MmH_InitializeCompressedSwapDevice(swap_dev* dev, void* buf, size_t size);
+obos_status MmH_GetCompressedSwapStats(swap_dev* dev, zswap_stats* stats);
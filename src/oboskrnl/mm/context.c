@@ -74,4 +74,28 @@ bool MmH_IsAddressUnPageable(uintptr_t addr)
 		return true;
 	return false;
 }
-RB_GENERATE_INTERNAL(page_tree, page, rb_node, pg_cmp_pages, OBOS_EXPORT __attribute__((optimize("-O0"))));
\ No newline at end of file
+RB_GENERATE_INTERNAL(page_tree, page, rb_node, pg_cmp_pages, OBOS_EXPORT);
+page* MmH_LookupPage(context* ctx, uintptr_t addr)
+{
+    page* last = ctx->lastLookup;
+    if (last)
+    {
+        if (last->addr == addr)
+            return last;
+        // Faults and walks over a range tend to go forward one page at a time.
+        if (last->addr < addr)
+        {
+            page* next = RB_NEXT(page_tree, &ctx->pages, last);
+            if (next && next->addr == addr)
+            {
+                ctx->lastLookup = next;
+                return next;
+            }
+        }
+    }
+    page what = {.addr=addr};
+    page* found = RB_FIND(page_tree, &ctx->pages, &what);
+    if (found)
+        ctx->lastLookup = found;
+    return found;
+}
\ No newline at end of file
@@ -29,8 +29,9 @@ typedef uintptr_t page_table;
 /// <param name="pt">The page table.</param>
 /// <param name="addr">The base address the page to query.</param>
 /// <param name="info">[out] The page struct to put the info into. Mustn't be nullptr.</param>
+/// <param name="phys">[out,optional] The physical address of the page, if it is present.</param>
 /// <returns>The status of the function.</returns>
-OBOS_WEAK obos_status MmS_QueryPageInfo(page_table pt, uintptr_t addr, page* info);
+OBOS_WEAK obos_status MmS_QueryPageInfo(page_table pt, uintptr_t addr, page* info, uintptr_t* phys);
 /// <summary>
 /// Gets the current page table.
 /// <para/>NOTE: This always returns the kernel page table.
@@ -76,8 +77,13 @@ typedef struct context
     page_table pt;
     dpc file_mapping_dpc;
     memstat stat;
+    // The page last found by MmH_LookupPage. Must be cleared when a page is removed from 'pages'.
+    page* lastLookup;
 } context;
 extern OBOS_EXPORT context Mm_KernelContext;
+// Finds the page at 'addr' (which must be the base of the page) in the context's page tree.
+// Repeated lookups of the same page, or of the page after the last one found, skip the tree walk.
+OBOS_EXPORT page* MmH_LookupPage(context* ctx, uintptr_t addr);
 extern char MmS_MMPageableRangeStart[];
 extern char MmS_MMPageableRangeEnd[];
 bool MmH_IsAddressUnPageable(uintptr_t addr);
\ No newline at end of file
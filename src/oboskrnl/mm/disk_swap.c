@@ -37,6 +37,15 @@ struct metadata
     obos_swap_header hdr;
     driver_id* driver;
     size_t blkSize;
+    // The slot allocator lives only in memory, since nothing in the swap outlives a boot.
+    // Slot n is the page at dataOffset+n*OBOS_PAGE_SIZE, and is in use if bit n is set.
+    spinlock lock;
+    uint64_t* bitmap;
+    size_t nSlots;
+    size_t nFreeSlots;
+    size_t dataOffset;
+    // Where the next search for free slots starts.
+    size_t hint;
 };
 
 static void* map(uintptr_t phys, size_t nPages, page** pages)
@@ -68,8 +77,54 @@ static void unmap(size_t nPages, page* pages)
         MmS_SetPageMapping(Mm_KernelContext.pt, &pages[i], 0);
         RB_REMOVE(page_tree, &Mm_KernelContext.pages, &pages[i]);
     }
+    Mm_KernelContext.lastLookup = nullptr;
     Mm_Allocator->Free(Mm_Allocator, pages, sizeof(page)*nPages);
 }
+// Finds 'nSlots' consecutive free slots, starting the search at the hint.
+// Must be called with the lock held.
+static size_t find_free_run(struct metadata* metadata, size_t nSlots)
+{
+    size_t slot = metadata->hint < metadata->nSlots ? metadata->hint : 0;
+    size_t run = 0;
+    // Runs can't wrap around the end, but one can start before the hint, hence the extra slots.
+    for (size_t nScanned = 0; nScanned < metadata->nSlots + nSlots; )
+    {
+        if (slot >= metadata->nSlots)
+        {
+            slot = 0;
+            run = 0;
+        }
+        // Skip full words without looking at each bit.
+        // The bits past the last slot are always set, so this can't go past the end of the bitmap.
+        if (!(slot % 64) && metadata->bitmap[slot / 64] == UINT64_MAX)
+        {
+            const size_t skipped = (metadata->nSlots - slot) < 64 ? (metadata->nSlots - slot) : 64;
+            slot += skipped;
+            nScanned += skipped;
+            run = 0;
+            continue;
+        }
+        if (metadata->bitmap[slot / 64] & ((uint64_t)1 << (slot % 64)))
+            run = 0;
+        else if (++run == nSlots)
+            return slot + 1 - nSlots;
+        slot++;
+        nScanned++;
+    }
+    return SIZE_MAX;
+}
+static void set_slots(struct metadata* metadata, size_t first, size_t nSlots, bool used)
+{
+    for (size_t i = first; i < first + nSlots; i++)
+    {
+        if (used)
+            metadata->bitmap[i / 64] |= ((uint64_t)1 << (i % 64));
+        else
+            metadata->bitmap[i / 64] &= ~((uint64_t)1 << (i % 64));
+    }
+}
+// Reserves a run of contiguous slots, so the pages in it can be written with one request.
+// The id is the byte offset of the first slot from the start of the swap file.
 obos_status swap_resv(struct swap_device* dev, uintptr_t *id, size_t nPages)
 {
     if (!dev || !id || !nPages)
@@ -79,93 +134,27 @@ obos_status swap_resv(struct swap_device* dev, uintptr_t *id, size_t nPages)
         return OBOS_STATUS_INVALID_ARGUMENT;
     if (metadata->hdr.magic != OBOS_SWAP_HEADER_MAGIC)
         return OBOS_STATUS_INVALID_ARGUMENT;
-    size_t nBytes = nPages*OBOS_PAGE_SIZE;
-    if (metadata->hdr.freelist.freeBytes < nBytes)
-        return OBOS_STATUS_NOT_ENOUGH_MEMORY;
-    size_t access_size = sizeof(obos_swap_free_region);
-    if (access_size % metadata->blkSize)
-        access_size += (metadata->blkSize-(access_size%metadata->blkSize));
-    size_t accessSizePages = (access_size/OBOS_PAGE_SIZE)+(access_size%OBOS_PAGE_SIZE != 0);
-    // uint8_t* buf = Mm_Allocator->ZeroAllocate(Mm_Allocator, 1, access_size, nullptr);
-    page* pages = nullptr;
-    uint8_t* buf = map(Mm_AllocatePhysicalPages(accessSizePages, 1, nullptr), accessSizePages, &pages);
-    size_t free_off = metadata->hdr.freelist.head;
-    const size_t base_offset = metadata->vn->flags & VFLAGS_PARTITION ? metadata->vn->partitions[0].off : 0;
-    uintptr_t offset = (free_off+base_offset) / metadata->blkSize;
-    metadata->driver->header.ftable.read_sync(metadata->vn->desc, buf, access_size/metadata->blkSize, offset, nullptr);
-    obos_swap_free_region* curr = (void*)buf;
-    off_t addend = 0;
-    while (curr->size < nBytes && free_off)
+    irql oldIrql = Core_SpinlockAcquireExplicit(&metadata->lock, IRQL_DISPATCH, true);
+    if (metadata->nFreeSlots < nPages)
     {
-        offset = (free_off+base_offset) / metadata->blkSize;
-        metadata->driver->header.ftable.read_sync(metadata->vn->desc, buf, access_size/metadata->blkSize, offset, nullptr);
-        free_off = curr->next;
-        if ((curr->size + sizeof(*curr)) >= nBytes)
-        {
-            nBytes -= sizeof(*curr);
-            addend -= sizeof(*curr);
-            break;
-        }
-    }
-    if (!free_off)
-    {
-        unmap(accessSizePages, pages);
+        Core_SpinlockRelease(&metadata->lock, oldIrql);
         return OBOS_STATUS_NOT_ENOUGH_MEMORY;
     }
-    curr->size -= nBytes;
-    curr->size -= curr->size%metadata->blkSize;
-    if (!curr->size)
+    size_t first = find_free_run(metadata, nPages);
+    if (first == SIZE_MAX)
     {
-        // Unlink the node.
-        page* other_pages = nullptr;
-        uint8_t* other_buf = map(Mm_AllocatePhysicalPages(accessSizePages, 1, nullptr), accessSizePages, &other_pages);
-        uint64_t next = curr->next;
-        uint64_t prev = curr->prev;
-        curr->next = 0;
-        curr->prev = 0;
-        curr->size = 0;
-        curr->sizeof_this = 0;
-        if (next)
-        {
-            metadata->driver->header.ftable.read_sync(metadata->vn->desc, other_buf, access_size/metadata->blkSize, (next+base_offset) / metadata->blkSize, nullptr);
-            obos_swap_free_region* next_reg = (void*)other_buf;
-            next_reg->prev = prev;
-            metadata->driver->header.ftable.write_sync(metadata->vn->desc, other_buf, access_size/metadata->blkSize, (next+base_offset) / metadata->blkSize, nullptr);
-        }
-        if (prev)
-        {
-            metadata->driver->header.ftable.read_sync(metadata->vn->desc, other_buf, access_size/metadata->blkSize, (prev+base_offset) / metadata->blkSize, nullptr);
-            obos_swap_free_region* next_reg = (void*)other_buf;
-            next_reg->next = next;
-            metadata->driver->header.ftable.write_sync(metadata->vn->desc, other_buf, access_size/metadata->blkSize, (prev+base_offset) / metadata->blkSize, nullptr);
-        }
-        bool flush_hdr = true;
-        if (metadata->hdr.freelist.head == offset)
-        {
-            metadata->hdr.freelist.head = next;
-            flush_hdr = true;
-        }
-        if (metadata->hdr.freelist.tail == offset)
-        {
-            metadata->hdr.freelist.tail = prev;
-            flush_hdr = true;
-        }
-        if (flush_hdr)
-        {
-            memcpy(other_buf, &metadata->hdr, metadata->blkSize);
-            metadata->driver->header.ftable.write_sync(metadata->vn->desc, other_buf, access_size/metadata->blkSize, 0, nullptr);
-        }
-        unmap(accessSizePages, other_pages);
+        Core_SpinlockRelease(&metadata->lock, oldIrql);
+        return OBOS_STATUS_NOT_ENOUGH_MEMORY;
     }
-    *id = (free_off+curr->size+addend);
-    metadata->driver->header.ftable.write_sync(metadata->vn->desc, buf, access_size/metadata->blkSize, offset, nullptr);
-    unmap(accessSizePages, pages);
+    set_slots(metadata, first, nPages, true);
+    metadata->nFreeSlots -= nPages;
+    metadata->hint = first + nPages;
+    Core_SpinlockRelease(&metadata->lock, oldIrql);
+    *id = metadata->dataOffset + first*OBOS_PAGE_SIZE;
     return OBOS_STATUS_SUCCESS;
 }
 obos_status swap_free(struct swap_device* dev, uintptr_t  id, size_t nPages)
 {
-    if (!dev || !id || !nPages)
-        return OBOS_STATUS_INVALID_ARGUMENT;
     if (!dev || !id || !nPages)
         return OBOS_STATUS_INVALID_ARGUMENT;
     struct metadata* metadata = dev->metadata;
@@ -173,39 +162,23 @@ obos_status swap_free(struct swap_device* dev, uintptr_t  id, size_t nPages)
         return OBOS_STATUS_INVALID_ARGUMENT;
     if (metadata->hdr.magic != OBOS_SWAP_HEADER_MAGIC)
         return OBOS_STATUS_INVALID_ARGUMENT;
-    size_t nBytes = nPages*OBOS_PAGE_SIZE;
-    size_t access_size = sizeof(obos_swap_free_region);
-    if (access_size % metadata->blkSize)
-        access_size += (metadata->blkSize-(access_size%metadata->blkSize));
-    size_t accessSizePages = (access_size/OBOS_PAGE_SIZE)+(access_size%OBOS_PAGE_SIZE != 0);
-    page* pages = nullptr;
-    const size_t base_offset = metadata->vn->flags & VFLAGS_PARTITION ? metadata->vn->partitions[0].off : 0;
-    uint8_t* buf = map(Mm_AllocatePhysicalPages(accessSizePages, 1, nullptr), accessSizePages, &pages);
-    obos_swap_free_region free = {};
-    free.sizeof_this = sizeof(obos_swap_free_region);
-    if (free.sizeof_this % metadata->blkSize)
-        free.sizeof_this += (metadata->blkSize-(free.sizeof_this%metadata->blkSize));
-    free.size = nBytes-(metadata->blkSize != 1 ? 0 : sizeof(obos_swap_free_region));
-    if (!metadata->hdr.freelist.head)
-        metadata->hdr.freelist.head = id;
-    if (metadata->hdr.freelist.tail)
+    if (id < metadata->dataOffset || (id - metadata->dataOffset) % OBOS_PAGE_SIZE)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    const size_t first = (id - metadata->dataOffset) / OBOS_PAGE_SIZE;
+    if (first >= metadata->nSlots || nPages > (metadata->nSlots - first))
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    irql oldIrql = Core_SpinlockAcquireExplicit(&metadata->lock, IRQL_DISPATCH, true);
+    for (size_t i = first; i < first + nPages; i++)
     {
-        uintptr_t offset = (metadata->hdr.freelist.tail+base_offset) / metadata->blkSize;
-        metadata->driver->header.ftable.read_sync(metadata->vn->desc, buf, access_size/metadata->blkSize, offset, nullptr);
-        obos_swap_free_region* curr = (void*)buf;
-        curr->next = id;
-        metadata->driver->header.ftable.write_sync(metadata->vn->desc, buf, access_size/metadata->blkSize, offset, nullptr);
+        if (!(metadata->bitmap[i / 64] & ((uint64_t)1 << (i % 64))))
+        {
+            Core_SpinlockRelease(&metadata->lock, oldIrql);
+            return OBOS_STATUS_INVALID_ARGUMENT;
+        }
     }
-    free.prev = metadata->hdr.freelist.tail;
-    memzero(buf, access_size);
-    metadata->hdr.freelist.tail = id;
-    memcpy(&free, buf, sizeof(free));
-    uintptr_t offset = (id+base_offset) / metadata->blkSize;
-    metadata->driver->header.ftable.write_sync(metadata->vn->desc, buf, access_size/metadata->blkSize, offset, nullptr);
-    memzero(buf, sizeof(free));
-    memcpy(&metadata->hdr, buf, sizeof(free));
-    metadata->driver->header.ftable.write_sync(metadata->vn->desc, buf, access_size/metadata->blkSize, offset, nullptr);
-    unmap(accessSizePages, pages);
+    set_slots(metadata, first, nPages, false);
+    metadata->nFreeSlots += nPages;
+    Core_SpinlockRelease(&metadata->lock, oldIrql);
     return OBOS_STATUS_SUCCESS;
 }
 obos_status swap_write(struct swap_device* dev, uintptr_t  id, uintptr_t phys, size_t nPages, size_t offsetBytes)
@@ -245,7 +218,32 @@ obos_status swap_read(struct swap_device* dev, uintptr_t  id, uintptr_t phys, si
     unmap(nPages, pages);
     return status;
 }
-OBOS_WEAK obos_status deinit_dev(struct swap_device* dev);
+// Writes the swap header back to the device, clearing the dirty flag.
+static obos_status deinit_dev(struct swap_device* dev)
+{
+    if (!dev)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    struct metadata* metadata = dev->metadata;
+    if (!metadata)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    if (metadata->hdr.magic != OBOS_SWAP_HEADER_MAGIC)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    irql oldIrql = Core_SpinlockAcquireExplicit(&metadata->lock, IRQL_DISPATCH, true);
+    metadata->hdr.freelist.freeBytes = metadata->nFreeSlots*OBOS_PAGE_SIZE;
+    metadata->hdr.flags &= ~OBOS_SWAP_HEADER_DIRTY;
+    Core_SpinlockRelease(&metadata->lock, oldIrql);
+    const size_t base_offset = metadata->vn->flags & VFLAGS_PARTITION ? metadata->vn->partitions[0].off : 0;
+    uint8_t* buf = OBOS_KernelAllocator->ZeroAllocate(OBOS_KernelAllocator, 1, metadata->hdr.header_size, nullptr);
+    memcpy(buf, &metadata->hdr, sizeof(metadata->hdr));
+    obos_status status = metadata->driver->header.ftable.write_sync(metadata->vn->desc, buf, metadata->hdr.header_size/metadata->blkSize, base_offset/metadata->blkSize, nullptr);
+    OBOS_KernelAllocator->Free(OBOS_KernelAllocator, buf, metadata->hdr.header_size);
+    if (obos_is_error(status))
+        return status;
+    Mm_Allocator->Free(Mm_Allocator, metadata->bitmap, ((metadata->nSlots + 63) / 64)*sizeof(uint64_t));
+    Mm_Allocator->Free(Mm_Allocator, metadata, sizeof(*metadata));
+    dev->metadata = nullptr;
+    return OBOS_STATUS_SUCCESS;
+}
 obos_status MmH_InitializeDiskSwapDevice(swap_dev *dev, void* vnode)
 {
     fd file = {};
@@ -286,34 +284,24 @@ obos_status MmH_InitializeDiskSwapDevice(swap_dev *dev, void* vnode)
         return OBOS_STATUS_MISMATCH;
     }
     if (hdr.flags & OBOS_SWAP_HEADER_DIRTY)
+        OBOS_Log("%s: Swap header dirty! This could be because of a power failure or a forced shutdown.\n", __func__);
+    // Nothing in the swap outlives a boot, so the free list on the device is never walked, and every slot
+    // starts out free.
+    // The header is marked dirty until the device is deinitialized, which is the only time it is written back.
+    const size_t dataOffset = (hdr.header_size + OBOS_PAGE_SIZE - 1) & ~(size_t)(OBOS_PAGE_SIZE - 1);
+    const size_t dataEnd = hdr.header_size + hdr.size;
+    const size_t nSlots = dataEnd > dataOffset ? (dataEnd - dataOffset) / OBOS_PAGE_SIZE : 0;
+    if (!nSlots)
     {
-        // Reset the freelist.
-        OBOS_Log("%s: Swap header dirty! This could be because of a power failure or a forced shutdown. Resetting free list...\n", __func__);
-        obos_swap_free_region free = {};
-        free.size = hdr.size - hdr.header_size;
-        free.next = free.prev = 0;
-        free.sizeof_this = sizeof(obos_swap_free_region);
-        if (free.sizeof_this % blkSize)
-            free.sizeof_this += (blkSize-(free.sizeof_this%blkSize));
-        hdr.freelist.head = hdr.header_size;
-        hdr.freelist.tail = hdr.header_size;
-        hdr.freelist.nNodes = 1;
-        buf = OBOS_KernelAllocator->ZeroAllocate(OBOS_KernelAllocator, 1, blkSize, nullptr);
-        hdr.flags &= ~OBOS_SWAP_HEADER_DIRTY;
-        memcpy(buf, &hdr, sizeof(hdr));
-        Vfs_FdSeek(&file, 0, SEEK_SET);
-        Vfs_FdWrite(&file, buf, blkSize, nullptr);
-        OBOS_KernelAllocator->Free(OBOS_KernelAllocator, buf, blkSize);
-    }
-    else 
-    {
-        hdr.flags |= OBOS_SWAP_HEADER_DIRTY;
-        buf = OBOS_KernelAllocator->ZeroAllocate(OBOS_KernelAllocator, 1, blkSize, nullptr);
-        memcpy(buf, &hdr, sizeof(hdr));
-        Vfs_FdSeek(&file, 0, SEEK_SET);
-        Vfs_FdWrite(&file, buf, blkSize, nullptr);
-        OBOS_KernelAllocator->Free(OBOS_KernelAllocator, buf, blkSize);
+        Vfs_FdClose(&file);
+        return OBOS_STATUS_INVALID_FILE;
     }
+    hdr.flags |= OBOS_SWAP_HEADER_DIRTY;
+    buf = OBOS_KernelAllocator->ZeroAllocate(OBOS_KernelAllocator, 1, blkSize, nullptr);
+    memcpy(buf, &hdr, sizeof(hdr));
+    Vfs_FdSeek(&file, 0, SEEK_SET);
+    Vfs_FdWrite(&file, buf, blkSize, nullptr);
+    OBOS_KernelAllocator->Free(OBOS_KernelAllocator, buf, blkSize);
     Vfs_FdClose(&file);
     dev->metadata = Mm_Allocator->ZeroAllocate(Mm_Allocator, 1, sizeof(struct metadata), nullptr);
     struct metadata* metadata = (struct metadata*)dev->metadata;
@@ -325,11 +313,20 @@ obos_status MmH_InitializeDiskSwapDevice(swap_dev *dev, void* vnode)
     if (file.vn->vtype == VNODE_TYPE_CHR || file.vn->vtype == VNODE_TYPE_BLK)
         driver = file.vn->un.device->driver;
     metadata->driver = driver;
+    const size_t nWords = (nSlots + 63) / 64;
+    metadata->bitmap = Mm_Allocator->ZeroAllocate(Mm_Allocator, nWords, sizeof(uint64_t), nullptr);
+    // Mark the bits past the last slot as used, so they are never handed out.
+    if (nSlots % 64)
+        metadata->bitmap[nWords - 1] = ~(((uint64_t)1 << (nSlots % 64)) - 1);
+    metadata->nSlots = nSlots;
+    metadata->nFreeSlots = nSlots;
+    metadata->dataOffset = dataOffset;
     dev->metadata = metadata;
     dev->swap_resv = swap_resv;
     dev->swap_free = swap_free;
     dev->swap_write = swap_write;
     dev->swap_read = swap_read;
+    dev->deinit_dev = deinit_dev;
     return OBOS_STATUS_SUCCESS;
 }
 obos_status MmH_InitializeDiskSwap(void* vn_)
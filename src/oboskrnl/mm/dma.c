@@ -0,0 +1,212 @@
+/*
+ * oboskrnl/mm/dma.c
+ *
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+#include <int.h>
+#include <klog.h>
+#include <error.h>
+#include <memmanip.h>
+
+#include <mm/dma.h>
+#include <mm/context.h>
+#include <mm/page.h>
+#include <mm/handler.h>
+
+#include <irq/irql.h>
+
+#include <locks/spinlock.h>
+
+#include <utils/tree.h>
+
+static page* find_page(context* ctx, uintptr_t addr)
+{
+    page* found = MmH_LookupPage(ctx, addr - (addr % OBOS_PAGE_SIZE));
+    if (!found && OBOS_HUGE_PAGE_SIZE != OBOS_PAGE_SIZE)
+    {
+        found = MmH_LookupPage(ctx, addr - (addr % OBOS_HUGE_PAGE_SIZE));
+        if (found && !found->prot.huge_page)
+            found = nullptr;
+    }
+    return found;
+}
+static void unpin_pages(context* ctx, page* first, uintptr_t limit)
+{
+    OBOS_UNUSED(ctx);
+    for (page* curr = first; curr && curr->addr < limit; curr = RB_NEXT(page_tree, &ctx->pages, curr))
+    {
+        OBOS_ASSERT(curr->pinCount);
+        if (curr->pinCount)
+            curr->pinCount--;
+    }
+}
+obos_status Mm_DMAMapBuffer(context* ctx, void* base_, size_t size, bool deviceWrites, dma_mapping* mapping)
+{
+    if (!ctx || !base_ || !size || !mapping)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    uintptr_t base = (uintptr_t)base_;
+    memzero(mapping, sizeof(*mapping));
+    irql oldIrql = Core_SpinlockAcquireExplicit(&ctx->lock, IRQL_DISPATCH, true);
+    page* first = find_page(ctx, base);
+    if (!first)
+    {
+        Core_SpinlockRelease(&ctx->lock, oldIrql);
+        return OBOS_STATUS_NOT_FOUND;
+    }
+    obos_status status = OBOS_STATUS_SUCCESS;
+    uintptr_t addr = first->addr;
+    page* curr = first;
+    while (addr < (base + size))
+    {
+        if (!curr || curr->addr != addr)
+        {
+            status = OBOS_STATUS_NOT_FOUND;
+            break;
+        }
+        if (curr->reserved || curr->isGuardPage || (deviceWrites && curr->prot.ro))
+        {
+            status = OBOS_STATUS_ACCESS_DENIED;
+            break;
+        }
+        // The page needs to be resident, and if the device is going to write to it, it cannot be shared
+        // with anything else, so fault it in like the CPU would.
+        if (curr->pagedOut || !curr->prot.present || (deviceWrites && !curr->prot.rw))
+        {
+            uint32_t ec = 0;
+            if (curr->prot.present && !curr->pagedOut)
+                ec |= PF_EC_PRESENT;
+            if (deviceWrites)
+                ec |= PF_EC_RW;
+            Core_SpinlockRelease(&ctx->lock, oldIrql);
+            status = Mm_HandlePageFault(ctx, addr, ec);
+            oldIrql = Core_SpinlockAcquireExplicit(&ctx->lock, IRQL_DISPATCH, true);
+            if (status == OBOS_STATUS_UNHANDLED)
+                status = OBOS_STATUS_ACCESS_DENIED;
+            if (obos_is_error(status))
+                break;
+            // The tree might have changed while we didn't hold the lock.
+            curr = find_page(ctx, addr);
+            if (!curr)
+            {
+                status = OBOS_STATUS_NOT_FOUND;
+                break;
+            }
+            if (addr == first->addr)
+                first = curr;
+        }
+        // The page now cannot be swapped out until the mapping is gone.
+        curr->pinCount++;
+        addr += curr->prot.huge_page ? OBOS_HUGE_PAGE_SIZE : OBOS_PAGE_SIZE;
+        curr = RB_NEXT(page_tree, &ctx->pages, curr);
+    }
+    if (obos_is_error(status))
+    {
+        if (addr != first->addr)
+            unpin_pages(ctx, first, addr);
+        Core_SpinlockRelease(&ctx->lock, oldIrql);
+        return status;
+    }
+    Core_SpinlockRelease(&ctx->lock, oldIrql);
+    mapping->ctx = ctx;
+    mapping->base = base;
+    mapping->size = size;
+    mapping->deviceWrites = deviceWrites;
+    mapping->first = first;
+    mapping->cursor.pg = first;
+    mapping->cursor.addr = first->addr;
+    return OBOS_STATUS_SUCCESS;
+}
+obos_status Mm_DMAGetScatterGatherList(dma_mapping* mapping, size_t offset, size_t size, size_t maxRegionSize, dma_region* regions, size_t maxRegions, size_t* nRegions, size_t* nBytes)
+{
+    if (!mapping || !mapping->first || !regions || !maxRegions || !nRegions)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    if (offset >= mapping->size)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    if (size > (mapping->size - offset))
+        size = mapping->size - offset;
+    if (!maxRegionSize)
+        maxRegionSize = SIZE_MAX;
+    uintptr_t addr = mapping->base + offset;
+    context* ctx = mapping->ctx;
+    // The pages are pinned, so the tree nodes we're walking over cannot go away, but the tree around them can change.
+    irql oldIrql = Core_SpinlockAcquireExplicit(&ctx->lock, IRQL_DISPATCH, true);
+    // Resume from where the last call left off if we can, otherwise walk from the start.
+    page* curr = mapping->cursor.pg;
+    if (addr < mapping->cursor.addr)
+        curr = mapping->first;
+    while (curr && (curr->addr + (curr->prot.huge_page ? OBOS_HUGE_PAGE_SIZE : OBOS_PAGE_SIZE)) <= addr)
+        curr = RB_NEXT(page_tree, &ctx->pages, curr);
+    if (!curr)
+    {
+        Core_SpinlockRelease(&ctx->lock, oldIrql);
+        return OBOS_STATUS_INTERNAL_ERROR;
+    }
+    mapping->cursor.pg = curr;
+    mapping->cursor.addr = curr->addr;
+    size_t nRegs = 0;
+    size_t bytesLeft = size;
+    while (bytesLeft && curr)
+    {
+        const size_t pgSize = curr->prot.huge_page ? OBOS_HUGE_PAGE_SIZE : OBOS_PAGE_SIZE;
+        // The buffer is translated through its own context, since this might not be called from it.
+        page info = {};
+        uintptr_t phys = 0;
+        MmS_QueryPageInfo(ctx->pt, curr->addr, &info, &phys);
+        OBOS_ASSERT(phys);
+        phys += (addr - curr->addr);
+        size_t chunk = pgSize - (addr - curr->addr);
+        if (chunk > bytesLeft)
+            chunk = bytesLeft;
+        while (chunk)
+        {
+            dma_region* last = nRegs ? &regions[nRegs - 1] : nullptr;
+            size_t taken = 0;
+            if (last && (last->phys + last->sz) == phys && last->sz < maxRegionSize)
+            {
+                taken = maxRegionSize - last->sz;
+                if (taken > chunk)
+                    taken = chunk;
+                last->sz += taken;
+            }
+            else
+            {
+                if (nRegs >= maxRegions)
+                    goto done;
+                taken = chunk > maxRegionSize ? maxRegionSize : chunk;
+                regions[nRegs].phys = phys;
+                regions[nRegs].sz = taken;
+                nRegs++;
+            }
+            phys += taken;
+            addr += taken;
+            chunk -= taken;
+            bytesLeft -= taken;
+        }
+        if (addr == (curr->addr + pgSize))
+        {
+            curr = RB_NEXT(page_tree, &ctx->pages, curr);
+            if (curr)
+            {
+                mapping->cursor.pg = curr;
+                mapping->cursor.addr = curr->addr;
+            }
+        }
+    }
+    done:
+    Core_SpinlockRelease(&ctx->lock, oldIrql);
+    *nRegions = nRegs;
+    if (nBytes)
+        *nBytes = size - bytesLeft;
+    return OBOS_STATUS_SUCCESS;
+}
+obos_status Mm_DMAUnmapBuffer(dma_mapping* mapping)
+{
+    if (!mapping || !mapping->ctx || !mapping->first)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    irql oldIrql = Core_SpinlockAcquireExplicit(&mapping->ctx->lock, IRQL_DISPATCH, true);
+    unpin_pages(mapping->ctx, mapping->first, mapping->base + mapping->size);
+    Core_SpinlockRelease(&mapping->ctx->lock, oldIrql);
+    memzero(mapping, sizeof(*mapping));
+    return OBOS_STATUS_SUCCESS;
+}
\ No newline at end of file
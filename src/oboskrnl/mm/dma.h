@@ -0,0 +1,72 @@
+/*
+ * oboskrnl/mm/dma.h
+ *
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+// Defines an interface for drivers to do DMA directly to/from a virtual buffer.
+
+#pragma once
+
+#include <int.h>
+#include <error.h>
+
+#include <mm/context.h>
+#include <mm/page.h>
+
+typedef struct dma_region
+{
+    uintptr_t phys;
+    size_t sz;
+} dma_region;
+typedef struct dma_mapping
+{
+    context* ctx;
+    uintptr_t base;
+    size_t size;
+    // Set if the device is going to write to the buffer.
+    bool deviceWrites;
+    // The page that contains 'base'.
+    page* first;
+    // Used by Mm_DMAGetScatterGatherList to resume a walk where the last call left off.
+    struct {
+        page* pg;
+        uintptr_t addr;
+    } cursor;
+} dma_mapping;
+
+/// <summary>
+/// Pins a buffer in memory for DMA.<para/>
+/// Every page in the buffer is made present, and is kept from being swapped out or remapped until the buffer is unmapped.<para/>
+/// While the buffer is mapped, Mm_VirtualMemoryFree and Mm_VirtualMemoryProtect fail with OBOS_STATUS_IN_USE on its pages.<para/>
+/// If the device writes to the buffer, any CoW pages in the buffer are copied beforehand.
+/// </summary>
+/// <param name="ctx">The context the buffer is in.</param>
+/// <param name="base">The base of the buffer. Does not need to be page aligned.</param>
+/// <param name="size">The size of the buffer, in bytes.</param>
+/// <param name="deviceWrites">Whether the device is going to write to the buffer (e.g., a disk read).</param>
+/// <param name="mapping">[out] The mapping. Cannot be nullptr.</param>
+/// <returns>The status of the function.</returns>
+OBOS_EXPORT obos_status Mm_DMAMapBuffer(context* ctx, void* base, size_t size, bool deviceWrites, dma_mapping* mapping);
+/// <summary>
+/// Gets the scatter-gather list of part of a buffer mapped with Mm_DMAMapBuffer.<para/>
+/// Physically contiguous pages are merged into one region, as long as the region does not exceed maxRegionSize.<para/>
+/// This does not allocate any memory, so it is safe to use in any I/O path.
+/// The buffer is translated through its own context, so this can be called from any thread.
+/// </summary>
+/// <param name="mapping">The mapping.</param>
+/// <param name="offset">The offset into the buffer to start at.</param>
+/// <param name="size">The maximum amount of bytes to describe.</param>
+/// <param name="maxRegionSize">The maximum size of one region, or zero for no limit.</param>
+/// <param name="regions">[out] The regions.</param>
+/// <param name="maxRegions">The amount of elements in 'regions'.</param>
+/// <param name="nRegions">[out] The amount of regions filled in.</param>
+/// <param name="nBytes">[out] The amount of bytes described by the regions. This can be less than 'size' if 'regions' is not big enough.</param>
+/// <returns>The status of the function.</returns>
+OBOS_EXPORT obos_status Mm_DMAGetScatterGatherList(dma_mapping* mapping, size_t offset, size_t size, size_t maxRegionSize, dma_region* regions, size_t maxRegions, size_t* nRegions, size_t* nBytes);
+/// <summary>
+/// Unpins a buffer mapped with Mm_DMAMapBuffer.
+/// </summary>
+/// <param name="mapping">The mapping.</param>
+/// <returns>The status of the function.</returns>
+OBOS_EXPORT obos_status Mm_DMAUnmapBuffer(dma_mapping* mapping);
\ No newline at end of file
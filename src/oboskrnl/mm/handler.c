@@ -72,56 +72,75 @@ static void handle_oom(context* ctx, size_t bytesNeeded, page* pg)
     // Return.
     return;
 }
-static obos_status copy_cow_page(context* ctx, page* page, struct page* other)
+// Puts a page that was just brought in on the referenced list.
+static void reference_page(context* ctx, page* page)
 {
-    void* addr = (void*)page->addr;
-    if (other->next_copied_page != page && other->prev_copied_page != page)
+    page->ln_node.data = page;
+    page->age |= 1;
+    page->prot.touched = false;
+    APPEND_PAGE_NODE(ctx->referenced, &page->ln_node);
+    // TODO: Try to figure out a better number based off the count of pages in the context/working-set.
+    const size_t threshold = (ctx->workingSet.capacity / 4) / OBOS_PAGE_SIZE;
+    if (ctx->referenced.nNodes >= threshold)
+        Mm_RunPRA(ctx);
+}
+// Gives 'page' a private copy of the frame it shares with other pages.
+// If nothing else references the frame anymore, it's simply made writable.
+static obos_status break_cow(context* ctx, page* page)
+{
+    uintptr_t phys = 0;
+    OBOSS_GetPagePhysicalAddress((void*)page->addr, &phys);
+    const bool fromZeroPage = phys == Mm_ZeroPage;
+    page->cow = false;
+    page->prot.rw = true;
+    if (Mm_IsPhysicalPageExclusive(phys))
     {
-        // The other page already did the hard work.
-        // We just need to update our page mappings.
-        uintptr_t phys = 0;
-        OBOSS_GetPagePhysicalAddress((void*)addr, &phys);
-        other->prot.rw = true;
+        // Everyone else already broke sharing with us.
         MmS_SetPageMapping(ctx->pt, page, phys);
         return OBOS_STATUS_SUCCESS;
     }
-    if (other->pagedOut)
-    {
-        // This is neat.
-        // We can just set prot.rw=true then finish.
-        other->prot.rw = true;
-        return OBOS_STATUS_SUCCESS;
-    }
-    // The other page gets the page, while we get a new one.
-    uintptr_t phys = page->addr;
-    OBOSS_GetPagePhysicalAddress((void*)addr, &phys);
     const size_t pgSize = page->prot.huge_page ? OBOS_HUGE_PAGE_SIZE : OBOS_PAGE_SIZE;
     obos_status status = OBOS_STATUS_SUCCESS;
     try_again:
     (void)0;
-    uintptr_t newPhys = Mm_AllocatePhysicalPages(pgSize/OBOS_PAGE_SIZE, pgSize/OBOS_PAGE_SIZE, &status);
+    uintptr_t newPhys = Mm_AllocatePhysicalPagesEx(pgSize/OBOS_PAGE_SIZE, pgSize/OBOS_PAGE_SIZE, fromZeroPage ? PHYS_ALLOC_ZEROED : 0, &status);
     if (obos_is_error(status) && status != OBOS_STATUS_NOT_ENOUGH_MEMORY)
-       return status;
+    {
+        page->cow = true;
+        page->prot.rw = false;
+        return status;
+    }
     if (status == OBOS_STATUS_NOT_ENOUGH_MEMORY)
     {
         handle_oom(ctx, pgSize, page);
         goto try_again;
     }
-    page->prot.rw = true;
+    if (!fromZeroPage)
+        memcpy(MmS_MapVirtFromPhys(newPhys), MmS_MapVirtFromPhys(phys), pgSize);
     MmS_SetPageMapping(ctx->pt, page, newPhys);
-    memcpy((void*)page->addr, MmS_MapVirtFromPhys(phys), pgSize);
-    other->prot.rw = true;
+    // The copy is ours, even if the frame we were sharing was borrowed.
+    if (!page->borrowed)
+        Mm_DereferencePhysicalPages(phys, pgSize/OBOS_PAGE_SIZE);
+    page->borrowed = false;
+    // This is the first time the page is backed by memory of its own, so the PRA needs
+    // to start tracking it, like it would after a swap in.
+    if (fromZeroPage && page->pageable)
+        reference_page(ctx, page);
     return OBOS_STATUS_SUCCESS;
 }
 obos_status Mm_HandlePageFault(context* ctx, uintptr_t addr, uint32_t ec)
 {
     OBOS_ASSERT(ctx);
     page what = {.addr=addr};
-    page* page = RB_FIND(page_tree, &ctx->pages, &what);
+    // The lookup caches the page it found in the context, so it has to be done with the lock held.
+    irql oldIrql = Core_SpinlockAcquire(&ctx->lock);
+    page* page = MmH_LookupPage(ctx, addr);
     if (!page)
+    {
+        Core_SpinlockRelease(&ctx->lock, oldIrql);
         return OBOS_STATUS_UNHANDLED;
+    }
     bool handled = false;
-    irql oldIrql = Core_SpinlockAcquire(&ctx->lock);
     bool requiresPageIn = false;
     OBOS_UNUSED(requiresPageIn);
     // To not waste time, check if the access is even allowed in the first place.
@@ -130,7 +149,6 @@ obos_status Mm_HandlePageFault(context* ctx, uintptr_t addr, uint32_t ec)
         Core_SpinlockRelease(&ctx->lock, oldIrql);
         return OBOS_STATUS_UNHANDLED; // TODO: Signal the thread.
     }
-    // if (ec & PF_EC_RW && !page->prot.rw && !(page->prev_copied_page || page->next_copied_page))
     if (ec & PF_EC_RW && page->prot.ro)
     {
         Core_SpinlockRelease(&ctx->lock, oldIrql);
@@ -160,46 +178,20 @@ obos_status Mm_HandlePageFault(context* ctx, uintptr_t addr, uint32_t ec)
             goto try_again1;
         }
         Mm_KernelContext.stat.paged -= (page->prot.huge_page ? OBOS_HUGE_PAGE_SIZE : OBOS_PAGE_SIZE);
-        page->ln_node.data = page;
-        page->age |= 1;
-        page->prot.touched = false;
-        APPEND_PAGE_NODE(ctx->referenced, &page->ln_node);
-        // TODO: Try to figure out a better number based off the count of pages in the context/working-set.
-        const size_t threshold = (ctx->workingSet.capacity / 4) / OBOS_PAGE_SIZE;
-        if (ctx->referenced.nNodes >= threshold)
-            Mm_RunPRA(ctx);
+        reference_page(ctx, page);
     }
-    if ((page->next_copied_page || page->prev_copied_page) && ec & PF_EC_RW)
+    if (page->cow && (ec & PF_EC_RW) && !page->pagedOut)
     {
         handled = true;
-        // CoW.
-        for (struct page* cur = page->next_copied_page; cur; )
-        {
-            copy_cow_page(ctx, cur->prev_copied_page, cur);
-            struct page* next = cur->next_copied_page;
-            if (cur->prev_copied_page)
-                cur->prev_copied_page->next_copied_page = cur->next_copied_page;
-            if (cur->next_copied_page)
-                cur->next_copied_page->prev_copied_page = cur->prev_copied_page;
-            cur->next_copied_page = nullptr;
-            cur->prev_copied_page = nullptr;
-            cur = next;
-        }
-        for (struct page* cur = page->prev_copied_page; cur; )
+        obos_status status = break_cow(ctx, page);
+        if (obos_is_error(status))
         {
-            copy_cow_page(ctx, cur->next_copied_page, cur);
-            struct page* next = cur->prev_copied_page;
-            if (cur->prev_copied_page)
-                cur->prev_copied_page->next_copied_page = cur->next_copied_page;
-            if (cur->next_copied_page)
-                cur->next_copied_page->prev_copied_page = cur->prev_copied_page;
-            cur->next_copied_page = nullptr;
-            cur->prev_copied_page = nullptr;
-            cur = next;
+            Core_SpinlockRelease(&ctx->lock, oldIrql);
+            return status;
         }
     }
     Core_SpinlockRelease(&ctx->lock, oldIrql);
-    if (page->region && !(ec & PF_EC_PRESENT))
+    if (page->region && !(ec & PF_EC_PRESENT) && !requiresPageIn)
     {
         // We need to map part of the file in.
         handled = true;
@@ -223,18 +215,18 @@ obos_status Mm_HandlePageFault(context* ctx, uintptr_t addr, uint32_t ec)
         {
             // Simply make both this page, and the page cache's page mapped as CoW
             uintptr_t pagePhys = 0;
-            if (pc_page->next_copied_page)
-                pc_page->next_copied_page->prev_copied_page = page;
-            page->next_copied_page = pc_page->next_copied_page;
-            page->prev_copied_page = pc_page;
-            pc_page->next_copied_page = page;
-            page->prot.rw = page->prot.ro;
-            pc_page->prot.rw = pc_page->prot.ro;
+            OBOSS_GetPagePhysicalAddress(pagecache_region, &pagePhys);
+            if (!page->prot.ro)
+            {
+                page->cow = true;
+                pc_page->cow = true;
+                page->prot.rw = false;
+                pc_page->prot.rw = false;
+            }
+            Mm_ReferencePhysicalPage(pagePhys);
             page->prot.present = true;
             pc_page->prot.present = true;
-            OBOSS_GetPagePhysicalAddress((void*)page->addr, &pagePhys);
             MmS_SetPageMapping(ctx->pt, page, pagePhys);
-            OBOSS_GetPagePhysicalAddress(pagecache_region, &pagePhys);
             MmS_SetPageMapping(Mm_KernelContext.pt, pc_page, pagePhys);
         }
         else 
@@ -298,7 +290,7 @@ obos_status Mm_RunPRA(context* ctx)
         OBOS_ASSERT(page);
         if (page->pagedOut)
             OBOS_Panic(OBOS_PANIC_FATAL_ERROR, "Page 0x%p is in working set, and is paged out.\n", (void*)page->addr);
-        MmS_QueryPageInfo(ctx->pt, page->addr, page);
+        MmS_QueryPageInfo(ctx->pt, page->addr, page, nullptr);
         if (page->prot.touched)
             page->age |= 1;
         page->age <<= 1;
@@ -355,8 +347,8 @@ obos_status Mm_RunPRA(context* ctx)
         else
         {
             // This page needs to be swapped out as well as removed from the referenced list.
-            Mm_SwapOut(page);
-            ctx->stat.paged += (page->prot.huge_page ? OBOS_HUGE_PAGE_SIZE : OBOS_PAGE_SIZE);
+            if (obos_is_success(Mm_SwapOut(page)))
+                ctx->stat.paged += (page->prot.huge_page ? OBOS_HUGE_PAGE_SIZE : OBOS_PAGE_SIZE);
         }
         node = next;
     }
@@ -34,16 +34,17 @@ typedef struct page
         bool ro : 1;                        // If set, this page was originally allocated as read-only. This is only used in CoW pages as of now.
     } prot;                                 // The protection of the page.
     size_t workingSets : 16;                // The amount of working sets the page is in.
+    size_t pinCount : 16;                   // The amount of DMA mappings that have this page pinned. If non-zero, the page cannot be swapped out.
     bool pageable : 1;                      // If set, the page is pageable.
     bool pagedOut : 1;                      // If set, the page is paged out.
     bool isGuardPage : 1;                   // If set, the page is a guard page.
     bool allocated : 1;                     // If set, this object was allocated by Mm_Allocator.
     bool reserved : 1;                      // If set, this object is reserved memory (i.e., not backed by anything).
+    bool borrowed : 1;                      // If set, the physical page is not owned by the memory manager (e.g., it is part of the InitRD), and is never freed.
+    bool cow : 1;                           // If set, the physical page might be shared with other pages, and is kept read-only until a write breaks the sharing.
     uint8_t age : 8;                        // The page's age
     uintptr_t addr : PTR_BITS;              // The page's address.
     uintptr_t swapId : PTR_BITS;            // The page's swap allocation id. Only valid if pagedOut == true.
-    struct page* next_copied_page;          // If CoW is enabled on this page, this contains the pointer to the next page we're sharing data with.
-    struct page* prev_copied_page;          // If CoW is enabled on this page, this contains the pointer to the previous page we're sharing data with.
 } page;
 typedef struct page_list
 {
@@ -51,17 +52,12 @@ typedef struct page_list
     size_t nNodes;
 } page_list;
 typedef RB_HEAD(page_tree, page) page_tree;
-#pragma GCC push_options
-#pragma GCC optimize ("-O0")
+// Branchless, so that it can be inlined into the tree functions.
 inline static int pg_cmp_pages(const page* left, const page* right)
 {
-    if (left->addr == right->addr)
-        return 0;
-    return (left->addr < right->addr) ? -1 : 1;
-    // return (intptr_t)left->addr - (intptr_t)right->addr;
+    return (left->addr > right->addr) - (left->addr < right->addr);
 }
-#pragma GCC pop_options
-RB_PROTOTYPE_INTERNAL(page_tree, page, rb_node, pg_cmp_pages, __attribute__((noinline)));
+RB_PROTOTYPE_INTERNAL(page_tree, page, rb_node, pg_cmp_pages, );
 #define APPEND_PAGE_NODE(list, node) do {\
 	(node)->next = nullptr;\
 	(node)->prev = nullptr;\
@@ -0,0 +1,204 @@
+/*
+ * oboskrnl/mm/page_zeroer.c
+ *
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+// Keeps a pool of already zeroed physical pages for each CPU, so that callers that need
+// zeroed memory (page tables, the first write to anonymous memory, etc.) don't need to
+// zero it themselves.
+// Each pool is refilled by a thread at idle priority, which is woken once the pool runs low.
+
+#include <int.h>
+#include <error.h>
+#include <klog.h>
+#include <memmanip.h>
+
+#include <mm/pmm.h>
+#include <mm/bare_map.h>
+#include <mm/alloc.h>
+#include <mm/context.h>
+
+#include <scheduler/cpu_local.h>
+#include <scheduler/thread.h>
+#include <scheduler/process.h>
+#include <scheduler/thread_context_info.h>
+
+#include <locks/spinlock.h>
+#include <locks/event.h>
+#include <locks/wait.h>
+
+#include <irq/irql.h>
+
+// The amount of pages each pool can hold.
+#define ZEROED_POOL_CAPACITY (64)
+// Once a pool has this many pages or less, its thread is woken up to refill it.
+#define ZEROED_POOL_LOW_WATER (16)
+// The pools aren't refilled while there's less than this many free pages, so that they
+// don't hoard memory the rest of the system needs.
+#define ZEROED_POOL_MIN_FREE_PAGES (1024)
+
+typedef struct zeroed_pool
+{
+    spinlock lock;
+    uintptr_t pages[ZEROED_POOL_CAPACITY];
+    size_t nPages;
+    event refill;
+    thread* worker;
+    void* workerStack;
+} zeroed_pool;
+static zeroed_pool* s_pools;
+static size_t s_nPools;
+
+// Zeroes the page with non-temporal stores, so that zeroing doesn't evict
+// anything useful from the cache.
+static void zero_page(void* page)
+{
+#ifdef __x86_64__
+    uint64_t* buf = page;
+    for (size_t i = 0; i < OBOS_PAGE_SIZE/sizeof(uint64_t); i += 4)
+        asm volatile(
+            "movnti %1, 0(%0);"
+            "movnti %1, 8(%0);"
+            "movnti %1, 16(%0);"
+            "movnti %1, 24(%0);"
+            : : "r"(buf + i), "r"((uint64_t)0) : "memory");
+    // Non-temporal stores are weakly ordered, so they need to be visible before anyone
+    // is able to take the page out of the pool.
+    asm volatile("sfence" : : : "memory");
+#else
+    memzero(page, OBOS_PAGE_SIZE);
+#endif
+}
+static zeroed_pool* get_pool()
+{
+    if (!s_pools)
+        return nullptr;
+    // CPU ids are not necessarily contiguous, so the pools are indexed the same way as Core_CpuInfo.
+    cpu_local* cpu = CoreS_GetCPULocalPtr();
+    if (!cpu || cpu < Core_CpuInfo || (size_t)(cpu - Core_CpuInfo) >= s_nPools)
+        return nullptr;
+    return &s_pools[cpu - Core_CpuInfo];
+}
+static uintptr_t pop_page(zeroed_pool* pool)
+{
+    uintptr_t phys = 0;
+    irql oldIrql = Core_SpinlockAcquireExplicit(&pool->lock, IRQL_DISPATCH, true);
+    if (pool->nPages)
+        phys = pool->pages[--pool->nPages];
+    bool needsRefill = pool->nPages <= ZEROED_POOL_LOW_WATER;
+    Core_SpinlockRelease(&pool->lock, oldIrql);
+    // If we can't signal the thread at this IRQL, the next allocation will.
+    if (needsRefill && Core_GetIrql() <= IRQL_DISPATCH)
+        Core_EventSet(&pool->refill, false);
+    return phys;
+}
+uintptr_t MmH_PopZeroedPage()
+{
+    // NOTE: We might be moved to another CPU after getting the pool, which doesn't matter
+    // since the pools are locked.
+    zeroed_pool* pool = get_pool();
+    if (!pool)
+        return 0;
+    return pop_page(pool);
+}
+uintptr_t MmH_ReclaimZeroedPage()
+{
+    for (size_t i = 0; i < s_nPools; i++)
+    {
+        uintptr_t phys = pop_page(&s_pools[i]);
+        if (phys)
+            return phys;
+    }
+    return 0;
+}
+static void refill_pool(zeroed_pool* pool)
+{
+    while (pool->nPages < ZEROED_POOL_CAPACITY)
+    {
+        if ((Mm_TotalPhysicalPages - Mm_TotalPhysicalPagesUsed) < ZEROED_POOL_MIN_FREE_PAGES)
+            break;
+        obos_status status = OBOS_STATUS_SUCCESS;
+        uintptr_t phys = Mm_AllocatePhysicalPages(1, 1, &status);
+        if (obos_is_error(status))
+            break;
+        zero_page(MmS_MapVirtFromPhys(phys));
+        irql oldIrql = Core_SpinlockAcquireExplicit(&pool->lock, IRQL_DISPATCH, true);
+        if (pool->nPages < ZEROED_POOL_CAPACITY)
+        {
+            pool->pages[pool->nPages++] = phys;
+            phys = 0;
+        }
+        Core_SpinlockRelease(&pool->lock, oldIrql);
+        if (phys)
+        {
+            // Someone else filled the pool.
+            Mm_FreePhysicalPages(phys, 1);
+            break;
+        }
+    }
+}
+static void zeroer_thread(zeroed_pool* pool)
+{
+    while (1)
+    {
+        Core_WaitOnObject(WAITABLE_OBJECT(pool->refill));
+        Core_EventClear(&pool->refill);
+        refill_pool(pool);
+    }
+}
+obos_status Mm_InitializeZeroedPagePools()
+{
+    if (s_pools)
+        return OBOS_STATUS_ALREADY_INITIALIZED;
+    obos_status status = OBOS_STATUS_SUCCESS;
+    zeroed_pool* pools = Mm_Allocator->ZeroAllocate(Mm_Allocator, Core_CpuCount, sizeof(zeroed_pool), &status);
+    if (obos_is_error(status))
+        return status;
+    size_t nInitialized = 0;
+    for (; nInitialized < Core_CpuCount; nInitialized++)
+    {
+        zeroed_pool* pool = &pools[nInitialized];
+        pool->lock = Core_SpinlockCreate();
+        pool->refill = EVENT_INITIALIZE(EVENT_NOTIFICATION);
+        pool->worker = CoreH_ThreadAllocate(&status);
+        if (!pool->worker)
+            goto fail;
+        pool->workerStack = Mm_VirtualMemoryAlloc(&Mm_KernelContext, nullptr, 0x4000, 0, VMA_FLAGS_KERNEL_STACK, nullptr, &status);
+        if (!pool->workerStack)
+        {
+            pool->worker->free(pool->worker);
+            goto fail;
+        }
+        thread_ctx ctx = {};
+        CoreS_SetupThreadContext(
+            &ctx,
+            (uintptr_t)zeroer_thread, (uintptr_t)pool,
+            false,
+            pool->workerStack,
+            0x4000);
+        CoreH_ThreadInitialize(pool->worker, THREAD_PRIORITY_IDLE, CoreH_CPUIdToAffinity(Core_CpuInfo[nInitialized].id), &ctx);
+        pool->worker->stackFree = CoreH_VMAStackFree;
+        pool->worker->stackFreeUserdata = &Mm_KernelContext;
+        // Fill the pool for the first time.
+        Core_EventSet(&pool->refill, false);
+    }
+    s_nPools = Core_CpuCount;
+    s_pools = pools;
+    // The threads are only made visible once all of them exist, so that a failure can simply free them.
+    for (size_t i = 0; i < s_nPools; i++)
+    {
+        Core_ProcessAppendThread(OBOS_KernelProcess, s_pools[i].worker);
+        CoreH_ThreadReady(s_pools[i].worker);
+    }
+    return OBOS_STATUS_SUCCESS;
+
+    fail:
+    for (size_t i = 0; i < nInitialized; i++)
+    {
+        Mm_VirtualMemoryFree(&Mm_KernelContext, pools[i].workerStack, 0x4000);
+        pools[i].worker->free(pools[i].worker);
+    }
+    Mm_Allocator->Free(Mm_Allocator, pools, Core_CpuCount*sizeof(zeroed_pool));
+    return obos_is_error(status) ? status : OBOS_STATUS_NOT_ENOUGH_MEMORY;
+}
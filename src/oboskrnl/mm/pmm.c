@@ -17,34 +17,191 @@
 
 #include <mm/pmm.h>
 
+#include <scheduler/cpu_local.h>
+
 struct freelist_node
 {
 	size_t nPages;
 	struct freelist_node *next, *prev;
 };
-static struct freelist_node *s_head;
-static struct freelist_node *s_tail;
+typedef struct pmm_node
+{
+	uint32_t domain;
+	struct freelist_node *head;
+	struct freelist_node *tail;
 #if OBOS_ARCHITECTURE_BITS == 64
-
-// 32-bit region start
-static struct freelist_node *s_head32;
-// 32-bit region tail
-static struct freelist_node *s_tail32;
-
+	// 32-bit region start
+	struct freelist_node *head32;
+	// 32-bit region tail
+	struct freelist_node *tail32;
 #endif
+	size_t nPages;
+	size_t nFreePages;
+	// The indices of every node, closest first. The first entry is always this node.
+	uint8_t fallback[OBOS_MAX_NUMA_NODES];
+} pmm_node;
+static pmm_node s_numaNodes[OBOS_MAX_NUMA_NODES];
+uint32_t Mm_NumaNodeCount;
+// Indexed by node index. Zero if the firmware didn't give a distance.
+static uint8_t s_numaDistances[OBOS_MAX_NUMA_NODES][OBOS_MAX_NUMA_NODES];
+static struct {
+	uintptr_t base;
+	uintptr_t top;
+	uint32_t node;
+} s_numaRanges[OBOS_MAX_NUMA_MEMORY_RANGES];
+static size_t s_nNumaRanges;
 static size_t s_nNodes;
 size_t Mm_TotalPhysicalPages;
 size_t Mm_TotalPhysicalPagesUsed;
 size_t Mm_UsablePhysicalPages;
 uintptr_t Mm_PhysicalMemoryBoundaries;
 thread_list Mm_ThreadsAwaitingPhysicalMemory;
+page_frame* Mm_PageFrameDatabase;
+size_t Mm_PageFrameCount;
+uintptr_t Mm_ZeroPage;
 static spinlock lock;
 
+static obos_status initialize_pfndb(uintptr_t usableEnd)
+{
+	size_t nFrames = usableEnd / OBOS_PAGE_SIZE;
+	size_t nPages = (nFrames * sizeof(page_frame) + OBOS_PAGE_SIZE - 1) / OBOS_PAGE_SIZE;
+	obos_status status = OBOS_STATUS_SUCCESS;
+	uintptr_t phys = Mm_AllocatePhysicalPages(nPages, 1, &status);
+	if (obos_is_error(status))
+		return status;
+	page_frame* db = (page_frame*)MmS_MapVirtFromPhys(phys);
+	memzero(db, nPages * OBOS_PAGE_SIZE);
+	Mm_PageFrameCount = nFrames;
+	Mm_PageFrameDatabase = db;
+	OBOS_Debug("%s: Page frame database at 0x%p, tracking %d frames.\n", __func__, phys, nFrames);
+	return OBOS_STATUS_SUCCESS;
+}
+static obos_status initialize_zero_page()
+{
+	obos_status status = OBOS_STATUS_SUCCESS;
+	uintptr_t phys = Mm_AllocatePhysicalPages(1, 1, &status);
+	if (obos_is_error(status))
+		return status;
+	memzero(MmS_MapVirtFromPhys(phys), OBOS_PAGE_SIZE);
+	// The zero page belongs to nobody, so it can never be freed, nor made writable
+	// by the last page sharing it.
+	page_frame* frame = Mm_GetPageFrame(phys);
+	if (frame)
+	{
+		frame->flags = 0;
+		atomic_store(&frame->refcount, 0);
+	}
+	Mm_ZeroPage = phys;
+	return OBOS_STATUS_SUCCESS;
+}
+
+uint32_t MmH_GetNumaNode(uint32_t domain)
+{
+	for (uint32_t i = 0; i < Mm_NumaNodeCount; i++)
+		if (s_numaNodes[i].domain == domain)
+			return i;
+	if (Mm_NumaNodeCount >= OBOS_MAX_NUMA_NODES)
+		return UINT32_MAX;
+	s_numaNodes[Mm_NumaNodeCount].domain = domain;
+	return Mm_NumaNodeCount++;
+}
+obos_status MmH_AddNumaMemoryRange(uint32_t domain, uintptr_t base, size_t size)
+{
+	if (!size)
+		return OBOS_STATUS_INVALID_ARGUMENT;
+	if (s_nNumaRanges >= OBOS_MAX_NUMA_MEMORY_RANGES)
+		return OBOS_STATUS_NOT_ENOUGH_MEMORY;
+	uint32_t node = MmH_GetNumaNode(domain);
+	if (node == UINT32_MAX)
+		return OBOS_STATUS_NOT_ENOUGH_MEMORY;
+	s_numaRanges[s_nNumaRanges].base = base;
+	s_numaRanges[s_nNumaRanges].top = base + size;
+	s_numaRanges[s_nNumaRanges].node = node;
+	s_nNumaRanges++;
+	return OBOS_STATUS_SUCCESS;
+}
+obos_status MmH_SetNumaDistance(uint32_t fromDomain, uint32_t toDomain, uint8_t distance)
+{
+	uint32_t from = MmH_GetNumaNode(fromDomain);
+	uint32_t to = MmH_GetNumaNode(toDomain);
+	if (from == UINT32_MAX || to == UINT32_MAX)
+		return OBOS_STATUS_NOT_ENOUGH_MEMORY;
+	s_numaDistances[from][to] = distance;
+	return OBOS_STATUS_SUCCESS;
+}
+static uint8_t numa_distance(uint32_t from, uint32_t to)
+{
+	if (s_numaDistances[from][to])
+		return s_numaDistances[from][to];
+	return from == to ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+}
+static void build_fallback_lists()
+{
+	for (uint32_t i = 0; i < Mm_NumaNodeCount; i++)
+	{
+		uint8_t* fallback = s_numaNodes[i].fallback;
+		// Insertion sort by distance. Ties keep their order, so this node stays first.
+		fallback[0] = i;
+		size_t n = 1;
+		for (uint32_t j = 0; j < Mm_NumaNodeCount; j++)
+		{
+			if (j == i)
+				continue;
+			size_t k = n++;
+			for (; k > 1 && numa_distance(i, fallback[k-1]) > numa_distance(i, j); k--)
+				fallback[k] = fallback[k-1];
+			fallback[k] = j;
+		}
+	}
+}
+// Returns the node that 'addr' is in, and how many of the pages starting at 'addr' are in that node.
+static pmm_node* node_for_range(uintptr_t addr, size_t nPages, size_t* nPagesInNode)
+{
+	uintptr_t top = addr + nPages * OBOS_PAGE_SIZE;
+	uint32_t node = 0;
+	for (size_t i = 0; i < s_nNumaRanges; i++)
+	{
+		if (addr >= s_numaRanges[i].base && addr < s_numaRanges[i].top)
+		{
+			node = s_numaRanges[i].node;
+			if (top > s_numaRanges[i].top)
+				top = s_numaRanges[i].top;
+			break;
+		}
+		// Memory outside of any range goes to the first node, up until the next range.
+		if (s_numaRanges[i].base > addr && s_numaRanges[i].base < top)
+			top = s_numaRanges[i].base;
+	}
+	*nPagesInNode = (top - addr + OBOS_PAGE_SIZE - 1) / OBOS_PAGE_SIZE;
+	return &s_numaNodes[node];
+}
+static uint32_t current_node()
+{
+	if (Mm_NumaNodeCount <= 1)
+		return 0;
+	cpu_local* cpu = CoreS_GetCPULocalPtr();
+	return cpu ? cpu->numaNode : 0;
+}
+obos_status Mm_GetNumaNodeStats(uint32_t node, numa_node_stats* stats)
+{
+	if (node >= Mm_NumaNodeCount || !stats)
+		return OBOS_STATUS_INVALID_ARGUMENT;
+	irql oldIrql = Core_SpinlockAcquireExplicit(&lock, IRQL_DISPATCH, true);
+	stats->domain = s_numaNodes[node].domain;
+	stats->nPages = s_numaNodes[node].nPages;
+	stats->nFreePages = s_numaNodes[node].nFreePages;
+	Core_SpinlockRelease(&lock, oldIrql);
+	return OBOS_STATUS_SUCCESS;
+}
 obos_status Mm_InitializePMM()
 {
 	uintptr_t i = 0;
+	uintptr_t usableEnd = 0;
 	if (!MmS_GetFirstPMemMapEntry(&i))
 		return OBOS_STATUS_INVALID_INIT_PHASE;
+	if (!Mm_NumaNodeCount)
+		MmH_GetNumaNode(0);
+	build_fallback_lists();
 	for (obos_pmem_map_entry* entry = MmS_GetFirstPMemMapEntry(&i); entry; )
 	{
 		uintptr_t phys = entry->pmem_map_base;
@@ -69,6 +226,8 @@ obos_status Mm_InitializePMM()
 			continue;
 		}
 		Mm_UsablePhysicalPages += nPages;
+		if ((phys + nPages * OBOS_PAGE_SIZE) > usableEnd)
+			usableEnd = (phys + nPages * OBOS_PAGE_SIZE);
 		// struct freelist_node* node = (struct freelist_node*)(MmS_MapVirtFromPhys(phys));
 		// memzero(node, sizeof(*node));
 		// node->nPages = nPages;
@@ -87,7 +246,16 @@ obos_status Mm_InitializePMM()
 	if (Mm_PhysicalMemoryBoundaries & 4294967295)
 		Mm_PhysicalMemoryBoundaries = (Mm_PhysicalMemoryBoundaries + 4294967295) & ~4294967295;
 #endif
-	return OBOS_STATUS_SUCCESS;
+	for (uint32_t node = 0; node < Mm_NumaNodeCount; node++)
+	{
+		s_numaNodes[node].nPages = s_numaNodes[node].nFreePages;
+		if (Mm_NumaNodeCount > 1)
+			OBOS_Debug("%s: NUMA node %d (domain %d) has %d KiB of memory.\n", __func__, node, s_numaNodes[node].domain, s_numaNodes[node].nPages*OBOS_PAGE_SIZE/1024);
+	}
+	obos_status status = initialize_pfndb(usableEnd);
+	if (obos_is_error(status))
+		return status;
+	return initialize_zero_page();
 }
 static bool IsRegionSufficient(struct freelist_node* node, size_t nPages, size_t alignmentMask, size_t *nPagesRequiredP)
 {
@@ -102,7 +270,7 @@ static bool IsRegionSufficient(struct freelist_node* node, size_t nPages, size_t
 }
 #define MAP_TO_HHDM(addr, type) ((type*)(MmS_MapVirtFromPhys((uintptr_t)(addr))))
 #define UNMAP_FROM_HHDM(addr) (MmS_UnmapVirtFromPhys((void*)(addr)))
-OBOS_NO_KASAN static uintptr_t allocate(size_t nPages, size_t alignmentPages, obos_status *status, struct freelist_node** const head, struct freelist_node** const tail)
+OBOS_NO_KASAN static uintptr_t allocate(size_t nPages, size_t alignmentPages, obos_status *status, pmm_node* pnode, struct freelist_node** const head, struct freelist_node** const tail)
 {
 	if (!nPages)
 	{
@@ -142,6 +310,7 @@ OBOS_NO_KASAN static uintptr_t allocate(size_t nPages, size_t alignmentPages, ob
 	OBOS_ASSERT(node->nPages >= nPagesRequired);
 	node->nPages -= nPagesRequired;
 	Mm_TotalPhysicalPagesUsed += nPagesRequired;
+	pnode->nFreePages -= nPagesRequired;
 	if (!node->nPages)
 	{
 		if (node->next)
@@ -158,6 +327,14 @@ OBOS_NO_KASAN static uintptr_t allocate(size_t nPages, size_t alignmentPages, ob
 	phys = UNMAP_FROM_HHDM(phys);
 	if (!node->nPages)
 		memzero(node, sizeof(*node));
+	if (Mm_PageFrameDatabase)
+	{
+		for (size_t pfn = phys / OBOS_PAGE_SIZE; pfn < (phys / OBOS_PAGE_SIZE + nPages) && pfn < Mm_PageFrameCount; pfn++)
+		{
+			atomic_store(&Mm_PageFrameDatabase[pfn].refcount, 1);
+			Mm_PageFrameDatabase[pfn].flags = PAGE_FRAME_ALLOCATED;
+		}
+	}
 	if (status)
 		*status = OBOS_STATUS_SUCCESS;
 	Core_SpinlockRelease(&lock, oldIrql);
@@ -167,26 +344,78 @@ OBOS_NO_KASAN static uintptr_t allocate(size_t nPages, size_t alignmentPages, ob
 }
 OBOS_NO_KASAN uintptr_t Mm_AllocatePhysicalPages(size_t nPages, size_t alignmentPages, obos_status *status)
 {
-	uintptr_t res = allocate(nPages, alignmentPages, status, &s_head, &s_tail);
+	return Mm_AllocatePhysicalPagesOnNode(current_node(), nPages, alignmentPages, status);
+}
+OBOS_NO_KASAN uintptr_t Mm_AllocatePhysicalPagesOnNode(uint32_t node, size_t nPages, size_t alignmentPages, obos_status *status)
+{
+	if (node >= Mm_NumaNodeCount)
+		node = 0;
+	const uint8_t* fallback = s_numaNodes[node].fallback;
+	uintptr_t res = 0;
+	// Memory above 4GiB is used up first on every node, since memory below 4GiB is needed for 32-bit DMA.
+	for (uint32_t i = 0; i < Mm_NumaNodeCount && !res; i++)
+	{
+		pmm_node* pnode = &s_numaNodes[fallback[i]];
+		if (status)
+			*status = OBOS_STATUS_SUCCESS;
+		res = allocate(nPages, alignmentPages, status, pnode, &pnode->head, &pnode->tail);
+	}
 	if (res)
 		return res;
 #if OBOS_ARCHITECTURE_BITS == 64
-	if (status)
-		*status = OBOS_STATUS_SUCCESS;
-	return allocate(nPages, alignmentPages, status, &s_head32, &s_tail32);
-#else
-	return 0;
+	for (uint32_t i = 0; i < Mm_NumaNodeCount && !res; i++)
+	{
+		pmm_node* pnode = &s_numaNodes[fallback[i]];
+		if (status)
+			*status = OBOS_STATUS_SUCCESS;
+		res = allocate(nPages, alignmentPages, status, pnode, &pnode->head32, &pnode->tail32);
+	}
+	if (res)
+		return res;
 #endif
+	// The zeroed page pools are still free memory, just prepared in advance.
+	if (nPages == 1 && (res = MmH_ReclaimZeroedPage()))
+	{
+		if (status)
+			*status = OBOS_STATUS_SUCCESS;
+	}
+	return res;
+}
+uintptr_t Mm_AllocatePhysicalPagesEx(size_t nPages, size_t alignmentPages, uint32_t flags, obos_status* status)
+{
+	if ((flags & PHYS_ALLOC_ZEROED) && nPages == 1 && alignmentPages <= 1)
+	{
+		uintptr_t phys = MmH_PopZeroedPage();
+		if (phys)
+		{
+			if (status)
+				*status = OBOS_STATUS_SUCCESS;
+			return phys;
+		}
+	}
+	uintptr_t phys = Mm_AllocatePhysicalPages(nPages, alignmentPages, status);
+	if (phys && (flags & PHYS_ALLOC_ZEROED))
+		memzero(MmS_MapVirtFromPhys(phys), nPages * OBOS_PAGE_SIZE);
+	return phys;
 }
 OBOS_NO_KASAN uintptr_t Mm_AllocatePhysicalPages32(size_t nPages, size_t alignmentPages, obos_status *status)
 {
 #if OBOS_ARCHITECTURE_BITS == 64
-	return allocate(nPages, alignmentPages, status, &s_head32, &s_tail32);
+	const uint8_t* fallback = s_numaNodes[current_node()].fallback;
+	uintptr_t res = 0;
+	for (uint32_t i = 0; i < Mm_NumaNodeCount && !res; i++)
+	{
+		pmm_node* pnode = &s_numaNodes[fallback[i]];
+		if (status)
+			*status = OBOS_STATUS_SUCCESS;
+		res = allocate(nPages, alignmentPages, status, pnode, &pnode->head32, &pnode->tail32);
+	}
+	return res;
 #else
 	return Mm_AllocatePhysicalPages(nPages, alignmentPages, status);
 #endif
 }
-OBOS_NO_KASAN static obos_status free(uintptr_t addr, size_t nPages, struct freelist_node** const head, struct freelist_node** const tail)
+OBOS_NO_KASAN static obos_status free(uintptr_t addr, size_t nPages, pmm_node* pnode, struct freelist_node** const head, struct freelist_node** const tail)
 {
 	if (!nPages)
 		return OBOS_STATUS_SUCCESS; // nothing freed, no-op.
@@ -201,6 +430,7 @@ OBOS_NO_KASAN static obos_status free(uintptr_t addr, size_t nPages, struct free
 	(*tail) = (struct freelist_node*)UNMAP_FROM_HHDM(node);
 	s_nNodes--;
 	Mm_TotalPhysicalPagesUsed -= nPages;
+	pnode->nFreePages += nPages;
 	Core_SpinlockRelease(&lock, oldIrql);
 	return OBOS_STATUS_SUCCESS;
 }
@@ -212,24 +442,45 @@ OBOS_NO_KASAN obos_status Mm_FreePhysicalPages(uintptr_t addr, size_t nPages)
 	addr -= (addr%OBOS_PAGE_SIZE);
 	if (!addr)
 		return OBOS_STATUS_INVALID_ARGUMENT;
-#if OBOS_ARCHITECTURE_BITS == 64
-	if (addr < 0xffffffff)
+	if (Mm_PageFrameDatabase)
 	{
-		if ((addr + (nPages*OBOS_PAGE_SIZE)) >= 0xffffffff)
+		for (size_t pfn = addr / OBOS_PAGE_SIZE; pfn < (addr / OBOS_PAGE_SIZE + nPages) && pfn < Mm_PageFrameCount; pfn++)
 		{
-			size_t pages = ((addr + (nPages*OBOS_PAGE_SIZE)) & ~0xffffffff) / OBOS_PAGE_SIZE;
-			free(0x100000000, pages, &s_head, &s_tail);
-			nPages -= pages;
-			OBOS_ASSERT((addr + (nPages*OBOS_PAGE_SIZE)) < 0xffffffff);
+			atomic_store(&Mm_PageFrameDatabase[pfn].refcount, 0);
+			Mm_PageFrameDatabase[pfn].flags = 0;
+			Mm_PageFrameDatabase[pfn].rmap = nullptr;
 		}
-		if (nPages)
-			free(addr, nPages, &s_head32, &s_tail32);
 	}
-	else
-		free(addr, nPages, &s_head, &s_tail);
+	const size_t nPagesFreed = nPages;
+	// The range might span multiple NUMA nodes, so give each node its part.
+	while (nPages)
+	{
+		size_t nPagesInNode = 0;
+		pmm_node* pnode = node_for_range(addr, nPages, &nPagesInNode);
+		uintptr_t chunk = addr;
+		size_t nChunkPages = nPagesInNode;
+		addr += nPagesInNode * OBOS_PAGE_SIZE;
+		nPages -= nPagesInNode;
+#if OBOS_ARCHITECTURE_BITS == 64
+		if (chunk < 0xffffffff)
+		{
+			if ((chunk + (nChunkPages*OBOS_PAGE_SIZE)) >= 0xffffffff)
+			{
+				size_t pages = ((chunk + (nChunkPages*OBOS_PAGE_SIZE)) - 0x100000000) / OBOS_PAGE_SIZE;
+				free(0x100000000, pages, pnode, &pnode->head, &pnode->tail);
+				nChunkPages -= pages;
+				OBOS_ASSERT((chunk + (nChunkPages*OBOS_PAGE_SIZE)) < 0xffffffff);
+			}
+			if (nChunkPages)
+				free(chunk, nChunkPages, pnode, &pnode->head32, &pnode->tail32);
+		}
+		else
+			free(chunk, nChunkPages, pnode, &pnode->head, &pnode->tail);
 #else
-	free(addr, nPages, &s_head, &s_tail);
+		free(chunk, nChunkPages, pnode, &pnode->head, &pnode->tail);
 #endif
+	}
+	nPages = nPagesFreed;
 	// OBOS_Debug("%s: Marking physical memory region at 0x%p-0x%p as free.\n", __func__, addr, addr+nPages*OBOS_PAGE_SIZE);
 	size_t nMemoryLeft = nPages * OBOS_PAGE_SIZE;
 	for (thread_node* node = Mm_ThreadsAwaitingPhysicalMemory.head; node; )
@@ -246,4 +497,61 @@ OBOS_NO_KASAN obos_status Mm_FreePhysicalPages(uintptr_t addr, size_t nPages)
 		node = next;
 	}
 	return OBOS_STATUS_SUCCESS;
-}
\ No newline at end of file
+}
+page_frame* Mm_GetPageFrame(uintptr_t phys)
+{
+	size_t pfn = phys / OBOS_PAGE_SIZE;
+	if (!Mm_PageFrameDatabase || pfn >= Mm_PageFrameCount)
+		return nullptr;
+	return &Mm_PageFrameDatabase[pfn];
+}
+void Mm_ReferencePhysicalPage(uintptr_t phys)
+{
+	page_frame* frame = Mm_GetPageFrame(phys);
+	if (!frame || !(frame->flags & PAGE_FRAME_ALLOCATED))
+		return;
+	atomic_fetch_add(&frame->refcount, 1);
+}
+obos_status Mm_DereferencePhysicalPages(uintptr_t phys, size_t nPages)
+{
+	if (!phys || !nPages)
+		return OBOS_STATUS_INVALID_ARGUMENT;
+	page_frame* frame = Mm_GetPageFrame(phys);
+	if (!frame)
+		return Mm_FreePhysicalPages(phys, nPages);
+	if (!(frame->flags & PAGE_FRAME_ALLOCATED))
+		return OBOS_STATUS_SUCCESS; // Not ours to free.
+	uint_least32_t old = atomic_fetch_sub(&frame->refcount, 1);
+	OBOS_ASSERT(old != 0);
+	if (old != 1)
+		return OBOS_STATUS_SUCCESS;
+	return Mm_FreePhysicalPages(phys, nPages);
+}
+bool Mm_IsPhysicalPageExclusive(uintptr_t phys)
+{
+	page_frame* frame = Mm_GetPageFrame(phys);
+	if (!frame || !(frame->flags & PAGE_FRAME_ALLOCATED))
+		return false;
+	return atomic_load(&frame->refcount) == 1;
+}
+void MmH_UpdatePageFrameMapping(const struct page* pg, uintptr_t oldPhys, uintptr_t newPhys)
+{
+	if (oldPhys == newPhys)
+		return;
+	// Only frames handed out by the PMM are tracked, since anything else (e.g., the zero page)
+	// could be mapped more times than the map count can hold.
+	page_frame* frame = oldPhys ? Mm_GetPageFrame(oldPhys) : nullptr;
+	if (frame && (frame->flags & PAGE_FRAME_ALLOCATED))
+	{
+		uint_least16_t mapcount = atomic_load(&frame->mapcount);
+		while (mapcount && !atomic_compare_exchange_weak(&frame->mapcount, &mapcount, mapcount - 1))
+			;
+		frame->rmap = nullptr;
+	}
+	frame = newPhys ? Mm_GetPageFrame(newPhys) : nullptr;
+	if (frame && (frame->flags & PAGE_FRAME_ALLOCATED))
+	{
+		atomic_fetch_add(&frame->mapcount, 1);
+		frame->rmap = (struct page*)pg;
+	}
+}
@@ -11,6 +11,8 @@
 
 #include <scheduler/thread.h>
 
+#include <stdatomic.h>
+
 extern size_t Mm_TotalPhysicalPages;
 extern size_t Mm_TotalPhysicalPagesUsed;
 extern size_t Mm_UsablePhysicalPages;
@@ -40,6 +42,80 @@ OBOS_EXPORT uintptr_t Mm_AllocatePhysicalPages(size_t nPages, size_t alignmentPa
 /// <param name="status">[optional] A pointer to a variable that will store the function's status. Can be nullptr.</param>
 /// <returns>The physical pages, or zero on failure.</returns>
 OBOS_EXPORT uintptr_t Mm_AllocatePhysicalPages32(size_t nPages, size_t alignmentPages, obos_status* status);
+enum {
+	// The pages returned are filled with zeroes.
+	// Single pages are taken from the pool of pages zeroed in advance if possible, otherwise they are zeroed synchronously.
+	PHYS_ALLOC_ZEROED = 0b1,
+};
+/// <summary>
+/// Allocates physical pages.
+/// </summary>
+/// <param name="nPages">The amount of physical pages to allocate.</param>
+/// <param name="alignmentPages">The alignment of the address returned, in pages.</param>
+/// <param name="flags">The allocation flags (PHYS_ALLOC_*).</param>
+/// <param name="status">[optional] A pointer to a variable that will store the function's status. Can be nullptr.</param>
+/// <returns>The physical pages, or zero on failure.</returns>
+OBOS_EXPORT uintptr_t Mm_AllocatePhysicalPagesEx(size_t nPages, size_t alignmentPages, uint32_t flags, obos_status* status);
+// The maximum amount of NUMA nodes the PMM keeps separate pools for.
+#define OBOS_MAX_NUMA_NODES (16)
+// The maximum amount of physical memory ranges that can be assigned to NUMA nodes.
+#define OBOS_MAX_NUMA_MEMORY_RANGES (64)
+// The distance from a NUMA node to itself, as defined by ACPI.
+#define NUMA_LOCAL_DISTANCE (10)
+// The distance assumed between two different NUMA nodes if the firmware doesn't say.
+#define NUMA_REMOTE_DISTANCE (20)
+typedef struct numa_node_stats
+{
+	// The firmware's id for the node (e.g., the ACPI proximity domain).
+	uint32_t domain;
+	// The amount of usable physical pages that belong to the node.
+	size_t nPages;
+	// The amount of those pages that are free.
+	size_t nFreePages;
+} numa_node_stats;
+// The amount of NUMA nodes. Always at least one.
+extern uint32_t Mm_NumaNodeCount;
+/// <summary>
+/// Assigns a range of physical memory to a NUMA node.<para/>
+/// Must be called by the architecture before Mm_InitializePMM. Memory that isn't in any range belongs to the first node.
+/// </summary>
+/// <param name="domain">The firmware's id for the node.</param>
+/// <param name="base">The base of the range.</param>
+/// <param name="size">The size of the range, in bytes.</param>
+/// <returns>The function status.</returns>
+obos_status MmH_AddNumaMemoryRange(uint32_t domain, uintptr_t base, size_t size);
+/// <summary>
+/// Sets the relative distance between two NUMA nodes, as reported by the firmware.<para/>
+/// Must be called by the architecture before Mm_InitializePMM.
+/// </summary>
+/// <param name="fromDomain">The firmware's id for the first node.</param>
+/// <param name="toDomain">The firmware's id for the second node.</param>
+/// <param name="distance">The distance, where NUMA_LOCAL_DISTANCE is the distance from a node to itself.</param>
+/// <returns>The function status.</returns>
+obos_status MmH_SetNumaDistance(uint32_t fromDomain, uint32_t toDomain, uint8_t distance);
+/// <summary>
+/// Gets the NUMA node with the firmware id 'domain', adding it if it doesn't exist yet.
+/// </summary>
+/// <param name="domain">The firmware's id for the node.</param>
+/// <returns>The index of the node, or UINT32_MAX if there are too many nodes.</returns>
+uint32_t MmH_GetNumaNode(uint32_t domain);
+/// <summary>
+/// Allocates physical pages, preferring memory on a certain NUMA node.<para/>
+/// If the node is out of memory, the other nodes are tried, closest first.
+/// </summary>
+/// <param name="node">The index of the preferred node.</param>
+/// <param name="nPages">The amount of physical pages to allocate.</param>
+/// <param name="alignmentPages">The alignment of the address returned, in pages.</param>
+/// <param name="status">[optional] A pointer to a variable that will store the function's status. Can be nullptr.</param>
+/// <returns>The physical pages, or zero on failure.</returns>
+OBOS_EXPORT uintptr_t Mm_AllocatePhysicalPagesOnNode(uint32_t node, size_t nPages, size_t alignmentPages, obos_status* status);
+/// <summary>
+/// Gets statistics about a NUMA node.
+/// </summary>
+/// <param name="node">The index of the node.</param>
+/// <param name="stats">[out] The statistics.</param>
+/// <returns>The function status.</returns>
+OBOS_EXPORT obos_status Mm_GetNumaNodeStats(uint32_t node, numa_node_stats* stats);
 /// <summary>
 /// Frees physical pages.
 /// </summary>
@@ -47,6 +123,62 @@ OBOS_EXPORT uintptr_t Mm_AllocatePhysicalPages32(size_t nPages, size_t alignment
 /// <param name="nPages">The amount of pages to free.</param>
 OBOS_EXPORT obos_status Mm_FreePhysicalPages(uintptr_t addr, size_t nPages);
 
+// The page frame database has one of these for every physical page up to the end of usable memory, indexed
+// by the page frame number (phys / OBOS_PAGE_SIZE).
+// For huge pages, only the descriptor of the first page is used.
+typedef struct page_frame
+{
+	// The amount of owners the frame has (the allocation itself, and every page sharing it copy-on-write).
+	// Once this reaches zero, the frame is freed.
+	atomic_uint_least32_t refcount;
+	// The amount of page table entries that map the frame.
+	atomic_uint_least16_t mapcount;
+	uint16_t flags;
+	// A hint to a page that maps the frame, for reverse mapping. Cleared when the frame is unmapped anywhere,
+	// so this might be nullptr even if mapcount != 0.
+	struct page* rmap;
+} page_frame;
+enum {
+	// Set if the frame was handed out by the PMM, and so can be freed by dropping references to it.
+	// Frames without this (e.g., boot modules, MMIO) are never freed through the database.
+	PAGE_FRAME_ALLOCATED = 0b1,
+};
+extern page_frame* Mm_PageFrameDatabase;
+// The amount of frames in the page frame database.
+extern size_t Mm_PageFrameCount;
+
+/// <summary>
+/// Gets the descriptor of a physical page.
+/// </summary>
+/// <param name="phys">The physical address of the page.</param>
+/// <returns>The descriptor, or nullptr if the page is not covered by the page frame database.</returns>
+OBOS_EXPORT page_frame* Mm_GetPageFrame(uintptr_t phys);
+/// <summary>
+/// Adds a reference to a physical page, for example when another page starts sharing it copy-on-write.
+/// </summary>
+/// <param name="phys">The physical address of the page.</param>
+OBOS_EXPORT void Mm_ReferencePhysicalPage(uintptr_t phys);
+/// <summary>
+/// Drops a reference to physical pages, freeing them if that was the last reference.<para/>
+/// Pages not covered by the page frame database are freed immediately.
+/// </summary>
+/// <param name="phys">The physical address of the pages.</param>
+/// <param name="nPages">The amount of pages, which is what is freed once there are no more references.</param>
+/// <returns>The function status.</returns>
+OBOS_EXPORT obos_status Mm_DereferencePhysicalPages(uintptr_t phys, size_t nPages);
+/// <summary>
+/// Checks whether a physical page has only one owner, so that a copy-on-write page using it can simply be made writable.
+/// </summary>
+/// <param name="phys">The physical address of the page.</param>
+/// <returns>Whether the page is exclusively owned.</returns>
+OBOS_EXPORT bool Mm_IsPhysicalPageExclusive(uintptr_t phys);
+// A page of zeroes that untouched anonymous memory is mapped to (copy-on-write), until it is first written.
+// Never freed.
+extern uintptr_t Mm_ZeroPage;
+// Called by the architecture whenever a page table entry changes from mapping 'oldPhys' to 'newPhys'.
+// Either can be zero, if nothing was or is going to be mapped.
+void MmH_UpdatePageFrameMapping(const struct page* pg, uintptr_t oldPhys, uintptr_t newPhys);
+
 // This returns a virtual address given a physical address.
 // For example, on x86-64, this can offset the physical address by the hhdm.
 OBOS_EXPORT void* MmS_MapVirtFromPhys(uintptr_t addr);
@@ -62,4 +194,13 @@ OBOS_EXPORT uintptr_t MmS_UnmapVirtFromPhys(void* virt);
 
 obos_pmem_map_entry* MmS_GetFirstPMemMapEntry(uintptr_t* index);
 // returns nullptr at the end of the list.
-obos_pmem_map_entry* MmS_GetNextPMemMapEntry(obos_pmem_map_entry* current, uintptr_t* index);
\ No newline at end of file
+obos_pmem_map_entry* MmS_GetNextPMemMapEntry(obos_pmem_map_entry* current, uintptr_t* index);
+
+// Starts keeping a pool of zeroed pages for each CPU.
+// Must be called after the VMM is initialized.
+obos_status Mm_InitializeZeroedPagePools();
+// Takes a zeroed page out of the pool of the current CPU, or returns zero if it's empty.
+uintptr_t MmH_PopZeroedPage();
+// Takes a zeroed page out of any pool, or returns zero if all of them are empty.
+// Used to give the memory back when the PMM runs out.
+uintptr_t MmH_ReclaimZeroedPage();
@@ -30,6 +30,8 @@ obos_status Mm_SwapOut(page* page)
     OBOS_ASSERT(!page->workingSets);
     if (!page->pageable || page->workingSets > 0)
         return OBOS_STATUS_INVALID_ARGUMENT;
+    if (page->pinCount)
+        return OBOS_STATUS_IN_USE;
     size_t nPages = page->prot.huge_page ? OBOS_HUGE_PAGE_SIZE/OBOS_PAGE_SIZE : 1;
     uintptr_t id;
     uintptr_t phys = 0;
@@ -61,7 +63,8 @@ obos_status Mm_SwapOut(page* page)
     if (phys)
     {
         // FIXME: Why is phys sometimes set to zero?
-        status = Mm_FreePhysicalPages(phys, nPages);
+        // A frame shared copy-on-write stays alive for the other pages sharing it.
+        status = Mm_DereferencePhysicalPages(phys, nPages);
         if (obos_is_error(status))
         {
             if (obos_is_error(Mm_SwapProvider->swap_free(Mm_SwapProvider, id, nPages)))
@@ -142,7 +145,11 @@ obos_status Mm_ChangeSwapProvider(swap_dev* to)
         curr->swapId = id;
         to->swap_write(to, curr->swapId, inter, (curr->prot.huge_page ? OBOS_HUGE_PAGE_SIZE : OBOS_PAGE_SIZE)/OBOS_PAGE_SIZE, 0);
     }
+    swap_dev* old = Mm_SwapProvider;
     Mm_SwapProvider = to;
     Core_SpinlockRelease(&Mm_KernelContext.lock, oldIrql);
+    // Nothing is left on the old provider, so it can be stopped.
+    if (old->deinit_dev)
+        old->deinit_dev(old);
     return OBOS_STATUS_SUCCESS;
 }
\ No newline at end of file
@@ -17,6 +17,7 @@ typedef struct swap_device
     obos_status(* swap_free)(struct swap_device* dev, uintptr_t  id, size_t nPages);
     obos_status(*swap_write)(struct swap_device* dev, uintptr_t  id, uintptr_t phys, size_t nPages, size_t offsetBytes);
     obos_status(* swap_read)(struct swap_device* dev, uintptr_t  id, uintptr_t phys, size_t nPages, size_t offsetBytes);
+    // Can be nullptr. Called once the device is no longer the swap provider.
     obos_status(*deinit_dev)(struct swap_device* dev);
     void* metadata;
 } swap_dev;
@@ -31,6 +31,7 @@ void OBOS_PartProbeAllDrives(bool check_checksum)
     //     ;
     dirent* directory = VfsH_DirentLookup(OBOS_DEV_PREFIX);
     OBOS_ASSERT(directory);
+    VfsH_DirentPopulate(directory);
     for (dirent* ent = directory->d_children.head; ent; )
     {
         if (ent->vnode->vtype == VNODE_TYPE_BLK && !(ent->vnode->flags & VFLAGS_PARTITION))
@@ -28,6 +28,8 @@ typedef struct cpu_local
 	struct thread* currentThread;
 	struct thread* idleThread;
 	struct context* currentContext;
+	// The index of the NUMA node the CPU is on, which is where the PMM allocates from first.
+	uint32_t numaNode;
 	cpu_local_arch arch_specific;
 	// Only threads that are ready can go in one of these thread lists.
 	thread_priority_list priorityLists[THREAD_PRIORITY_MAX_VALUE + 1];
@@ -37,7 +39,6 @@ typedef struct cpu_local
 	irql currentIrql;
 	bool initialized;
 	dpc_queue dpcs;
-	spinlock dpc_queue_lock;
 	struct {
 		// in native timer ticks
 		uint64_t work_balancer; 
@@ -55,6 +56,8 @@ extern DRV_EXPORT cpu_local* Core_CpuInfo;
 extern DRV_EXPORT size_t Core_CpuCount;
 
 #ifdef OBOS_KERNEL
+// Wakes 'cpu' up if it is idle, so that it picks up a thread that was just made ready on it.
+void CoreS_WakeIdleCPU(cpu_local* cpu);
 OBOS_WEAK cpu_local* CoreS_GetCPULocalPtr();
 #elif defined(OBOS_DRIVER)
 OBOS_EXPORT cpu_local* CoreS_GetCPULocalPtr();
@@ -106,6 +106,7 @@ obos_status CoreH_ThreadReadyNode(thread* thr, thread_node* node)
 	obos_status status = CoreH_ThreadListAppend(priorityList, node);
 	Core_SpinlockRelease(&thr->masterCPU->schedulerLock, oldIrql2);
 	Core_SpinlockRelease(&Core_SchedulerLock, oldIrql);
+	CoreS_WakeIdleCPU(cpuFound);
 	return status;
 }
 obos_status CoreH_ThreadBlock(thread* thr, bool canYield)
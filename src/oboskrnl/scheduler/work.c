@@ -0,0 +1,370 @@
+/*
+ * oboskrnl/scheduler/work.c
+ *
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+#include <int.h>
+#include <error.h>
+#include <klog.h>
+
+#include <scheduler/work.h>
+#include <scheduler/thread.h>
+#include <scheduler/process.h>
+#include <scheduler/cpu_local.h>
+#include <scheduler/thread_context_info.h>
+
+#include <irq/irql.h>
+#include <irq/dpc.h>
+
+#include <locks/spinlock.h>
+#include <locks/event.h>
+#include <locks/wait.h>
+
+#include <mm/alloc.h>
+#include <mm/context.h>
+
+#include <allocators/base.h>
+
+#include <stdatomic.h>
+
+#define WORK_STACK_SIZE (0x10000)
+// The maximum amount of threads in each of a CPU's pools.
+#define WORK_POOL_MAX_THREADS (4)
+// The maximum amount of threads in each unbound pool, per CPU.
+#define WORK_UNBOUND_THREADS_PER_CPU (2)
+// Threads exit instead of waiting for work if their pool already has this many idle threads.
+#define WORK_POOL_MAX_IDLE (2)
+
+typedef struct worker
+{
+	struct worker* next;
+	struct worker* nextIdle;
+	thread* thr;
+	// Set when the thread is taken off the idle list.
+	event wake;
+	struct work_pool* pool;
+	// The work item being run, or nullptr.
+	work_item* current;
+} worker;
+typedef struct work_waiter
+{
+	struct work_waiter* next;
+	// Set once the condition is met, with the pool's lock held.
+	event done;
+	// The work item waited on, or nullptr to wait for the pool to go idle.
+	work_item* work;
+} work_waiter;
+typedef struct work_pool
+{
+	spinlock lock;
+	work_item* head[WORK_PRIORITY_MAX + 1];
+	work_item* tail[WORK_PRIORITY_MAX + 1];
+	size_t nQueued;
+	// Items queued from above IRQL_DISPATCH whose DPC hasn't put them in the pool yet.
+	// Incremented without the lock, since it can't be taken from there.
+	_Atomic(size_t) nBouncing;
+	size_t nRunning;
+	worker* workers;
+	worker* idle;
+	size_t nWorkers;
+	size_t nIdle;
+	size_t maxWorkers;
+	work_waiter* waiters;
+	thread_priority priority;
+	thread_affinity affinity;
+} work_pool;
+
+// A normal and a high priority pool for each CPU, then the unbound pools.
+static work_pool* s_pools;
+static const work_priority s_runOrder[] = { WORK_PRIORITY_HIGH, WORK_PRIORITY_NORMAL, WORK_PRIORITY_LOW };
+
+static work_pool* pool_for(struct cpu_local* cpu, work_priority priority)
+{
+	const size_t index = cpu ? (size_t)(cpu - Core_CpuInfo) : Core_CpuCount;
+	return &s_pools[index*2 + (priority == WORK_PRIORITY_HIGH)];
+}
+// Must be called with the pool's lock held.
+static work_item* pop(work_pool* pool)
+{
+	for (size_t i = 0; i < sizeof(s_runOrder)/sizeof(*s_runOrder); i++)
+	{
+		const work_priority priority = s_runOrder[i];
+		work_item* work = pool->head[priority];
+		if (!work)
+			continue;
+		pool->head[priority] = work->next;
+		if (!work->next)
+			pool->tail[priority] = nullptr;
+		work->next = nullptr;
+		pool->nQueued--;
+		return work;
+	}
+	return nullptr;
+}
+// Must be called with the pool's lock held.
+static bool satisfied(const work_pool* pool, const work_waiter* waiter)
+{
+	if (!waiter->work)
+		return !pool->nQueued && !pool->nRunning && !atomic_load(&pool->nBouncing);
+	if (atomic_load(&waiter->work->queued))
+		return false;
+	for (const worker* w = pool->workers; w; w = w->next)
+		if (w->current == waiter->work)
+			return false;
+	return true;
+}
+// Must be called with the pool's lock held.
+static void wake_waiters(work_pool* pool)
+{
+	for (work_waiter** link = &pool->waiters; *link; )
+	{
+		work_waiter* waiter = *link;
+		if (!satisfied(pool, waiter))
+		{
+			link = &waiter->next;
+			continue;
+		}
+		*link = waiter->next;
+		Core_EventSet(&waiter->done, false);
+	}
+}
+static obos_status wait(work_pool* pool, work_waiter* waiter)
+{
+	irql oldIrql = Core_SpinlockAcquire(&pool->lock);
+	if (!satisfied(pool, waiter))
+	{
+		waiter->done = EVENT_INITIALIZE(EVENT_NOTIFICATION);
+		waiter->next = pool->waiters;
+		pool->waiters = waiter;
+		Core_SpinlockRelease(&pool->lock, oldIrql);
+		Core_WaitOnObject(WAITABLE_OBJECT(waiter->done));
+		// The event is set with the lock held, so this makes sure the waiter isn't being used anymore.
+		oldIrql = Core_SpinlockAcquire(&pool->lock);
+	}
+	Core_SpinlockRelease(&pool->lock, oldIrql);
+	return OBOS_STATUS_SUCCESS;
+}
+
+static void worker_main(worker* self);
+// The caller must have already counted the thread in pool->nWorkers.
+static obos_status spawn_worker(work_pool* pool)
+{
+	obos_status status = OBOS_STATUS_SUCCESS;
+	thread_ctx ctx = {};
+	void* stack = nullptr;
+	irql oldIrql = IRQL_INVALID;
+	worker* w = OBOS_NonPagedPoolAllocator->ZeroAllocate(OBOS_NonPagedPoolAllocator, 1, sizeof(worker), &status);
+	if (!w)
+		goto fail;
+	w->pool = pool;
+	w->wake = EVENT_INITIALIZE(EVENT_NOTIFICATION);
+	w->thr = CoreH_ThreadAllocate(&status);
+	if (!w->thr)
+		goto fail;
+	stack = Mm_VirtualMemoryAlloc(&Mm_KernelContext, nullptr, WORK_STACK_SIZE, 0, VMA_FLAGS_KERNEL_STACK, nullptr, &status);
+	if (!stack)
+		goto fail;
+	CoreS_SetupThreadContext(&ctx, (uintptr_t)worker_main, (uintptr_t)w, false, stack, WORK_STACK_SIZE);
+	CoreH_ThreadInitialize(w->thr, pool->priority, pool->affinity, &ctx);
+	w->thr->stackFree = CoreH_VMAStackFree;
+	w->thr->stackFreeUserdata = &Mm_KernelContext;
+	Core_ProcessAppendThread(OBOS_KernelProcess, w->thr);
+	oldIrql = Core_SpinlockAcquire(&pool->lock);
+	w->next = pool->workers;
+	pool->workers = w;
+	Core_SpinlockRelease(&pool->lock, oldIrql);
+	CoreH_ThreadReady(w->thr);
+	return OBOS_STATUS_SUCCESS;
+
+	fail:
+	if (w)
+	{
+		if (w->thr)
+			w->thr->free(w->thr);
+		OBOS_NonPagedPoolAllocator->Free(OBOS_NonPagedPoolAllocator, w, sizeof(*w));
+	}
+	oldIrql = Core_SpinlockAcquire(&pool->lock);
+	pool->nWorkers--;
+	Core_SpinlockRelease(&pool->lock, oldIrql);
+	return obos_is_error(status) ? status : OBOS_STATUS_NOT_ENOUGH_MEMORY;
+}
+static void worker_main(worker* self)
+{
+	work_pool* pool = self->pool;
+	irql oldIrql = Core_SpinlockAcquire(&pool->lock);
+	while (1)
+	{
+		work_item* work = pop(pool);
+		if (!work)
+		{
+			if (pool->nIdle >= WORK_POOL_MAX_IDLE && pool->nWorkers > 1)
+				break;
+			self->nextIdle = pool->idle;
+			pool->idle = self;
+			pool->nIdle++;
+			Core_SpinlockRelease(&pool->lock, oldIrql);
+			// Whoever queues work takes us off the idle list before setting the event.
+			Core_WaitOnObject(WAITABLE_OBJECT(self->wake));
+			Core_EventClear(&self->wake);
+			oldIrql = Core_SpinlockAcquire(&pool->lock);
+			continue;
+		}
+		// Cleared before the handler is called, so that it can queue the item again.
+		atomic_store(&work->queued, false);
+		self->current = work;
+		pool->nRunning++;
+		// If this item blocks, the rest of the queue needs another thread.
+		const bool grow = pool->nQueued && !pool->nIdle && pool->nWorkers < pool->maxWorkers;
+		if (grow)
+			pool->nWorkers++;
+		void(*handler)(work_item* work, void* userdata) = work->handler;
+		void* userdata = work->userdata;
+		Core_SpinlockRelease(&pool->lock, oldIrql);
+		if (grow)
+			spawn_worker(pool);
+		// The item can be freed by the handler, so it isn't touched after this.
+		handler(work, userdata);
+		oldIrql = Core_SpinlockAcquire(&pool->lock);
+		self->current = nullptr;
+		pool->nRunning--;
+		wake_waiters(pool);
+	}
+	for (worker** link = &pool->workers; *link; link = &(*link)->next)
+	{
+		if (*link != self)
+			continue;
+		*link = self->next;
+		break;
+	}
+	pool->nWorkers--;
+	Core_SpinlockRelease(&pool->lock, oldIrql);
+	OBOS_NonPagedPoolAllocator->Free(OBOS_NonPagedPoolAllocator, self, sizeof(*self));
+	Core_ExitCurrentThread();
+}
+
+// Must be called at IRQL_DISPATCH or lower.
+static void enqueue(work_pool* pool, work_item* work, bool bounced)
+{
+	irql oldIrql = Core_SpinlockAcquire(&pool->lock);
+	// Done with the lock held, so that a flush sees the item either bouncing or queued.
+	if (bounced)
+		atomic_fetch_sub(&pool->nBouncing, 1);
+	work->next = nullptr;
+	if (pool->tail[work->priority])
+		pool->tail[work->priority]->next = work;
+	else
+		pool->head[work->priority] = work;
+	pool->tail[work->priority] = work;
+	pool->nQueued++;
+	worker* idle = pool->idle;
+	if (idle)
+	{
+		pool->idle = idle->nextIdle;
+		pool->nIdle--;
+		Core_EventSet(&idle->wake, false);
+	}
+	// Threads can only be made at IRQL_PASSIVE, otherwise the next thread to pick up work makes one.
+	const bool grow = !idle && pool->nWorkers < pool->maxWorkers && oldIrql < IRQL_DISPATCH;
+	if (grow)
+		pool->nWorkers++;
+	Core_SpinlockRelease(&pool->lock, oldIrql);
+	if (grow)
+		spawn_worker(pool);
+}
+static void bounce_handler(dpc* obj, void* userdata)
+{
+	OBOS_UNUSED(obj);
+	work_item* work = userdata;
+	enqueue(work->pool, work, true);
+}
+
+obos_status Core_InitializeWorkQueues()
+{
+	if (s_pools)
+		return OBOS_STATUS_ALREADY_INITIALIZED;
+	obos_status status = OBOS_STATUS_SUCCESS;
+	const size_t nPools = (Core_CpuCount + 1) * 2;
+	work_pool* pools = OBOS_NonPagedPoolAllocator->ZeroAllocate(OBOS_NonPagedPoolAllocator, nPools, sizeof(work_pool), &status);
+	if (obos_is_error(status))
+		return status;
+	for (size_t i = 0; i < nPools; i++)
+	{
+		work_pool* pool = &pools[i];
+		const size_t cpu = i / 2;
+		pool->lock = Core_SpinlockCreate();
+		pool->priority = (i % 2) ? THREAD_PRIORITY_HIGH : THREAD_PRIORITY_NORMAL;
+		if (cpu < Core_CpuCount)
+		{
+			pool->affinity = CoreH_CPUIdToAffinity(Core_CpuInfo[cpu].id);
+			pool->maxWorkers = WORK_POOL_MAX_THREADS;
+		}
+		else
+		{
+			pool->affinity = Core_DefaultThreadAffinity;
+			pool->maxWorkers = WORK_UNBOUND_THREADS_PER_CPU * Core_CpuCount;
+			if (pool->maxWorkers < WORK_POOL_MAX_THREADS)
+				pool->maxWorkers = WORK_POOL_MAX_THREADS;
+		}
+		pool->nWorkers = 1;
+		if (obos_is_error(status = spawn_worker(pool)))
+			return status;
+	}
+	s_pools = pools;
+	return OBOS_STATUS_SUCCESS;
+}
+obos_status Core_WorkQueue(work_item* work, void(*handler)(work_item* work, void* userdata), struct cpu_local* cpu)
+{
+	if (!work || !handler || work->priority > WORK_PRIORITY_MAX)
+		return OBOS_STATUS_INVALID_ARGUMENT;
+	if (!s_pools)
+		return OBOS_STATUS_INVALID_INIT_PHASE;
+	bool expected = false;
+	if (!atomic_compare_exchange_strong(&work->queued, &expected, true))
+		return OBOS_STATUS_IN_USE;
+	work->handler = handler;
+	work->pool = pool_for(cpu, work->priority);
+	if (Core_GetIrql() <= IRQL_DISPATCH)
+	{
+		enqueue(work->pool, work, false);
+		return OBOS_STATUS_SUCCESS;
+	}
+	// The pool's lock can't be taken from here.
+	// Counted before the DPC is queued, so that it can't be taken off the count before it is added.
+	atomic_fetch_add(&work->pool->nBouncing, 1);
+	work->bounce.userdata = work;
+	obos_status status = CoreH_InitializeDPC(&work->bounce, bounce_handler, CoreH_CPUIdToAffinity(cpu ? cpu->id : CoreS_GetCPULocalPtr()->id));
+	if (obos_is_error(status))
+	{
+		atomic_fetch_sub(&work->pool->nBouncing, 1);
+		atomic_store(&work->queued, false);
+	}
+	return status;
+}
+obos_status Core_WorkWait(work_item* work)
+{
+	if (!work)
+		return OBOS_STATUS_INVALID_ARGUMENT;
+	if (Core_GetIrql() >= IRQL_DISPATCH)
+		return OBOS_STATUS_INVALID_IRQL;
+	if (!work->pool)
+		return OBOS_STATUS_SUCCESS;
+	work_waiter waiter = { .work = work };
+	return wait(work->pool, &waiter);
+}
+obos_status Core_WorkFlush(struct cpu_local* cpu)
+{
+	if (Core_GetIrql() >= IRQL_DISPATCH)
+		return OBOS_STATUS_INVALID_IRQL;
+	if (!s_pools)
+		return OBOS_STATUS_INVALID_INIT_PHASE;
+	// Items queued from above IRQL_DISPATCH are waited on too, even if their DPC hasn't run yet.
+	for (work_priority priority = WORK_PRIORITY_NORMAL; priority <= WORK_PRIORITY_HIGH; priority++)
+	{
+		work_waiter waiter = {};
+		obos_status status = wait(pool_for(cpu, priority), &waiter);
+		if (obos_is_error(status))
+			return status;
+	}
+	return OBOS_STATUS_SUCCESS;
+}
@@ -0,0 +1,78 @@
+/*
+ * oboskrnl/scheduler/work.h
+ *
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+#pragma once
+
+#include <int.h>
+#include <error.h>
+
+#include <irq/dpc.h>
+
+#include <stdatomic.h>
+
+// Work items run at IRQL_PASSIVE on pools of kernel threads, so unlike DPCs, they can block.
+// Every CPU has its own pools, and there are unbound pools whose threads can run on any CPU.
+// Pools start with one thread, and grow when all of their threads are busy, up to a limit.
+// Threads exit once a pool has more idle threads than it needs.
+// Since the number of threads is bounded, an item that can block indefinitely (e.g., waiting on
+// user input) should get a thread of its own, otherwise enough of them would stall their pool.
+
+typedef enum work_priority
+{
+	// The default, so that zeroed work items get it.
+	WORK_PRIORITY_NORMAL,
+	// Run on a pool of THREAD_PRIORITY_HIGH threads.
+	WORK_PRIORITY_HIGH,
+	// Run after every other work item in the pool.
+	WORK_PRIORITY_LOW,
+	WORK_PRIORITY_MAX = WORK_PRIORITY_LOW,
+} work_priority;
+
+// Work items are allocated by the caller, usually as part of another object, so queueing one never allocates.
+typedef struct work_item
+{
+	struct work_item* next;
+	// Called at IRQL_PASSIVE.
+	// The handler can queue the work item again, or free it.
+	void(*handler)(struct work_item* work, void* userdata);
+	void* userdata;
+	// Set before queueing.
+	work_priority priority;
+	// The pool the item was last queued on.
+	struct work_pool* pool;
+	_Atomic(bool) queued;
+	// Used to queue the item from above IRQL_DISPATCH.
+	dpc bounce;
+} work_item;
+
+/// <summary>
+/// Initializes the work pools.
+/// </summary>
+/// <returns>The status of the function.</returns>
+obos_status Core_InitializeWorkQueues();
+/// <summary>
+/// Queues a work item.<para/>
+/// If this is called above IRQL_DISPATCH, the item is queued from a DPC.
+/// </summary>
+/// <param name="work">The work item. userdata and priority must be set before calling this.</param>
+/// <param name="handler">The function to call.</param>
+/// <param name="cpu">The CPU to run the work item on, or nullptr to run it on any CPU.</param>
+/// <returns>The status of the function. OBOS_STATUS_IN_USE if the work item is already queued.</returns>
+OBOS_EXPORT obos_status Core_WorkQueue(work_item* work, void(*handler)(work_item* work, void* userdata), struct cpu_local* cpu);
+/// <summary>
+/// Blocks until a work item is no longer queued or running.<para/>
+/// The item must not have been freed.
+/// </summary>
+/// <param name="work">The work item.</param>
+/// <returns>The status of the function.</returns>
+OBOS_EXPORT obos_status Core_WorkWait(work_item* work);
+/// <summary>
+/// Blocks until every work item queued on the pools of a CPU has finished.<para/>
+/// This includes items queued from above IRQL_DISPATCH that are still waiting for their DPC.
+/// </summary>
+/// <param name="cpu">The CPU whose pools are flushed, or nullptr for the unbound pools.</param>
+/// <returns>The status of the function.</returns>
+OBOS_EXPORT obos_status Core_WorkFlush(struct cpu_local* cpu);
@@ -0,0 +1,217 @@
+/*
+ * oboskrnl/utils/crc32.c
+ *
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+#include <int.h>
+
+#include <utils/crc32.h>
+
+#ifdef __x86_64__
+#	include <irq/irql.h>
+#	include <arch/x86_64/asm_helpers.h>
+#endif
+
+#define CRC32_POLYNOMIAL 0xEDB88320U
+
+// s_crctab[0] is the usual byte-at-a-time table, s_crctab[n] is the CRC of a byte followed by n zero bytes.
+static uint32_t s_crctab[8][256];
+static bool s_initialized_tables;
+
+static void init_tables()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (uint8_t j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (CRC32_POLYNOMIAL & -(crc & 1));
+        s_crctab[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+        for (uint8_t slice = 1; slice < 8; slice++)
+            s_crctab[slice][i] = (s_crctab[slice-1][i] >> 8) ^ s_crctab[0][s_crctab[slice-1][i] & 0xff];
+    s_initialized_tables = true;
+}
+
+// Operates on the raw (non-inverted) CRC register.
+// The words are assembled byte by byte, so this works the same on big-endian targets.
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t* buf, size_t sz)
+{
+    while (sz >= 8)
+    {
+        uint32_t lo = crc ^ ((uint32_t)buf[0] | ((uint32_t)buf[1] << 8) | ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24));
+        uint32_t hi = (uint32_t)buf[4] | ((uint32_t)buf[5] << 8) | ((uint32_t)buf[6] << 16) | ((uint32_t)buf[7] << 24);
+        crc = s_crctab[7][lo & 0xff] ^ s_crctab[6][(lo >> 8) & 0xff] ^
+              s_crctab[5][(lo >> 16) & 0xff] ^ s_crctab[4][lo >> 24] ^
+              s_crctab[3][hi & 0xff] ^ s_crctab[2][(hi >> 8) & 0xff] ^
+              s_crctab[1][(hi >> 16) & 0xff] ^ s_crctab[0][hi >> 24];
+        buf += 8;
+        sz -= 8;
+    }
+    while (sz--)
+        crc = (crc >> 8) ^ s_crctab[0][(crc ^ *buf++) & 0xff];
+    return crc;
+}
+
+#ifdef __x86_64__
+// Folding constants for the reflected polynomial, x^(n) mod P for the distances used below.
+// The low qword multiplies the low half of the accumulator, the high qword the high half.
+static const uint64_t s_fold_by_4[2] = { 0x0000000154442bd4, 0x00000001c6e41596 }; // 512 bits
+static const uint64_t s_fold_by_1[2] = { 0x00000001751997d0, 0x00000000ccaa009e }; // 128 bits
+// Don't bother with the vector path for small buffers, the setup costs more than it saves.
+#define PCLMUL_THRESHOLD (256)
+// How much is done per trip to IRQL_DISPATCH, to bound the time spent with preemption off.
+#define PCLMUL_CHUNK (64*1024)
+
+// 0: unknown, 1: unsupported, 2: supported
+static uint8_t s_has_pclmul;
+static bool has_pclmul()
+{
+    if (!s_has_pclmul)
+    {
+        uint32_t ecx = 0;
+        __cpuid__(1, 0, nullptr, nullptr, &ecx, nullptr);
+        s_has_pclmul = (ecx & BIT(1)) ? 2 : 1;
+    }
+    return s_has_pclmul == 2;
+}
+
+// Folds 'sz' bytes (a multiple of 16, at least 64) of 'buf' down to 128 bits, which have the same CRC
+// (starting from zero) as 'buf' does starting from 'crc'.
+// The kernel is built without SSE, so the registers used are saved and restored here, and this must be
+// called at IRQL_DISPATCH or higher, so that the thread is not switched out with them live.
+static void pclmul_fold(uint32_t crc, const uint8_t* buf, size_t sz, uint8_t out[16])
+{
+    uint8_t saved[6*16];
+    asm volatile(
+        "movdqu %%xmm0, 0x00(%[saved]);"
+        "movdqu %%xmm1, 0x10(%[saved]);"
+        "movdqu %%xmm2, 0x20(%[saved]);"
+        "movdqu %%xmm3, 0x30(%[saved]);"
+        "movdqu %%xmm4, 0x40(%[saved]);"
+        "movdqu %%xmm5, 0x50(%[saved]);"
+
+        "movdqu 0x00(%[buf]), %%xmm1;"
+        "movdqu 0x10(%[buf]), %%xmm2;"
+        "movdqu 0x20(%[buf]), %%xmm3;"
+        "movdqu 0x30(%[buf]), %%xmm4;"
+        "movd %k[crc], %%xmm0;"
+        "pxor %%xmm0, %%xmm1;"
+        "add $0x40, %[buf];"
+        "sub $0x40, %[sz];"
+
+        // Fold 512 bits at a time into the four accumulators.
+        "movdqu (%[k4]), %%xmm0;"
+        "1:;"
+        "cmp $0x40, %[sz];"
+        "jb 2f;"
+        "movdqa %%xmm1, %%xmm5;"
+        "pclmulqdq $0x00, %%xmm0, %%xmm1;"
+        "pclmulqdq $0x11, %%xmm0, %%xmm5;"
+        "pxor %%xmm5, %%xmm1;"
+        "movdqu 0x00(%[buf]), %%xmm5;"
+        "pxor %%xmm5, %%xmm1;"
+        "movdqa %%xmm2, %%xmm5;"
+        "pclmulqdq $0x00, %%xmm0, %%xmm2;"
+        "pclmulqdq $0x11, %%xmm0, %%xmm5;"
+        "pxor %%xmm5, %%xmm2;"
+        "movdqu 0x10(%[buf]), %%xmm5;"
+        "pxor %%xmm5, %%xmm2;"
+        "movdqa %%xmm3, %%xmm5;"
+        "pclmulqdq $0x00, %%xmm0, %%xmm3;"
+        "pclmulqdq $0x11, %%xmm0, %%xmm5;"
+        "pxor %%xmm5, %%xmm3;"
+        "movdqu 0x20(%[buf]), %%xmm5;"
+        "pxor %%xmm5, %%xmm3;"
+        "movdqa %%xmm4, %%xmm5;"
+        "pclmulqdq $0x00, %%xmm0, %%xmm4;"
+        "pclmulqdq $0x11, %%xmm0, %%xmm5;"
+        "pxor %%xmm5, %%xmm4;"
+        "movdqu 0x30(%[buf]), %%xmm5;"
+        "pxor %%xmm5, %%xmm4;"
+        "add $0x40, %[buf];"
+        "sub $0x40, %[sz];"
+        "jmp 1b;"
+
+        // Fold the four accumulators into one.
+        "2:;"
+        "movdqu (%[k1]), %%xmm0;"
+        "movdqa %%xmm1, %%xmm5;"
+        "pclmulqdq $0x00, %%xmm0, %%xmm1;"
+        "pclmulqdq $0x11, %%xmm0, %%xmm5;"
+        "pxor %%xmm5, %%xmm1;"
+        "pxor %%xmm2, %%xmm1;"
+        "movdqa %%xmm1, %%xmm5;"
+        "pclmulqdq $0x00, %%xmm0, %%xmm1;"
+        "pclmulqdq $0x11, %%xmm0, %%xmm5;"
+        "pxor %%xmm5, %%xmm1;"
+        "pxor %%xmm3, %%xmm1;"
+        "movdqa %%xmm1, %%xmm5;"
+        "pclmulqdq $0x00, %%xmm0, %%xmm1;"
+        "pclmulqdq $0x11, %%xmm0, %%xmm5;"
+        "pxor %%xmm5, %%xmm1;"
+        "pxor %%xmm4, %%xmm1;"
+
+        // Then fold in whatever 16-byte blocks are left.
+        "3:;"
+        "cmp $0x10, %[sz];"
+        "jb 4f;"
+        "movdqa %%xmm1, %%xmm5;"
+        "pclmulqdq $0x00, %%xmm0, %%xmm1;"
+        "pclmulqdq $0x11, %%xmm0, %%xmm5;"
+        "pxor %%xmm5, %%xmm1;"
+        "movdqu (%[buf]), %%xmm5;"
+        "pxor %%xmm5, %%xmm1;"
+        "add $0x10, %[buf];"
+        "sub $0x10, %[sz];"
+        "jmp 3b;"
+
+        "4:;"
+        "movdqu %%xmm1, (%[out]);"
+
+        "movdqu 0x00(%[saved]), %%xmm0;"
+        "movdqu 0x10(%[saved]), %%xmm1;"
+        "movdqu 0x20(%[saved]), %%xmm2;"
+        "movdqu 0x30(%[saved]), %%xmm3;"
+        "movdqu 0x40(%[saved]), %%xmm4;"
+        "movdqu 0x50(%[saved]), %%xmm5;"
+        : [buf]"+r"(buf), [sz]"+r"(sz)
+        : [crc]"r"(crc), [k4]"r"(s_fold_by_4), [k1]"r"(s_fold_by_1), [out]"r"(out), [saved]"r"(saved)
+        : "memory", "cc"
+    );
+}
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t* buf, size_t sz)
+{
+    while (sz >= PCLMUL_THRESHOLD)
+    {
+        size_t chunk = sz > PCLMUL_CHUNK ? PCLMUL_CHUNK : sz;
+        chunk &= ~(size_t)0xf;
+        uint8_t folded[16];
+        irql oldIrql = Core_GetIrql() < IRQL_DISPATCH ? Core_RaiseIrql(IRQL_DISPATCH) : IRQL_INVALID;
+        pclmul_fold(crc, buf, chunk, folded);
+        if (oldIrql != IRQL_INVALID)
+            Core_LowerIrql(oldIrql);
+        crc = crc32_slice8(0, folded, 16);
+        buf += chunk;
+        sz -= chunk;
+    }
+    return crc32_slice8(crc, buf, sz);
+}
+#endif
+
+uint32_t OBOS_Crc32Continue(const void* data, size_t sz, uint32_t previousChecksum)
+{
+    if (!s_initialized_tables)
+        init_tables();
+    uint32_t crc = ~previousChecksum;
+#ifdef __x86_64__
+    if (sz >= PCLMUL_THRESHOLD && has_pclmul())
+        return ~crc32_pclmul(crc, data, sz);
+#endif
+    return ~crc32_slice8(crc, data, sz);
+}
+uint32_t OBOS_Crc32(const void* data, size_t sz)
+{
+    return OBOS_Crc32Continue(data, sz, 0);
+}
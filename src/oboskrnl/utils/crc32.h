@@ -0,0 +1,18 @@
+/*
+ * oboskrnl/utils/crc32.h
+ *
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+#pragma once
+
+#include <int.h>
+
+// The CRC32 used by GPT, zlib, and Ethernet (reflected polynomial 0xEDB88320).
+// Note that this is not the same as CRC32C, which is what x86's crc32 instruction computes.
+
+// Computes the CRC32 of a buffer.
+OBOS_EXPORT uint32_t OBOS_Crc32(const void* data, size_t sz);
+// Computes the CRC32 of a buffer, continuing from the checksum of the data before it.
+// OBOS_Crc32Continue(b, szB, OBOS_Crc32(a, szA)) == OBOS_Crc32(a .. b, szA+szB)
+OBOS_EXPORT uint32_t OBOS_Crc32Continue(const void* data, size_t sz, uint32_t previousChecksum);
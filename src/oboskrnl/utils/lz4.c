@@ -0,0 +1,176 @@
+/*
+ * oboskrnl/utils/lz4.c
+ *
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+#include <int.h>
+#include <error.h>
+#include <memmanip.h>
+
+#include <utils/lz4.h>
+
+#define MIN_MATCH (4)
+// The last match must start at least this many bytes before the end of the input.
+#define MF_LIMIT (12)
+// The last this many bytes are always literals.
+#define LAST_LITERALS (5)
+#define HASH_BITS (12)
+
+// Assembled byte by byte, so this works the same regardless of alignment or endianness.
+static uint32_t read32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+static uint32_t hash32(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+// The space needed to encode a length of 'len' past what fits in the token.
+static size_t ext_length_size(size_t len)
+{
+    return len >= 15 ? (len - 15) / 255 + 1 : 0;
+}
+static uint8_t* write_ext_length(uint8_t* op, size_t len)
+{
+    if (len < 15)
+        return op;
+    len -= 15;
+    while (len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+size_t OBOS_LZ4Compress(const void* src_, size_t srcSz, void* dst_, size_t dstCap, void* workspace)
+{
+    if (!src_ || !dst_ || !workspace || srcSz > LZ4_MAX_INPUT_SIZE)
+        return 0;
+    const uint8_t* src = src_;
+    uint8_t* dst = dst_;
+    uint8_t* op = dst;
+    uint8_t* const oend = dst + dstCap;
+    uint16_t* table = workspace;
+    memzero(table, LZ4_WORKSPACE_SIZE);
+    size_t ip = 0;
+    size_t anchor = 0;
+    if (srcSz > MF_LIMIT)
+    {
+        const size_t limit = srcSz - MF_LIMIT;
+        const size_t matchLimit = srcSz - LAST_LITERALS;
+        // Position zero is in the table from the start, since that's what it is zeroed to.
+        ip = 1;
+        size_t misses = 0;
+        while (ip < limit)
+        {
+            const uint32_t seq = read32(src + ip);
+            const uint32_t h = hash32(seq);
+            const size_t cand = table[h];
+            table[h] = (uint16_t)ip;
+            if (read32(src + cand) != seq)
+            {
+                // Skip faster through data that doesn't compress.
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+            size_t mlen = MIN_MATCH;
+            while (ip + mlen < matchLimit && src[cand + mlen] == src[ip + mlen])
+                mlen++;
+            const size_t litLen = ip - anchor;
+            const size_t needed = 1 + ext_length_size(litLen) + litLen + 2 + ext_length_size(mlen - MIN_MATCH);
+            if ((size_t)(oend - op) < needed)
+                return 0;
+            const size_t offset = ip - cand;
+            *op++ = (uint8_t)(((litLen < 15 ? litLen : 15) << 4) | (mlen - MIN_MATCH < 15 ? mlen - MIN_MATCH : 15));
+            op = write_ext_length(op, litLen);
+            memcpy(op, src + anchor, litLen);
+            op += litLen;
+            *op++ = (uint8_t)(offset & 0xff);
+            *op++ = (uint8_t)(offset >> 8);
+            op = write_ext_length(op, mlen - MIN_MATCH);
+            ip += mlen;
+            anchor = ip;
+            // Remember a position inside the match, it makes the next one more likely to be found.
+            if (ip < limit)
+                table[hash32(read32(src + ip - 2))] = (uint16_t)(ip - 2);
+        }
+    }
+    const size_t litLen = srcSz - anchor;
+    if ((size_t)(oend - op) < 1 + ext_length_size(litLen) + litLen)
+        return 0;
+    *op++ = (uint8_t)((litLen < 15 ? litLen : 15) << 4);
+    op = write_ext_length(op, litLen);
+    memcpy(op, src + anchor, litLen);
+    op += litLen;
+    return op - dst;
+}
+
+static bool read_ext_length(const uint8_t** ip, const uint8_t* iend, size_t* len)
+{
+    if (*len != 15)
+        return true;
+    uint8_t b = 0;
+    do {
+        if (*ip >= iend)
+            return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+obos_status OBOS_LZ4Decompress(const void* src, size_t srcSz, void* dst_, size_t dstCap, size_t* nDecompressed)
+{
+    if (!src || !dst_ || !srcSz)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    const uint8_t* ip = src;
+    const uint8_t* const iend = ip + srcSz;
+    uint8_t* const dst = dst_;
+    uint8_t* op = dst;
+    uint8_t* const oend = dst + dstCap;
+    while (true)
+    {
+        if (ip >= iend)
+            return OBOS_STATUS_INVALID_ARGUMENT;
+        const uint8_t token = *ip++;
+        size_t litLen = token >> 4;
+        if (!read_ext_length(&ip, iend, &litLen))
+            return OBOS_STATUS_INVALID_ARGUMENT;
+        if ((size_t)(iend - ip) < litLen || (size_t)(oend - op) < litLen)
+            return OBOS_STATUS_INVALID_ARGUMENT;
+        memcpy(op, ip, litLen);
+        op += litLen;
+        ip += litLen;
+        // The last sequence has no match.
+        if (ip == iend)
+            break;
+        if ((iend - ip) < 2)
+            return OBOS_STATUS_INVALID_ARGUMENT;
+        const size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t mlen = token & 0xf;
+        if (!read_ext_length(&ip, iend, &mlen))
+            return OBOS_STATUS_INVALID_ARGUMENT;
+        mlen += MIN_MATCH;
+        if (!offset || offset > (size_t)(op - dst) || (size_t)(oend - op) < mlen)
+            return OBOS_STATUS_INVALID_ARGUMENT;
+        // Matches can overlap the output they produce, so this has to go forwards a byte at a time.
+        const uint8_t* match = op - offset;
+        if (offset >= mlen)
+        {
+            memcpy(op, match, mlen);
+            op += mlen;
+        }
+        else
+        {
+            for (size_t i = 0; i < mlen; i++)
+                *op++ = *match++;
+        }
+    }
+    if (nDecompressed)
+        *nDecompressed = op - dst;
+    return OBOS_STATUS_SUCCESS;
+}
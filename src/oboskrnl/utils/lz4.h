@@ -0,0 +1,28 @@
+/*
+ * oboskrnl/utils/lz4.h
+ *
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+#pragma once
+
+#include <int.h>
+#include <error.h>
+
+// A compressor/decompressor for the LZ4 block format.
+// This favours speed over ratio (greedy matching, no frame format), and is meant for small, self-contained
+// buffers, such as single pages.
+
+// The size of the workspace OBOS_LZ4Compress needs.
+#define LZ4_WORKSPACE_SIZE (4096*sizeof(uint16_t))
+// The biggest input OBOS_LZ4Compress accepts.
+#define LZ4_MAX_INPUT_SIZE (65536)
+
+// Compresses 'srcSz' bytes from 'src' into 'dst'.
+// 'workspace' must be at least LZ4_WORKSPACE_SIZE bytes, and is clobbered.
+// Returns the size of the compressed data, or zero if it would not fit in 'dstCap' bytes, or if the
+// input is too big.
+OBOS_EXPORT size_t OBOS_LZ4Compress(const void* src, size_t srcSz, void* dst, size_t dstCap, void* workspace);
+// Decompresses 'srcSz' bytes from 'src' into 'dst', which is 'dstCap' bytes big.
+// If the data is malformed, or would not fit in 'dst', OBOS_STATUS_INVALID_ARGUMENT is returned.
+OBOS_EXPORT obos_status OBOS_LZ4Decompress(const void* src, size_t srcSz, void* dst, size_t dstCap, size_t* nDecompressed);
@@ -22,6 +22,7 @@
 #include <scheduler/process.h>
 #include <scheduler/thread.h>
 #include <scheduler/thread_context_info.h>
+#include <scheduler/work.h>
 
 #include <utils/list.h>
 
@@ -41,13 +42,15 @@ static bool is_eof(vnode* vn, size_t off)
     return off >= vn->filesize;
 }
 
-static void async_read(struct async_irp* irp)
+static void async_read(work_item* work, void* userdata)
 {
+    OBOS_UNUSED(work);
+    struct async_irp* irp = userdata;
     mount* const point = irp->vn->mount_point ? irp->vn->mount_point : irp->vn->un.mounted;
     const driver_header* driver = irp->vn->vtype == VNODE_TYPE_REG ? &point->fs_driver->driver->header : nullptr;
     if (irp->vn->vtype == VNODE_TYPE_CHR || irp->vn->vtype == VNODE_TYPE_BLK)
         driver = &irp->vn->un.device->driver->header;
-    if (!VfsH_LockMountpoint(point))
+    if (obos_is_error(VfsH_LockVnode(irp->vn, false)))
         goto abort;
     driver->ftable.read_sync(
         irp->vn->desc,
@@ -56,21 +59,22 @@ static void async_read(struct async_irp* irp)
         irp->fileoff,
         nullptr
     );
-    VfsH_UnlockMountpoint(point);
+    VfsH_UnlockVnode(irp->vn, false);
 
     abort:
     Core_EventSet(irp->e, true);
     irp->vn->nPendingAsyncIO--;
     Vfs_Free(irp);
-    Core_ExitCurrentThread();
 }
-static void async_write(struct async_irp* irp)
+static void async_write(work_item* work, void* userdata)
 {
+    OBOS_UNUSED(work);
+    struct async_irp* irp = userdata;
     mount* const point = irp->vn->mount_point ? irp->vn->mount_point : irp->vn->un.mounted;
     const driver_header* driver = irp->vn->vtype == VNODE_TYPE_REG ? &point->fs_driver->driver->header : nullptr;
     if (irp->vn->vtype == VNODE_TYPE_CHR || irp->vn->vtype == VNODE_TYPE_BLK)
         driver = &irp->vn->un.device->driver->header;
-    if (!VfsH_LockMountpoint(point))
+    if (obos_is_error(VfsH_LockVnode(irp->vn, true)))
         goto abort;
     driver->ftable.write_sync(
         irp->vn->desc,
@@ -79,13 +83,46 @@ static void async_write(struct async_irp* irp)
         irp->fileoff,
         nullptr
     );
-    VfsH_UnlockMountpoint(point);
+    VfsH_UnlockVnode(irp->vn, true);
     
     abort:
     Core_EventSet(irp->e, true);
     irp->vn->nPendingAsyncIO--;
     Vfs_Free(irp);
-    Core_GetCurrentThread();
+}
+
+// Reads and writes of character devices can block forever (e.g., a read from a terminal).
+// The work pools have a bounded number of threads, so these IRPs get a thread of their own instead.
+static void irp_thread(struct async_irp* irp)
+{
+    if (irp->rw)
+        async_write(&irp->work, irp);
+    else
+        async_read(&irp->work, irp);
+    Core_ExitCurrentThread();
+}
+static obos_status dispatch_irp(struct async_irp* irp, void(*handler)(work_item* work, void* userdata))
+{
+    if (irp->vn->vtype != VNODE_TYPE_CHR)
+        return Core_WorkQueue(&irp->work, handler, nullptr);
+    obos_status status = OBOS_STATUS_SUCCESS;
+    thread* thr = CoreH_ThreadAllocate(&status);
+    if (!thr)
+        return obos_is_error(status) ? status : OBOS_STATUS_NOT_ENOUGH_MEMORY;
+    void* stack = Mm_VirtualMemoryAlloc(&Mm_KernelContext, nullptr, 0x10000, 0, VMA_FLAGS_KERNEL_STACK, nullptr, &status);
+    if (!stack)
+    {
+        thr->free(thr);
+        return obos_is_error(status) ? status : OBOS_STATUS_NOT_ENOUGH_MEMORY;
+    }
+    thread_ctx ctx = {};
+    CoreS_SetupThreadContext(&ctx, (uintptr_t)irp_thread, (uintptr_t)irp, false, stack, 0x10000);
+    CoreH_ThreadInitialize(thr, THREAD_PRIORITY_HIGH, Core_DefaultThreadAffinity, &ctx);
+    thr->stackFree = CoreH_VMAStackFree;
+    thr->stackFreeUserdata = &Mm_KernelContext;
+    Core_ProcessAppendThread(OBOS_KernelProcess, thr);
+    CoreH_ThreadReady(thr);
+    return OBOS_STATUS_SUCCESS;
 }
 
 obos_status Vfs_FdAWrite(fd* desc, const void* buf, size_t nBytes, event* evnt)
@@ -117,7 +154,7 @@ obos_status Vfs_FdAWrite(fd* desc, const void* buf, size_t nBytes, event* evnt)
         if (nBytes >= sector_size)
             goto irp;
         
-        if (!VfsH_LockMountpoint(point))
+        if (obos_is_error(VfsH_LockVnode(desc->vn, true)))
             return OBOS_STATUS_ABORTED;
         obos_status status = driver->ftable.write_sync(
             desc->vn->desc,
@@ -128,7 +165,7 @@ obos_status Vfs_FdAWrite(fd* desc, const void* buf, size_t nBytes, event* evnt)
         );
         Core_EventSet(evnt, true);
         desc->offset += nBytes;
-        VfsH_UnlockMountpoint(point);
+        VfsH_UnlockVnode(desc->vn, true);
         return status;
     }
     // else 
@@ -161,20 +198,16 @@ obos_status Vfs_FdAWrite(fd* desc, const void* buf, size_t nBytes, event* evnt)
     irp->requestSize = nBytes;
     irp->un.cbuf = buf;
     irp->vn = desc->vn;
-    irp->worker = CoreH_ThreadAllocate(nullptr);
-    thread_ctx ctx = {};
-    CoreS_SetupThreadContext(
-        &ctx, 
-        (uintptr_t)async_write, (uintptr_t)irp,
-        false,
-        Mm_VirtualMemoryAlloc(&Mm_KernelContext, nullptr, 0x10000, 0, VMA_FLAGS_KERNEL_STACK, nullptr, nullptr), 
-        0x10000);
-    CoreH_ThreadInitialize(irp->worker, THREAD_PRIORITY_HIGH, Core_DefaultThreadAffinity, &ctx);
-    irp->worker->stackFree = CoreH_VMAStackFree;
-    irp->worker->stackFreeUserdata = &Mm_KernelContext;
-    Core_ProcessAppendThread(OBOS_KernelProcess, irp->worker);
+    irp->work.userdata = irp;
+    irp->work.priority = WORK_PRIORITY_HIGH;
     desc->vn->nPendingAsyncIO++;
-    CoreH_ThreadReady(irp->worker);
+    obos_status status = dispatch_irp(irp, async_write);
+    if (obos_is_error(status))
+    {
+        desc->vn->nPendingAsyncIO--;
+        Vfs_Free(irp);
+        return status;
+    }
     desc->offset += nBytes;
     return OBOS_STATUS_SUCCESS;
 }
@@ -206,7 +239,7 @@ obos_status Vfs_FdARead(fd* desc, void* buf, size_t nBytes, event* evnt)
         driver->ftable.get_blk_size(point->device->desc, &sector_size);
         if (nBytes >= sector_size)
             goto irp;
-        if (!VfsH_LockMountpoint(point))
+        if (obos_is_error(VfsH_LockVnode(desc->vn, false)))
             return OBOS_STATUS_ABORTED;
         obos_status status = driver->ftable.read_sync(
             desc->vn->desc,
@@ -217,7 +250,7 @@ obos_status Vfs_FdARead(fd* desc, void* buf, size_t nBytes, event* evnt)
         );
         Core_EventSet(evnt, true);
         desc->offset += nBytes;
-        VfsH_UnlockMountpoint(point);
+        VfsH_UnlockVnode(desc->vn, false);
         return status;
     }
     // else 
@@ -250,19 +283,16 @@ obos_status Vfs_FdARead(fd* desc, void* buf, size_t nBytes, event* evnt)
     irp->requestSize = nBytes;
     irp->un.buf = buf;
     irp->vn = desc->vn;
-    irp->worker = CoreH_ThreadAllocate(nullptr);
-    thread_ctx ctx = {};
-    CoreS_SetupThreadContext(
-        &ctx, 
-        (uintptr_t)async_read, (uintptr_t)irp,
-        false,
-        Mm_VirtualMemoryAlloc(&Mm_KernelContext, nullptr, 0x10000, 0, VMA_FLAGS_KERNEL_STACK, nullptr, nullptr), 
-        0x10000);
-    CoreH_ThreadInitialize(irp->worker, THREAD_PRIORITY_HIGH, Core_DefaultThreadAffinity, &ctx);
-    irp->worker->stackFree = CoreH_VMAStackFree;
-    irp->worker->stackFreeUserdata = &Mm_KernelContext;
+    irp->work.userdata = irp;
+    irp->work.priority = WORK_PRIORITY_HIGH;
     desc->vn->nPendingAsyncIO++;
-    CoreH_ThreadReady(irp->worker);
+    obos_status status = dispatch_irp(irp, async_read);
+    if (obos_is_error(status))
+    {
+        desc->vn->nPendingAsyncIO--;
+        Vfs_Free(irp);
+        return status;
+    }
     desc->offset += nBytes;
     return OBOS_STATUS_SUCCESS;
 }
\ No newline at end of file
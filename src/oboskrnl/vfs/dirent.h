@@ -9,6 +9,7 @@
 #include <int.h>
 
 #include <vfs/limits.h>
+#include <vfs/namecache.h>
 
 #include <utils/string.h>
 #include <utils/list.h>
@@ -31,6 +32,12 @@ typedef struct dirent
     struct vnode* vnode;
     string name;
     LIST_NODE(dirent_list, struct dirent) node;
+    // Set if this is a directory on a mounted filesystem whose children have not been read yet.
+    bool unpopulated;
+    // The name cache entries under this directory, and the ones that resolve to this dirent.
+    // Protected by the name cache's lock.
+    namecache_children nc_children;
+    namecache_refs nc_refs;
 } dirent;
 LIST_PROTOTYPE(dirent_list, dirent, node);
 #define d_children tree_info.children
@@ -43,5 +50,8 @@ void VfsH_DirentRemoveChild(dirent* parent, dirent* what);
 // the lookup
 dirent* VfsH_DirentLookup(const char* path);
 dirent* VfsH_DirentLookupFrom(const char* path, dirent* root);
+// Reads the children of a directory from its filesystem, if that has not been done yet.
+// Lookups do this on their own, but anything that walks d_children directly must call this first.
+void VfsH_DirentPopulate(dirent* dir);
 
 OBOS_EXPORT dirent* Drv_RegisterVNode(struct vnode* vn, const char* const dev_name);
\ No newline at end of file
@@ -26,6 +26,9 @@
 
 #include <locks/mutex.h>
 
+#include <mm/context.h>
+#include <mm/dma.h>
+
 #include <driver_interface/driverId.h>
 #include <driver_interface/header.h>
 
@@ -103,136 +106,281 @@ OBOS_EXPORT obos_status Vfs_FdOpenVnode(fd* const desc, void* vn, uint32_t oflag
     desc->flags |= FD_FLAGS_OPEN;
     return OBOS_STATUS_SUCCESS;
 }
-static obos_status do_uncached_write(fd* desc, const void* from, size_t nBytes, size_t* nWritten_)
+static const driver_header* get_driver(vnode* vn)
 {
-    mount* const point = desc->vn->mount_point ? desc->vn->mount_point : desc->vn->un.mounted;
-    const driver_header* driver = desc->vn->vtype == VNODE_TYPE_REG ? &point->fs_driver->driver->header : nullptr;
-    if (desc->vn->vtype == VNODE_TYPE_CHR || desc->vn->vtype == VNODE_TYPE_BLK)
-        driver = &desc->vn->un.device->driver->header;
+    mount* const point = vn->mount_point ? vn->mount_point : vn->un.mounted;
+    const driver_header* driver = vn->vtype == VNODE_TYPE_REG ? &point->fs_driver->driver->header : nullptr;
+    if (vn->vtype == VNODE_TYPE_CHR || vn->vtype == VNODE_TYPE_BLK)
+        driver = &vn->un.device->driver->header;
+    return driver;
+}
+static size_t iov_size(const iovec* vec, size_t nVec)
+{
+    size_t sz = 0;
+    for (size_t i = 0; i < nVec; i++)
+        sz += vec[i].iov_len;
+    return sz;
+}
+static bool iov_valid(const iovec* vec, size_t nVec)
+{
+    if (!vec && nVec)
+        return false;
+    for (size_t i = 0; i < nVec; i++)
+        if (!vec[i].iov_base && vec[i].iov_len)
+            return false;
+    return true;
+}
+// The context a buffer passed to the direct I/O path lives in.
+static context* buffer_context(const void* buf)
+{
+    if ((uintptr_t)buf >= OBOS_KERNEL_ADDRESS_SPACE_BASE)
+        return &Mm_KernelContext;
+    return Core_GetCurrentThread()->proc->ctx;
+}
+// Does one driver request for each run of segments that are contiguous in memory.
+// Each run is pinned for the duration of the request, so a driver doing DMA can use the caller's buffer directly.
+// The page cache is kept coherent: overlapping dirty regions are flushed beforehand, and after a write,
+// overlapping cached pages are invalidated.
+// The caller must hold the vnode lock.
+static obos_status do_uncached_io(fd* desc, const iovec* vec, size_t nVec, uoff_t off, size_t nBytes, bool write, size_t* nTransferred_)
+{
+    const driver_header* driver = get_driver(desc->vn);
     size_t blkSize = 0;
     driver->ftable.get_blk_size(desc->vn->desc, &blkSize);
-    if (nBytes % blkSize)
+    if (off % blkSize)
         return OBOS_STATUS_INVALID_ARGUMENT;
-    nBytes /= blkSize;
     const size_t base_offset = desc->vn->flags & VFLAGS_PARTITION ? desc->vn->partitions[0].off : 0;
-    const uintptr_t offset = (desc->offset + base_offset) / blkSize;
-    if (!VfsH_LockMountpoint(point))
-        return OBOS_STATUS_ABORTED;
-    obos_status status = driver->ftable.write_sync(desc->vn->desc, from, nBytes, offset, nWritten_);
-    VfsH_UnlockMountpoint(point);
-    if (obos_expect(obos_is_error(status) == true, 0))
+    VfsH_PageCacheFlushRange(&desc->vn->pagecache, desc->vn, off, nBytes);
+    size_t nTransferred = 0;
+    obos_status status = OBOS_STATUS_SUCCESS;
+    for (size_t i = 0; i < nVec && nTransferred < nBytes; )
+    {
+        char* base = vec[i].iov_base;
+        size_t len = vec[i].iov_len;
+        for (i++; i < nVec && ((char*)vec[i-1].iov_base + vec[i-1].iov_len) == vec[i].iov_base; i++)
+            len += vec[i].iov_len;
+        if (len > (nBytes - nTransferred))
+            len = nBytes - nTransferred;
+        if (!len)
+            continue;
+        if (len % blkSize)
+        {
+            status = OBOS_STATUS_INVALID_ARGUMENT;
+            break;
+        }
+        // If the buffer can't be pinned (e.g., it is in the kernel image), the driver just gets it as-is.
+        dma_mapping mapping = {};
+        const bool pinned = obos_is_success(Mm_DMAMapBuffer(buffer_context(base), base, len, !write, &mapping));
+        const uintptr_t blkOffset = (off + nTransferred + base_offset) / blkSize;
+        size_t nBlks = 0;
+        if (write)
+            status = driver->ftable.write_sync(desc->vn->desc, base, len / blkSize, blkOffset, &nBlks);
+        else
+            status = driver->ftable.read_sync(desc->vn->desc, base, len / blkSize, blkOffset, &nBlks);
+        if (pinned)
+            Mm_DMAUnmapBuffer(&mapping);
+        if (obos_expect(obos_is_error(status) == true, 0))
+            break;
+        nTransferred += nBlks*blkSize;
+        if (nBlks*blkSize != len)
+            break;
+    }
+    if (write && nTransferred)
+        VfsH_PageCacheInvalidateRange(&desc->vn->pagecache, desc->vn, off, nTransferred);
+    if (nTransferred_)
+        *nTransferred_ = nTransferred;
+    return status;
+}
+obos_status VfsH_LockVnode(vnode* vn, bool exclusive)
+{
+    // Counted before the flags are checked, so an unmount that marks the vnode as dying waits for us to leave.
+    atomic_fetch_add(&vn->nLockUsers, 1);
+    obos_status status = OBOS_STATUS_ABORTED;
+    if (!(vn->flags & VFLAGS_DYING))
+        status = exclusive ? Core_RwLockAcquireExclusive(&vn->lock) : Core_RwLockAcquireShared(&vn->lock);
+    // The unmount could have started while we were waiting.
+    if (obos_is_success(status) && (vn->flags & VFLAGS_DYING))
+    {
+        exclusive ? Core_RwLockReleaseExclusive(&vn->lock) : Core_RwLockReleaseShared(&vn->lock);
+        status = OBOS_STATUS_ABORTED;
+    }
+    if (obos_is_error(status))
+        atomic_fetch_sub(&vn->nLockUsers, 1);
+    return status;
+}
+void VfsH_UnlockVnode(vnode* vn, bool exclusive)
+{
+    exclusive ? Core_RwLockReleaseExclusive(&vn->lock) : Core_RwLockReleaseShared(&vn->lock);
+    // The vnode mustn't be touched after this.
+    atomic_fetch_sub(&vn->nLockUsers, 1);
+}
+// Reads take the vnode's lock shared, and writes take it exclusive.
+// The mount point lock is left for namespace changes, so I/O to different files, or reads of the same file, can run in parallel.
+static obos_status lock_vnode(fd* desc, bool exclusive)
+{
+    obos_status status = VfsH_LockVnode(desc->vn, exclusive);
+    if (obos_is_error(status))
         return status;
-    if (nWritten_)
-        *nWritten_ *= blkSize;
+    // The fd might have been closed while we were waiting.
+    if (!(desc->flags & FD_FLAGS_OPEN))
+    {
+        VfsH_UnlockVnode(desc->vn, exclusive);
+        return OBOS_STATUS_ABORTED;
+    }
     return OBOS_STATUS_SUCCESS;
 }
-obos_status Vfs_FdWrite(fd* desc, const void* buf, size_t nBytes, size_t* nWritten)
+static obos_status writev_at(fd* desc, const iovec* vec, size_t nVec, uoff_t off, size_t* nWritten)
 {
-    if (!desc || !buf)
+    if (!desc || !iov_valid(vec, nVec))
         return OBOS_STATUS_INVALID_ARGUMENT;
     if (!(desc->flags & FD_FLAGS_OPEN))
         return OBOS_STATUS_UNINITIALIZED;
+    const size_t nBytes = iov_size(vec, nVec);
+    if (nWritten)
+        *nWritten = 0;
     if (!nBytes)
         return OBOS_STATUS_SUCCESS;
-    if (is_eof(desc->vn, desc->offset))
-        return OBOS_STATUS_EOF;
     if (!(desc->flags & FD_FLAGS_WRITE))
         return OBOS_STATUS_ACCESS_DENIED;
-    obos_status status = OBOS_STATUS_SUCCESS;
-    if (desc->flags & FD_FLAGS_UNCACHED)
+    obos_status status = lock_vnode(desc, true);
+    if (obos_is_error(status))
+        return status;
+    if (is_eof(desc->vn, off))
     {
-        // Keep it nice and simple, and just do an uncached write on the file.
-
-        status = do_uncached_write(desc, buf, nBytes, nWritten);
+        VfsH_UnlockVnode(desc->vn, true);
+        return OBOS_STATUS_EOF;
     }
+    size_t written = nBytes;
+    if (desc->flags & FD_FLAGS_UNCACHED)
+        status = do_uncached_io(desc, vec, nVec, off, nBytes, true, &written);
     else 
     {
-        mount* const point = desc->vn->mount_point ? desc->vn->mount_point : desc->vn->un.mounted;
-        if (!VfsH_LockMountpoint(point))
-            return OBOS_STATUS_ABORTED;;
-        pagecache_dirty_region* dirty = VfsH_PCDirtyRegionCreate(&desc->vn->pagecache, desc->offset, nBytes);
+        // The whole range is one dirty region, and is brought into the page cache at once.
+        pagecache_dirty_region* dirty = VfsH_PCDirtyRegionCreate(&desc->vn->pagecache, off, nBytes);
         OBOS_ASSERT(obos_expect(dirty != nullptr, 0));
         Core_MutexAcquire(&dirty->lock);
-        memcpy(VfsH_PageCacheGetEntry(&desc->vn->pagecache, desc->vn, desc->offset, nBytes), buf, nBytes);
-        VfsH_UnlockMountpoint(point);
+        char* iter = VfsH_PageCacheGetEntry(&desc->vn->pagecache, desc->vn, off, nBytes);
+        for (size_t i = 0; i < nVec; i++)
+        {
+            memcpy(iter, vec[i].iov_base, vec[i].iov_len);
+            iter += vec[i].iov_len;
+        }
         Core_MutexRelease(&dirty->lock);
-
-        if (nWritten)
-            *nWritten = nBytes;
     }
     if (obos_expect(obos_is_success(status), 1))
     {
-        if (nBytes > (desc->vn->filesize - desc->offset) && desc->vn->vtype == VNODE_TYPE_REG)
-            desc->vn->filesize += (nBytes-(desc->vn->filesize - desc->offset)); // add the difference to the file size
-        Vfs_FdSeek(desc, nBytes, SEEK_CUR);
+        if (written > (desc->vn->filesize - off) && desc->vn->vtype == VNODE_TYPE_REG)
+            desc->vn->filesize += (written-(desc->vn->filesize - off)); // add the difference to the file size
+        if (nWritten)
+            *nWritten = written;
     }
+    VfsH_UnlockVnode(desc->vn, true);
     return status;
 }
-static obos_status do_uncached_read(fd* desc, void* into, size_t nBytes, size_t* nRead_)
-{
-    mount* const point = desc->vn->mount_point ? desc->vn->mount_point : desc->vn->un.mounted;
-    const driver_header* driver = desc->vn->vtype == VNODE_TYPE_REG ? &point->fs_driver->driver->header : nullptr;
-    if (desc->vn->vtype == VNODE_TYPE_CHR || desc->vn->vtype == VNODE_TYPE_BLK)
-        driver = &desc->vn->un.device->driver->header;
-    size_t blkSize = 0;
-    driver->ftable.get_blk_size(desc->vn->desc, &blkSize);
-    if (nBytes % blkSize)
-        return OBOS_STATUS_INVALID_ARGUMENT;
-    nBytes /= blkSize;
-    const size_t base_offset = desc->vn->flags & VFLAGS_PARTITION ? desc->vn->partitions[0].off : 0;
-    const uintptr_t offset = (desc->offset+base_offset) / blkSize;
-    if (!VfsH_LockMountpoint(point))
-        return OBOS_STATUS_ABORTED;
-    obos_status status = driver->ftable.read_sync(desc->vn->desc, into, nBytes, offset, nRead_);
-    VfsH_UnlockMountpoint(point);
-    if (obos_expect(obos_is_error(status) == true, 0))
-        return status;
-    if (nRead_)
-        *nRead_ *= blkSize;
-    return OBOS_STATUS_SUCCESS;
-}
-obos_status Vfs_FdRead(fd* desc, void* buf, size_t nBytes, size_t* nRead)
+static obos_status readv_at(fd* desc, const iovec* vec, size_t nVec, uoff_t off, size_t* nRead)
 {
-    if (!desc || !buf)
+    if (!desc || !iov_valid(vec, nVec))
         return OBOS_STATUS_INVALID_ARGUMENT;
     if (!(desc->flags & FD_FLAGS_OPEN))
         return OBOS_STATUS_UNINITIALIZED;
+    size_t nBytes = iov_size(vec, nVec);
+    if (nRead)
+        *nRead = 0;
     if (!nBytes)
         return OBOS_STATUS_SUCCESS;
-    if (is_eof(desc->vn, desc->offset))
-        return OBOS_STATUS_EOF;
     if (!(desc->flags & FD_FLAGS_READ))
         return OBOS_STATUS_ACCESS_DENIED;
-    if (nBytes > (desc->vn->filesize - desc->offset) && desc->vn->vtype == VNODE_TYPE_REG)
-        nBytes = desc->vn->filesize - desc->offset; // truncate size to the space we have left in the file.
-    obos_status status = OBOS_STATUS_SUCCESS;
-    if (desc->flags & FD_FLAGS_UNCACHED)
+    obos_status status = lock_vnode(desc, false);
+    if (obos_is_error(status))
+        return status;
+    if (is_eof(desc->vn, off))
     {
-        // Keep it nice and simple, and just do an uncached read on the file.
-
-        status = do_uncached_read(desc, buf, nBytes, nRead);
+        VfsH_UnlockVnode(desc->vn, false);
+        return OBOS_STATUS_EOF;
     }
+    if (nBytes > (desc->vn->filesize - off) && desc->vn->vtype == VNODE_TYPE_REG)
+        nBytes = desc->vn->filesize - off; // truncate size to the space we have left in the file.
+    size_t read = nBytes;
+    if (desc->flags & FD_FLAGS_UNCACHED)
+        status = do_uncached_io(desc, vec, nVec, off, nBytes, false, &read);
     else 
     {
-        pagecache_dirty_region* dirty = VfsH_PCDirtyRegionLookup(&desc->vn->pagecache, desc->offset);
-        if (dirty)
-            Core_MutexAcquire(&dirty->lock);
-        mount* const point = desc->vn->mount_point ? desc->vn->mount_point : desc->vn->un.mounted;
-        // const size_t base_offset = desc->vn->flags & VFLAGS_PARTITION ? desc->vn->partitions[0].off : 0;
-        if (!VfsH_LockMountpoint(point))
-            return OBOS_STATUS_ABORTED;
-        memcpy(buf, VfsH_PageCacheGetEntry(&desc->vn->pagecache, desc->vn, desc->offset, nBytes), nBytes);
-        if (dirty)
-            Core_MutexRelease(&dirty->lock);
-        VfsH_UnlockMountpoint(point);
-
-        if (nRead)
-            *nRead = nBytes;
+        // Writers hold the vnode lock exclusive, so nothing can change the cached data under us.
+        const char* iter = VfsH_PageCacheGetEntry(&desc->vn->pagecache, desc->vn, off, nBytes);
+        size_t left = nBytes;
+        for (size_t i = 0; i < nVec && left; i++)
+        {
+            size_t len = vec[i].iov_len > left ? left : vec[i].iov_len;
+            memcpy(vec[i].iov_base, iter, len);
+            iter += len;
+            left -= len;
+        }
     }
+    VfsH_UnlockVnode(desc->vn, false);
+    if (obos_expect(obos_is_success(status), 1) && nRead)
+        *nRead = read;
+    return status;
+}
+obos_status Vfs_FdWrite(fd* desc, const void* buf, size_t nBytes, size_t* nWritten)
+{
+    if (!desc || !buf)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    const iovec vec = { .iov_base=(void*)buf, .iov_len=nBytes };
+    return Vfs_FdWriteV(desc, &vec, 1, nWritten);
+}
+obos_status Vfs_FdRead(fd* desc, void* buf, size_t nBytes, size_t* nRead)
+{
+    if (!desc || !buf)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    const iovec vec = { .iov_base=buf, .iov_len=nBytes };
+    return Vfs_FdReadV(desc, &vec, 1, nRead);
+}
+obos_status Vfs_FdWriteV(fd* desc, const iovec* vec, size_t nVec, size_t* nWritten)
+{
+    if (!desc)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    size_t written = 0;
+    obos_status status = writev_at(desc, vec, nVec, desc->offset, &written);
+    if (obos_expect(obos_is_success(status), 1))
+        Vfs_FdSeek(desc, written, SEEK_CUR);
+    if (nWritten)
+        *nWritten = written;
+    return status;
+}
+obos_status Vfs_FdReadV(fd* desc, const iovec* vec, size_t nVec, size_t* nRead)
+{
+    if (!desc)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    size_t read = 0;
+    obos_status status = readv_at(desc, vec, nVec, desc->offset, &read);
     if (obos_expect(obos_is_success(status), 1))
-        Vfs_FdSeek(desc, nBytes, SEEK_CUR);
+        Vfs_FdSeek(desc, read, SEEK_CUR);
+    if (nRead)
+        *nRead = read;
     return status;
 }
+obos_status Vfs_FdPWrite(fd* desc, const void* buf, size_t nBytes, uoff_t off, size_t* nWritten)
+{
+    if (!buf)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    const iovec vec = { .iov_base=(void*)buf, .iov_len=nBytes };
+    return writev_at(desc, &vec, 1, off, nWritten);
+}
+obos_status Vfs_FdPRead(fd* desc, void* buf, size_t nBytes, uoff_t off, size_t* nRead)
+{
+    if (!buf)
+        return OBOS_STATUS_INVALID_ARGUMENT;
+    const iovec vec = { .iov_base=buf, .iov_len=nBytes };
+    return readv_at(desc, &vec, 1, off, nRead);
+}
+obos_status Vfs_FdPWriteV(fd* desc, const iovec* vec, size_t nVec, uoff_t off, size_t* nWritten)
+{
+    return writev_at(desc, vec, nVec, off, nWritten);
+}
+obos_status Vfs_FdPReadV(fd* desc, const iovec* vec, size_t nVec, uoff_t off, size_t* nRead)
+{
+    return readv_at(desc, vec, nVec, off, nRead);
+}
 obos_status Vfs_FdSeek(fd* desc, off_t off, whence_t whence)
 {
     if (!desc)
@@ -323,11 +471,11 @@ obos_status Vfs_FdFlush(fd* desc)
         return OBOS_STATUS_INVALID_ARGUMENT;
     if (desc->flags & FD_FLAGS_UNCACHED)
         return OBOS_STATUS_INVALID_OPERATION;
-    mount* const point = desc->vn->mount_point ? desc->vn->mount_point : desc->vn->un.mounted;
-    if (!VfsH_LockMountpoint(point))
-        return OBOS_STATUS_ABORTED;
+    obos_status status = lock_vnode(desc, true);
+    if (obos_is_error(status))
+        return status;
     VfsH_PageCacheFlush(&desc->vn->pagecache, desc->vn);
-    VfsH_UnlockMountpoint(point);
+    VfsH_UnlockVnode(desc->vn, true);
     return OBOS_STATUS_SUCCESS;
 }
 obos_status Vfs_FdClose(fd* desc)
@@ -30,6 +30,12 @@ enum
     FD_OFLAGS_READ_ONLY = 1,
     FD_OFLAGS_UNCACHED = 2,
 };
+// A segment of a buffer, for vectored I/O.
+typedef struct iovec
+{
+    void* iov_base;
+    size_t iov_len;
+} iovec;
 typedef struct fd
 {
     struct vnode* vn;
@@ -42,6 +48,16 @@ OBOS_EXPORT obos_status       Vfs_FdOpenDirent(fd* const desc, dirent* ent, uint
 OBOS_EXPORT obos_status       Vfs_FdOpenVnode(fd* const desc, void* vn, uint32_t oflags);
 OBOS_EXPORT obos_status      Vfs_FdWrite(fd* desc, const void* buf, size_t nBytes, size_t* nWritten);
 OBOS_EXPORT obos_status       Vfs_FdRead(fd* desc, void* buf, size_t nBytes, size_t* nRead);
+// The segments are read or written in order, as if they were one buffer.
+// The cached path brings the whole range into the page cache at once, and the uncached path does one driver
+// request for each run of segments that are contiguous in memory.
+OBOS_EXPORT obos_status     Vfs_FdWriteV(fd* desc, const iovec* vec, size_t nVec, size_t* nWritten);
+OBOS_EXPORT obos_status      Vfs_FdReadV(fd* desc, const iovec* vec, size_t nVec, size_t* nRead);
+// Positional I/O. These neither use nor update the offset of the fd.
+OBOS_EXPORT obos_status     Vfs_FdPWrite(fd* desc, const void* buf, size_t nBytes, uoff_t off, size_t* nWritten);
+OBOS_EXPORT obos_status      Vfs_FdPRead(fd* desc, void* buf, size_t nBytes, uoff_t off, size_t* nRead);
+OBOS_EXPORT obos_status    Vfs_FdPWriteV(fd* desc, const iovec* vec, size_t nVec, uoff_t off, size_t* nWritten);
+OBOS_EXPORT obos_status     Vfs_FdPReadV(fd* desc, const iovec* vec, size_t nVec, uoff_t off, size_t* nRead);
 OBOS_EXPORT obos_status     Vfs_FdAWrite(fd* desc, const void* buf, size_t nBytes, event* evnt);
 OBOS_EXPORT obos_status      Vfs_FdARead(fd* desc, void* buf, size_t nBytes, event* evnt);
 OBOS_EXPORT obos_status       Vfs_FdSeek(fd* desc, off_t off, whence_t whence);
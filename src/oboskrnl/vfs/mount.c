@@ -41,20 +41,16 @@ typedef struct symbolic_link
 } symbolic_link;
 LIST_GENERATE_STATIC(symbolic_link_list, struct symbolic_link, node);
 
-static size_t str_search(const char* str, char ch)
-{
-    size_t ret = strchr(str, ch);
-    for (; str[ret] == ch && str[ret] != 0; ret++)
-        ;
-    return ret;
-}
 OBOS_STATIC_ASSERT(sizeof(driver_file_perm) == sizeof(file_perm), "Invalid sizes!");
+// Returns nullptr for symbolic links, as they are resolved later.
 static vnode* create_vnode(mount* mountpoint, dev_desc desc, file_type* t)
 {
     file_type type = 0;
     driver_file_perm perm = {};
     mountpoint->fs_driver->driver->header.ftable.get_file_perms(desc, &perm);
     mountpoint->fs_driver->driver->header.ftable.get_file_type(desc, &type);
+    if (t)
+        *t = type;
     vnode* vn = Vfs_Calloc(1, sizeof(vnode));
     switch (type)
     {
@@ -69,8 +65,7 @@ static vnode* create_vnode(mount* mountpoint, dev_desc desc, file_type* t)
         {
             // Defer the initialization of the vnode.
             Vfs_Free(vn);
-            vn = nullptr;
-            break;
+            return nullptr;
         }
         default:
             OBOS_ASSERT(type);
@@ -79,103 +74,122 @@ static vnode* create_vnode(mount* mountpoint, dev_desc desc, file_type* t)
     vn->desc = desc;
     memcpy(&vn->perm, &perm, sizeof(file_perm));
     VfsH_PageCacheRef(&vn->pagecache);
-    if (t)
-        *t = type;
     return vn;
 }
-static iterate_decision callback(dev_desc desc, size_t blkSize, size_t blkCount, void* userdata)
+static iterate_decision populate_cb(dev_desc desc, size_t blkSize, size_t blkCount, void* userdata)
 {
+    OBOS_UNUSED(blkSize);
+    OBOS_UNUSED(blkCount);
     uintptr_t *udata = (uintptr_t*)userdata;
     mount* mountpoint = (mount*)udata[0];
-    vdev* fs_driver = (vdev*)udata[1];
-    vdev* device = (vdev*)udata[2];
-    symbolic_link_list* symlinks = (symbolic_link_list*)udata[3];
-    OBOS_UNUSED(blkSize);
-    OBOS_UNUSED(device);
-    file_type type = 0;
+    dirent* dir = (dirent*)udata[1];
+    symbolic_link_list* symlinks = (symbolic_link_list*)udata[2];
     const char* path = nullptr;
-    OBOS_UNUSED(mountpoint);
-    OBOS_UNUSED(desc);
-    OBOS_UNUSED(blkCount);
-    OBOS_UNUSED(device);
-    fs_driver->driver->header.ftable.query_path(desc, &path);
-    fs_driver->driver->header.ftable.get_file_type(desc, &type);
+    mountpoint->fs_driver->driver->header.ftable.query_path(desc, &path);
+    if (!path)
+        return ITERATE_DECISION_CONTINUE;
+    // The name of the entry is the last component of its path.
     size_t pathlen = strlen(path);
-    const char* tok = path;
-    bool is_base = false;
-    size_t tok_len = 0;
+    while (pathlen && path[pathlen - 1] == '/')
+        pathlen--;
+    size_t name_start = pathlen;
+    while (name_start && path[name_start - 1] != '/')
+        name_start--;
+    if (name_start == pathlen)
+        return ITERATE_DECISION_CONTINUE;
+    const char* name = path + name_start;
+    const size_t namelen = pathlen - name_start;
+    for (dirent* curr = dir->d_children.head; curr; curr = curr->d_next_child)
+        if (OBOS_CompareStringNC(&curr->name, name, namelen))
+            return ITERATE_DECISION_CONTINUE; // already known
+    dirent* new = Vfs_Calloc(1, sizeof(dirent));
+    OBOS_StringSetAllocator(&new->name, Vfs_Allocator);
+    OBOS_InitStringLen(&new->name, name, namelen);
+    file_type type = 0;
+    new->vnode = create_vnode(mountpoint, desc, &type);
+    if (type == FILE_TYPE_SYMBOLIC_LINK)
+    {
+        symbolic_link* lnk = Vfs_Calloc(1, sizeof(symbolic_link));
+        lnk->ent = new;
+        lnk->desc = desc;
+        LIST_APPEND(symbolic_link_list, symlinks, lnk);
+    }
+    else
     {
-        size_t currentPathLen = strlen(tok)-1;
-        if (tok[currentPathLen] != '/')
-            currentPathLen++;
-        while (tok[currentPathLen] == '/')
-            currentPathLen--;
-        tok_len = strchr(tok, '/');
-        if (tok_len != currentPathLen)
-            tok_len--;
-        else
-            is_base = true;
+        new->vnode->refs++;
+        // Subdirectories are read when they are first used.
+        new->unpopulated = (type == FILE_TYPE_DIRECTORY);
     }
-    dirent* last = mountpoint->root;
-    char* currentPath = Vfs_Calloc(pathlen + 1, sizeof(char));
-    size_t currentPathLen = 0;
-    while (tok < (path+pathlen))
+    VfsH_DirentAppendChild(dir, new);
+    return ITERATE_DECISION_CONTINUE;
+}
+// Symbolic links are resolved after their directory is read, as they might point into it.
+static void resolve_symlinks(mount* mountpoint, symbolic_link_list* symlinks)
+{
+    const driver_header* driver = &mountpoint->fs_driver->driver->header;
+    // A link can point at another link in the same directory, so keep going while links get resolved.
+    bool progress = true;
+    while (progress && LIST_GET_HEAD(symbolic_link_list, symlinks))
     {
-        char* token = Vfs_Calloc(tok_len + 1, sizeof(char));
-        memcpy(token, tok, tok_len);
-        token[tok_len] = 0;
-        memcpy(currentPath + currentPathLen, token, tok_len);
-        currentPathLen += tok_len;
-        if (!is_base)
-            currentPath[currentPathLen++] = '/';
-        dirent* new = VfsH_DirentLookupFrom(token, last ? last : mountpoint->root);
-        if (!new)
+        progress = false;
+        for (symbolic_link* lnk = LIST_GET_HEAD(symbolic_link_list, symlinks); lnk; )
         {
-            // Allocate a new dirent.
-            new = Vfs_Calloc(1, sizeof(dirent));
-            OBOS_StringSetAllocator(&new->name, Vfs_Allocator);
-            OBOS_InitStringLen(&new->name, token, tok_len);
-            dev_desc curdesc = 0;
-            file_type curtype = 0;
-            if (is_base)
-                curdesc = desc;
-            else
-                fs_driver->driver->header.ftable.path_search(&curdesc, (void*)udata[2], currentPath);
-            mountpoint->fs_driver->driver->header.ftable.get_file_type(desc, &type);
-            if (curtype == FILE_TYPE_SYMBOLIC_LINK)
+            symbolic_link* next = LIST_GET_NEXT(symbolic_link_list, symlinks, lnk);
+            const char *points_at = nullptr;
+            dev_desc desc_points_at = 0;
+            driver->ftable.get_linked_desc(lnk->desc, &desc_points_at);
+            if (desc_points_at)
+                driver->ftable.query_path(desc_points_at, &points_at);
+            dirent* resolved = points_at ? VfsH_DirentLookupFrom(points_at, mountpoint->root) : nullptr;
+            if (resolved && resolved->vnode)
             {
-                symbolic_link* lnk = Vfs_Calloc(1, sizeof(symbolic_link));
-                lnk->ent = new;
-                lnk->desc = desc;
-                LIST_APPEND(symbolic_link_list, symlinks, lnk);   
-            }
-            else 
-            {
-                vnode* new_vn = create_vnode(mountpoint, curdesc, &curtype);
-                new->vnode = new_vn;
-                new->vnode->refs++;
+                lnk->ent->vnode = resolved->vnode;
+                lnk->ent->vnode->refs++;
+                VfsH_PageCacheRef(&lnk->ent->vnode->pagecache);
+                LIST_REMOVE(symbolic_link_list, symlinks, lnk);
+                Vfs_Free(lnk); // free the temporary structure.
+                progress = true;
             }
+            lnk = next;
         }
-        if (!new->d_prev_child && !new->d_next_child && last->d_children.head != new)
-            VfsH_DirentAppendChild(last ? last : mountpoint->root, new);
-        last = new;
-        Vfs_Free(token);
-
-        tok += str_search(tok, '/');
-        size_t currentPathLen = strlen(tok)-1;
-        if (tok[currentPathLen] != '/')
-            currentPathLen++;
-        while (tok[currentPathLen] == '/')
-            currentPathLen--;
-        tok_len = strchr(tok, '/');
-        if (tok_len != currentPathLen)
-            tok_len--;
-        else
-            is_base = true;
     }
-    if (type == FILE_TYPE_DIRECTORY)
-        fs_driver->driver->header.ftable.list_dir(desc, (void*)udata[2], callback, udata);
-    return ITERATE_DECISION_CONTINUE;
+    for (symbolic_link* lnk = LIST_GET_HEAD(symbolic_link_list, symlinks); lnk; )
+    {
+        symbolic_link* next = LIST_GET_NEXT(symbolic_link_list, symlinks, lnk);
+        OBOS_Warning("VFS: Could not resolve symbolic link '%*s'.\n", OBOS_GetStringSize(&lnk->ent->name), OBOS_GetStringCPtr(&lnk->ent->name));
+        VfsH_DirentRemoveChild(lnk->ent->d_parent, lnk->ent);
+        OBOS_FreeString(&lnk->ent->name);
+        Vfs_Free(lnk->ent);
+        LIST_REMOVE(symbolic_link_list, symlinks, lnk);
+        Vfs_Free(lnk);
+        lnk = next;
+    }
+}
+void VfsH_DirentPopulate(dirent* dir)
+{
+    if (!dir || !dir->unpopulated || !dir->vnode)
+        return;
+    mount* const point = (dir->vnode->flags & VFLAGS_MOUNTPOINT) ? dir->vnode->un.mounted : dir->vnode->mount_point;
+    if (!point)
+        return;
+    Core_MutexAcquire(&point->populate_lock);
+    if (!dir->unpopulated)
+    {
+        // Someone else got here first.
+        Core_MutexRelease(&point->populate_lock);
+        return;
+    }
+    symbolic_link_list symlinks = {};
+    uintptr_t udata[3] = {
+        (uintptr_t)point,
+        (uintptr_t)dir,
+        (uintptr_t)&symlinks,
+    };
+    const dev_desc desc = dir == point->root ? UINTPTR_MAX : dir->vnode->desc;
+    point->fs_driver->driver->header.ftable.list_dir(desc, point->device, populate_cb, udata);
+    dir->unpopulated = false;
+    Core_MutexRelease(&point->populate_lock);
+    resolve_symlinks(point, &symlinks);
 }
 obos_status Vfs_Mount(const char* at_, vnode* on, vdev* fs_driver, mount** pMountpoint)
 {
@@ -200,52 +214,12 @@ obos_status Vfs_Mount(const char* at_, vnode* on, vdev* fs_driver, mount** pMoun
     // at->vnode->mount_point = mountpoint;
     at->vnode->flags |= VFLAGS_MOUNTPOINT;
     mountpoint->root = at;
-    symbolic_link_list symlinks = {};
-    uintptr_t udata[4] = {
-        (uintptr_t)mountpoint,
-        (uintptr_t)fs_driver,
-        (uintptr_t)on,
-        (uintptr_t)&symlinks,
-    };
     mountpoint->fs_driver = memcpy(Vfs_Calloc(1, sizeof(vdev)), fs_driver, sizeof(*fs_driver));
     if (mountpoint->device)
         mountpoint->device->refs++;
     mountpoint->device = on;
-    fs_driver->driver->header.ftable.list_dir(UINTPTR_MAX, on, callback, udata);
-    for (symbolic_link* lnk = LIST_GET_HEAD(symbolic_link_list, &symlinks); lnk; )
-    {
-        symbolic_link* next = LIST_GET_NEXT(symbolic_link_list, &symlinks, lnk);
-        if (lnk->ent->vnode)
-        {
-            // We have already been resolved.
-            lnk = next;
-            continue;
-        }
-        const char *points_at = nullptr;
-        dev_desc desc_points_at = 0;
-        fs_driver->driver->header.ftable.get_linked_desc(lnk->desc, &desc_points_at);
-        fs_driver->driver->header.ftable.query_path(desc_points_at, &points_at);
-        dirent* resolved = VfsH_DirentLookupFrom(points_at, mountpoint->root);
-        OBOS_ASSERT(resolved); // TODO: Proper error handling.
-        dev_desc desc = 0;
-        while (!resolved->vnode)
-        {
-            desc = desc_points_at;
-            // *resolved is probably also an unresolved symlink.
-            // resolve it.
-            points_at = nullptr;
-            desc_points_at = 0;
-            fs_driver->driver->header.ftable.get_linked_desc(desc, &desc_points_at);
-            fs_driver->driver->header.ftable.query_path(desc_points_at, &points_at);
-            resolved = VfsH_DirentLookupFrom(points_at, mountpoint->root);
-            OBOS_ASSERT(resolved); // TODO: Proper error handling.
-        }
-        lnk->ent->vnode = resolved->vnode;
-        lnk->ent->vnode->refs++;
-        VfsH_PageCacheRef(&lnk->ent->vnode->pagecache);
-        Vfs_Free(lnk); // free the temporary structure.
-        lnk = next;
-    }
+    // Nothing is read from the filesystem until it is used, so mounting costs the same no matter how many files there are.
+    at->unpopulated = true;
     LIST_APPEND(mount_list, &Vfs_Mounted, mountpoint);
     return OBOS_STATUS_SUCCESS;
 }
@@ -302,14 +276,20 @@ static void stage_one(mount* unused, dirent* ent, void* userdata)
 {
     OBOS_UNUSED(unused);
     OBOS_UNUSED(userdata);
+    // Anyone that locks the vnode after this gives up, instead of touching it after it is freed.
+    ent->vnode->flags |= VFLAGS_DYING;
+    // Wait for any I/O in progress on the vnode to finish.
+    Core_RwLockAcquireExclusive(&ent->vnode->lock);
     for (fd* curr = LIST_GET_HEAD(fd_list, &ent->vnode->opened); curr; )
     {
         fd* next = LIST_GET_NEXT(fd_list, &ent->vnode->opened, curr);
         close_fd(curr);
         curr = next;
     }
+    Core_RwLockReleaseExclusive(&ent->vnode->lock);
+    // Threads that were waiting for the lock wake up, see that the vnode is dying, and leave.
     // TODO: Use a proper synchronization primitive to deal with this.
-    while (ent->vnode->nPendingAsyncIO)
+    while (atomic_load(&ent->vnode->nLockUsers) || ent->vnode->nPendingAsyncIO)
         Core_Yield();
 }
 static void stage_two(mount* unused, dirent* ent, void* userdata)
@@ -329,18 +309,12 @@ obos_status Vfs_Unmount(mount* what)
     what->mounted_on->un.mounted = nullptr;
     what->mounted_on->flags &= ~VFLAGS_MOUNTPOINT;
     foreach_dirent(what, stage_one, nullptr);
-    namecache_ent* curr;
-    for (curr = RB_MIN(namecache, &what->nc); curr;)
-    {
-        namecache_ent* next = RB_RIGHT(curr, rb_cache);
-        deref_vnode(curr->ref);
-        OBOS_FreeString(&curr->path);
-        Vfs_Free(curr);
-        curr = next;
-    }
+    // The dirents of the mount are about to be freed.
+    VfsH_NameCacheFlush();
     what->root->d_children.head = nullptr;
     what->root->d_children.tail = nullptr;
     what->root->d_children.nChildren = 0;
+    what->root->unpopulated = false;
     foreach_dirent(what, stage_two, nullptr);
     LIST_REMOVE(mount_list, &Vfs_Mounted, what);
     if (what->root == Vfs_Root)
@@ -368,5 +342,4 @@ obos_status Vfs_UnmountP(const char* at)
     return Vfs_Unmount(resolved->vnode->un.mounted);
 }
 
-RB_GENERATE(namecache, namecache_ent, rb_cache, cmp_namecache_ent);
 LIST_GENERATE(mount_list, mount, node);
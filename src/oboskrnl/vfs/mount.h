@@ -22,12 +22,14 @@ LIST_PROTOTYPE(mount_list, struct mount, node);
 typedef struct mount
 {
     LIST_NODE(mount_list, struct mount) node;
+    // Taken for namespace changes (e.g., adding entries, closing fds, unmounting). File I/O uses the vnode lock instead.
     mutex lock;
+    // Serializes the population of the mount's directories.
+    mutex populate_lock;
     dirent* root;
     vdev* fs_driver;
     vnode* device; // the block device the filesystem is situated on.
     vnode* mounted_on;
-    namecache nc;
     dirent_list dirent_list;
     atomic_size_t nWaiting;
     bool awaitingFree;
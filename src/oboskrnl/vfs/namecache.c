@@ -0,0 +1,166 @@
+/*
+ * oboskrnl/vfs/namecache.c
+ *
+ * Copyright (c) 2024 Omar Berrow
+*/
+
+#include <int.h>
+#include <klog.h>
+#include <memmanip.h>
+
+#include <vfs/namecache.h>
+#include <vfs/dirent.h>
+#include <vfs/alloc.h>
+
+#include <locks/mutex.h>
+
+#include <utils/list.h>
+#include <utils/string.h>
+
+static namecache_ent* s_buckets[NAMECACHE_BUCKET_COUNT];
+// Least recently used first.
+static namecache_lru s_lru;
+static size_t s_nEntries;
+static mutex s_lock;
+
+LIST_GENERATE(namecache_lru, struct namecache_ent, lru_node);
+LIST_GENERATE(namecache_children, struct namecache_ent, parent_node);
+LIST_GENERATE(namecache_refs, struct namecache_ent, ent_node);
+
+// FNV-1a over the component, seeded with the parent.
+static uint32_t hash_component(const dirent* parent, const char* name, size_t namelen)
+{
+    uint64_t hash = 0xcbf29ce484222325 ^ ((uintptr_t)parent >> 4);
+    for (size_t i = 0; i < namelen; i++)
+    {
+        hash ^= (uint8_t)name[i];
+        hash *= 0x100000001b3;
+    }
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+// Returns the link that points to the entry, or to the nullptr at the end of the bucket if there is none.
+static namecache_ent** find_entry(const dirent* parent, uint32_t hash, const char* name, size_t namelen)
+{
+    namecache_ent** link = &s_buckets[hash & (NAMECACHE_BUCKET_COUNT - 1)];
+    for (; *link; link = &(*link)->next_in_bucket)
+    {
+        const namecache_ent* curr = *link;
+        if (curr->parent != parent || curr->hash != hash)
+            continue;
+        if (OBOS_CompareStringNC(curr->ent ? &curr->ent->name : &curr->name, name, namelen))
+            break;
+    }
+    return link;
+}
+static void remove_entry(namecache_ent** link)
+{
+    namecache_ent* ent = *link;
+    *link = ent->next_in_bucket;
+    LIST_REMOVE(namecache_lru, &s_lru, ent);
+    LIST_REMOVE(namecache_children, &ent->parent->nc_children, ent);
+    if (ent->ent)
+        LIST_REMOVE(namecache_refs, &ent->ent->nc_refs, ent);
+    else
+        OBOS_FreeString(&ent->name);
+    Vfs_Free(ent);
+    s_nEntries--;
+}
+// Removes an entry that was found without going through its bucket.
+static void remove_entry_direct(namecache_ent* ent)
+{
+    namecache_ent** link = &s_buckets[ent->hash & (NAMECACHE_BUCKET_COUNT - 1)];
+    while (*link != ent)
+        link = &(*link)->next_in_bucket;
+    remove_entry(link);
+}
+static void evict_lru()
+{
+    namecache_ent* victim = LIST_GET_HEAD(namecache_lru, &s_lru);
+    if (!victim)
+        return;
+    remove_entry_direct(victim);
+}
+static void insert_entry(dirent* parent, dirent* ent, uint32_t hash, const char* name, size_t namelen)
+{
+    if (s_nEntries >= NAMECACHE_MAX_ENTRIES)
+        evict_lru();
+    namecache_ent* nc_ent = Vfs_Calloc(1, sizeof(namecache_ent));
+    nc_ent->parent = parent;
+    nc_ent->ent = ent;
+    nc_ent->hash = hash;
+    if (!ent)
+    {
+        OBOS_StringSetAllocator(&nc_ent->name, Vfs_Allocator);
+        OBOS_InitStringLen(&nc_ent->name, name, namelen);
+    }
+    namecache_ent** bucket = &s_buckets[hash & (NAMECACHE_BUCKET_COUNT - 1)];
+    nc_ent->next_in_bucket = *bucket;
+    *bucket = nc_ent;
+    LIST_APPEND(namecache_lru, &s_lru, nc_ent);
+    LIST_APPEND(namecache_children, &parent->nc_children, nc_ent);
+    if (ent)
+        LIST_APPEND(namecache_refs, &ent->nc_refs, nc_ent);
+    s_nEntries++;
+}
+dirent* VfsH_NameCacheLookup(dirent* parent, const char* name, size_t namelen)
+{
+    if (!parent || !name || !namelen)
+        return nullptr;
+    const uint32_t hash = hash_component(parent, name, namelen);
+    Core_MutexAcquire(&s_lock);
+    namecache_ent** link = find_entry(parent, hash, name, namelen);
+    if (*link)
+    {
+        namecache_ent* hit = *link;
+        LIST_REMOVE(namecache_lru, &s_lru, hit);
+        LIST_APPEND(namecache_lru, &s_lru, hit);
+        dirent* found = hit->ent;
+        Core_MutexRelease(&s_lock);
+        return found;
+    }
+    // Walk the directory once, and remember the result either way.
+    // This is done with the lock held, so a child added concurrently is either seen here, or
+    // invalidates the entry after it is inserted.
+    dirent* found = nullptr;
+    for (dirent* curr = parent->d_children.head; curr; curr = curr->d_next_child)
+    {
+        if (OBOS_CompareStringNC(&curr->name, name, namelen))
+        {
+            found = curr;
+            break;
+        }
+    }
+    insert_entry(parent, found, hash, name, namelen);
+    Core_MutexRelease(&s_lock);
+    return found;
+}
+void VfsH_NameCacheInvalidate(dirent* parent, const char* name, size_t namelen)
+{
+    if (!parent || !name || !namelen)
+        return;
+    const uint32_t hash = hash_component(parent, name, namelen);
+    Core_MutexAcquire(&s_lock);
+    namecache_ent** link = find_entry(parent, hash, name, namelen);
+    if (*link)
+        remove_entry(link);
+    Core_MutexRelease(&s_lock);
+}
+void VfsH_NameCacheRemoveDirent(dirent* ent)
+{
+    if (!ent)
+        return;
+    Core_MutexAcquire(&s_lock);
+    // The dirent knows every entry that refers to it, so only those are looked at.
+    while (LIST_GET_HEAD(namecache_children, &ent->nc_children))
+        remove_entry_direct(LIST_GET_HEAD(namecache_children, &ent->nc_children));
+    while (LIST_GET_HEAD(namecache_refs, &ent->nc_refs))
+        remove_entry_direct(LIST_GET_HEAD(namecache_refs, &ent->nc_refs));
+    Core_MutexRelease(&s_lock);
+}
+void VfsH_NameCacheFlush()
+{
+    Core_MutexAcquire(&s_lock);
+    while (LIST_GET_HEAD(namecache_lru, &s_lru))
+        evict_lru();
+    Core_MutexRelease(&s_lock);
+}
@@ -8,27 +8,48 @@
 
 #include <int.h>
 
-#include <utils/tree.h>
 #include <utils/list.h>
 #include <utils/string.h>
 
-#include <uacpi_libc.h>
+// The name cache maps a (parent dirent, component) pair to the child dirent, so that resolving a path
+// costs one hash probe per component instead of a walk over every sibling.
+// Misses are remembered as negative entries (ent == nullptr), so repeated failed lookups are just as cheap.
 
-typedef RB_HEAD(namecache, namecache_ent) namecache;
-typedef LIST_HEAD(namecache_list, struct namecache_ent) namecache_list;
+// Must be a power of two.
+#define NAMECACHE_BUCKET_COUNT (1024)
+// Once there are more entries than this, the least recently used ones are evicted.
+#define NAMECACHE_MAX_ENTRIES (4096)
 
+typedef LIST_HEAD(namecache_lru, struct namecache_ent) namecache_lru;
+// The entries whose parent is a dirent, kept in the dirent.
+typedef LIST_HEAD(namecache_children, struct namecache_ent) namecache_children;
+// The entries whose child is a dirent, kept in the dirent.
+typedef LIST_HEAD(namecache_refs, struct namecache_ent) namecache_refs;
 typedef struct namecache_ent
 {
-    RB_ENTRY(namecache_ent) rb_cache;
-    LIST_NODE(namecache_list, struct namecache_ent) list_node;
-    struct vnode* ref;
+    struct namecache_ent* next_in_bucket;
+    LIST_NODE(namecache_lru, struct namecache_ent) lru_node;
+    LIST_NODE(namecache_children, struct namecache_ent) parent_node;
+    // Unused for negative entries.
+    LIST_NODE(namecache_refs, struct namecache_ent) ent_node;
+    struct dirent* parent;
+    // nullptr if this is a negative entry.
     struct dirent* ent;
-    string path; // path relative to the mount point root.
+    uint32_t hash;
+    // Only set for negative entries, positive entries use the name of 'ent'.
+    string name;
 } namecache_ent;
+LIST_PROTOTYPE(namecache_lru, struct namecache_ent, lru_node);
+LIST_PROTOTYPE(namecache_children, struct namecache_ent, parent_node);
+LIST_PROTOTYPE(namecache_refs, struct namecache_ent, ent_node);
 
-inline static int cmp_namecache_ent(const struct namecache_ent* a, const struct namecache_ent* b)
-{
-    return uacpi_strcmp(OBOS_GetStringCPtr(&a->path), OBOS_GetStringCPtr(&b->path));
-}
-RB_PROTOTYPE(namecache, namecache_ent, rb_cache, cmp_namecache_ent);
-LIST_PROTOTYPE(namecache_list, struct namecache_ent, list_node);
\ No newline at end of file
+// Looks up the child of 'parent' called 'name'.
+// This does not allocate anything on a cache hit.
+struct dirent* VfsH_NameCacheLookup(struct dirent* parent, const char* name, size_t namelen);
+// Drops the entry for the child of 'parent' called 'name', if there is one.
+// Must be called whenever a child is added to a directory, in case the name was cached as a miss.
+void VfsH_NameCacheInvalidate(struct dirent* parent, const char* name, size_t namelen);
+// Drops every entry that refers to 'ent', either as the parent or as the child.
+void VfsH_NameCacheRemoveDirent(struct dirent* ent);
+// Drops every entry in the name cache.
+void VfsH_NameCacheFlush();
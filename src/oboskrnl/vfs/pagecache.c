@@ -113,25 +113,41 @@ void VfsH_PageCacheUnref(pagecache* pc)
     {
         Vfs_Free(pc->data);
         pc->data = nullptr;
+        pc->sz = 0;
     }
 }
-void VfsH_PageCacheFlush(pagecache* pc, void* vn_)
+static const driver_header* get_driver(vnode* vn)
 {
-    vnode* vn = (vnode*)vn_;
-    OBOS_ASSERT(vn);
-    OBOS_ASSERT(&vn->pagecache == pc);
-    Core_MutexAcquire(&pc->dirty_list_lock);
     mount* const point = vn->mount_point ? vn->mount_point : vn->un.mounted;
     const driver_header* driver = vn->vtype == VNODE_TYPE_REG ? &point->fs_driver->driver->header : nullptr;
     if (vn->vtype == VNODE_TYPE_CHR || vn->vtype == VNODE_TYPE_BLK)
         driver = &vn->un.device->driver->header;
+    return driver;
+}
+// Writes back every dirty region that overlaps [offset, offset+size), and drops it.
+// If size is SIZE_MAX, every dirty region is written back.
+static void flush_range(pagecache* pc, vnode* vn, size_t offset, size_t size)
+{
+    OBOS_ASSERT(vn);
+    OBOS_ASSERT(&vn->pagecache == pc);
+    Core_MutexAcquire(&pc->dirty_list_lock);
+    const driver_header* driver = get_driver(vn);
     const size_t base_offset = vn->flags & VFLAGS_PARTITION ? vn->partitions[0].off : 0;
     size_t blkSize = 0;
     // OBOS_Debug("flushing %d regions\n", pc->dirty_regions.nNodes);
     driver->ftable.get_blk_size(vn->desc, &blkSize);
+    // Give the filesystem the final size before anything is written back, so it can allocate the
+    // whole file at once, instead of allocating as each dirty region is written.
+    if (vn->vtype == VNODE_TYPE_REG && driver->ftable.preallocate_file && LIST_GET_HEAD(dirty_pc_list, &pc->dirty_regions))
+        driver->ftable.preallocate_file(vn->desc, vn->filesize);
     for (pagecache_dirty_region* curr = LIST_GET_HEAD(dirty_pc_list, &pc->dirty_regions); curr; )
     {   
         pagecache_dirty_region* next = LIST_GET_NEXT(dirty_pc_list, &pc->dirty_regions, curr);
+        if (size != SIZE_MAX && (curr->fileoff >= (offset + size) || (curr->fileoff + curr->sz) <= offset))
+        {
+            curr = next;
+            continue;
+        }
         // OBOS_Debug("flushing dirty region from offset 0x%016x with a size of 0x%016x bytes\n", curr->fileoff, curr->sz);
         driver->ftable.write_sync(vn->desc, pc->data + curr->fileoff, curr->sz/blkSize, (curr->fileoff+base_offset)/blkSize, nullptr);
         LIST_REMOVE(dirty_pc_list, &pc->dirty_regions, curr);
@@ -140,45 +156,146 @@ void VfsH_PageCacheFlush(pagecache* pc, void* vn_)
     }
     Core_MutexRelease(&pc->dirty_list_lock);
 }
+void VfsH_PageCacheFlush(pagecache* pc, void* vn)
+{
+    flush_range(pc, vn, 0, SIZE_MAX);
+}
+void VfsH_PageCacheFlushRange(pagecache* pc, void* vn, size_t offset, size_t size)
+{
+    if (!size || !pc->data)
+        return;
+    flush_range(pc, vn, offset, size);
+}
+// Looks up a page of the page cache, with the kernel context's lock held.
+// Returns false if the page is outside of the reservation, otherwise sets *committed to whether it is in memory.
+static bool lookup_page(uintptr_t addr, bool* committed)
+{
+    irql oldIrql = Core_SpinlockAcquireExplicit(&Mm_KernelContext.lock, IRQL_DISPATCH, true);
+    page* curr = MmH_LookupPage(&Mm_KernelContext, addr);
+    *committed = curr && !curr->reserved;
+    Core_SpinlockRelease(&Mm_KernelContext.lock, oldIrql);
+    return curr != nullptr;
+}
+// Clamps the end of [offset, offset+size) to the page cache's reservation.
+static uintptr_t range_top(const pagecache* pc, size_t offset, size_t size)
+{
+    if (offset >= pc->sz)
+        return (uintptr_t)pc->data;
+    if (size > (pc->sz - offset))
+        size = pc->sz - offset;
+    return (uintptr_t)pc->data + offset + size;
+}
+void VfsH_PageCacheInvalidateRange(pagecache* pc, void* vn_, size_t offset, size_t size)
+{
+    vnode* vn = (vnode*)vn_;
+    if (!size || !pc->data)
+        return;
+    const driver_header* driver = get_driver(vn);
+    const size_t base_offset = vn->flags & VFLAGS_PARTITION ? vn->partitions[0].off : 0;
+    size_t blkSize = 0;
+    driver->ftable.get_blk_size(vn->desc, &blkSize);
+    Core_MutexAcquire(&pc->lock);
+    uintptr_t base = (uintptr_t)pc->data + offset;
+    base -= base % OBOS_PAGE_SIZE;
+    // Anything past the reservation (e.g., an uncached write that extended the file) was never cached.
+    const uintptr_t top = range_top(pc, offset, size);
+    for (uintptr_t addr = base; addr < top; addr += OBOS_PAGE_SIZE)
+    {
+        bool committed = false;
+        if (!lookup_page(addr, &committed) || !committed)
+            continue;
+        const size_t pgoff = addr - (uintptr_t)pc->data;
+        bool mapped = false;
+        for (pagecache_mapped_region* reg = LIST_GET_HEAD(mapped_region_list, &pc->mapped_regions); reg && !mapped; )
+        {
+            mapped = pgoff < (reg->fileoff + reg->sz) && reg->fileoff < (pgoff + OBOS_PAGE_SIZE);
+            reg = LIST_GET_NEXT(mapped_region_list, &pc->mapped_regions, reg);
+        }
+        if (!mapped && obos_is_success(Mm_VirtualMemoryDecommitPage(&Mm_KernelContext, (void*)addr)))
+            continue;
+        // Something else can see the page, so it has to stay, but with the new contents.
+        driver->ftable.read_sync(vn->desc, (void*)addr, OBOS_PAGE_SIZE/blkSize, (pgoff+base_offset)/blkSize, nullptr);
+    }
+    Core_MutexRelease(&pc->lock);
+}
+// Returns whether every page in [offset, offset+size) is already in the page cache.
+static bool range_resident(pagecache* pc, size_t offset, size_t size)
+{
+    if (offset > pc->sz || size > (pc->sz - offset))
+        return false;
+    uintptr_t base = (uintptr_t)pc->data + offset;
+    base -= base % OBOS_PAGE_SIZE;
+    const uintptr_t top = (uintptr_t)pc->data + offset + size;
+    for (uintptr_t addr = base; addr < top; addr += OBOS_PAGE_SIZE)
+    {
+        bool committed = false;
+        if (!lookup_page(addr, &committed) || !committed)
+            return false;
+    }
+    return true;
+}
 void *VfsH_PageCacheGetEntry(pagecache* pc, void* vn_, size_t offset, size_t size)
 {
     vnode* vn = (vnode*)vn_;
     if (!pc->data)
-        pc->data = Mm_VirtualMemoryAlloc(&Mm_KernelContext, nullptr, vn->filesize, 0, VMA_FLAGS_RESERVE|VMA_FLAGS_NON_PAGED, nullptr, nullptr);
+    {
+        Core_MutexAcquire(&pc->lock);
+        if (!pc->data)
+        {
+            pc->data = Mm_VirtualMemoryAlloc(&Mm_KernelContext, nullptr, vn->filesize, 0, VMA_FLAGS_RESERVE|VMA_FLAGS_NON_PAGED, nullptr, nullptr);
+            if (pc->data)
+                pc->sz = vn->filesize + (OBOS_PAGE_SIZE - (vn->filesize % OBOS_PAGE_SIZE)) % OBOS_PAGE_SIZE;
+        }
+        Core_MutexRelease(&pc->lock);
+    }
+    // Pages are only filled in with the page cache lock held, so a range that is already
+    // in memory (the common case for reads) can be used without taking it.
+    if (range_resident(pc, offset, size))
+        return (void*)((uintptr_t)pc->data + offset);
+    Core_MutexAcquire(&pc->lock);
     // Formulate a list of each unmapped (and therefore, empty) page cache region that we need.
     uintptr_t* emptyPages = nullptr;
     size_t nEmptyPages = 0;
     uintptr_t base = (uintptr_t)pc->data + offset;
     base -= base % OBOS_PAGE_SIZE;
-    uintptr_t top = base + size;
-    // top += OBOS_PAGE_SIZE-(top%OBOS_PAGE_SIZE);
-    page what = {};
+    const uintptr_t top = (uintptr_t)pc->data + offset + size;
     for (uintptr_t addr = base; addr < top; addr += OBOS_PAGE_SIZE)
     {
-        what.addr = addr;
-        page* curr = RB_FIND(page_tree, &Mm_KernelContext.pages, &what);
-        OBOS_ASSERT(curr);
-        if (curr->reserved)
+        bool committed = false;
+        const bool found = lookup_page(addr, &committed);
+        OBOS_ASSERT(found);
+        OBOS_UNUSED(found);
+        if (!committed)
         {
             emptyPages = Vfs_Realloc(emptyPages, ++nEmptyPages * sizeof(*emptyPages));
             emptyPages[nEmptyPages-1] = addr;
         }
     }
-    mount* const point = vn->mount_point ? vn->mount_point : vn->un.mounted;
-    const driver_header* driver = vn->vtype == VNODE_TYPE_REG ? &point->fs_driver->driver->header : nullptr;
-    if (vn->vtype == VNODE_TYPE_CHR || vn->vtype == VNODE_TYPE_BLK)
-        driver = &vn->un.device->driver->header;
+    const driver_header* driver = get_driver(vn);
     size_t blkSize = 0;
     driver->ftable.get_blk_size(vn->desc, &blkSize);
     const size_t base_offset = vn->flags & VFLAGS_PARTITION ? vn->partitions[0].off : 0;
+    void* ret = (void*)((uintptr_t)pc->data + offset);
     for (size_t i = 0; i < nEmptyPages; i++)
     {
+        // If the driver already has the page in memory (e.g., the InitRD), map it instead of copying it.
+        if (driver->ftable.get_resident_page && vn->vtype == VNODE_TYPE_REG)
+        {
+            uintptr_t phys = 0;
+            if (obos_is_success(driver->ftable.get_resident_page(vn->desc, emptyPages[i]-(uintptr_t)pc->data, &phys)) &&
+                obos_is_success(Mm_VirtualMemoryMapBorrowed(&Mm_KernelContext, (void*)emptyPages[i], phys)))
+                continue;
+        }
         Mm_VirtualMemoryAlloc(&Mm_KernelContext, (void*)emptyPages[i], OBOS_PAGE_SIZE, 0, VMA_FLAGS_NON_PAGED, nullptr, nullptr);
         const uintptr_t offset = ((emptyPages[i]-(uintptr_t)pc->data)+base_offset) / blkSize;
         obos_status status = driver->ftable.read_sync(vn->desc, (void*)emptyPages[i], OBOS_PAGE_SIZE/blkSize, offset, nullptr);
         if (obos_expect(obos_is_error(status) == true, 0))
-            return nullptr;
+        {
+            ret = nullptr;
+            break;
+        }
     }
+    Core_MutexRelease(&pc->lock);
     Vfs_Free(emptyPages);
-    return (void*)((uintptr_t)pc->data + offset);
+    return ret;
 }
\ No newline at end of file
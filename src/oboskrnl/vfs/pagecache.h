@@ -20,9 +20,12 @@ typedef LIST_HEAD(mapped_region_list, struct pagecache_mapped_region) mapped_reg
 LIST_PROTOTYPE(mapped_region_list, struct pagecache_mapped_region, node);
 typedef struct pagecache
 {
-    // Take this lock when expanding the page cache.
+    // Take this lock when expanding the page cache, or when filling in or dropping pages.
+    // This is separate from the vnode and mount locks, so readers of cached data never take it.
     mutex lock;
     char* data;
+    // The size of the reservation at 'data', which is made once, and doesn't grow with the file.
+    size_t sz;
     // Take this lock when using dirty region list.
     mutex dirty_list_lock;
     dirty_pc_list dirty_regions;
@@ -64,6 +67,14 @@ OBOS_EXPORT void VfsH_PageCacheUnref(pagecache* pc);
 // Flushes the page cache.
 // vn is of type `vnode*`
 OBOS_EXPORT void VfsH_PageCacheFlush(pagecache* pc, void* vn);
+// Flushes the dirty regions that overlap [offset, offset+size).
+// vn is of type `vnode*`
+OBOS_EXPORT void VfsH_PageCacheFlushRange(pagecache* pc, void* vn, size_t offset, size_t size);
+// Drops the cached pages in [offset, offset+size), so they are read again from the driver the next time they are used.
+// Pages that are mapped somewhere are read again in place instead.
+// Any dirty region in the range must be flushed first.
+// vn is of type `vnode*`
+OBOS_EXPORT void VfsH_PageCacheInvalidateRange(pagecache* pc, void* vn, size_t offset, size_t size);
 // Gets a page cache entry.
 // vn is of type `vnode*`
 OBOS_EXPORT void *VfsH_PageCacheGetEntry(pagecache* pc, void* vn, size_t offset, size_t size);
\ No newline at end of file
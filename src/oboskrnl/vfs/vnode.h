@@ -17,6 +17,9 @@
 #include <utils/list.h>
 
 #include <locks/mutex.h>
+#include <locks/rwlock.h>
+
+#include <scheduler/work.h>
 
 enum 
 {
@@ -44,6 +47,8 @@ enum
     VFLAGS_MOUNTPOINT = 1,
     VFLAGS_IS_TTY = 2,
     VFLAGS_PARTITION = 4,
+    // The vnode is being freed by an unmount, and can't be locked anymore.
+    VFLAGS_DYING = 8,
 };
 
 // basically a struct specinfo, but renamed.
@@ -88,6 +93,12 @@ typedef struct vnode
     fd_list opened;
     struct partition* partitions;
     size_t nPartitions;
+    // Taken shared for reads, and exclusive for writes and flushes.
+    // Use VfsH_LockVnode and VfsH_UnlockVnode instead of taking it directly.
+    rwlock lock;
+    // The amount of threads in VfsH_LockVnode, or holding the lock.
+    // An unmount waits for this to reach zero before freeing the vnode.
+    atomic_size_t nLockUsers;
 } vnode;
 struct async_irp
 {
@@ -98,10 +109,15 @@ struct async_irp
         void* buf;
     } un;
     size_t requestSize;
-    thread* worker;
+    work_item work;
     bool rw : 1; // if false, the operation is a read, otherwise it is a write.
     bool cached : 1;
     uoff_t fileoff;
     vnode* vn;
 };
+// Takes the vnode's lock, shared or exclusive.
+// Returns OBOS_STATUS_ABORTED if the vnode is being freed by an unmount.
+OBOS_EXPORT obos_status VfsH_LockVnode(vnode* vn, bool exclusive);
+// Releases the vnode's lock. After this, the vnode can be freed by an unmount.
+OBOS_EXPORT void VfsH_UnlockVnode(vnode* vn, bool exclusive);
 OBOS_EXPORT vnode* Drv_AllocateVNode(driver_id* drv, dev_desc desc, size_t filesize, vdev** dev, uint32_t type);
\ No newline at end of file
@@ -19,6 +19,7 @@
 #include <scheduler/thread.h>
 #include <scheduler/thread_context_info.h>
 #include <irq/dpc.h>
+#include <scheduler/work.h>
 
 #include <locks/spinlock.h>
 #include <locks/mutex.h>
@@ -527,71 +528,54 @@ uacpi_status uacpi_kernel_uninstall_interrupt_handler(
 }	
 typedef struct uacpi_work
 {
-    uacpi_work_type type;
+    work_item item;
     uacpi_work_handler cb; 
     uacpi_handle ctx;
-    dpc* work;
-    struct uacpi_work *next, *prev;
 } uacpi_work;
-static uacpi_work *s_workHead = nullptr, *s_workTail = nullptr;
-static size_t s_nWork = 0;
-static spinlock s_workQueueLock;
-static bool s_isWorkQueueLockInit = false;
-static void work_handler(dpc* dpc, void* userdata)
+static _Atomic(size_t) s_nWork = 0;
+static cpu_local* gpe_cpu()
 {
-    OBOS_UNUSED(dpc);
+    // GPE methods are run on the BSP.
+    for (size_t i = 0; i < Core_CpuCount; i++)
+        if (Core_CpuInfo[i].isBSP)
+            return &Core_CpuInfo[i];
+    return nullptr;
+}
+static void work_handler(work_item* item, void* userdata)
+{
+    OBOS_UNUSED(item);
     uacpi_work* work = (uacpi_work*)userdata;
     work->cb(work->ctx);
-    // Remove the work from the queue.
-    irql oldIrql = Core_SpinlockAcquire(&s_workQueueLock);
-    if (work->next)
-        work->next->prev = work->prev;
-    if (work->prev)
-        work->prev->next = work->next;
-    if (s_workTail == work)
-        s_workTail = work->prev;
-    if (s_workHead == work)
-        s_workHead = work->next;
+    OBOS_KernelAllocator->Free(OBOS_KernelAllocator, work, sizeof(uacpi_work));
     s_nWork--;
-    Core_SpinlockRelease(&s_workQueueLock, oldIrql);
-    CoreH_FreeDPC(dpc, true);
 }
 uacpi_status uacpi_kernel_schedule_work(uacpi_work_type type, uacpi_work_handler cb, uacpi_handle ctx)
 {
-    if (!s_isWorkQueueLockInit)
-        s_workQueueLock = Core_SpinlockCreate();
     // Make the work object.
     uacpi_work* work = OBOS_KernelAllocator->ZeroAllocate(OBOS_KernelAllocator, 1, sizeof(uacpi_work), nullptr);
-    work->type = type;
+    if (!work)
+        return UACPI_STATUS_OUT_OF_MEMORY;
     work->cb = cb; 
     work->ctx = ctx;
-    irql oldIrql = Core_SpinlockAcquire(&s_workQueueLock);
-    if(!s_workHead)
-        s_workHead = work;
-    if (s_workTail)
-        s_workTail->next = work;
-    work->prev = s_workTail;
-    s_workTail = work;
+    work->item.userdata = work;
     s_nWork++;
-    Core_SpinlockRelease(&s_workQueueLock, oldIrql);
-    thread_affinity affinity = 0;
-    if (type == UACPI_WORK_GPE_EXECUTION)
-        affinity = 1;
-    else
-        affinity = Core_DefaultThreadAffinity;
-    work->work = CoreH_AllocateDPC(nullptr);
-    work->work->userdata = work;
-    CoreH_InitializeDPC(work->work, work_handler, affinity);
+    obos_status status = Core_WorkQueue(&work->item, work_handler, type == UACPI_WORK_GPE_EXECUTION ? gpe_cpu() : nullptr);
+    if (obos_is_error(status))
+    {
+        OBOS_KernelAllocator->Free(OBOS_KernelAllocator, work, sizeof(uacpi_work));
+        s_nWork--;
+        return UACPI_STATUS_INTERNAL_ERROR;
+    }
     return UACPI_STATUS_OK;
 }
 uacpi_status uacpi_kernel_wait_for_work_completion(void)
 {
-	size_t spin = 0;
+    // The flushes block until the pools are idle, including work that was queued from an IRQ.
+    // They only need to be repeated if the work that ran queued more work.
     while (s_nWork > 0)
     {
-        if (spin++ > 10000)
-			spin_hung();
-        spinlock_hint();
+        Core_WorkFlush(gpe_cpu());
+        Core_WorkFlush(nullptr);
     }
     return UACPI_STATUS_OK;
 }